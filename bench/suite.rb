@@ -0,0 +1,134 @@
+# Benchmark suite for the extension hot paths: dataset iteration, property
+# get/set, snapshot/destroy, the parallel scan of every pool against the
+# serial Ruby traversal, the overhead of LibZfs.stats and the memory used by
+# each open handle.
+#
+# Everything runs below a scratch filesystem, (<pool>/zetta_bench), created
+# and destroyed by the suite itself, so any pool will do: the file backed
+# tpool used by the test suite, or the local stand-in library. Results are
+# printed, and saved as JSON, so different releases can be compared:
+#
+#   rake bench [BENCH_POOL=tpool] [BENCH_DATASETS=50] [BENCH_SNAPSHOTS=20]
+#              [BENCH_ITERATIONS=2000] [BENCH_THREADS=8]
+#              [BENCH_OUTPUT=/tmp/zetta_bench.json]
+#
+# Results go to the system temporary directory by default, never into the
+# source tree.
+#
+require 'json'
+require 'tmpdir'
+require 'zetta'
+
+pool = ENV['BENCH_POOL'] || 'tpool'
+datasets = (ENV['BENCH_DATASETS'] || 50).to_i
+snapshots = (ENV['BENCH_SNAPSHOTS'] || 20).to_i
+iterations = (ENV['BENCH_ITERATIONS'] || 2000).to_i
+threads = (ENV['BENCH_THREADS'] || 8).to_i
+output = ENV['BENCH_OUTPUT'] || File.join(Dir.tmpdir, 'zetta_bench.json')
+
+root = "#{pool}/zetta_bench"
+fs_type = ZfsConsts::Types::FILESYSTEM
+zlib = LibZfs.new
+results = {}
+
+# Operations per second of the given block, run count times:
+def rate(results, name, count)
+  start = Time.now
+  count.times { |i| yield i }
+  elapsed = Time.now - start
+  results[name] = { 'count' => count, 'seconds' => elapsed,
+    'per_second' => elapsed > 0 ? count / elapsed : nil }
+  printf("%-28s %10d %12.3fs %14.1f/s\n", name, count, elapsed, count / elapsed)
+end
+
+# Resident memory in bytes, (Linux, nil elsewhere):
+def rss
+  File.read('/proc/self/statm').split[1].to_i * 4096
+rescue SystemCallError
+  nil
+end
+
+# The same records than ZFS.scan, walking every pool from Ruby:
+def serial_walk(zfs, props, acc)
+  acc << [zfs.name, zfs.fs_type, zfs.get_many(props)]
+  zfs.each_filesystem { |fs| serial_walk(fs, props, acc) }
+  zfs.each_snapshot { |snap| acc << [snap.name, snap.fs_type, snap.get_many(props)] }
+  acc
+end
+
+# Dependents are yielded children first, so they can be destroyed in order:
+cleanup = lambda do
+  if ZFS.exists?(root, fs_type, zlib)
+    top = ZFS.new(root, fs_type, zlib)
+    top.each_dependent { |zfs| zfs.destroy! }
+    top.destroy!
+  end
+end
+
+cleanup.call
+ZFS.create(root, fs_type, zlib)
+begin
+  datasets.times { |i| ZFS.create("#{root}/fs#{i}", fs_type, zlib) }
+  ZFS.snapshot("#{root}@base", {:recursive => true}, zlib)
+  snapshots.times { |i| ZFS.snapshot("#{root}/fs0@s#{i}", zlib) }
+  fs = ZFS.new("#{root}/fs0", fs_type, zlib)
+  top = ZFS.new(root, fs_type, zlib)
+
+  printf("%-28s %10s %13s %15s\n", 'benchmark', 'count', 'time', 'rate')
+  rate(results, 'ZFS.each', iterations) { ZFS.each(zlib) { |zfs| } }
+  rate(results, 'each_filesystem', iterations / 10 + 1) { top.each_filesystem { |zfs| } }
+  rate(results, 'each_snapshot', iterations / 10 + 1) { fs.each_snapshot { |snap| } }
+  rate(results, 'each_dependent', iterations / 10 + 1) { top.each_dependent { |zfs| } }
+  rate(results, 'get', iterations * 10) { fs.get('used') }
+  rate(results, 'get_many', iterations) { fs.get_many(['used', 'available', 'referenced']) }
+  rate(results, 'set', iterations / 10 + 1) { |i| fs.set('zetta:bench', i.to_s) }
+  rate(results, 'snapshot', snapshots) { |i| ZFS.snapshot("#{root}/fs1@b#{i}", zlib) }
+  rate(results, 'destroy', snapshots) do |i|
+    ZFS.new("#{root}/fs1@b#{i}", ZfsConsts::Types::SNAPSHOT, zlib).destroy!
+  end
+
+  props = ['used', 'available', 'referenced']
+  any = ZfsConsts::Types::ANY
+  rate(results, 'serial walk (ruby)', iterations / 100 + 1) do
+    ZFS.each(zlib) { |zfs| serial_walk(zfs, props, []) }
+  end
+  rate(results, 'ZFS.scan :threads => 1', iterations / 100 + 1) do
+    ZFS.scan({:threads => 1, :types => any, :props => props}, zlib)
+  end
+  rate(results, "ZFS.scan :threads => #{threads}", iterations / 100 + 1) do
+    ZFS.scan({:threads => threads, :types => any, :props => props}, zlib)
+  end
+
+  # Same operations, (open and refresh), without and with call statistics:
+  LibZfs.stats_enabled = false
+  rate(results, 'open+refresh, no stats', iterations) { ZFS.new("#{root}/fs0", fs_type, zlib).refresh! }
+  LibZfs.stats_enabled = true
+  rate(results, 'open+refresh, stats', iterations) { ZFS.new("#{root}/fs0", fs_type, zlib).refresh! }
+  LibZfs.stats_enabled = false
+  LibZfs.reset_stats
+
+  GC.start
+  before = rss
+  handles = []
+  datasets.times { |i| handles << ZFS.new("#{root}/fs#{i}", fs_type, zlib) }
+  after = rss
+  if before && after
+    results['handle_memory'] = { 'count' => datasets, 'bytes_per_handle' => (after - before) / datasets }
+    printf("%-28s %10d %25d bytes\n", 'handle memory', datasets, (after - before) / datasets)
+  end
+  handles = nil
+ensure
+  cleanup.call
+end
+
+report = {
+  'time' => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+  'ruby' => RUBY_VERSION,
+  'platform' => RUBY_PLATFORM,
+  'pool' => pool,
+  'datasets' => datasets,
+  'snapshots' => snapshots,
+  'results' => results
+}
+File.open(output, 'w') { |f| f.write(JSON.pretty_generate(report)) }
+puts "Results saved to #{output}"
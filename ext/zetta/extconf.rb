@@ -4,7 +4,7 @@ pkg_name = File.basename(File.dirname(File.expand_path(__FILE__)))
 
 dir_config(pkg_name)
 
-if PLATFORM =~ /freebsd/
+if RUBY_PLATFORM =~ /freebsd/
   $CFLAGS+= " -I/usr/src/cddl/contrib/opensolaris/lib/libzfs/common"
   $CFLAGS+= " -I/usr/src/cddl/contrib/opensolaris/lib/libzpool/common"
   $CFLAGS+= " -I/usr/src/cddl/compat/opensolaris/include"
@@ -24,9 +24,51 @@ if PLATFORM =~ /freebsd/
 end
 
 have_library("c", "main")
+have_library("pthread", "pthread_create")
+# Zero copy send streams (Linux):
+have_func('splice', 'fcntl.h')
+# Monotonic clock for LibZfs.stats, (gethrtime on Solaris):
+have_func('gethrtime', 'sys/time.h') ||
+  have_func('clock_gettime', 'time.h') || (have_library('rt', 'clock_gettime') && have_func('clock_gettime', 'time.h'))
+
+# Release the interpreter lock around blocking libzfs calls when the running
+# Ruby allows it (1.9: rb_thread_blocking_region, 2.0+: ruby/thread.h):
+have_header('ruby/thread.h') && have_func('rb_thread_call_without_gvl', 'ruby/thread.h') &&
+  have_func('rb_thread_call_without_gvl2', 'ruby/thread.h')
+have_func('rb_thread_blocking_region')
+have_func('rb_fiber_current')
+
+# Build against the in-memory libzfs simulator, (see sim/libzfs.h), instead
+# of the system library, to run the tests and benchmarks without any pool.
+# The simulator is built into the build directory, with the ZFS on Linux
+# extensions unless --with-zfs-sim=snv_134 is given:
+if sim = with_config('zfs-sim')
+  sim_dir = File.join(File.dirname(File.expand_path(__FILE__)), 'sim')
+  sim_build = File.join(Dir.pwd, 'zfs_sim')
+  sim_flags = (sim == 'snv_134') ? '' : '-DZFS_SIM_ZOL'
+  FileUtils.mkdir_p(sim_build)
+  system('make', '-B', '-C', sim_build, '-f', File.join(sim_dir, 'Makefile'),
+    "SRCDIR=#{sim_dir}", "SIMFLAGS=#{sim_flags}") || abort('cannot build the libzfs simulator')
+  $INCFLAGS = "-I#{sim_dir} " + $INCFLAGS
+  $CPPFLAGS << " #{sim_flags}"
+  $LDFLAGS << " -L#{sim_build} -Wl,-rpath,#{sim_build}"
+end
 
 # Check for prerequisite ZFS header and library.
 have_library('zfs', 'zpool_create') || failed_prereqs = true
 have_header('libzfs.h') || failed_prereqs = true
 
+# Optional libzfs functions, depending on the libzfs version:
+have_func('zfs_snapshot_nvl', 'libzfs.h')
+have_func('zfs_destroy_snaps_nvl', 'libzfs.h')
+have_struct_member('recvflags_t', 'resumable', 'libzfs.h')
+# Pool events channel, (ZFS on Linux):
+have_func('zpool_events_next', 'libzfs.h') && have_func('zpool_events_seek', 'libzfs.h')
+# Deferred share table updates, (ZFS on Linux):
+have_func('zfs_commit_all_shares', 'libzfs.h')
+have_const('ZFS_PROP_WRITTEN', 'libzfs.h')
+have_const('ZFS_PROP_LOGICALUSED', 'libzfs.h')
+have_library('zfs_core', 'lzc_destroy_snaps') &&
+  have_header('libzfs_core.h') && have_func('lzc_destroy_snaps', 'libzfs_core.h')
+
 create_makefile(pkg_name) unless failed_prereqs
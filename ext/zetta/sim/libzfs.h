@@ -0,0 +1,576 @@
+/*
+ * In-memory libzfs simulator.
+ *
+ * The subset of the libzfs (and libnvpair) interfaces used by zetta, as of
+ * OpenSolaris snv_134 (SPA version 22), implemented by libzfs_sim.c over an
+ * in-memory dataset tree. Build the extension against it with:
+ *
+ *   ruby extconf.rb --with-zfs-sim
+ *
+ * which also defines ZFS_SIM_ZOL, adding the ZFS on Linux extensions used by
+ * zetta, (pool events and deferred share commits). No real libzfs has those
+ * together with the snv_134 interfaces, (like the 7 arguments zfs_send), so
+ * that combination is only good to exercise both code paths, and not tested
+ * against any real system. --with-zfs-sim=snv_134 builds without them.
+ *
+ * See libzfs_sim.c for the environment variables used to seed the tree and
+ * to add latency to the simulated ioctls.
+ */
+#ifndef _LIBZFS_SIM_H
+#define _LIBZFS_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define ZFS_SIM 1
+
+// Pool versions, up to snv_134:
+#define SPA_VERSION_1 1
+#define SPA_VERSION_2 2
+#define SPA_VERSION_3 3
+#define SPA_VERSION_4 4
+#define SPA_VERSION_5 5
+#define SPA_VERSION_6 6
+#define SPA_VERSION_7 7
+#define SPA_VERSION_8 8
+#define SPA_VERSION_9 9
+#define SPA_VERSION_10 10
+#define SPA_VERSION_11 11
+#define SPA_VERSION_12 12
+#define SPA_VERSION_13 13
+#define SPA_VERSION_14 14
+#define SPA_VERSION_15 15
+#define SPA_VERSION_16 16
+#define SPA_VERSION_17 17
+#define SPA_VERSION_18 18
+#define SPA_VERSION_19 19
+#define SPA_VERSION_20 20
+#define SPA_VERSION_21 21
+#define SPA_VERSION_22 22
+#define SPA_VERSION SPA_VERSION_22
+
+typedef enum { B_FALSE = 0, B_TRUE = 1 } boolean_t;
+typedef unsigned int uint_t;
+typedef unsigned char uchar_t;
+
+typedef struct libzfs_handle libzfs_handle_t;
+typedef struct zfs_handle zfs_handle_t;
+typedef struct zpool_handle zpool_handle_t;
+typedef struct avl_tree avl_tree_t;
+
+/*
+ * Name/value lists.
+ */
+typedef struct nvlist nvlist_t;
+typedef struct nvpair nvpair_t;
+
+#define NV_UNIQUE_NAME 0x1
+
+typedef enum {
+  DATA_TYPE_UNKNOWN = 0,
+  DATA_TYPE_BOOLEAN,
+  DATA_TYPE_BYTE,
+  DATA_TYPE_INT16,
+  DATA_TYPE_UINT16,
+  DATA_TYPE_INT32,
+  DATA_TYPE_UINT32,
+  DATA_TYPE_INT64,
+  DATA_TYPE_UINT64,
+  DATA_TYPE_STRING,
+  DATA_TYPE_BYTE_ARRAY,
+  DATA_TYPE_INT16_ARRAY,
+  DATA_TYPE_UINT16_ARRAY,
+  DATA_TYPE_INT32_ARRAY,
+  DATA_TYPE_UINT32_ARRAY,
+  DATA_TYPE_INT64_ARRAY,
+  DATA_TYPE_UINT64_ARRAY,
+  DATA_TYPE_STRING_ARRAY,
+  DATA_TYPE_HRTIME,
+  DATA_TYPE_NVLIST,
+  DATA_TYPE_NVLIST_ARRAY,
+  DATA_TYPE_BOOLEAN_VALUE
+} data_type_t;
+
+int nvlist_alloc(nvlist_t **, uint_t, int);
+void nvlist_free(nvlist_t *);
+int nvlist_dup(nvlist_t *, nvlist_t **, int);
+int nvlist_add_boolean(nvlist_t *, const char *);
+int nvlist_add_int32(nvlist_t *, const char *, int32_t);
+int nvlist_add_int64(nvlist_t *, const char *, int64_t);
+int nvlist_add_uint64(nvlist_t *, const char *, uint64_t);
+int nvlist_add_string(nvlist_t *, const char *, const char *);
+int nvlist_add_nvlist(nvlist_t *, const char *, nvlist_t *);
+int nvlist_add_int64_array(nvlist_t *, const char *, int64_t *, uint_t);
+int nvlist_add_uint64_array(nvlist_t *, const char *, uint64_t *, uint_t);
+int nvlist_add_nvlist_array(nvlist_t *, const char *, nvlist_t **, uint_t);
+int nvlist_remove_all(nvlist_t *, const char *);
+boolean_t nvlist_exists(nvlist_t *, const char *);
+int nvlist_lookup_int32(nvlist_t *, const char *, int32_t *);
+int nvlist_lookup_int64(nvlist_t *, const char *, int64_t *);
+int nvlist_lookup_uint64(nvlist_t *, const char *, uint64_t *);
+int nvlist_lookup_string(nvlist_t *, const char *, char **);
+int nvlist_lookup_nvlist(nvlist_t *, const char *, nvlist_t **);
+int nvlist_lookup_int64_array(nvlist_t *, const char *, int64_t **, uint_t *);
+int nvlist_lookup_uint64_array(nvlist_t *, const char *, uint64_t **, uint_t *);
+int nvlist_lookup_nvlist_array(nvlist_t *, const char *, nvlist_t ***, uint_t *);
+nvpair_t *nvlist_next_nvpair(nvlist_t *, nvpair_t *);
+char *nvpair_name(nvpair_t *);
+data_type_t nvpair_type(nvpair_t *);
+int nvpair_value_boolean_value(nvpair_t *, boolean_t *);
+int nvpair_value_int32(nvpair_t *, int32_t *);
+int nvpair_value_uint32(nvpair_t *, uint32_t *);
+int nvpair_value_int64(nvpair_t *, int64_t *);
+int nvpair_value_uint64(nvpair_t *, uint64_t *);
+int nvpair_value_string(nvpair_t *, char **);
+int nvpair_value_nvlist(nvpair_t *, nvlist_t **);
+int nvpair_value_int64_array(nvpair_t *, int64_t **, uint_t *);
+int nvpair_value_uint64_array(nvpair_t *, uint64_t **, uint_t *);
+int nvpair_value_nvlist_array(nvpair_t *, nvlist_t ***, uint_t *);
+
+/*
+ * Datasets, pools and properties.
+ */
+#define ZFS_MAXNAMELEN 256
+#define ZPOOL_MAXNAMELEN 256
+#define ZFS_MAXPROPLEN 1024
+#define ZPOOL_MAXPROPLEN 1024
+
+typedef enum {
+  ZFS_TYPE_FILESYSTEM = 0x1,
+  ZFS_TYPE_SNAPSHOT = 0x2,
+  ZFS_TYPE_VOLUME = 0x4,
+  ZFS_TYPE_POOL = 0x8
+} zfs_type_t;
+
+#define ZFS_TYPE_DATASET (ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME | ZFS_TYPE_SNAPSHOT)
+
+#define ZPROP_CONT -2
+#define ZPROP_INVAL -1
+#define ZPROP_VALUE "value"
+#define ZPROP_SOURCE "source"
+
+typedef enum {
+  ZFS_PROP_TYPE,
+  ZFS_PROP_CREATION,
+  ZFS_PROP_USED,
+  ZFS_PROP_AVAILABLE,
+  ZFS_PROP_REFERENCED,
+  ZFS_PROP_COMPRESSRATIO,
+  ZFS_PROP_MOUNTED,
+  ZFS_PROP_ORIGIN,
+  ZFS_PROP_QUOTA,
+  ZFS_PROP_RESERVATION,
+  ZFS_PROP_VOLSIZE,
+  ZFS_PROP_VOLBLOCKSIZE,
+  ZFS_PROP_RECORDSIZE,
+  ZFS_PROP_MOUNTPOINT,
+  ZFS_PROP_SHARENFS,
+  ZFS_PROP_CHECKSUM,
+  ZFS_PROP_COMPRESSION,
+  ZFS_PROP_ATIME,
+  ZFS_PROP_DEVICES,
+  ZFS_PROP_EXEC,
+  ZFS_PROP_SETUID,
+  ZFS_PROP_READONLY,
+  ZFS_PROP_ZONED,
+  ZFS_PROP_SNAPDIR,
+  ZFS_PROP_ACLMODE,
+  ZFS_PROP_ACLINHERIT,
+  ZFS_PROP_CREATETXG,
+  ZFS_PROP_NAME,
+  ZFS_PROP_CANMOUNT,
+  ZFS_PROP_SHAREISCSI,
+  ZFS_PROP_ISCSIOPTIONS,
+  ZFS_PROP_XATTR,
+  ZFS_PROP_NUMCLONES,
+  ZFS_PROP_COPIES,
+  ZFS_PROP_VERSION,
+  ZFS_PROP_UTF8ONLY,
+  ZFS_PROP_NORMALIZE,
+  ZFS_PROP_CASE,
+  ZFS_PROP_VSCAN,
+  ZFS_PROP_NBMAND,
+  ZFS_PROP_SHARESMB,
+  ZFS_PROP_REFQUOTA,
+  ZFS_PROP_REFRESERVATION,
+  ZFS_PROP_GUID,
+  ZFS_PROP_PRIMARYCACHE,
+  ZFS_PROP_SECONDARYCACHE,
+  ZFS_PROP_USEDSNAP,
+  ZFS_PROP_USEDDS,
+  ZFS_PROP_USEDCHILD,
+  ZFS_PROP_USEDREFRESERV,
+  ZFS_PROP_USERACCOUNTING,
+  ZFS_PROP_STMF_SHAREINFO,
+  ZFS_PROP_DEFER_DESTROY,
+  ZFS_PROP_USERREFS,
+  ZFS_PROP_LOGBIAS,
+  ZFS_PROP_UNIQUE,
+  ZFS_PROP_OBJSETID,
+  ZFS_PROP_DEDUP,
+  ZFS_PROP_WRITTEN,
+  ZFS_PROP_LOGICALUSED,
+  ZFS_NUM_PROPS
+} zfs_prop_t;
+
+typedef enum {
+  ZFS_PROP_USERUSED,
+  ZFS_PROP_USERQUOTA,
+  ZFS_PROP_GROUPUSED,
+  ZFS_PROP_GROUPQUOTA,
+  ZFS_NUM_USERQUOTA_PROPS
+} zfs_userquota_prop_t;
+
+typedef enum {
+  ZPOOL_PROP_NAME,
+  ZPOOL_PROP_SIZE,
+  ZPOOL_PROP_USED,
+  ZPOOL_PROP_AVAILABLE,
+  ZPOOL_PROP_CAPACITY,
+  ZPOOL_PROP_ALTROOT,
+  ZPOOL_PROP_HEALTH,
+  ZPOOL_PROP_GUID,
+  ZPOOL_PROP_VERSION,
+  ZPOOL_PROP_BOOTFS,
+  ZPOOL_PROP_DELEGATION,
+  ZPOOL_PROP_AUTOREPLACE,
+  ZPOOL_PROP_CACHEFILE,
+  ZPOOL_PROP_FAILUREMODE,
+  ZPOOL_PROP_LISTSNAPS,
+  ZPOOL_NUM_PROPS
+} zpool_prop_t;
+
+typedef enum {
+  ZPROP_SRC_NONE = 0x1,
+  ZPROP_SRC_DEFAULT = 0x2,
+  ZPROP_SRC_TEMPORARY = 0x4,
+  ZPROP_SRC_LOCAL = 0x8,
+  ZPROP_SRC_INHERITED = 0x10
+} zprop_source_t;
+
+typedef enum {
+  PROP_TYPE_NUMBER,
+  PROP_TYPE_STRING,
+  PROP_TYPE_INDEX
+} zprop_type_t;
+
+typedef int (*zprop_func)(int, void *);
+
+typedef enum {
+  POOL_STATE_ACTIVE = 0,
+  POOL_STATE_EXPORTED,
+  POOL_STATE_DESTROYED,
+  POOL_STATE_SPARE,
+  POOL_STATE_L2CACHE,
+  POOL_STATE_UNINITIALIZED,
+  POOL_STATE_UNAVAIL,
+  POOL_STATE_POTENTIALLY_ACTIVE
+} pool_state_t;
+
+typedef enum {
+  ZPOOL_STATUS_CORRUPT_CACHE,
+  ZPOOL_STATUS_MISSING_DEV_R,
+  ZPOOL_STATUS_MISSING_DEV_NR,
+  ZPOOL_STATUS_CORRUPT_LABEL_R,
+  ZPOOL_STATUS_CORRUPT_LABEL_NR,
+  ZPOOL_STATUS_BAD_GUID_SUM,
+  ZPOOL_STATUS_CORRUPT_POOL,
+  ZPOOL_STATUS_CORRUPT_DATA,
+  ZPOOL_STATUS_FAILING_DEV,
+  ZPOOL_STATUS_VERSION_NEWER,
+  ZPOOL_STATUS_HOSTID_MISMATCH,
+  ZPOOL_STATUS_IO_FAILURE_WAIT,
+  ZPOOL_STATUS_IO_FAILURE_CONTINUE,
+  ZPOOL_STATUS_BAD_LOG,
+  ZPOOL_STATUS_FAULTED_DEV_R,
+  ZPOOL_STATUS_FAULTED_DEV_NR,
+  ZPOOL_STATUS_VERSION_OLDER,
+  ZPOOL_STATUS_RESILVERING,
+  ZPOOL_STATUS_OFFLINE_DEV,
+  ZPOOL_STATUS_REMOVED_DEV,
+  ZPOOL_STATUS_OK
+} zpool_status_t;
+
+typedef enum {
+  VDEV_STATE_UNKNOWN = 0,
+  VDEV_STATE_CLOSED,
+  VDEV_STATE_OFFLINE,
+  VDEV_STATE_REMOVED,
+  VDEV_STATE_CANT_OPEN,
+  VDEV_STATE_FAULTED,
+  VDEV_STATE_DEGRADED,
+  VDEV_STATE_HEALTHY
+} vdev_state_t;
+
+typedef enum {
+  VDEV_AUX_NONE
+} vdev_aux_t;
+
+typedef enum {
+  ZIO_TYPE_NULL = 0,
+  ZIO_TYPE_READ,
+  ZIO_TYPE_WRITE,
+  ZIO_TYPE_FREE,
+  ZIO_TYPE_CLAIM,
+  ZIO_TYPE_IOCTL,
+  ZIO_TYPES
+} zio_type_t;
+
+typedef struct vdev_stat {
+  int64_t vs_timestamp;
+  uint64_t vs_state;
+  uint64_t vs_aux;
+  uint64_t vs_alloc;
+  uint64_t vs_space;
+  uint64_t vs_dspace;
+  uint64_t vs_rsize;
+  uint64_t vs_ops[ZIO_TYPES];
+  uint64_t vs_bytes[ZIO_TYPES];
+  uint64_t vs_read_errors;
+  uint64_t vs_write_errors;
+  uint64_t vs_checksum_errors;
+  uint64_t vs_self_healed;
+  uint64_t vs_scrub_type;
+  uint64_t vs_scrub_complete;
+  uint64_t vs_scrub_examined;
+  uint64_t vs_scrub_repaired;
+  uint64_t vs_scrub_errors;
+  uint64_t vs_scrub_start;
+  uint64_t vs_scrub_end;
+} vdev_stat_t;
+
+#define ZPOOL_CONFIG_VERSION "version"
+#define ZPOOL_CONFIG_POOL_NAME "name"
+#define ZPOOL_CONFIG_POOL_STATE "state"
+#define ZPOOL_CONFIG_POOL_TXG "txg"
+#define ZPOOL_CONFIG_POOL_GUID "pool_guid"
+#define ZPOOL_CONFIG_VDEV_TREE "vdev_tree"
+#define ZPOOL_CONFIG_TYPE "type"
+#define ZPOOL_CONFIG_CHILDREN "children"
+#define ZPOOL_CONFIG_ID "id"
+#define ZPOOL_CONFIG_GUID "guid"
+#define ZPOOL_CONFIG_PATH "path"
+#define ZPOOL_CONFIG_STATS "stats"
+#define ZPOOL_CONFIG_IS_LOG "is_log"
+#define ZPOOL_CONFIG_L2CACHE "l2cache"
+#define ZPOOL_CONFIG_SPARES "spares"
+
+#define VDEV_TYPE_ROOT "root"
+#define VDEV_TYPE_FILE "file"
+
+/*
+ * Errors.
+ */
+enum {
+  EZFS_NOMEM = 2000,
+  EZFS_BADPROP,
+  EZFS_PROPREADONLY,
+  EZFS_PROPTYPE,
+  EZFS_PROPNONINHERIT,
+  EZFS_PROPSPACE,
+  EZFS_BADTYPE,
+  EZFS_BUSY,
+  EZFS_EXISTS,
+  EZFS_NOENT,
+  EZFS_BADSTREAM,
+  EZFS_DSREADONLY,
+  EZFS_VOLTOOBIG,
+  EZFS_INVALIDNAME,
+  EZFS_BADRESTORE,
+  EZFS_BADBACKUP,
+  EZFS_BADTARGET,
+  EZFS_NODEVICE,
+  EZFS_BADDEV,
+  EZFS_NOREPLICAS,
+  EZFS_RESILVERING,
+  EZFS_BADVERSION,
+  EZFS_POOLUNAVAIL,
+  EZFS_DEVOVERFLOW,
+  EZFS_BADPATH,
+  EZFS_CROSSTARGET,
+  EZFS_ZONED,
+  EZFS_MOUNTFAILED,
+  EZFS_UMOUNTFAILED,
+  EZFS_UNSHARENFSFAILED,
+  EZFS_SHARENFSFAILED,
+  EZFS_PERM,
+  EZFS_NOSPC,
+  EZFS_FAULT,
+  EZFS_IO,
+  EZFS_INTR,
+  EZFS_ISSPARE,
+  EZFS_INVALCONFIG,
+  EZFS_RECURSIVE,
+  EZFS_NOHISTORY,
+  EZFS_UNSHAREISCSIFAILED,
+  EZFS_SHAREISCSIFAILED,
+  EZFS_POOLPROPS,
+  EZFS_POOL_NOTSUP,
+  EZFS_POOL_INVALARG,
+  EZFS_NAMETOOLONG,
+  EZFS_OPENFAILED,
+  EZFS_NOCAP,
+  EZFS_LABELFAILED,
+  EZFS_BADWHO,
+  EZFS_BADPERM,
+  EZFS_BADPERMSET,
+  EZFS_NODELEGATION,
+  EZFS_PERMRDONLY,
+  EZFS_UNSHARESMBFAILED,
+  EZFS_SHARESMBFAILED,
+  EZFS_BADCACHE,
+  EZFS_ISL2CACHE,
+  EZFS_VDEVNOTSUP,
+  EZFS_NOTSUP,
+  EZFS_ACTIVE_SPARE,
+  EZFS_UNPLAYED_LOGS,
+  EZFS_REFTAG_RELE,
+  EZFS_REFTAG_HOLD,
+  EZFS_TAGTOOLONG,
+  EZFS_PIPEFAILED,
+  EZFS_THREADCREATEFAILED,
+  EZFS_POSTSPLIT_ONLINE,
+  EZFS_UNKNOWN
+};
+
+/*
+ * Library handles.
+ */
+libzfs_handle_t *libzfs_init(void);
+void libzfs_fini(libzfs_handle_t *);
+int libzfs_errno(libzfs_handle_t *);
+const char *libzfs_error_action(libzfs_handle_t *);
+const char *libzfs_error_description(libzfs_handle_t *);
+void libzfs_print_on_error(libzfs_handle_t *, boolean_t);
+libzfs_handle_t *zpool_get_handle(zpool_handle_t *);
+libzfs_handle_t *zfs_get_handle(zfs_handle_t *);
+
+/*
+ * Pools.
+ */
+typedef int (*zpool_iter_f)(zpool_handle_t *, void *);
+
+zpool_handle_t *zpool_open(libzfs_handle_t *, const char *);
+zpool_handle_t *zpool_open_canfail(libzfs_handle_t *, const char *);
+void zpool_close(zpool_handle_t *);
+const char *zpool_get_name(zpool_handle_t *);
+int zpool_get_state(zpool_handle_t *);
+zpool_status_t zpool_get_status(zpool_handle_t *, char **);
+int zpool_iter(libzfs_handle_t *, zpool_iter_f, void *);
+int zpool_create(libzfs_handle_t *, const char *, nvlist_t *, nvlist_t *, nvlist_t *);
+int zpool_refresh_stats(zpool_handle_t *, boolean_t *);
+nvlist_t *zpool_get_config(zpool_handle_t *, nvlist_t **);
+
+/*
+ * Events, (ZFS on Linux). Any descriptor works as the zevent cursor, (the
+ * simulator keeps the cursor by descriptor number), /dev/null will do.
+ */
+#ifdef ZFS_SIM_ZOL
+#define ZFS_DEV "/dev/null"
+#define ZEVENT_NONE 0x0
+#define ZEVENT_NONBLOCK 0x1
+#define ZEVENT_SEEK_START 0
+#define ZEVENT_SEEK_END UINT64_MAX
+int zpool_events_next(libzfs_handle_t *, nvlist_t **, int *, unsigned, int);
+int zpool_events_seek(libzfs_handle_t *, uint64_t, int);
+#endif
+uint64_t zpool_get_space_used(zpool_handle_t *);
+uint64_t zpool_get_space_total(zpool_handle_t *);
+int zpool_get_prop(zpool_handle_t *, zpool_prop_t, char *, size_t, zprop_source_t *);
+uint64_t zpool_get_prop_int(zpool_handle_t *, zpool_prop_t, zprop_source_t *);
+int zpool_set_prop(zpool_handle_t *, const char *, const char *);
+int zpool_name_to_prop(const char *);
+const char *zpool_prop_to_name(zpool_prop_t);
+zprop_type_t zpool_prop_get_type(zpool_prop_t);
+
+int zprop_iter(zprop_func, void *, boolean_t, boolean_t, zfs_type_t);
+
+/*
+ * Datasets.
+ */
+typedef int (*zfs_iter_f)(zfs_handle_t *, void *);
+typedef int (*zfs_userspace_cb_t)(void *, const char *, uid_t, uint64_t);
+typedef boolean_t (snapfilter_cb_t)(zfs_handle_t *, void *);
+
+typedef struct sendflags {
+  int verbose : 1;
+  int replicate : 1;
+  int doall : 1;
+  int fromorigin : 1;
+  int dedup : 1;
+  int props : 1;
+} sendflags_t;
+
+typedef struct recvflags {
+  int verbose : 1;
+  int isprefix : 1;
+  int dryrun : 1;
+  int force : 1;
+  int canmountoff : 1;
+  int byteswap : 1;
+  int nomount : 1;
+} recvflags_t;
+
+zfs_handle_t *zfs_open(libzfs_handle_t *, const char *, int);
+void zfs_close(zfs_handle_t *);
+zfs_type_t zfs_get_type(const zfs_handle_t *);
+const char *zfs_get_name(const zfs_handle_t *);
+zpool_handle_t *zfs_get_pool_handle(const zfs_handle_t *);
+boolean_t zfs_dataset_exists(libzfs_handle_t *, const char *, zfs_type_t);
+
+int zfs_name_to_prop(const char *);
+const char *zfs_prop_to_name(zfs_prop_t);
+boolean_t zfs_prop_user(const char *);
+boolean_t zfs_prop_userquota(const char *);
+boolean_t zfs_prop_readonly(zfs_prop_t);
+boolean_t zfs_prop_valid_for_type(int, zfs_type_t);
+zprop_type_t zfs_prop_get_type(zfs_prop_t);
+int zfs_prop_get(zfs_handle_t *, zfs_prop_t, char *, size_t, zprop_source_t *, char *, size_t, boolean_t);
+int zfs_prop_get_numeric(zfs_handle_t *, zfs_prop_t, uint64_t *, zprop_source_t *, char *, size_t);
+uint64_t zfs_prop_get_int(zfs_handle_t *, zfs_prop_t);
+int zfs_prop_set(zfs_handle_t *, const char *, const char *);
+nvlist_t *zfs_get_user_props(zfs_handle_t *);
+void zfs_refresh_properties(zfs_handle_t *);
+void zfs_nicenum(uint64_t, char *, size_t);
+
+int zfs_iter_root(libzfs_handle_t *, zfs_iter_f, void *);
+int zfs_iter_children(zfs_handle_t *, zfs_iter_f, void *);
+int zfs_iter_dependents(zfs_handle_t *, boolean_t, zfs_iter_f, void *);
+int zfs_iter_filesystems(zfs_handle_t *, zfs_iter_f, void *);
+int zfs_iter_snapshots(zfs_handle_t *, zfs_iter_f, void *);
+
+int zfs_create(libzfs_handle_t *, const char *, zfs_type_t, nvlist_t *);
+int zfs_destroy(zfs_handle_t *, boolean_t);
+int zfs_destroy_snaps_nvl(libzfs_handle_t *, nvlist_t *, boolean_t);
+int zfs_clone(zfs_handle_t *, const char *, nvlist_t *);
+int zfs_promote(zfs_handle_t *);
+int zfs_rename(zfs_handle_t *, const char *, boolean_t);
+int zfs_rollback(zfs_handle_t *, zfs_handle_t *, boolean_t);
+int zfs_snapshot(libzfs_handle_t *, const char *, boolean_t, nvlist_t *);
+int zfs_snapshot_nvl(libzfs_handle_t *, nvlist_t *, nvlist_t *);
+int zfs_send(zfs_handle_t *, const char *, const char *, sendflags_t, int, snapfilter_cb_t, void *);
+int zfs_receive(libzfs_handle_t *, const char *, recvflags_t, int, avl_tree_t *);
+int zfs_userspace(zfs_handle_t *, zfs_userquota_prop_t, zfs_userspace_cb_t, void *);
+
+#define MS_FORCE 0x400
+boolean_t zfs_is_mounted(zfs_handle_t *, char **);
+int zfs_mount(zfs_handle_t *, const char *, int);
+int zfs_unmount(zfs_handle_t *, const char *, int);
+boolean_t zfs_is_shared(zfs_handle_t *);
+int zfs_share(zfs_handle_t *);
+int zfs_unshare(zfs_handle_t *);
+boolean_t zfs_is_shared_nfs(zfs_handle_t *, char **);
+int zfs_share_nfs(zfs_handle_t *);
+int zfs_unshare_nfs(zfs_handle_t *, const char *);
+boolean_t zfs_is_shared_smb(zfs_handle_t *, char **);
+int zfs_share_smb(zfs_handle_t *);
+int zfs_unshare_smb(zfs_handle_t *, const char *);
+boolean_t zfs_is_shared_iscsi(zfs_handle_t *);
+int zfs_share_iscsi(zfs_handle_t *);
+int zfs_unshare_iscsi(zfs_handle_t *);
+#ifdef ZFS_SIM_ZOL
+void zfs_commit_all_shares(void);
+#endif
+
+#endif
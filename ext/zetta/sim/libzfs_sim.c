@@ -0,0 +1,3596 @@
+/*
+ * In-memory libzfs simulator.
+ *
+ * Implements the libzfs subset declared by libzfs.h over a process wide,
+ * in-memory, tree of pools and datasets, so the extension can be built,
+ * tested and benchmarked without any real pool:
+ *
+ * - ZFS_SIM_SEED, file with the commands used to build the initial tree,
+ *   one per line (see sim_seed_line). The default seed is the one described
+ *   by the README for the test suite: tpool, tpool/home, tpool/thome, ...
+ * - ZFS_SIM_DATASETS and ZFS_SIM_FANOUT, add that many synthetic
+ *   filesystems below tpool/synthetic, ZFS_SIM_FANOUT (100) per level.
+ * - ZFS_SIM_LATENCY, microseconds added to every simulated ioctl, either a
+ *   single number or a list of op=usec, (see sim_op_names), where 'default'
+ *   applies to the ops not listed: "open=50,snapshot=2000,default=10".
+ *
+ * Every operation takes a single global lock, while the latency is spent
+ * outside of it, the same way a real ioctl wouldn't block other threads.
+ * Iterators don't hold the lock while running their callbacks.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <grp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libzfs.h"
+
+/*
+ * Name/value lists.
+ */
+struct nvpair {
+  struct nvpair *next;
+  char *name;
+  data_type_t type;
+  union {
+    int32_t i32;
+    int64_t i64;
+    uint64_t u64;
+    char *str;
+    nvlist_t *nvl;
+    struct {
+      void *items;
+      uint_t count;
+    } array;
+  } value;
+};
+
+struct nvlist {
+  nvpair_t *head;
+  nvpair_t *tail;
+  int unique;
+};
+
+static void nvpair_free(nvpair_t *pair)
+{
+  uint_t i;
+
+  switch (pair->type) {
+    case DATA_TYPE_STRING: free(pair->value.str); break;
+    case DATA_TYPE_NVLIST: nvlist_free(pair->value.nvl); break;
+    case DATA_TYPE_INT64_ARRAY: free(pair->value.array.items); break;
+    case DATA_TYPE_UINT64_ARRAY: free(pair->value.array.items); break;
+    case DATA_TYPE_NVLIST_ARRAY:
+      for (i = 0; i < pair->value.array.count; i++) {
+        nvlist_free(((nvlist_t **)pair->value.array.items)[i]);
+      }
+      free(pair->value.array.items);
+      break;
+    default: break;
+  }
+  free(pair->name);
+  free(pair);
+}
+
+int nvlist_alloc(nvlist_t **nvlp, uint_t flags, int kmflag)
+{
+  if ((*nvlp = calloc(1, sizeof(nvlist_t))) == NULL) {
+    return ENOMEM;
+  }
+  (*nvlp)->unique = (flags & NV_UNIQUE_NAME) != 0;
+  return 0;
+}
+
+void nvlist_free(nvlist_t *nvl)
+{
+  nvpair_t *pair, *next;
+
+  if (nvl == NULL) {
+    return;
+  }
+  for (pair = nvl->head; pair != NULL; pair = next) {
+    next = pair->next;
+    nvpair_free(pair);
+  }
+  free(nvl);
+}
+
+int nvlist_remove_all(nvlist_t *nvl, const char *name)
+{
+  nvpair_t *pair, *prev = NULL, *next;
+  int ret = ENOENT;
+
+  for (pair = nvl->head; pair != NULL; pair = next) {
+    next = pair->next;
+    if (strcmp(pair->name, name) == 0) {
+      if (prev == NULL) {
+        nvl->head = next;
+      } else {
+        prev->next = next;
+      }
+      if (nvl->tail == pair) {
+        nvl->tail = prev;
+      }
+      nvpair_free(pair);
+      ret = 0;
+    } else {
+      prev = pair;
+    }
+  }
+  return ret;
+}
+
+static nvpair_t *nvlist_add(nvlist_t *nvl, const char *name, data_type_t type)
+{
+  nvpair_t *pair;
+
+  if (nvl == NULL || name == NULL) {
+    return NULL;
+  }
+  if (nvl->unique) {
+    nvlist_remove_all(nvl, name);
+  }
+  if ((pair = calloc(1, sizeof(nvpair_t))) == NULL || (pair->name = strdup(name)) == NULL) {
+    free(pair);
+    return NULL;
+  }
+  pair->type = type;
+  if (nvl->tail == NULL) {
+    nvl->head = pair;
+  } else {
+    nvl->tail->next = pair;
+  }
+  nvl->tail = pair;
+  return pair;
+}
+
+static nvpair_t *nvlist_find(nvlist_t *nvl, const char *name, data_type_t type)
+{
+  nvpair_t *pair;
+
+  if (nvl == NULL || name == NULL) {
+    return NULL;
+  }
+  for (pair = nvl->head; pair != NULL; pair = pair->next) {
+    if (pair->type == type && strcmp(pair->name, name) == 0) {
+      return pair;
+    }
+  }
+  return NULL;
+}
+
+int nvlist_dup(nvlist_t *nvl, nvlist_t **nvlp, int kmflag)
+{
+  nvpair_t *pair;
+  int ret = 0;
+
+  if (nvlist_alloc(nvlp, nvl->unique ? NV_UNIQUE_NAME : 0, kmflag) != 0) {
+    return ENOMEM;
+  }
+  for (pair = nvl->head; pair != NULL && ret == 0; pair = pair->next) {
+    switch (pair->type) {
+      case DATA_TYPE_BOOLEAN: ret = nvlist_add_boolean(*nvlp, pair->name); break;
+      case DATA_TYPE_INT32: ret = nvlist_add_int32(*nvlp, pair->name, pair->value.i32); break;
+      case DATA_TYPE_INT64: ret = nvlist_add_int64(*nvlp, pair->name, pair->value.i64); break;
+      case DATA_TYPE_UINT64: ret = nvlist_add_uint64(*nvlp, pair->name, pair->value.u64); break;
+      case DATA_TYPE_STRING: ret = nvlist_add_string(*nvlp, pair->name, pair->value.str); break;
+      case DATA_TYPE_NVLIST: ret = nvlist_add_nvlist(*nvlp, pair->name, pair->value.nvl); break;
+      case DATA_TYPE_INT64_ARRAY:
+        ret = nvlist_add_int64_array(*nvlp, pair->name, pair->value.array.items, pair->value.array.count);
+        break;
+      case DATA_TYPE_UINT64_ARRAY:
+        ret = nvlist_add_uint64_array(*nvlp, pair->name, pair->value.array.items, pair->value.array.count);
+        break;
+      case DATA_TYPE_NVLIST_ARRAY:
+        ret = nvlist_add_nvlist_array(*nvlp, pair->name, pair->value.array.items, pair->value.array.count);
+        break;
+      default: ret = EINVAL;
+    }
+  }
+  if (ret != 0) {
+    nvlist_free(*nvlp);
+    *nvlp = NULL;
+  }
+  return ret;
+}
+
+int nvlist_add_boolean(nvlist_t *nvl, const char *name)
+{
+  return nvlist_add(nvl, name, DATA_TYPE_BOOLEAN) ? 0 : ENOMEM;
+}
+
+int nvlist_add_int32(nvlist_t *nvl, const char *name, int32_t value)
+{
+  nvpair_t *pair = nvlist_add(nvl, name, DATA_TYPE_INT32);
+  if (pair == NULL) {
+    return ENOMEM;
+  }
+  pair->value.i32 = value;
+  return 0;
+}
+
+int nvlist_add_int64(nvlist_t *nvl, const char *name, int64_t value)
+{
+  nvpair_t *pair = nvlist_add(nvl, name, DATA_TYPE_INT64);
+  if (pair == NULL) {
+    return ENOMEM;
+  }
+  pair->value.i64 = value;
+  return 0;
+}
+
+int nvlist_add_uint64(nvlist_t *nvl, const char *name, uint64_t value)
+{
+  nvpair_t *pair = nvlist_add(nvl, name, DATA_TYPE_UINT64);
+  if (pair == NULL) {
+    return ENOMEM;
+  }
+  pair->value.u64 = value;
+  return 0;
+}
+
+int nvlist_add_string(nvlist_t *nvl, const char *name, const char *value)
+{
+  nvpair_t *pair;
+  char *copy = strdup(value);
+
+  if (copy == NULL || (pair = nvlist_add(nvl, name, DATA_TYPE_STRING)) == NULL) {
+    free(copy);
+    return ENOMEM;
+  }
+  pair->value.str = copy;
+  return 0;
+}
+
+int nvlist_add_nvlist(nvlist_t *nvl, const char *name, nvlist_t *value)
+{
+  nvpair_t *pair;
+  nvlist_t *copy;
+
+  if (nvlist_dup(value, &copy, 0) != 0) {
+    return ENOMEM;
+  }
+  if ((pair = nvlist_add(nvl, name, DATA_TYPE_NVLIST)) == NULL) {
+    nvlist_free(copy);
+    return ENOMEM;
+  }
+  pair->value.nvl = copy;
+  return 0;
+}
+
+int nvlist_add_int64_array(nvlist_t *nvl, const char *name, int64_t *values, uint_t count)
+{
+  nvpair_t *pair;
+  int64_t *copy = malloc((count + 1) * sizeof(int64_t));
+
+  if (copy == NULL || (pair = nvlist_add(nvl, name, DATA_TYPE_INT64_ARRAY)) == NULL) {
+    free(copy);
+    return ENOMEM;
+  }
+  memcpy(copy, values, count * sizeof(int64_t));
+  pair->value.array.items = copy;
+  pair->value.array.count = count;
+  return 0;
+}
+
+int nvlist_add_uint64_array(nvlist_t *nvl, const char *name, uint64_t *values, uint_t count)
+{
+  nvpair_t *pair;
+  uint64_t *copy = malloc((count + 1) * sizeof(uint64_t));
+
+  if (copy == NULL || (pair = nvlist_add(nvl, name, DATA_TYPE_UINT64_ARRAY)) == NULL) {
+    free(copy);
+    return ENOMEM;
+  }
+  memcpy(copy, values, count * sizeof(uint64_t));
+  pair->value.array.items = copy;
+  pair->value.array.count = count;
+  return 0;
+}
+
+int nvlist_add_nvlist_array(nvlist_t *nvl, const char *name, nvlist_t **values, uint_t count)
+{
+  nvpair_t *pair;
+  nvlist_t **copy = calloc(count + 1, sizeof(nvlist_t *));
+  uint_t i;
+
+  if (copy == NULL) {
+    return ENOMEM;
+  }
+  for (i = 0; i < count; i++) {
+    if (nvlist_dup(values[i], &copy[i], 0) != 0) {
+      break;
+    }
+  }
+  if (i < count || (pair = nvlist_add(nvl, name, DATA_TYPE_NVLIST_ARRAY)) == NULL) {
+    while (i > 0) {
+      nvlist_free(copy[--i]);
+    }
+    free(copy);
+    return ENOMEM;
+  }
+  pair->value.array.items = copy;
+  pair->value.array.count = count;
+  return 0;
+}
+
+boolean_t nvlist_exists(nvlist_t *nvl, const char *name)
+{
+  nvpair_t *pair;
+
+  for (pair = (nvl != NULL) ? nvl->head : NULL; pair != NULL; pair = pair->next) {
+    if (strcmp(pair->name, name) == 0) {
+      return B_TRUE;
+    }
+  }
+  return B_FALSE;
+}
+
+int nvlist_lookup_int32(nvlist_t *nvl, const char *name, int32_t *value)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_INT32);
+  return pair ? nvpair_value_int32(pair, value) : ENOENT;
+}
+
+int nvlist_lookup_int64(nvlist_t *nvl, const char *name, int64_t *value)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_INT64);
+  return pair ? nvpair_value_int64(pair, value) : ENOENT;
+}
+
+int nvlist_lookup_uint64(nvlist_t *nvl, const char *name, uint64_t *value)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_UINT64);
+  return pair ? nvpair_value_uint64(pair, value) : ENOENT;
+}
+
+int nvlist_lookup_string(nvlist_t *nvl, const char *name, char **value)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_STRING);
+  return pair ? nvpair_value_string(pair, value) : ENOENT;
+}
+
+int nvlist_lookup_nvlist(nvlist_t *nvl, const char *name, nvlist_t **value)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_NVLIST);
+  return pair ? nvpair_value_nvlist(pair, value) : ENOENT;
+}
+
+int nvlist_lookup_int64_array(nvlist_t *nvl, const char *name, int64_t **values, uint_t *count)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_INT64_ARRAY);
+  return pair ? nvpair_value_int64_array(pair, values, count) : ENOENT;
+}
+
+int nvlist_lookup_uint64_array(nvlist_t *nvl, const char *name, uint64_t **values, uint_t *count)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_UINT64_ARRAY);
+
+  if (pair == NULL) {
+    return ENOENT;
+  }
+  *values = pair->value.array.items;
+  *count = pair->value.array.count;
+  return 0;
+}
+
+int nvlist_lookup_nvlist_array(nvlist_t *nvl, const char *name, nvlist_t ***values, uint_t *count)
+{
+  nvpair_t *pair = nvlist_find(nvl, name, DATA_TYPE_NVLIST_ARRAY);
+
+  if (pair == NULL) {
+    return ENOENT;
+  }
+  *values = pair->value.array.items;
+  *count = pair->value.array.count;
+  return 0;
+}
+
+nvpair_t *nvlist_next_nvpair(nvlist_t *nvl, nvpair_t *pair)
+{
+  if (nvl == NULL) {
+    return NULL;
+  }
+  return (pair == NULL) ? nvl->head : pair->next;
+}
+
+char *nvpair_name(nvpair_t *pair)
+{
+  return pair->name;
+}
+
+data_type_t nvpair_type(nvpair_t *pair)
+{
+  return pair->type;
+}
+
+// Never added by the simulator, for the types libzfs can return:
+int nvpair_value_boolean_value(nvpair_t *pair, boolean_t *value)
+{
+  return EINVAL;
+}
+
+int nvpair_value_uint32(nvpair_t *pair, uint32_t *value)
+{
+  return EINVAL;
+}
+
+int nvpair_value_int32(nvpair_t *pair, int32_t *value)
+{
+  if (pair->type != DATA_TYPE_INT32) {
+    return EINVAL;
+  }
+  *value = pair->value.i32;
+  return 0;
+}
+
+int nvpair_value_int64(nvpair_t *pair, int64_t *value)
+{
+  if (pair->type != DATA_TYPE_INT64) {
+    return EINVAL;
+  }
+  *value = pair->value.i64;
+  return 0;
+}
+
+int nvpair_value_uint64(nvpair_t *pair, uint64_t *value)
+{
+  if (pair->type != DATA_TYPE_UINT64) {
+    return EINVAL;
+  }
+  *value = pair->value.u64;
+  return 0;
+}
+
+int nvpair_value_string(nvpair_t *pair, char **value)
+{
+  if (pair->type != DATA_TYPE_STRING) {
+    return EINVAL;
+  }
+  *value = pair->value.str;
+  return 0;
+}
+
+int nvpair_value_nvlist(nvpair_t *pair, nvlist_t **value)
+{
+  if (pair->type != DATA_TYPE_NVLIST) {
+    return EINVAL;
+  }
+  *value = pair->value.nvl;
+  return 0;
+}
+
+static int nvpair_value_array(nvpair_t *pair, data_type_t type, void **values, uint_t *count)
+{
+  if (pair->type != type) {
+    return EINVAL;
+  }
+  *values = pair->value.array.items;
+  *count = pair->value.array.count;
+  return 0;
+}
+
+int nvpair_value_int64_array(nvpair_t *pair, int64_t **values, uint_t *count)
+{
+  return nvpair_value_array(pair, DATA_TYPE_INT64_ARRAY, (void **)values, count);
+}
+
+int nvpair_value_uint64_array(nvpair_t *pair, uint64_t **values, uint_t *count)
+{
+  return nvpair_value_array(pair, DATA_TYPE_UINT64_ARRAY, (void **)values, count);
+}
+
+int nvpair_value_nvlist_array(nvpair_t *pair, nvlist_t ***values, uint_t *count)
+{
+  return nvpair_value_array(pair, DATA_TYPE_NVLIST_ARRAY, (void **)values, count);
+}
+
+/*
+ * Simulated pools and datasets.
+ */
+typedef struct sim_prop {
+  struct sim_prop *next;
+  int prop;
+  char *value;
+} sim_prop_t;
+
+typedef struct sim_pool sim_pool_t;
+
+// userquota@ and groupquota@ properties:
+typedef struct sim_quota {
+  struct sim_quota *next;
+  zfs_userquota_prop_t type;  // ZFS_PROP_USERQUOTA or ZFS_PROP_GROUPQUOTA
+  char *domain;               // "" for POSIX ids
+  uid_t rid;
+  uint64_t quota;
+} sim_quota_t;
+
+typedef struct sim_ds {
+  char *name;
+  zfs_type_t type;
+  uint64_t guid;
+  uint64_t createtxg;
+  uint64_t creation;
+  uint64_t refer;
+  sim_pool_t *pool;
+  struct sim_ds *parent;      // parent filesystem, or the snapshot's dataset
+  struct sim_ds *children;    // filesystems and volumes
+  struct sim_ds *children_tail;
+  struct sim_ds *snapshots;   // oldest first
+  struct sim_ds *snapshots_tail;
+  struct sim_ds *next;        // next sibling
+  struct sim_ds *origin;      // clones, origin snapshot
+  struct sim_ds *clones;      // snapshots, clones made from them
+  struct sim_ds *clone_next;
+  struct sim_ds *hash_next;
+  sim_prop_t *props;          // local native properties
+  nvlist_t *user_props;       // local user properties
+  sim_quota_t *quotas;
+  unsigned mounted : 1;
+  unsigned shared_nfs : 1;
+  unsigned shared_smb : 1;
+  unsigned defer_destroy : 1;
+} sim_ds_t;
+
+struct sim_pool {
+  sim_pool_t *next;
+  char *name;
+  char *path;
+  uint64_t guid;
+  uint64_t vdev_guid;
+  uint64_t size;
+  uint64_t config_txg;
+  uint64_t version;
+  sim_prop_t *props;
+  sim_ds_t *root;
+  uint64_t ops[ZIO_TYPES];
+  uint64_t bytes[ZIO_TYPES];
+  int64_t loaded;             // CLOCK_MONOTONIC ns, vdev timestamps count from here
+};
+
+struct libzfs_handle {
+  int error;
+  boolean_t print;
+  char action[1024];
+  char desc[1024];
+};
+
+struct zfs_handle {
+  libzfs_handle_t *lib;
+  char name[ZFS_MAXNAMELEN];
+  zfs_type_t type;
+  nvlist_t *user_props;
+  zpool_handle_t *pool;
+};
+
+struct zpool_handle {
+  libzfs_handle_t *lib;
+  char name[ZPOOL_MAXNAMELEN];
+  nvlist_t *config;
+  nvlist_t *old_config;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+static sim_pool_t *sim_pools;     // sorted by name, like the pool namespace
+static sim_ds_t **sim_table;
+static size_t sim_table_size;
+static size_t sim_count;
+static uint64_t sim_txg = 4;
+static uint64_t sim_guid_state = 0x5a17c0ffee15bad5ULL;
+
+#define SIM_REFER (21 * 1024)     // referenced by an empty filesystem
+#define SIM_POOL_SIZE (128ULL << 20)
+
+static uint64_t sim_guid(void)
+{
+  // xorshift64*, stable guids for a given seed
+  sim_guid_state ^= sim_guid_state >> 12;
+  sim_guid_state ^= sim_guid_state << 25;
+  sim_guid_state ^= sim_guid_state >> 27;
+  return sim_guid_state * 2685821657736338717ULL;
+}
+
+static size_t sim_hash(const char *name)
+{
+  size_t hash = 2166136261U;
+
+  while (*name != '\0') {
+    hash = (hash ^ (unsigned char)*name++) * 16777619U;
+  }
+  return hash;
+}
+
+static sim_ds_t *sim_lookup(const char *name)
+{
+  sim_ds_t *ds;
+
+  if (sim_table == NULL) {
+    return NULL;
+  }
+  for (ds = sim_table[sim_hash(name) & (sim_table_size - 1)]; ds != NULL; ds = ds->hash_next) {
+    if (strcmp(ds->name, name) == 0) {
+      return ds;
+    }
+  }
+  return NULL;
+}
+
+static void sim_hash_insert(sim_ds_t *ds)
+{
+  size_t i, slot;
+  sim_ds_t **table, *item, *next;
+
+  if (sim_count >= sim_table_size) {
+    size_t size = sim_table_size ? sim_table_size * 2 : 1024;
+    if ((table = calloc(size, sizeof(sim_ds_t *))) == NULL) {
+      abort();
+    }
+    for (i = 0; i < sim_table_size; i++) {
+      for (item = sim_table[i]; item != NULL; item = next) {
+        next = item->hash_next;
+        slot = sim_hash(item->name) & (size - 1);
+        item->hash_next = table[slot];
+        table[slot] = item;
+      }
+    }
+    free(sim_table);
+    sim_table = table;
+    sim_table_size = size;
+  }
+  slot = sim_hash(ds->name) & (sim_table_size - 1);
+  ds->hash_next = sim_table[slot];
+  sim_table[slot] = ds;
+  sim_count++;
+}
+
+static void sim_hash_remove(sim_ds_t *ds)
+{
+  sim_ds_t **link = &sim_table[sim_hash(ds->name) & (sim_table_size - 1)];
+
+  while (*link != NULL && *link != ds) {
+    link = &(*link)->hash_next;
+  }
+  if (*link == ds) {
+    *link = ds->hash_next;
+    sim_count--;
+  }
+}
+
+static sim_pool_t *sim_pool_lookup(const char *name, size_t len)
+{
+  sim_pool_t *pool;
+
+  for (pool = sim_pools; pool != NULL; pool = pool->next) {
+    if (strlen(pool->name) == len && strncmp(pool->name, name, len) == 0) {
+      return pool;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Simulated ioctl latency and pool I/O counters.
+ */
+typedef enum {
+  SIM_OP_OPEN,
+  SIM_OP_ITER,
+  SIM_OP_GET,
+  SIM_OP_SET,
+  SIM_OP_CREATE,
+  SIM_OP_DESTROY,
+  SIM_OP_SNAPSHOT,
+  SIM_OP_CLONE,
+  SIM_OP_RENAME,
+  SIM_OP_ROLLBACK,
+  SIM_OP_PROMOTE,
+  SIM_OP_SEND,
+  SIM_OP_RECV,
+  SIM_OP_MOUNT,
+  SIM_OP_SHARE,
+  SIM_OP_POOL,
+  SIM_NUM_OPS
+} sim_op_t;
+
+static const char *sim_op_names[SIM_NUM_OPS] = {
+  "open", "iter", "get", "set", "create", "destroy", "snapshot", "clone",
+  "rename", "rollback", "promote", "send", "recv", "mount", "share", "pool"
+};
+
+static useconds_t sim_latency[SIM_NUM_OPS];
+
+static void sim_latency_init(const char *spec)
+{
+  char name[32];
+  const char *item;
+  unsigned long usec;
+  int i, n, pass;
+
+  if (spec == NULL) {
+    return;
+  }
+  if (sscanf(spec, "%lu%n", &usec, &n) == 1 && spec[n] == '\0') {
+    for (i = 0; i < SIM_NUM_OPS; i++) {
+      sim_latency[i] = usec;
+    }
+    return;
+  }
+  // The default first, so the named ops win whatever the order:
+  for (pass = 0; pass < 2; pass++) {
+    for (item = spec; sscanf(item, " %31[^=,]=%lu%n", name, &usec, &n) == 2; item += n) {
+      for (i = 0; i < SIM_NUM_OPS; i++) {
+        if (pass == 0 ? strcmp(name, "default") == 0 : strcmp(name, sim_op_names[i]) == 0) {
+          sim_latency[i] = usec;
+        }
+      }
+      if (item[n] == ',') {
+        n++;
+      }
+    }
+  }
+}
+
+static void sim_ioctl(sim_op_t op)
+{
+  if (sim_latency[op] > 0) {
+    usleep(sim_latency[op]);
+  }
+}
+
+/*
+ * Events: the kernel keeps the last SIM_EVENTS_MAX of them, and a cursor for
+ * each reader, (by descriptor number). Every change to a pool posts a
+ * history event, the way ZFS on Linux does.
+ */
+#define SIM_EVENTS_MAX 1024
+#define SIM_EVENTS_FDS 1024
+
+static nvlist_t *sim_events[SIM_EVENTS_MAX];
+static uint64_t sim_eid;
+#ifdef ZFS_SIM_ZOL
+static uint64_t sim_event_cursors[SIM_EVENTS_FDS];
+#endif
+
+// Lock held:
+static void sim_event_post(sim_pool_t *pool, const char *op)
+{
+  nvlist_t *event;
+  struct timespec ts;
+  int64_t tv[2];
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  tv[0] = ts.tv_sec;
+  tv[1] = ts.tv_nsec;
+  nvlist_alloc(&event, NV_UNIQUE_NAME, 0);
+  nvlist_add_string(event, "class", "sysevent.fs.zfs.history_event");
+  nvlist_add_uint64(event, "eid", ++sim_eid);
+  nvlist_add_int64_array(event, "time", tv, 2);
+  nvlist_add_string(event, "pool", pool->name);
+  nvlist_add_uint64(event, "pool_guid", pool->guid);
+  nvlist_add_string(event, "history_internal_name", op);
+  nvlist_free(sim_events[sim_eid % SIM_EVENTS_MAX]);
+  sim_events[sim_eid % SIM_EVENTS_MAX] = event;
+}
+
+#ifdef ZFS_SIM_ZOL
+static uint64_t sim_event_oldest(void)
+{
+  return (sim_eid > SIM_EVENTS_MAX) ? sim_eid - SIM_EVENTS_MAX + 1 : 1;
+}
+#endif
+
+// Account one ioctl against the pool of the given dataset, (lock held):
+static void sim_count_io(sim_pool_t *pool, sim_op_t op, uint64_t bytes)
+{
+  zio_type_t type;
+
+  if (pool == NULL) {
+    return;
+  }
+  switch (op) {
+    case SIM_OP_OPEN: case SIM_OP_ITER: case SIM_OP_GET: case SIM_OP_SEND:
+    case SIM_OP_POOL:
+      type = ZIO_TYPE_READ;
+      break;
+    case SIM_OP_DESTROY:
+      type = ZIO_TYPE_FREE;
+      break;
+    default:
+      type = ZIO_TYPE_WRITE;
+  }
+  // Mounts and shares are not pool changes:
+  if (type != ZIO_TYPE_READ && op != SIM_OP_MOUNT && op != SIM_OP_SHARE) {
+    sim_event_post(pool, sim_op_names[op]);
+  }
+  pool->ops[type]++;
+  pool->bytes[type] += bytes ? bytes : 4096;
+}
+
+/*
+ * Errors, the same messages than libzfs.
+ */
+static const char *sim_strerror(int error)
+{
+  switch (error) {
+    case 0: return "no error";
+    case EZFS_NOMEM: return "out of memory";
+    case EZFS_BADPROP: return "invalid property value";
+    case EZFS_PROPREADONLY: return "read-only property";
+    case EZFS_PROPTYPE: return "property doesn't apply to datasets of this type";
+    case EZFS_PROPNONINHERIT: return "property cannot be inherited";
+    case EZFS_BADTYPE: return "operation not applicable to datasets of this type";
+    case EZFS_BUSY: return "pool or dataset is busy";
+    case EZFS_EXISTS: return "pool or dataset exists";
+    case EZFS_NOENT: return "no such pool or dataset";
+    case EZFS_BADSTREAM: return "invalid backup stream";
+    case EZFS_INVALIDNAME: return "invalid name";
+    case EZFS_BADBACKUP: return "backup failed";
+    case EZFS_BADTARGET: return "invalid target vdev";
+    case EZFS_BADVERSION: return "unsupported version";
+    case EZFS_CROSSTARGET: return "operation crosses datasets or pools";
+    case EZFS_BADDEV: return "invalid device";
+    case EZFS_INTR: return "signal received";
+    case EZFS_MOUNTFAILED: return "mount failed";
+    case EZFS_UMOUNTFAILED: return "umount failed";
+    case EZFS_UNSHARENFSFAILED: return "unshare(1M) failed";
+    case EZFS_SHARENFSFAILED: return "share(1M) failed";
+    case EZFS_IO: return "I/O error";
+    case EZFS_RECURSIVE: return "recursive dataset dependency";
+    case EZFS_SHAREISCSIFAILED: return "iscsitgtd failed request to share";
+    case EZFS_UNSHAREISCSIFAILED: return "iscsitgtd failed request to unshare";
+    case EZFS_NAMETOOLONG: return "dataset name is too long";
+    case EZFS_NOTSUP: return "operation not supported on this dataset";
+    default: return "unknown error";
+  }
+}
+
+static int sim_error(libzfs_handle_t *lib, int error, const char *desc, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(lib->action, sizeof(lib->action), fmt, ap);
+  va_end(ap);
+  lib->error = error;
+  if (desc != NULL) {
+    snprintf(lib->desc, sizeof(lib->desc), "%s", desc);
+  } else {
+    lib->desc[0] = '\0';
+  }
+  if (lib->print) {
+    fprintf(stderr, "%s: %s\n", lib->action, libzfs_error_description(lib));
+  }
+  return -1;
+}
+
+/*
+ * Properties.
+ */
+#define SIM_FS ZFS_TYPE_FILESYSTEM
+#define SIM_VOL ZFS_TYPE_VOLUME
+#define SIM_SNAP ZFS_TYPE_SNAPSHOT
+#define SIM_FSVOL (ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME)
+
+#define SIM_PROP_READONLY 0x1
+#define SIM_PROP_INHERIT 0x2
+#define SIM_PROP_HIDDEN 0x4
+#define SIM_PROP_NONE 0x8       // numeric properties where 0 is "none"
+#define SIM_PROP_SIZE 0x10      // numeric properties shown with zfs_nicenum
+
+typedef struct sim_prop_desc {
+  const char *name;
+  zprop_type_t type;
+  int types;
+  int flags;
+  const char *def;
+  const char *values;
+} sim_prop_desc_t;
+
+#define ON_OFF "off|on"
+
+static const sim_prop_desc_t sim_fs_props[ZFS_NUM_PROPS] = {
+  [ZFS_PROP_TYPE] = { "type", PROP_TYPE_STRING, ZFS_TYPE_DATASET, SIM_PROP_READONLY },
+  [ZFS_PROP_CREATION] = { "creation", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY },
+  [ZFS_PROP_USED] = { "used", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_AVAILABLE] = { "available", PROP_TYPE_NUMBER, SIM_FSVOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_REFERENCED] = { "referenced", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_COMPRESSRATIO] = { "compressratio", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY },
+  [ZFS_PROP_MOUNTED] = { "mounted", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_READONLY, "no", "no|yes" },
+  [ZFS_PROP_ORIGIN] = { "origin", PROP_TYPE_STRING, SIM_FSVOL, SIM_PROP_READONLY },
+  [ZFS_PROP_QUOTA] = { "quota", PROP_TYPE_NUMBER, SIM_FS, SIM_PROP_NONE | SIM_PROP_SIZE, "0" },
+  [ZFS_PROP_RESERVATION] = { "reservation", PROP_TYPE_NUMBER, SIM_FSVOL, SIM_PROP_NONE | SIM_PROP_SIZE, "0" },
+  [ZFS_PROP_VOLSIZE] = { "volsize", PROP_TYPE_NUMBER, SIM_VOL, SIM_PROP_SIZE, "0" },
+  [ZFS_PROP_VOLBLOCKSIZE] = { "volblocksize", PROP_TYPE_NUMBER, SIM_VOL, SIM_PROP_READONLY | SIM_PROP_SIZE, "8192" },
+  [ZFS_PROP_RECORDSIZE] = { "recordsize", PROP_TYPE_NUMBER, SIM_FS, SIM_PROP_INHERIT | SIM_PROP_SIZE, "131072" },
+  [ZFS_PROP_MOUNTPOINT] = { "mountpoint", PROP_TYPE_STRING, SIM_FS, SIM_PROP_INHERIT },
+  [ZFS_PROP_SHARENFS] = { "sharenfs", PROP_TYPE_STRING, SIM_FS, SIM_PROP_INHERIT, "off" },
+  [ZFS_PROP_CHECKSUM] = { "checksum", PROP_TYPE_INDEX, SIM_FSVOL, SIM_PROP_INHERIT, "on",
+    "on|off|fletcher2|fletcher4|sha256" },
+  [ZFS_PROP_COMPRESSION] = { "compression", PROP_TYPE_INDEX, SIM_FSVOL, SIM_PROP_INHERIT, "off",
+    "on|off|lzjb|gzip|gzip-1|gzip-2|gzip-3|gzip-4|gzip-5|gzip-6|gzip-7|gzip-8|gzip-9|zle" },
+  [ZFS_PROP_ATIME] = { "atime", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_INHERIT, "on", ON_OFF },
+  [ZFS_PROP_DEVICES] = { "devices", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_INHERIT, "on", ON_OFF },
+  [ZFS_PROP_EXEC] = { "exec", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_INHERIT, "on", ON_OFF },
+  [ZFS_PROP_SETUID] = { "setuid", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_INHERIT, "on", ON_OFF },
+  [ZFS_PROP_READONLY] = { "readonly", PROP_TYPE_INDEX, SIM_FSVOL, SIM_PROP_INHERIT, "off", ON_OFF },
+  [ZFS_PROP_ZONED] = { "zoned", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_INHERIT, "off", ON_OFF },
+  [ZFS_PROP_SNAPDIR] = { "snapdir", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_INHERIT, "hidden", "hidden|visible" },
+  [ZFS_PROP_ACLMODE] = { "aclmode", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_INHERIT, "groupmask",
+    "discard|groupmask|passthrough" },
+  [ZFS_PROP_ACLINHERIT] = { "aclinherit", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_INHERIT, "restricted",
+    "discard|noallow|restricted|passthrough|passthrough-x" },
+  [ZFS_PROP_CREATETXG] = { "createtxg", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY },
+  [ZFS_PROP_NAME] = { "name", PROP_TYPE_STRING, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_HIDDEN },
+  [ZFS_PROP_CANMOUNT] = { "canmount", PROP_TYPE_INDEX, SIM_FS, 0, "on", "off|on|noauto" },
+  [ZFS_PROP_SHAREISCSI] = { "shareiscsi", PROP_TYPE_STRING, SIM_FSVOL, SIM_PROP_INHERIT, "off" },
+  [ZFS_PROP_ISCSIOPTIONS] = { "iscsioptions", PROP_TYPE_STRING, SIM_VOL, SIM_PROP_HIDDEN | SIM_PROP_INHERIT, "" },
+  [ZFS_PROP_XATTR] = { "xattr", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_INHERIT, "on", ON_OFF },
+  [ZFS_PROP_NUMCLONES] = { "numclones", PROP_TYPE_NUMBER, SIM_SNAP, SIM_PROP_READONLY | SIM_PROP_HIDDEN },
+  [ZFS_PROP_COPIES] = { "copies", PROP_TYPE_INDEX, SIM_FSVOL, SIM_PROP_INHERIT, "1", "1|2|3" },
+  [ZFS_PROP_VERSION] = { "version", PROP_TYPE_NUMBER, SIM_FS | SIM_SNAP, 0, "4" },
+  [ZFS_PROP_UTF8ONLY] = { "utf8only", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_READONLY, "off", ON_OFF },
+  [ZFS_PROP_NORMALIZE] = { "normalization", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_READONLY, "none",
+    "none|formC|formD|formKC|formKD" },
+  [ZFS_PROP_CASE] = { "casesensitivity", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_READONLY, "sensitive",
+    "sensitive|insensitive|mixed" },
+  [ZFS_PROP_VSCAN] = { "vscan", PROP_TYPE_INDEX, SIM_FS, SIM_PROP_INHERIT, "off", ON_OFF },
+  [ZFS_PROP_NBMAND] = { "nbmand", PROP_TYPE_INDEX, SIM_FS | SIM_SNAP, SIM_PROP_INHERIT, "off", ON_OFF },
+  [ZFS_PROP_SHARESMB] = { "sharesmb", PROP_TYPE_STRING, SIM_FS, SIM_PROP_INHERIT, "off" },
+  [ZFS_PROP_REFQUOTA] = { "refquota", PROP_TYPE_NUMBER, SIM_FS, SIM_PROP_NONE | SIM_PROP_SIZE, "0" },
+  [ZFS_PROP_REFRESERVATION] = { "refreservation", PROP_TYPE_NUMBER, SIM_FSVOL, SIM_PROP_NONE | SIM_PROP_SIZE, "0" },
+  [ZFS_PROP_GUID] = { "guid", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_HIDDEN },
+  [ZFS_PROP_PRIMARYCACHE] = { "primarycache", PROP_TYPE_INDEX, ZFS_TYPE_DATASET, SIM_PROP_INHERIT, "all",
+    "none|metadata|all" },
+  [ZFS_PROP_SECONDARYCACHE] = { "secondarycache", PROP_TYPE_INDEX, ZFS_TYPE_DATASET, SIM_PROP_INHERIT, "all",
+    "none|metadata|all" },
+  [ZFS_PROP_USEDSNAP] = { "usedbysnapshots", PROP_TYPE_NUMBER, SIM_FSVOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_USEDDS] = { "usedbydataset", PROP_TYPE_NUMBER, SIM_FSVOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_USEDCHILD] = { "usedbychildren", PROP_TYPE_NUMBER, SIM_FSVOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_USEDREFRESERV] = { "usedbyrefreservation", PROP_TYPE_NUMBER, SIM_FSVOL,
+    SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_USERACCOUNTING] = { "useraccounting", PROP_TYPE_INDEX, ZFS_TYPE_DATASET,
+    SIM_PROP_READONLY | SIM_PROP_HIDDEN, "on", ON_OFF },
+  [ZFS_PROP_STMF_SHAREINFO] = { "stmf_sbd_lu", PROP_TYPE_STRING, SIM_VOL, SIM_PROP_HIDDEN, "" },
+  [ZFS_PROP_DEFER_DESTROY] = { "defer_destroy", PROP_TYPE_INDEX, SIM_SNAP, SIM_PROP_READONLY, "off", ON_OFF },
+  [ZFS_PROP_USERREFS] = { "userrefs", PROP_TYPE_NUMBER, SIM_SNAP, SIM_PROP_READONLY },
+  [ZFS_PROP_LOGBIAS] = { "logbias", PROP_TYPE_INDEX, SIM_FSVOL, SIM_PROP_INHERIT, "latency",
+    "latency|throughput" },
+  [ZFS_PROP_UNIQUE] = { "unique", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_HIDDEN },
+  [ZFS_PROP_OBJSETID] = { "objsetid", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_HIDDEN },
+  [ZFS_PROP_DEDUP] = { "dedup", PROP_TYPE_INDEX, SIM_FSVOL, SIM_PROP_INHERIT, "off",
+    "off|on|verify|sha256|sha256,verify" },
+  [ZFS_PROP_WRITTEN] = { "written", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZFS_PROP_LOGICALUSED] = { "logicalused", PROP_TYPE_NUMBER, ZFS_TYPE_DATASET, SIM_PROP_READONLY | SIM_PROP_SIZE }
+};
+
+static const sim_prop_desc_t sim_pool_props[ZPOOL_NUM_PROPS] = {
+  [ZPOOL_PROP_NAME] = { "name", PROP_TYPE_STRING, ZFS_TYPE_POOL, SIM_PROP_READONLY },
+  [ZPOOL_PROP_SIZE] = { "size", PROP_TYPE_NUMBER, ZFS_TYPE_POOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZPOOL_PROP_USED] = { "used", PROP_TYPE_NUMBER, ZFS_TYPE_POOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZPOOL_PROP_AVAILABLE] = { "available", PROP_TYPE_NUMBER, ZFS_TYPE_POOL, SIM_PROP_READONLY | SIM_PROP_SIZE },
+  [ZPOOL_PROP_CAPACITY] = { "capacity", PROP_TYPE_NUMBER, ZFS_TYPE_POOL, SIM_PROP_READONLY },
+  [ZPOOL_PROP_ALTROOT] = { "altroot", PROP_TYPE_STRING, ZFS_TYPE_POOL, SIM_PROP_READONLY, "-" },
+  [ZPOOL_PROP_HEALTH] = { "health", PROP_TYPE_STRING, ZFS_TYPE_POOL, SIM_PROP_READONLY, "ONLINE" },
+  [ZPOOL_PROP_GUID] = { "guid", PROP_TYPE_NUMBER, ZFS_TYPE_POOL, SIM_PROP_READONLY },
+  [ZPOOL_PROP_VERSION] = { "version", PROP_TYPE_NUMBER, ZFS_TYPE_POOL, 0 },
+  [ZPOOL_PROP_BOOTFS] = { "bootfs", PROP_TYPE_STRING, ZFS_TYPE_POOL, 0, "-" },
+  [ZPOOL_PROP_DELEGATION] = { "delegation", PROP_TYPE_INDEX, ZFS_TYPE_POOL, 0, "on", ON_OFF },
+  [ZPOOL_PROP_AUTOREPLACE] = { "autoreplace", PROP_TYPE_INDEX, ZFS_TYPE_POOL, 0, "off", ON_OFF },
+  [ZPOOL_PROP_CACHEFILE] = { "cachefile", PROP_TYPE_STRING, ZFS_TYPE_POOL, 0, "-" },
+  [ZPOOL_PROP_FAILUREMODE] = { "failmode", PROP_TYPE_INDEX, ZFS_TYPE_POOL, 0, "wait", "wait|continue|panic" },
+  [ZPOOL_PROP_LISTSNAPS] = { "listsnapshots", PROP_TYPE_INDEX, ZFS_TYPE_POOL, 0, "off", ON_OFF }
+};
+
+static const struct {
+  const char *alias;
+  zfs_prop_t prop;
+} sim_fs_aliases[] = {
+  { "avail", ZFS_PROP_AVAILABLE }, { "refer", ZFS_PROP_REFERENCED },
+  { "ratio", ZFS_PROP_COMPRESSRATIO }, { "compress", ZFS_PROP_COMPRESSION },
+  { "recsize", ZFS_PROP_RECORDSIZE }, { "volblock", ZFS_PROP_VOLBLOCKSIZE },
+  { "reserv", ZFS_PROP_RESERVATION }, { "refreserv", ZFS_PROP_REFRESERVATION },
+  { "usedsnap", ZFS_PROP_USEDSNAP }, { "usedds", ZFS_PROP_USEDDS },
+  { "usedchild", ZFS_PROP_USEDCHILD }, { "usedrefreserv", ZFS_PROP_USEDREFRESERV },
+  { NULL }
+};
+
+// Position of value into the '|' separated list of values, or -1:
+static int sim_index_of(const char *values, const char *value)
+{
+  size_t len = strlen(value);
+  int index = 0;
+
+  while (values != NULL && *values != '\0') {
+    const char *end = strchr(values, '|');
+    size_t n = end ? (size_t)(end - values) : strlen(values);
+    if (n == len && strncmp(values, value, n) == 0) {
+      return index;
+    }
+    index++;
+    values = end ? end + 1 : values + n;
+  }
+  return -1;
+}
+
+// Parse a numeric property value, (zfs_nicestrtonum): "1024", "10M", "1.5G":
+static int sim_strtonum(const char *value, int none_ok, uint64_t *num)
+{
+  static const char *units = "BKMGTPE";
+  const char *u;
+  char *end;
+  double n;
+  int shift;
+
+  if (none_ok && strcmp(value, "none") == 0) {
+    *num = 0;
+    return 0;
+  }
+  if (!isdigit((unsigned char)*value) && *value != '.') {
+    return -1;
+  }
+  n = strtod(value, &end);
+  if (*end == '\0') {
+    *num = (uint64_t)n;
+    return (n == (double)*num) ? 0 : -1;
+  }
+  if ((u = strchr(units, toupper((unsigned char)*end))) == NULL) {
+    return -1;
+  }
+  end++;
+  if (*end != '\0' && !((*end == 'B' || *end == 'b') && end[1] == '\0' && u != units)) {
+    return -1;
+  }
+  shift = 10 * (int)(u - units);
+  *num = (uint64_t)(n * (double)(1ULL << shift));
+  return 0;
+}
+
+void zfs_nicenum(uint64_t num, char *buf, size_t buflen)
+{
+  uint64_t n = num;
+  int index = 0, i;
+  char u;
+
+  while (n >= 1024 && index < 6) {
+    n /= 1024;
+    index++;
+  }
+  u = " KMGTPE"[index];
+  if (index == 0) {
+    snprintf(buf, buflen, "%llu", (unsigned long long)n);
+  } else if ((num & ((1ULL << 10 * index) - 1)) == 0) {
+    snprintf(buf, buflen, "%llu%c", (unsigned long long)n, u);
+  } else {
+    for (i = 2; i >= 0; i--) {
+      if (snprintf(buf, buflen, "%.*f%c", i, (double)num / (1ULL << 10 * index), u) <= 5) {
+        break;
+      }
+    }
+  }
+}
+
+int zfs_name_to_prop(const char *name)
+{
+  int i;
+
+  for (i = 0; i < ZFS_NUM_PROPS; i++) {
+    if (strcmp(sim_fs_props[i].name, name) == 0) {
+      return i;
+    }
+  }
+  for (i = 0; sim_fs_aliases[i].alias != NULL; i++) {
+    if (strcmp(sim_fs_aliases[i].alias, name) == 0) {
+      return sim_fs_aliases[i].prop;
+    }
+  }
+  return ZPROP_INVAL;
+}
+
+const char *zfs_prop_to_name(zfs_prop_t prop)
+{
+  return (prop >= 0 && prop < ZFS_NUM_PROPS) ? sim_fs_props[prop].name : NULL;
+}
+
+boolean_t zfs_prop_user(const char *name)
+{
+  const char *c;
+  boolean_t colon = B_FALSE;
+
+  for (c = name; *c != '\0'; c++) {
+    if (!isalnum((unsigned char)*c) && strchr("-_.:", *c) == NULL) {
+      return B_FALSE;
+    }
+    if (*c == ':') {
+      colon = B_TRUE;
+    }
+  }
+  return colon && !isupper((unsigned char)name[0]) && c - name < ZFS_MAXNAMELEN;
+}
+
+boolean_t zfs_prop_userquota(const char *name)
+{
+  return strncmp(name, "userquota@", 10) == 0 || strncmp(name, "groupquota@", 11) == 0;
+}
+
+boolean_t zfs_prop_readonly(zfs_prop_t prop)
+{
+  return (sim_fs_props[prop].flags & SIM_PROP_READONLY) != 0;
+}
+
+boolean_t zfs_prop_valid_for_type(int prop, zfs_type_t type)
+{
+  if (prop < 0 || prop >= ZFS_NUM_PROPS) {
+    return B_FALSE;
+  }
+  return (sim_fs_props[prop].types & type) != 0;
+}
+
+zprop_type_t zfs_prop_get_type(zfs_prop_t prop)
+{
+  return sim_fs_props[prop].type;
+}
+
+int zpool_name_to_prop(const char *name)
+{
+  int i;
+
+  for (i = 0; i < ZPOOL_NUM_PROPS; i++) {
+    if (strcmp(sim_pool_props[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (strcmp(name, "avail") == 0) {
+    return ZPOOL_PROP_AVAILABLE;
+  }
+  if (strcmp(name, "listsnaps") == 0) {
+    return ZPOOL_PROP_LISTSNAPS;
+  }
+  return strcmp(name, "cap") == 0 ? ZPOOL_PROP_CAPACITY : ZPROP_INVAL;
+}
+
+const char *zpool_prop_to_name(zpool_prop_t prop)
+{
+  return (prop >= 0 && prop < ZPOOL_NUM_PROPS) ? sim_pool_props[prop].name : NULL;
+}
+
+zprop_type_t zpool_prop_get_type(zpool_prop_t prop)
+{
+  return sim_pool_props[prop].type;
+}
+
+static int sim_prop_name_cmp(const void *a, const void *b)
+{
+  return strcmp(((const sim_prop_desc_t *)a)->name, ((const sim_prop_desc_t *)b)->name);
+}
+
+int zprop_iter(zprop_func func, void *data, boolean_t show_all, boolean_t ordered, zfs_type_t type)
+{
+  const sim_prop_desc_t *table = (type == ZFS_TYPE_POOL) ? sim_pool_props : sim_fs_props;
+  int count = (type == ZFS_TYPE_POOL) ? ZPOOL_NUM_PROPS : ZFS_NUM_PROPS;
+  sim_prop_desc_t sorted[ZFS_NUM_PROPS];
+  int order[ZFS_NUM_PROPS];
+  int i, j, ret;
+
+  for (i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  if (ordered) {
+    memcpy(sorted, table, count * sizeof(sim_prop_desc_t));
+    qsort(sorted, count, sizeof(sim_prop_desc_t), sim_prop_name_cmp);
+    for (i = 0; i < count; i++) {
+      for (j = 0; strcmp(table[j].name, sorted[i].name) != 0; j++);
+      order[i] = j;
+    }
+  }
+  for (i = 0; i < count; i++) {
+    const sim_prop_desc_t *desc = &table[order[i]];
+    if (!(desc->types & type) || (!show_all && (desc->flags & SIM_PROP_HIDDEN))) {
+      continue;
+    }
+    if ((ret = func(order[i], data)) != ZPROP_CONT) {
+      return ret;
+    }
+  }
+  return ZPROP_CONT;
+}
+
+/*
+ * Dataset tree, (lock held).
+ */
+static sim_ds_t *sim_ds_alloc(const char *name, zfs_type_t type, sim_pool_t *pool, sim_ds_t *parent)
+{
+  sim_ds_t *ds = calloc(1, sizeof(sim_ds_t));
+
+  if (ds == NULL || (ds->name = strdup(name)) == NULL) {
+    abort();
+  }
+  ds->type = type;
+  ds->guid = sim_guid();
+  ds->createtxg = sim_txg++;
+  ds->creation = (uint64_t)time(NULL);
+  ds->refer = SIM_REFER;
+  ds->pool = pool;
+  ds->parent = parent;
+  if (parent != NULL && type == ZFS_TYPE_SNAPSHOT) {
+    ds->refer = parent->refer;
+    if (parent->snapshots_tail == NULL) {
+      parent->snapshots = ds;
+    } else {
+      parent->snapshots_tail->next = ds;
+    }
+    parent->snapshots_tail = ds;
+  } else if (parent != NULL) {
+    if (parent->children_tail == NULL) {
+      parent->children = ds;
+    } else {
+      parent->children_tail->next = ds;
+    }
+    parent->children_tail = ds;
+  }
+  sim_hash_insert(ds);
+  return ds;
+}
+
+// Unlink from the parent list of children or snapshots:
+static void sim_ds_unlink(sim_ds_t *ds)
+{
+  sim_ds_t **head, **tail, *prev = NULL, *item;
+
+  if (ds->parent == NULL) {
+    return;
+  }
+  if (ds->type == ZFS_TYPE_SNAPSHOT) {
+    head = &ds->parent->snapshots;
+    tail = &ds->parent->snapshots_tail;
+  } else {
+    head = &ds->parent->children;
+    tail = &ds->parent->children_tail;
+  }
+  for (item = *head; item != NULL && item != ds; item = item->next) {
+    prev = item;
+  }
+  if (item == NULL) {
+    return;
+  }
+  if (prev == NULL) {
+    *head = ds->next;
+  } else {
+    prev->next = ds->next;
+  }
+  if (*tail == ds) {
+    *tail = prev;
+  }
+  ds->next = NULL;
+}
+
+static void sim_clone_unlink(sim_ds_t *ds)
+{
+  sim_ds_t **link;
+
+  if (ds->origin == NULL) {
+    return;
+  }
+  for (link = &ds->origin->clones; *link != NULL && *link != ds; link = &(*link)->clone_next);
+  if (*link == ds) {
+    *link = ds->clone_next;
+  }
+  ds->clone_next = NULL;
+  ds->origin = NULL;
+}
+
+static void sim_clone_link(sim_ds_t *ds, sim_ds_t *origin)
+{
+  ds->origin = origin;
+  ds->clone_next = origin->clones;
+  origin->clones = ds;
+}
+
+static void sim_props_free(sim_prop_t *props)
+{
+  sim_prop_t *next;
+
+  for (; props != NULL; props = next) {
+    next = props->next;
+    free(props->value);
+    free(props);
+  }
+}
+
+static void sim_ds_free(sim_ds_t *ds)
+{
+  sim_ds_t *origin = ds->origin;
+
+  sim_hash_remove(ds);
+  sim_ds_unlink(ds);
+  sim_clone_unlink(ds);
+  sim_props_free(ds->props);
+  nvlist_free(ds->user_props);
+  while (ds->quotas != NULL) {
+    sim_quota_t *quota = ds->quotas;
+    ds->quotas = quota->next;
+    free(quota->domain);
+    free(quota);
+  }
+  free(ds->name);
+  free(ds);
+  // The last clone gone, destroy the origin if its destruction was deferred:
+  if (origin != NULL && origin->defer_destroy && origin->clones == NULL) {
+    sim_ds_free(origin);
+  }
+}
+
+// Rename ds, its snapshots and all its descendants, replacing the prefix:
+static void sim_ds_rename(sim_ds_t *ds, size_t oldlen, const char *prefix)
+{
+  sim_ds_t *item;
+  size_t len = strlen(prefix) + strlen(ds->name + oldlen) + 1;
+  char *name = malloc(len);
+
+  if (name == NULL) {
+    abort();
+  }
+  snprintf(name, len, "%s%s", prefix, ds->name + oldlen);
+  sim_hash_remove(ds);
+  free(ds->name);
+  ds->name = name;
+  sim_hash_insert(ds);
+  for (item = ds->snapshots; item != NULL; item = item->next) {
+    sim_ds_rename(item, oldlen, prefix);
+  }
+  for (item = ds->children; item != NULL; item = item->next) {
+    sim_ds_rename(item, oldlen, prefix);
+  }
+}
+
+static sim_prop_t *sim_prop_local(const sim_ds_t *ds, int prop)
+{
+  sim_prop_t *item;
+
+  for (item = ds->props; item != NULL; item = item->next) {
+    if (item->prop == prop) {
+      return item;
+    }
+  }
+  return NULL;
+}
+
+static void sim_prop_store(sim_prop_t **props, int prop, const char *value)
+{
+  sim_prop_t *item;
+
+  for (item = *props; item != NULL && item->prop != prop; item = item->next);
+  if (item == NULL) {
+    if ((item = calloc(1, sizeof(sim_prop_t))) == NULL) {
+      abort();
+    }
+    item->prop = prop;
+    item->next = *props;
+    *props = item;
+  }
+  free(item->value);
+  if ((item->value = strdup(value)) == NULL) {
+    abort();
+  }
+}
+
+/*
+ * The value of a property either local, inherited or the default one,
+ * (mountpoints are inherited with the relative path appended).
+ */
+static const char *sim_prop_resolve(const sim_ds_t *ds, int prop, char *buf, size_t len,
+  zprop_source_t *src, char *statbuf, size_t statlen)
+{
+  const sim_ds_t *item = (ds->type == ZFS_TYPE_SNAPSHOT) ? ds->parent : ds;
+  const sim_prop_desc_t *desc = &sim_fs_props[prop];
+  sim_prop_t *local;
+
+  for (; item != NULL; item = (desc->flags & SIM_PROP_INHERIT) ? item->parent : NULL) {
+    if ((local = sim_prop_local(item, prop)) == NULL) {
+      continue;
+    }
+    if (src != NULL) {
+      *src = (item == ds) ? ZPROP_SRC_LOCAL : ZPROP_SRC_INHERITED;
+    }
+    if (statbuf != NULL && statlen > 0) {
+      snprintf(statbuf, statlen, "%s", (item == ds) ? "" : item->name);
+    }
+    if (prop == ZFS_PROP_MOUNTPOINT && local->value[0] == '/') {
+      const char *rel = ds->name + strlen(item->name);
+      snprintf(buf, len, "%s%s", strcmp(local->value, "/") == 0 && *rel ? "" : local->value, rel);
+      return buf;
+    }
+    return local->value;
+  }
+  if (src != NULL) {
+    *src = ZPROP_SRC_DEFAULT;
+  }
+  if (statbuf != NULL && statlen > 0) {
+    statbuf[0] = '\0';
+  }
+  if (prop == ZFS_PROP_MOUNTPOINT) {
+    snprintf(buf, len, "/%s", ds->name);
+    return buf;
+  }
+  return desc->def ? desc->def : "";
+}
+
+static uint64_t sim_ds_used(const sim_ds_t *ds)
+{
+  const sim_ds_t *child;
+  uint64_t used = ds->refer;
+
+  if (ds->type == ZFS_TYPE_SNAPSHOT) {
+    return 0;
+  }
+  for (child = ds->children; child != NULL; child = child->next) {
+    used += sim_ds_used(child);
+  }
+  return used;
+}
+
+static uint64_t sim_pool_used(const sim_pool_t *pool)
+{
+  return pool->root ? sim_ds_used(pool->root) : 0;
+}
+
+static uint64_t sim_ds_local_num(const sim_ds_t *ds, int prop)
+{
+  char buf[ZFS_MAXPROPLEN];
+  return strtoull(sim_prop_resolve(ds, prop, buf, sizeof(buf), NULL, NULL, 0), NULL, 10);
+}
+
+// Numeric value of a number or index property, (-1 if not valid):
+static int sim_ds_numeric(const sim_ds_t *ds, int prop, uint64_t *value, zprop_source_t *src)
+{
+  const sim_prop_desc_t *desc = &sim_fs_props[prop];
+  const sim_ds_t *child;
+  uint64_t avail, used, quota;
+  char buf[ZFS_MAXPROPLEN];
+  int index;
+
+  if (!(desc->types & ds->type)) {
+    return -1;
+  }
+  if (src != NULL) {
+    *src = ZPROP_SRC_NONE;
+  }
+  switch (prop) {
+    case ZFS_PROP_CREATION: *value = ds->creation; break;
+    case ZFS_PROP_CREATETXG: *value = ds->createtxg; break;
+    case ZFS_PROP_GUID: *value = ds->guid; break;
+    case ZFS_PROP_USED:
+    case ZFS_PROP_LOGICALUSED:
+      *value = sim_ds_used(ds);
+      break;
+    case ZFS_PROP_REFERENCED: *value = ds->refer; break;
+    case ZFS_PROP_USEDDS: *value = ds->refer; break;
+    case ZFS_PROP_USEDSNAP: *value = 0; break;
+    case ZFS_PROP_USEDREFRESERV: *value = 0; break;
+    case ZFS_PROP_USEDCHILD:
+      *value = 0;
+      for (child = ds->children; child != NULL; child = child->next) {
+        *value += sim_ds_used(child);
+      }
+      break;
+    case ZFS_PROP_AVAILABLE:
+      used = sim_pool_used(ds->pool);
+      avail = (ds->pool->size > used) ? ds->pool->size - used : 0;
+      quota = sim_ds_local_num(ds, ZFS_PROP_QUOTA);
+      used = sim_ds_used(ds);
+      if (quota > 0 && quota < used + avail) {
+        avail = (quota > used) ? quota - used : 0;
+      }
+      *value = avail;
+      break;
+    case ZFS_PROP_COMPRESSRATIO: *value = 100; break;
+    case ZFS_PROP_WRITTEN: *value = ds->snapshots ? 0 : ds->refer; break;
+    case ZFS_PROP_UNIQUE: *value = (ds->type == ZFS_TYPE_SNAPSHOT) ? 0 : ds->refer; break;
+    case ZFS_PROP_OBJSETID: *value = ds->createtxg + 16; break;
+    case ZFS_PROP_USERREFS: *value = 0; break;
+    case ZFS_PROP_NUMCLONES:
+      *value = 0;
+      for (child = ds->clones; child != NULL; child = child->clone_next) {
+        (*value)++;
+      }
+      break;
+    case ZFS_PROP_MOUNTED: *value = ds->mounted; break;
+    case ZFS_PROP_DEFER_DESTROY: *value = ds->defer_destroy; break;
+    default:
+      if (desc->type == PROP_TYPE_STRING) {
+        return -1;
+      }
+      if (desc->type == PROP_TYPE_NUMBER) {
+        *value = strtoull(sim_prop_resolve(ds, prop, buf, sizeof(buf), src, NULL, 0), NULL, 10);
+      } else {
+        index = sim_index_of(desc->values, sim_prop_resolve(ds, prop, buf, sizeof(buf), src, NULL, 0));
+        *value = (index < 0) ? 0 : (uint64_t)index;
+      }
+  }
+  return 0;
+}
+
+// Formatted value of any property, (-1 if not valid for the dataset type):
+static int sim_ds_prop(const sim_ds_t *ds, int prop, char *buf, size_t len, zprop_source_t *src,
+  char *statbuf, size_t statlen, boolean_t literal)
+{
+  const sim_prop_desc_t *desc = &sim_fs_props[prop];
+  char value[ZFS_MAXPROPLEN];
+  uint64_t num;
+  time_t time;
+  struct tm tm;
+
+  if (!(desc->types & ds->type)) {
+    return -1;
+  }
+  if (statbuf != NULL && statlen > 0) {
+    statbuf[0] = '\0';
+  }
+  if (src != NULL) {
+    *src = ZPROP_SRC_NONE;
+  }
+  switch (prop) {
+    case ZFS_PROP_TYPE:
+      snprintf(buf, len, "%s", ds->type == ZFS_TYPE_FILESYSTEM ? "filesystem" :
+        ds->type == ZFS_TYPE_VOLUME ? "volume" : "snapshot");
+      return 0;
+    case ZFS_PROP_NAME:
+      snprintf(buf, len, "%s", ds->name);
+      return 0;
+    case ZFS_PROP_ORIGIN:
+      if (ds->origin == NULL) {
+        return -1;
+      }
+      snprintf(buf, len, "%s", ds->origin->name);
+      return 0;
+    case ZFS_PROP_MOUNTED:
+      snprintf(buf, len, "%s", ds->mounted ? "yes" : "no");
+      return 0;
+    case ZFS_PROP_DEFER_DESTROY:
+      snprintf(buf, len, "%s", ds->defer_destroy ? "on" : "off");
+      return 0;
+    case ZFS_PROP_CREATION:
+      time = (time_t)ds->creation;
+      if (literal || localtime_r(&time, &tm) == NULL) {
+        snprintf(buf, len, "%llu", (unsigned long long)ds->creation);
+      } else {
+        strftime(buf, len, "%a %b %e %k:%M %Y", &tm);
+      }
+      return 0;
+    case ZFS_PROP_COMPRESSRATIO:
+      snprintf(buf, len, "1.00x");
+      return 0;
+  }
+  if (desc->type != PROP_TYPE_NUMBER) {
+    snprintf(buf, len, "%s", sim_prop_resolve(ds, prop, value, sizeof(value), src, statbuf, statlen));
+    return 0;
+  }
+  if (sim_ds_numeric(ds, prop, &num, src) != 0) {
+    return -1;
+  }
+  if (src != NULL && (desc->flags & SIM_PROP_READONLY) == 0) {
+    sim_prop_resolve(ds, prop, value, sizeof(value), src, statbuf, statlen);
+  }
+  if (literal || !(desc->flags & SIM_PROP_SIZE)) {
+    snprintf(buf, len, "%llu", (unsigned long long)num);
+  } else if (num == 0 && (desc->flags & SIM_PROP_NONE)) {
+    snprintf(buf, len, "none");
+  } else {
+    zfs_nicenum(num, buf, len);
+  }
+  return 0;
+}
+
+// Validate, and store, a native property value. Error description or NULL:
+static const char *sim_ds_set(sim_ds_t *ds, int prop, const char *value, char *desc, size_t desclen)
+{
+  const sim_prop_desc_t *info = &sim_fs_props[prop];
+  char num[32];
+  uint64_t n;
+
+  if (!(info->types & ds->type)) {
+    snprintf(desc, desclen, "'%s' does not apply to datasets of this type", info->name);
+    return desc;
+  }
+  if (info->flags & SIM_PROP_READONLY) {
+    snprintf(desc, desclen, "'%s' is readonly", info->name);
+    return desc;
+  }
+  switch (info->type) {
+    case PROP_TYPE_NUMBER:
+      if (sim_strtonum(value, info->flags & SIM_PROP_NONE, &n) != 0) {
+        snprintf(desc, desclen, "bad numeric value '%s'", value);
+        return desc;
+      }
+      if (prop == ZFS_PROP_RECORDSIZE && (n < 512 || n > 131072 || (n & (n - 1)) != 0)) {
+        snprintf(desc, desclen, "'recordsize' must be power of 2 from %u to %uk", 512, 128);
+        return desc;
+      }
+      if (prop == ZFS_PROP_VERSION && (n < sim_ds_local_num(ds, prop) || n > 4)) {
+        snprintf(desc, desclen, "invalid version %llu", (unsigned long long)n);
+        return desc;
+      }
+      snprintf(num, sizeof(num), "%llu", (unsigned long long)n);
+      value = num;
+      break;
+    case PROP_TYPE_INDEX:
+      if (sim_index_of(info->values, value) < 0) {
+        snprintf(desc, desclen, "'%s' must be one of '%s'", info->name, info->values);
+        return desc;
+      }
+      break;
+    default:
+      if (prop == ZFS_PROP_MOUNTPOINT && value[0] != '/' &&
+          strcmp(value, "legacy") != 0 && strcmp(value, "none") != 0) {
+        snprintf(desc, desclen, "bad mount point '%s': must be an absolute path, 'none', or 'legacy'", value);
+        return desc;
+      }
+  }
+  sim_prop_store(&ds->props, prop, value);
+  return NULL;
+}
+
+static int sim_user_prop_set(sim_ds_t *ds, const char *name, const char *value)
+{
+  if (ds->user_props == NULL && nvlist_alloc(&ds->user_props, NV_UNIQUE_NAME, 0) != 0) {
+    return -1;
+  }
+  return nvlist_add_string(ds->user_props, name, value) == 0 ? 0 : -1;
+}
+
+// "userquota@1001", "groupquota@staff" or "userquota@S-1-5-21-1-2-3-1104":
+static const char *sim_quota_set(sim_ds_t *ds, const char *name, const char *value, char *desc, size_t desclen)
+{
+  zfs_userquota_prop_t type = (name[0] == 'u') ? ZFS_PROP_USERQUOTA : ZFS_PROP_GROUPQUOTA;
+  const char *who = strchr(name, '@') + 1, *dash;
+  char domain[ZFS_MAXNAMELEN] = "", *end;
+  sim_quota_t **item, *quota;
+  struct passwd *pw;
+  struct group *gr;
+  unsigned long rid;
+  uint64_t num;
+
+  if (ds->type != ZFS_TYPE_FILESYSTEM) {
+    snprintf(desc, desclen, "'%s' does not apply to datasets of this type", name);
+    return desc;
+  }
+  if (strncmp(who, "S-1-", 4) == 0 && (dash = strrchr(who, '-')) - who < (long)sizeof(domain)) {
+    memcpy(domain, who, dash - who);
+    domain[dash - who] = '\0';
+    who = dash + 1;
+  }
+  rid = strtoul(who, &end, 10);
+  if (*who == '\0' || *end != '\0') {
+    if (domain[0] == '\0' && type == ZFS_PROP_USERQUOTA && (pw = getpwnam(who)) != NULL) {
+      rid = pw->pw_uid;
+    } else if (domain[0] == '\0' && type == ZFS_PROP_GROUPQUOTA && (gr = getgrnam(who)) != NULL) {
+      rid = gr->gr_gid;
+    } else {
+      snprintf(desc, desclen, "invalid %s name '%s'", type == ZFS_PROP_USERQUOTA ? "user" : "group", who);
+      return desc;
+    }
+  }
+  if (sim_strtonum(value, 1, &num) != 0) {
+    snprintf(desc, desclen, "bad numeric value '%s'", value);
+    return desc;
+  }
+
+  for (item = &ds->quotas; *item != NULL; item = &(*item)->next) {
+    if ((*item)->type == type && (*item)->rid == rid && strcmp((*item)->domain, domain) == 0) {
+      break;
+    }
+  }
+  if (*item == NULL && num != 0) {
+    if ((quota = calloc(1, sizeof(sim_quota_t))) == NULL || (quota->domain = strdup(domain)) == NULL) {
+      free(quota);
+      snprintf(desc, desclen, "out of memory");
+      return desc;
+    }
+    quota->type = type;
+    quota->rid = rid;
+    *item = quota;
+  }
+  if (num != 0) {
+    (*item)->quota = num;
+  } else if (*item != NULL) {
+    quota = *item;
+    *item = quota->next;
+    free(quota->domain);
+    free(quota);
+  }
+  return NULL;
+}
+
+/*
+ * Seeding.
+ */
+static const char *sim_default_seed =
+  "pool tpool 128M /export/vdev/d1\n"
+  "create tpool/home\n"
+  "create tpool/thome\n"
+  "snapshot tpool/thome@snap\n"
+  "clone tpool/thome@snap tpool/thomeclone\n"
+  "set zfs_rb:sample=test tpool/thome\n"
+  "create tpool/rollback\n"
+  "pool tpool2 64M /export/vdev/d2\n";
+
+static int64_t sim_monotonic(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static sim_pool_t *sim_pool_add(const char *name, uint64_t size, const char *path)
+{
+  sim_pool_t *pool = calloc(1, sizeof(sim_pool_t)), **link;
+
+  if (pool == NULL || (pool->name = strdup(name)) == NULL || (pool->path = strdup(path)) == NULL) {
+    abort();
+  }
+  pool->guid = sim_guid();
+  pool->vdev_guid = sim_guid();
+  pool->size = size;
+  pool->version = SPA_VERSION;
+  pool->config_txg = sim_txg++;
+  pool->loaded = sim_monotonic();
+  pool->root = sim_ds_alloc(name, ZFS_TYPE_FILESYSTEM, pool, NULL);
+  for (link = &sim_pools; *link != NULL && strcmp((*link)->name, name) < 0; link = &(*link)->next);
+  pool->next = *link;
+  *link = pool;
+  return pool;
+}
+
+// Parent dataset of a filesystem or snapshot name, (lock held):
+static sim_ds_t *sim_parent_of(const char *name)
+{
+  char parent[ZFS_MAXNAMELEN];
+  const char *sep = strchr(name, '@');
+
+  if (sep == NULL) {
+    sep = strrchr(name, '/');
+  }
+  if (sep == NULL || (size_t)(sep - name) >= sizeof(parent)) {
+    return NULL;
+  }
+  memcpy(parent, name, sep - name);
+  parent[sep - name] = '\0';
+  return sim_lookup(parent);
+}
+
+// Synthetic filesystems below root, fanout per level:
+static void sim_seed_synthetic(const char *root, unsigned long count, unsigned long fanout)
+{
+  sim_ds_t *top = sim_lookup(root), *parent, **nodes;
+  char name[ZFS_MAXNAMELEN];
+  unsigned long i;
+
+  if (top == NULL) {
+    if ((parent = sim_parent_of(root)) == NULL) {
+      fprintf(stderr, "zfs sim: cannot create '%s'\n", root);
+      return;
+    }
+    top = sim_ds_alloc(root, ZFS_TYPE_FILESYSTEM, parent->pool, parent);
+  }
+  if (fanout < 2) {
+    fanout = 100;
+  }
+  if ((nodes = malloc(count * sizeof(sim_ds_t *))) == NULL) {
+    abort();
+  }
+  for (i = 0; i < count; i++) {
+    parent = (i < fanout) ? top : nodes[i / fanout - 1];
+    snprintf(name, sizeof(name), "%s/s%lu", parent->name, i);
+    nodes[i] = sim_ds_alloc(name, ZFS_TYPE_FILESYSTEM, top->pool, parent);
+  }
+  free(nodes);
+}
+
+/*
+ * One seed command:
+ *
+ *   pool NAME [SIZE [PATH]]
+ *   create FILESYSTEM
+ *   snapshot FILESYSTEM@SNAP
+ *   clone FILESYSTEM@SNAP FILESYSTEM
+ *   set PROPERTY=VALUE DATASET
+ *   synthetic FILESYSTEM COUNT [FANOUT]
+ */
+static void sim_seed_line(const char *line)
+{
+  char cmd[32], arg1[ZFS_MAXNAMELEN], arg2[ZFS_MAXNAMELEN], arg3[ZFS_MAXNAMELEN], desc[256];
+  sim_ds_t *ds, *parent;
+  uint64_t size;
+  char *eq;
+  int n = sscanf(line, "%31s %255s %255s %255s", cmd, arg1, arg2, arg3);
+  int prop;
+
+  if (n < 1 || cmd[0] == '#') {
+    return;
+  }
+  if (strcmp(cmd, "pool") == 0 && n >= 2) {
+    if (n < 3 || sim_strtonum(arg2, 0, &size) != 0) {
+      size = SIM_POOL_SIZE;
+    }
+    sim_pool_add(arg1, size, n >= 4 ? arg3 : "/dev/null");
+  } else if ((strcmp(cmd, "create") == 0 || strcmp(cmd, "snapshot") == 0) && n == 2 &&
+      sim_lookup(arg1) == NULL && (parent = sim_parent_of(arg1)) != NULL) {
+    sim_ds_alloc(arg1, cmd[0] == 'c' ? ZFS_TYPE_FILESYSTEM : ZFS_TYPE_SNAPSHOT, parent->pool, parent);
+  } else if (strcmp(cmd, "clone") == 0 && n == 3 && (ds = sim_lookup(arg1)) != NULL &&
+      ds->type == ZFS_TYPE_SNAPSHOT && sim_lookup(arg2) == NULL && (parent = sim_parent_of(arg2)) != NULL) {
+    sim_ds_t *clone = sim_ds_alloc(arg2, ZFS_TYPE_FILESYSTEM, parent->pool, parent);
+    clone->refer = ds->refer;
+    sim_clone_link(clone, ds);
+  } else if (strcmp(cmd, "set") == 0 && n == 3 && (eq = strchr(arg1, '=')) != NULL &&
+      (ds = sim_lookup(arg2)) != NULL) {
+    *eq++ = '\0';
+    if (zfs_prop_user(arg1)) {
+      sim_user_prop_set(ds, arg1, eq);
+    } else if ((prop = zfs_name_to_prop(arg1)) != ZPROP_INVAL && sim_ds_set(ds, prop, eq, desc, sizeof(desc))) {
+      fprintf(stderr, "zfs sim: %s\n", desc);
+    }
+  } else if (strcmp(cmd, "synthetic") == 0 && n >= 3) {
+    sim_seed_synthetic(arg1, strtoul(arg2, NULL, 10), n >= 4 ? strtoul(arg3, NULL, 10) : 100);
+  } else {
+    fprintf(stderr, "zfs sim: ignoring seed line '%s'\n", line);
+  }
+}
+
+static void sim_init(void)
+{
+  const char *path = getenv("ZFS_SIM_SEED"), *count = getenv("ZFS_SIM_DATASETS");
+  const char *fanout = getenv("ZFS_SIM_FANOUT");
+  char line[1024];
+  const char *seed, *end;
+  FILE *file;
+
+  sim_latency_init(getenv("ZFS_SIM_LATENCY"));
+  pthread_mutex_lock(&sim_lock);
+  if (path != NULL && (file = fopen(path, "r")) != NULL) {
+    while (fgets(line, sizeof(line), file) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      sim_seed_line(line);
+    }
+    fclose(file);
+  } else {
+    if (path != NULL) {
+      fprintf(stderr, "zfs sim: cannot read '%s', using the default seed\n", path);
+    }
+    for (seed = sim_default_seed; *seed != '\0'; seed = end + 1) {
+      end = strchr(seed, '\n');
+      snprintf(line, sizeof(line), "%.*s", (int)(end - seed), seed);
+      sim_seed_line(line);
+    }
+  }
+  if (count != NULL && strtoul(count, NULL, 10) > 0 && sim_pools != NULL) {
+    snprintf(line, sizeof(line), "%s/synthetic", sim_pools->name);
+    sim_seed_synthetic(line, strtoul(count, NULL, 10), fanout ? strtoul(fanout, NULL, 10) : 100);
+  }
+  pthread_mutex_unlock(&sim_lock);
+}
+
+/*
+ * Library handles.
+ */
+libzfs_handle_t *libzfs_init(void)
+{
+  pthread_once(&sim_once, sim_init);
+  return calloc(1, sizeof(libzfs_handle_t));
+}
+
+void libzfs_fini(libzfs_handle_t *lib)
+{
+  free(lib);
+}
+
+int libzfs_errno(libzfs_handle_t *lib)
+{
+  return lib->error;
+}
+
+const char *libzfs_error_action(libzfs_handle_t *lib)
+{
+  return lib->action;
+}
+
+const char *libzfs_error_description(libzfs_handle_t *lib)
+{
+  return lib->desc[0] != '\0' ? lib->desc : sim_strerror(lib->error);
+}
+
+void libzfs_print_on_error(libzfs_handle_t *lib, boolean_t print)
+{
+  lib->print = print;
+}
+
+libzfs_handle_t *zpool_get_handle(zpool_handle_t *zhp)
+{
+  return zhp->lib;
+}
+
+libzfs_handle_t *zfs_get_handle(zfs_handle_t *zhp)
+{
+  return zhp->lib;
+}
+
+/*
+ * Pools.
+ */
+static nvlist_t *sim_vdev_config(sim_pool_t *pool, const char *type, uint64_t guid, int leaf)
+{
+  nvlist_t *vdev;
+  vdev_stat_t vs;
+
+  memset(&vs, 0, sizeof(vs));
+  vs.vs_timestamp = sim_monotonic() - pool->loaded;
+  vs.vs_state = VDEV_STATE_HEALTHY;
+  vs.vs_alloc = sim_pool_used(pool);
+  vs.vs_space = vs.vs_dspace = pool->size;
+  vs.vs_rsize = pool->size;
+  memcpy(vs.vs_ops, pool->ops, sizeof(vs.vs_ops));
+  memcpy(vs.vs_bytes, pool->bytes, sizeof(vs.vs_bytes));
+
+  nvlist_alloc(&vdev, NV_UNIQUE_NAME, 0);
+  nvlist_add_string(vdev, ZPOOL_CONFIG_TYPE, type);
+  nvlist_add_uint64(vdev, ZPOOL_CONFIG_ID, 0);
+  nvlist_add_uint64(vdev, ZPOOL_CONFIG_GUID, guid);
+  if (leaf) {
+    nvlist_add_string(vdev, ZPOOL_CONFIG_PATH, pool->path);
+  }
+  nvlist_add_uint64_array(vdev, ZPOOL_CONFIG_STATS, (uint64_t *)&vs, sizeof(vs) / sizeof(uint64_t));
+  return vdev;
+}
+
+// Build the configuration of the pool, NULL if it doesn't exist anymore:
+static nvlist_t *sim_pool_config(const char *name)
+{
+  sim_pool_t *pool;
+  nvlist_t *config = NULL, *root, *leaf;
+
+  pthread_mutex_lock(&sim_lock);
+  if ((pool = sim_pool_lookup(name, strlen(name))) != NULL) {
+    nvlist_alloc(&config, NV_UNIQUE_NAME, 0);
+    nvlist_add_uint64(config, ZPOOL_CONFIG_VERSION, pool->version);
+    nvlist_add_string(config, ZPOOL_CONFIG_POOL_NAME, pool->name);
+    nvlist_add_uint64(config, ZPOOL_CONFIG_POOL_STATE, POOL_STATE_ACTIVE);
+    nvlist_add_uint64(config, ZPOOL_CONFIG_POOL_TXG, pool->config_txg);
+    nvlist_add_uint64(config, ZPOOL_CONFIG_POOL_GUID, pool->guid);
+    root = sim_vdev_config(pool, VDEV_TYPE_ROOT, pool->guid, 0);
+    leaf = sim_vdev_config(pool, VDEV_TYPE_FILE, pool->vdev_guid, 1);
+    nvlist_add_nvlist_array(root, ZPOOL_CONFIG_CHILDREN, &leaf, 1);
+    nvlist_add_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, root);
+    nvlist_free(leaf);
+    nvlist_free(root);
+    sim_count_io(pool, SIM_OP_POOL, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return config;
+}
+
+static zpool_handle_t *sim_pool_open(libzfs_handle_t *lib, const char *name, int canfail)
+{
+  zpool_handle_t *zhp;
+
+  sim_ioctl(SIM_OP_OPEN);
+  if (strlen(name) >= ZPOOL_MAXNAMELEN) {
+    sim_error(lib, EZFS_INVALIDNAME, NULL, "cannot open '%s'", name);
+    return NULL;
+  }
+  if ((zhp = calloc(1, sizeof(zpool_handle_t))) == NULL) {
+    sim_error(lib, EZFS_NOMEM, NULL, "internal error");
+    return NULL;
+  }
+  zhp->lib = lib;
+  snprintf(zhp->name, sizeof(zhp->name), "%s", name);
+  if ((zhp->config = sim_pool_config(name)) == NULL) {
+    free(zhp);
+    sim_error(lib, EZFS_NOENT, "no such pool", "cannot open '%s'", name);
+    return NULL;
+  }
+  return zhp;
+}
+
+zpool_handle_t *zpool_open_canfail(libzfs_handle_t *lib, const char *name)
+{
+  return sim_pool_open(lib, name, 1);
+}
+
+zpool_handle_t *zpool_open(libzfs_handle_t *lib, const char *name)
+{
+  return sim_pool_open(lib, name, 0);
+}
+
+int zpool_create(libzfs_handle_t *lib, const char *name, nvlist_t *nvroot, nvlist_t *props, nvlist_t *fsprops)
+{
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_POOL);
+  pthread_mutex_lock(&sim_lock);
+  if (strchr(name, '/') != NULL || strchr(name, '@') != NULL || !isalpha((unsigned char)name[0])) {
+    ret = sim_error(lib, EZFS_INVALIDNAME, NULL, "cannot create '%s'", name);
+  } else if (sim_pool_lookup(name, strlen(name)) != NULL) {
+    ret = sim_error(lib, EZFS_EXISTS, "pool already exists", "cannot create '%s'", name);
+  } else {
+    sim_pool_add(name, SIM_POOL_SIZE, "/dev/null");
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+void zpool_close(zpool_handle_t *zhp)
+{
+  nvlist_free(zhp->config);
+  nvlist_free(zhp->old_config);
+  free(zhp);
+}
+
+const char *zpool_get_name(zpool_handle_t *zhp)
+{
+  return zhp->name;
+}
+
+int zpool_get_state(zpool_handle_t *zhp)
+{
+  return POOL_STATE_ACTIVE;
+}
+
+zpool_status_t zpool_get_status(zpool_handle_t *zhp, char **msgid)
+{
+  *msgid = NULL;
+  return ZPOOL_STATUS_OK;
+}
+
+int zpool_iter(libzfs_handle_t *lib, zpool_iter_f func, void *data)
+{
+  char **names;
+  sim_pool_t *pool;
+  zpool_handle_t *zhp;
+  size_t count = 0, i;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_ITER);
+  pthread_mutex_lock(&sim_lock);
+  for (pool = sim_pools; pool != NULL; pool = pool->next) {
+    count++;
+  }
+  names = calloc(count + 1, sizeof(char *));
+  for (pool = sim_pools, i = 0; names != NULL && pool != NULL; pool = pool->next) {
+    names[i++] = strdup(pool->name);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  if (names == NULL) {
+    return sim_error(lib, EZFS_NOMEM, NULL, "internal error");
+  }
+  for (i = 0; i < count; i++) {
+    if (ret == 0 && (zhp = zpool_open_canfail(lib, names[i])) != NULL) {
+      ret = func(zhp, data);
+    }
+    free(names[i]);
+  }
+  free(names);
+  return ret;
+}
+
+int zpool_refresh_stats(zpool_handle_t *zhp, boolean_t *missing)
+{
+  nvlist_t *config;
+
+  sim_ioctl(SIM_OP_POOL);
+  if ((config = sim_pool_config(zhp->name)) == NULL) {
+    *missing = B_TRUE;
+    return 0;
+  }
+  *missing = B_FALSE;
+  nvlist_free(zhp->old_config);
+  zhp->old_config = zhp->config;
+  zhp->config = config;
+  return 0;
+}
+
+nvlist_t *zpool_get_config(zpool_handle_t *zhp, nvlist_t **oldconfig)
+{
+  if (oldconfig != NULL) {
+    *oldconfig = zhp->old_config;
+  }
+  return zhp->config;
+}
+
+#ifdef ZFS_SIM_ZOL
+int zpool_events_next(libzfs_handle_t *lib, nvlist_t **nvp, int *dropped, unsigned flags, int fd)
+{
+  uint64_t cursor, oldest;
+  int ret = 0;
+
+  *nvp = NULL;
+  *dropped = 0;
+  if (fd < 0 || fd >= SIM_EVENTS_FDS) {
+    return sim_error(lib, EZFS_BADDEV, NULL, "cannot get event");
+  }
+  pthread_mutex_lock(&sim_lock);
+  for (;;) {
+    cursor = sim_event_cursors[fd];
+    if (cursor < sim_eid) {
+      oldest = sim_event_oldest();
+      if (cursor + 1 < oldest) {
+        *dropped = (int)(oldest - cursor - 1);
+        cursor = oldest - 1;
+      }
+      sim_event_cursors[fd] = ++cursor;
+      ret = nvlist_dup(sim_events[cursor % SIM_EVENTS_MAX], nvp, 0) ? sim_error(lib, EZFS_NOMEM, NULL, "cannot get event") : 0;
+      break;
+    }
+    if (flags & ZEVENT_NONBLOCK) {
+      break;
+    }
+    // Waits are interrupted by signals, as the zevent ioctl is:
+    pthread_mutex_unlock(&sim_lock);
+    if (poll(NULL, 0, 10) < 0 && errno == EINTR) {
+      return sim_error(lib, EZFS_INTR, NULL, "cannot get event");
+    }
+    pthread_mutex_lock(&sim_lock);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zpool_events_seek(libzfs_handle_t *lib, uint64_t eid, int fd)
+{
+  int ret = 0;
+
+  if (fd < 0 || fd >= SIM_EVENTS_FDS) {
+    return sim_error(lib, EZFS_BADDEV, NULL, "cannot get event");
+  }
+  pthread_mutex_lock(&sim_lock);
+  if (eid == ZEVENT_SEEK_START) {
+    sim_event_cursors[fd] = sim_event_oldest() - 1;
+  } else if (eid == ZEVENT_SEEK_END) {
+    sim_event_cursors[fd] = sim_eid;
+  } else if (eid >= sim_event_oldest() && eid <= sim_eid) {
+    sim_event_cursors[fd] = eid;
+  } else {
+    ret = sim_error(lib, EZFS_NOENT, NULL, "cannot get event");
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+#endif
+
+static int sim_pool_prop(zpool_handle_t *zhp, zpool_prop_t prop, uint64_t *num, char *buf, size_t len,
+  zprop_source_t *src)
+{
+  const sim_prop_desc_t *desc = &sim_pool_props[prop];
+  sim_pool_t *pool;
+  sim_prop_t *local;
+  uint64_t used;
+  int ret = 0;
+
+  if (prop < 0 || prop >= ZPOOL_NUM_PROPS) {
+    return -1;
+  }
+  if (src != NULL) {
+    *src = (desc->flags & SIM_PROP_READONLY) ? ZPROP_SRC_NONE : ZPROP_SRC_DEFAULT;
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((pool = sim_pool_lookup(zhp->name, strlen(zhp->name))) == NULL) {
+    pthread_mutex_unlock(&sim_lock);
+    return -1;
+  }
+  used = sim_pool_used(pool);
+  *num = 0;
+  buf[0] = '\0';
+  switch (prop) {
+    case ZPOOL_PROP_NAME: snprintf(buf, len, "%s", pool->name); break;
+    case ZPOOL_PROP_SIZE: *num = pool->size; break;
+    case ZPOOL_PROP_USED: *num = used; break;
+    case ZPOOL_PROP_AVAILABLE: *num = pool->size > used ? pool->size - used : 0; break;
+    case ZPOOL_PROP_CAPACITY: *num = pool->size ? used * 100 / pool->size : 0; break;
+    case ZPOOL_PROP_GUID: *num = pool->guid; break;
+    case ZPOOL_PROP_VERSION: *num = pool->version; break;
+    default:
+      for (local = pool->props; local != NULL && local->prop != (int)prop; local = local->next);
+      if (local != NULL && src != NULL) {
+        *src = ZPROP_SRC_LOCAL;
+      }
+      snprintf(buf, len, "%s", local ? local->value : desc->def);
+      if (desc->type == PROP_TYPE_INDEX) {
+        *num = sim_index_of(desc->values, buf);
+      }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zpool_get_prop(zpool_handle_t *zhp, zpool_prop_t prop, char *buf, size_t len, zprop_source_t *src)
+{
+  uint64_t num;
+
+  if (sim_pool_prop(zhp, prop, &num, buf, len, src) != 0) {
+    return -1;
+  }
+  if (sim_pool_props[prop].type != PROP_TYPE_NUMBER) {
+    return 0;
+  }
+  if (prop == ZPOOL_PROP_CAPACITY) {
+    snprintf(buf, len, "%llu%%", (unsigned long long)num);
+  } else if (sim_pool_props[prop].flags & SIM_PROP_SIZE) {
+    zfs_nicenum(num, buf, len);
+  } else {
+    snprintf(buf, len, "%llu", (unsigned long long)num);
+  }
+  return 0;
+}
+
+uint64_t zpool_get_prop_int(zpool_handle_t *zhp, zpool_prop_t prop, zprop_source_t *src)
+{
+  char buf[ZPOOL_MAXPROPLEN];
+  uint64_t num;
+
+  return sim_pool_prop(zhp, prop, &num, buf, sizeof(buf), src) == 0 ? num : 0;
+}
+
+int zpool_set_prop(zpool_handle_t *zhp, const char *name, const char *value)
+{
+  const sim_prop_desc_t *desc;
+  sim_pool_t *pool;
+  char errbuf[1024];
+  uint64_t num;
+  int prop = zpool_name_to_prop(name), ret = 0;
+
+  sim_ioctl(SIM_OP_SET);
+  snprintf(errbuf, sizeof(errbuf), "cannot set property for '%s'", zhp->name);
+  if (prop == ZPROP_INVAL) {
+    snprintf(errbuf, sizeof(errbuf), "invalid property '%s'", name);
+    return sim_error(zhp->lib, EZFS_BADPROP, errbuf, "cannot set property for '%s'", zhp->name);
+  }
+  desc = &sim_pool_props[prop];
+  if (desc->flags & SIM_PROP_READONLY) {
+    snprintf(errbuf, sizeof(errbuf), "'%s' is readonly", desc->name);
+    return sim_error(zhp->lib, EZFS_PROPREADONLY, errbuf, "cannot set property for '%s'", zhp->name);
+  }
+  if (desc->type == PROP_TYPE_INDEX && sim_index_of(desc->values, value) < 0) {
+    snprintf(errbuf, sizeof(errbuf), "'%s' must be one of '%s'", desc->name, desc->values);
+    return sim_error(zhp->lib, EZFS_BADPROP, errbuf, "cannot set property for '%s'", zhp->name);
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((pool = sim_pool_lookup(zhp->name, strlen(zhp->name))) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "no such pool", "cannot set property for '%s'", zhp->name);
+  } else if (prop == ZPOOL_PROP_VERSION) {
+    if (sim_strtonum(value, 0, &num) != 0 || num < pool->version || num > SPA_VERSION) {
+      snprintf(errbuf, sizeof(errbuf), "property '%s' number %s is invalid.", desc->name, value);
+      ret = sim_error(zhp->lib, EZFS_BADVERSION, errbuf, "cannot set property for '%s'", zhp->name);
+    } else {
+      pool->version = num;
+    }
+  } else if (prop == ZPOOL_PROP_BOOTFS && strcmp(value, "") != 0 && strcmp(value, "-") != 0 &&
+      (sim_lookup(value) == NULL || sim_lookup(value)->pool != pool)) {
+    snprintf(errbuf, sizeof(errbuf), "'%s' is an invalid name", value);
+    ret = sim_error(zhp->lib, EZFS_INVALIDNAME, errbuf, "cannot set property for '%s'", zhp->name);
+  } else {
+    sim_prop_store(&pool->props, prop, value);
+  }
+  if (pool != NULL) {
+    sim_count_io(pool, SIM_OP_SET, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+uint64_t zpool_get_space_used(zpool_handle_t *zhp)
+{
+  return zpool_get_prop_int(zhp, ZPOOL_PROP_USED, NULL);
+}
+
+uint64_t zpool_get_space_total(zpool_handle_t *zhp)
+{
+  return zpool_get_prop_int(zhp, ZPOOL_PROP_SIZE, NULL);
+}
+
+/*
+ * Datasets.
+ */
+static int sim_name_error(libzfs_handle_t *lib, const char *name, int types, const char *fmt)
+{
+  const char *c;
+
+  if (strlen(name) >= ZFS_MAXNAMELEN) {
+    return sim_error(lib, EZFS_NAMETOOLONG, NULL, fmt, name);
+  }
+  if (name[0] == '\0' || name[0] == '/' || strstr(name, "//") != NULL ||
+      name[strlen(name) - 1] == '/' || (!(types & ZFS_TYPE_SNAPSHOT) && strchr(name, '@') != NULL) ||
+      (types == ZFS_TYPE_SNAPSHOT && strchr(name, '@') == NULL)) {
+    return sim_error(lib, EZFS_INVALIDNAME, NULL, fmt, name);
+  }
+  for (c = name; *c != '\0'; c++) {
+    if (!isalnum((unsigned char)*c) && strchr("-_.:/@ ", *c) == NULL) {
+      return sim_error(lib, EZFS_INVALIDNAME, NULL, fmt, name);
+    }
+  }
+  return 0;
+}
+
+// Dataset of a handle, (lock held), NULL if it doesn't exist anymore:
+static sim_ds_t *sim_ds_of(zfs_handle_t *zhp)
+{
+  sim_ds_t *ds = sim_lookup(zhp->name);
+  return (ds != NULL && ds->type == zhp->type) ? ds : NULL;
+}
+
+// User properties with their source, inherited from the parents:
+static nvlist_t *sim_user_props(const sim_ds_t *ds)
+{
+  const sim_ds_t *item;
+  nvlist_t *props, *prop;
+  nvpair_t *pair;
+  char *value;
+
+  nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+  for (item = ds; item != NULL; item = item->parent) {
+    for (pair = nvlist_next_nvpair(item->user_props, NULL); pair != NULL;
+         pair = nvlist_next_nvpair(item->user_props, pair)) {
+      if (nvlist_exists(props, nvpair_name(pair)) || nvpair_value_string(pair, &value) != 0) {
+        continue;
+      }
+      nvlist_alloc(&prop, NV_UNIQUE_NAME, 0);
+      nvlist_add_string(prop, ZPROP_VALUE, value);
+      nvlist_add_string(prop, ZPROP_SOURCE, item->name);
+      nvlist_add_nvlist(props, nvpair_name(pair), prop);
+      nvlist_free(prop);
+    }
+  }
+  return props;
+}
+
+static zfs_handle_t *sim_handle(libzfs_handle_t *lib, const sim_ds_t *ds)
+{
+  zfs_handle_t *zhp = calloc(1, sizeof(zfs_handle_t));
+
+  if (zhp == NULL) {
+    return NULL;
+  }
+  zhp->lib = lib;
+  zhp->type = ds->type;
+  snprintf(zhp->name, sizeof(zhp->name), "%s", ds->name);
+  sim_count_io(ds->pool, SIM_OP_OPEN, 0);
+  return zhp;
+}
+
+zfs_handle_t *zfs_open(libzfs_handle_t *lib, const char *name, int types)
+{
+  zfs_handle_t *zhp = NULL;
+  sim_ds_t *ds;
+
+  sim_ioctl(SIM_OP_OPEN);
+  if (sim_name_error(lib, name, ZFS_TYPE_DATASET, "cannot open '%s'") != 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_lookup(name)) == NULL) {
+    sim_error(lib, EZFS_NOENT, "dataset does not exist", "cannot open '%s'", name);
+  } else if (!(ds->type & types)) {
+    sim_error(lib, EZFS_BADTYPE, NULL, "cannot open '%s'", name);
+  } else if ((zhp = sim_handle(lib, ds)) == NULL) {
+    sim_error(lib, EZFS_NOMEM, NULL, "internal error");
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return zhp;
+}
+
+void zfs_close(zfs_handle_t *zhp)
+{
+  if (zhp->pool != NULL) {
+    zpool_close(zhp->pool);
+  }
+  nvlist_free(zhp->user_props);
+  free(zhp);
+}
+
+zfs_type_t zfs_get_type(const zfs_handle_t *zhp)
+{
+  return zhp->type;
+}
+
+const char *zfs_get_name(const zfs_handle_t *zhp)
+{
+  return zhp->name;
+}
+
+zpool_handle_t *zfs_get_pool_handle(const zfs_handle_t *zhp)
+{
+  zfs_handle_t *handle = (zfs_handle_t *)zhp;
+  char name[ZPOOL_MAXNAMELEN];
+
+  if (handle->pool == NULL) {
+    snprintf(name, sizeof(name), "%.*s", (int)strcspn(zhp->name, "/@"), zhp->name);
+    handle->pool = zpool_open_canfail(zhp->lib, name);
+  }
+  return handle->pool;
+}
+
+boolean_t zfs_dataset_exists(libzfs_handle_t *lib, const char *name, zfs_type_t types)
+{
+  sim_ds_t *ds;
+  boolean_t exists;
+
+  sim_ioctl(SIM_OP_OPEN);
+  pthread_mutex_lock(&sim_lock);
+  exists = (ds = sim_lookup(name)) != NULL && (ds->type & types);
+  pthread_mutex_unlock(&sim_lock);
+  return exists;
+}
+
+int zfs_prop_get(zfs_handle_t *zhp, zfs_prop_t prop, char *buf, size_t len, zprop_source_t *src,
+  char *statbuf, size_t statlen, boolean_t literal)
+{
+  sim_ds_t *ds;
+  int ret = -1;
+
+  if (prop < 0 || prop >= ZFS_NUM_PROPS) {
+    return -1;
+  }
+  sim_ioctl(SIM_OP_GET);
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) != NULL) {
+    ret = sim_ds_prop(ds, prop, buf, len, src, statbuf, statlen, literal);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zfs_prop_get_numeric(zfs_handle_t *zhp, zfs_prop_t prop, uint64_t *value, zprop_source_t *src,
+  char *statbuf, size_t statlen)
+{
+  sim_ds_t *ds;
+  int ret = -1;
+
+  if (prop < 0 || prop >= ZFS_NUM_PROPS) {
+    return -1;
+  }
+  sim_ioctl(SIM_OP_GET);
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) != NULL) {
+    ret = sim_ds_numeric(ds, prop, value, src);
+  }
+  if (statbuf != NULL && statlen > 0) {
+    statbuf[0] = '\0';
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+uint64_t zfs_prop_get_int(zfs_handle_t *zhp, zfs_prop_t prop)
+{
+  uint64_t value;
+  return zfs_prop_get_numeric(zhp, prop, &value, NULL, NULL, 0) == 0 ? value : 0;
+}
+
+int zfs_prop_set(zfs_handle_t *zhp, const char *name, const char *value)
+{
+  char desc[1024];
+  sim_ds_t *ds;
+  int prop = zfs_name_to_prop(name), ret = 0;
+
+  sim_ioctl(SIM_OP_SET);
+  if (prop == ZPROP_INVAL && !zfs_prop_user(name) && !zfs_prop_userquota(name)) {
+    snprintf(desc, sizeof(desc), "invalid property '%s'", name);
+    return sim_error(zhp->lib, EZFS_BADPROP, desc, "cannot set property for '%s'", zhp->name);
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "dataset does not exist", "cannot set property for '%s'", zhp->name);
+  } else if (prop == ZPROP_INVAL && zfs_prop_userquota(name)) {
+    if (sim_quota_set(ds, name, value, desc, sizeof(desc)) != NULL) {
+      ret = sim_error(zhp->lib, strstr(desc, "memory") ? EZFS_NOMEM : strstr(desc, "does not apply") ?
+        EZFS_PROPTYPE : EZFS_BADPROP, desc, "cannot set property for '%s'", zhp->name);
+    }
+  } else if (prop == ZPROP_INVAL) {
+    if (sim_user_prop_set(ds, name, value) != 0) {
+      ret = sim_error(zhp->lib, EZFS_NOMEM, NULL, "cannot set property for '%s'", zhp->name);
+    }
+  } else if (sim_ds_set(ds, prop, value, desc, sizeof(desc)) != NULL) {
+    ret = sim_error(zhp->lib, strstr(desc, "readonly") ? EZFS_PROPREADONLY :
+      strstr(desc, "does not apply") ? EZFS_PROPTYPE : EZFS_BADPROP, desc,
+      "cannot set property for '%s'", zhp->name);
+  }
+  if (ds != NULL) {
+    sim_count_io(ds->pool, SIM_OP_SET, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  if (ret == 0) {
+    zfs_refresh_properties(zhp);
+  }
+  return ret;
+}
+
+nvlist_t *zfs_get_user_props(zfs_handle_t *zhp)
+{
+  sim_ds_t *ds;
+
+  if (zhp->user_props == NULL) {
+    pthread_mutex_lock(&sim_lock);
+    if ((ds = sim_ds_of(zhp)) != NULL) {
+      zhp->user_props = sim_user_props(ds);
+    } else {
+      nvlist_alloc(&zhp->user_props, NV_UNIQUE_NAME, 0);
+    }
+    pthread_mutex_unlock(&sim_lock);
+  }
+  return zhp->user_props;
+}
+
+void zfs_refresh_properties(zfs_handle_t *zhp)
+{
+  nvlist_free(zhp->user_props);
+  zhp->user_props = NULL;
+}
+
+/*
+ * Iterators: the names are collected with the lock held, and the callbacks
+ * run without it, on fresh handles they own.
+ */
+typedef struct sim_names {
+  char **names;
+  size_t count;
+  size_t size;
+} sim_names_t;
+
+static void sim_names_add(sim_names_t *list, const char *name)
+{
+  if (list->count == list->size) {
+    list->size = list->size ? list->size * 2 : 16;
+    if ((list->names = realloc(list->names, list->size * sizeof(char *))) == NULL) {
+      abort();
+    }
+  }
+  if ((list->names[list->count++] = strdup(name)) == NULL) {
+    abort();
+  }
+}
+
+static int sim_names_iter(libzfs_handle_t *lib, sim_names_t *list, zfs_iter_f func, void *data)
+{
+  zfs_handle_t *zhp;
+  sim_ds_t *ds;
+  size_t i;
+  int ret = 0;
+
+  for (i = 0; i < list->count; i++) {
+    if (ret == 0) {
+      pthread_mutex_lock(&sim_lock);
+      zhp = ((ds = sim_lookup(list->names[i])) != NULL) ? sim_handle(lib, ds) : NULL;
+      pthread_mutex_unlock(&sim_lock);
+      if (zhp != NULL) {
+        ret = func(zhp, data);
+      }
+    }
+    free(list->names[i]);
+  }
+  free(list->names);
+  return ret;
+}
+
+int zfs_iter_root(libzfs_handle_t *lib, zfs_iter_f func, void *data)
+{
+  sim_names_t list = { NULL, 0, 0 };
+  sim_pool_t *pool;
+
+  sim_ioctl(SIM_OP_ITER);
+  pthread_mutex_lock(&sim_lock);
+  for (pool = sim_pools; pool != NULL; pool = pool->next) {
+    sim_names_add(&list, pool->name);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return sim_names_iter(lib, &list, func, data);
+}
+
+static int sim_iter(zfs_handle_t *zhp, int filesystems, int snapshots, zfs_iter_f func, void *data)
+{
+  sim_names_t list = { NULL, 0, 0 };
+  sim_ds_t *ds, *item;
+
+  sim_ioctl(SIM_OP_ITER);
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) != NULL) {
+    for (item = filesystems ? ds->children : NULL; item != NULL; item = item->next) {
+      sim_names_add(&list, item->name);
+    }
+    for (item = snapshots ? ds->snapshots : NULL; item != NULL; item = item->next) {
+      sim_names_add(&list, item->name);
+    }
+    sim_count_io(ds->pool, SIM_OP_ITER, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return sim_names_iter(zhp->lib, &list, func, data);
+}
+
+int zfs_iter_filesystems(zfs_handle_t *zhp, zfs_iter_f func, void *data)
+{
+  return sim_iter(zhp, 1, 0, func, data);
+}
+
+int zfs_iter_snapshots(zfs_handle_t *zhp, zfs_iter_f func, void *data)
+{
+  return sim_iter(zhp, 0, 1, func, data);
+}
+
+int zfs_iter_children(zfs_handle_t *zhp, zfs_iter_f func, void *data)
+{
+  return sim_iter(zhp, 1, 1, func, data);
+}
+
+// Dependents in destroy order: children, clones and snapshots before them:
+static void sim_dependents(sim_ds_t *ds, sim_names_t *list)
+{
+  sim_ds_t *item, *clone;
+
+  for (item = ds->children; item != NULL; item = item->next) {
+    sim_dependents(item, list);
+    sim_names_add(list, item->name);
+  }
+  for (item = ds->snapshots; item != NULL; item = item->next) {
+    for (clone = item->clones; clone != NULL; clone = clone->clone_next) {
+      sim_dependents(clone, list);
+      sim_names_add(list, clone->name);
+    }
+    sim_names_add(list, item->name);
+  }
+  for (clone = (ds->type == ZFS_TYPE_SNAPSHOT) ? ds->clones : NULL; clone != NULL; clone = clone->clone_next) {
+    sim_dependents(clone, list);
+    sim_names_add(list, clone->name);
+  }
+}
+
+int zfs_iter_dependents(zfs_handle_t *zhp, boolean_t allowrecursion, zfs_iter_f func, void *data)
+{
+  sim_names_t list = { NULL, 0, 0 };
+  sim_ds_t *ds;
+
+  sim_ioctl(SIM_OP_ITER);
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) != NULL) {
+    sim_dependents(ds, &list);
+    sim_count_io(ds->pool, SIM_OP_ITER, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return sim_names_iter(zhp->lib, &list, func, data);
+}
+
+/*
+ * Create, destroy, snapshot, clone, promote, rename and rollback.
+ */
+
+// Apply the properties given at creation time, (lock held):
+static int sim_props_apply(libzfs_handle_t *lib, sim_ds_t *ds, nvlist_t *props, const char *fmt)
+{
+  nvpair_t *pair = NULL;
+  char desc[1024], *value;
+  int prop;
+
+  while ((pair = nvlist_next_nvpair(props, pair)) != NULL) {
+    if (nvpair_value_string(pair, &value) != 0) {
+      snprintf(desc, sizeof(desc), "'%s' must be a string", nvpair_name(pair));
+      return sim_error(lib, EZFS_BADPROP, desc, fmt, ds->name);
+    }
+    if (zfs_prop_user(nvpair_name(pair))) {
+      sim_user_prop_set(ds, nvpair_name(pair), value);
+    } else if ((prop = zfs_name_to_prop(nvpair_name(pair))) == ZPROP_INVAL) {
+      snprintf(desc, sizeof(desc), "invalid property '%s'", nvpair_name(pair));
+      return sim_error(lib, EZFS_BADPROP, desc, fmt, ds->name);
+    } else if (prop == ZFS_PROP_VOLBLOCKSIZE && ds->type == ZFS_TYPE_VOLUME) {
+      sim_prop_store(&ds->props, prop, value);
+    } else if (sim_ds_set(ds, prop, value, desc, sizeof(desc)) != NULL) {
+      return sim_error(lib, EZFS_BADPROP, desc, fmt, ds->name);
+    }
+  }
+  return 0;
+}
+
+int zfs_create(libzfs_handle_t *lib, const char *name, zfs_type_t type, nvlist_t *props)
+{
+  sim_ds_t *parent, *ds;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_CREATE);
+  if (sim_name_error(lib, name, type, "cannot create '%s'") != 0) {
+    return -1;
+  }
+  if (strchr(name, '/') == NULL) {
+    return sim_error(lib, EZFS_INVALIDNAME, "missing dataset name", "cannot create '%s'", name);
+  }
+  if (type == ZFS_TYPE_VOLUME && !nvlist_exists(props, "volsize")) {
+    return sim_error(lib, EZFS_BADPROP, "missing volume size", "cannot create '%s'", name);
+  }
+  pthread_mutex_lock(&sim_lock);
+  if (sim_lookup(name) != NULL) {
+    ret = sim_error(lib, EZFS_EXISTS, "dataset already exists", "cannot create '%s'", name);
+  } else if ((parent = sim_parent_of(name)) == NULL) {
+    ret = sim_error(lib, EZFS_NOENT, sim_pool_lookup(name, strcspn(name, "/")) ?
+      "parent does not exist" : "no such pool", "cannot create '%s'", name);
+  } else if (parent->type != ZFS_TYPE_FILESYSTEM) {
+    ret = sim_error(lib, EZFS_BADTYPE, "parent is not a filesystem", "cannot create '%s'", name);
+  } else {
+    ds = sim_ds_alloc(name, type, parent->pool, parent);
+    if ((ret = sim_props_apply(lib, ds, props, "cannot create '%s'")) != 0) {
+      sim_ds_free(ds);
+    } else {
+      sim_count_io(ds->pool, SIM_OP_CREATE, 0);
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+// Why the dataset cannot be destroyed, NULL if it can, (lock held):
+static const char *sim_busy(const sim_ds_t *ds, boolean_t defer)
+{
+  if (ds->type == ZFS_TYPE_SNAPSHOT) {
+    return (ds->clones != NULL && !defer) ? "snapshot has dependent clones" : NULL;
+  }
+  if (ds->parent == NULL) {
+    return "operation does not apply to pools";
+  }
+  if (ds->children != NULL || ds->snapshots != NULL) {
+    return "filesystem has children";
+  }
+  return ds->mounted ? "dataset is busy" : NULL;
+}
+
+// Destroy, or defer the destruction of, a dataset that isn't busy:
+static void sim_destroy(sim_ds_t *ds, boolean_t defer)
+{
+  if (ds->type == ZFS_TYPE_SNAPSHOT && ds->clones != NULL) {
+    ds->defer_destroy = defer;
+  } else {
+    sim_count_io(ds->pool, SIM_OP_DESTROY, ds->refer);
+    sim_ds_free(ds);
+  }
+}
+
+int zfs_destroy(zfs_handle_t *zhp, boolean_t defer)
+{
+  sim_ds_t *ds;
+  const char *busy;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_DESTROY);
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "dataset does not exist", "cannot destroy '%s'", zhp->name);
+  } else if ((busy = sim_busy(ds, defer)) != NULL) {
+    ret = sim_error(zhp->lib, ds->parent ? EZFS_BUSY : EZFS_BADTYPE, busy, "cannot destroy '%s'", zhp->name);
+  } else {
+    sim_destroy(ds, defer);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zfs_destroy_snaps_nvl(libzfs_handle_t *lib, nvlist_t *snaps, boolean_t defer)
+{
+  nvpair_t *pair = NULL;
+  sim_ds_t *ds;
+  const char *busy;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_DESTROY);
+  pthread_mutex_lock(&sim_lock);
+  // All or nothing, like a single ioctl:
+  while (ret == 0 && (pair = nvlist_next_nvpair(snaps, pair)) != NULL) {
+    ds = sim_lookup(nvpair_name(pair));
+    if (ds != NULL && ds->type != ZFS_TYPE_SNAPSHOT) {
+      ret = sim_error(lib, EZFS_BADTYPE, NULL, "cannot destroy '%s'", nvpair_name(pair));
+    } else if (ds != NULL && (busy = sim_busy(ds, defer)) != NULL) {
+      ret = sim_error(lib, EZFS_BUSY, busy, "cannot destroy '%s'", nvpair_name(pair));
+    }
+  }
+  while (ret == 0 && (pair = nvlist_next_nvpair(snaps, pair)) != NULL) {
+    if ((ds = sim_lookup(nvpair_name(pair))) != NULL) {
+      sim_destroy(ds, defer);
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+// Check a list of new snapshot names, before creating any, (lock held):
+static int sim_snapshot_check(libzfs_handle_t *lib, const char *name)
+{
+  sim_ds_t *ds;
+
+  if (sim_name_error(lib, name, ZFS_TYPE_SNAPSHOT, "cannot create snapshot '%s'") != 0) {
+    return -1;
+  }
+  if (sim_lookup(name) != NULL) {
+    return sim_error(lib, EZFS_EXISTS, "dataset already exists", "cannot create snapshot '%s'", name);
+  }
+  if ((ds = sim_parent_of(name)) == NULL || ds->type == ZFS_TYPE_SNAPSHOT) {
+    return sim_error(lib, EZFS_NOENT, "dataset does not exist", "cannot create snapshot '%s'", name);
+  }
+  return 0;
+}
+
+static sim_ds_t *sim_snapshot_create(libzfs_handle_t *lib, const char *name, nvlist_t *props)
+{
+  sim_ds_t *parent = sim_parent_of(name), *snap;
+
+  snap = sim_ds_alloc(name, ZFS_TYPE_SNAPSHOT, parent->pool, parent);
+  sim_props_apply(lib, snap, props, "cannot create snapshot '%s'");
+  sim_count_io(snap->pool, SIM_OP_SNAPSHOT, 0);
+  return snap;
+}
+
+static void sim_snapshot_names(sim_ds_t *ds, const char *snap, sim_names_t *list)
+{
+  char name[ZFS_MAXNAMELEN];
+  sim_ds_t *child;
+
+  snprintf(name, sizeof(name), "%s@%s", ds->name, snap);
+  sim_names_add(list, name);
+  for (child = ds->children; child != NULL; child = child->next) {
+    sim_snapshot_names(child, snap, list);
+  }
+}
+
+int zfs_snapshot(libzfs_handle_t *lib, const char *name, boolean_t recursive, nvlist_t *props)
+{
+  sim_names_t list = { NULL, 0, 0 };
+  sim_ds_t *ds;
+  size_t i;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_SNAPSHOT);
+  if (sim_name_error(lib, name, ZFS_TYPE_SNAPSHOT, "cannot create snapshot '%s'") != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_parent_of(name)) == NULL) {
+    ret = sim_error(lib, EZFS_NOENT, "dataset does not exist", "cannot create snapshot '%s'", name);
+  } else if (recursive) {
+    sim_snapshot_names(ds, strchr(name, '@') + 1, &list);
+  } else {
+    sim_names_add(&list, name);
+  }
+  for (i = 0; ret == 0 && i < list.count; i++) {
+    ret = sim_snapshot_check(lib, list.names[i]);
+  }
+  for (i = 0; i < list.count; i++) {
+    if (ret == 0) {
+      sim_snapshot_create(lib, list.names[i], props);
+    }
+    free(list.names[i]);
+  }
+  free(list.names);
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zfs_snapshot_nvl(libzfs_handle_t *lib, nvlist_t *snaps, nvlist_t *props)
+{
+  nvpair_t *pair = NULL;
+  const char *first = NULL;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_SNAPSHOT);
+  pthread_mutex_lock(&sim_lock);
+  while (ret == 0 && (pair = nvlist_next_nvpair(snaps, pair)) != NULL) {
+    if ((ret = sim_snapshot_check(lib, nvpair_name(pair))) != 0) {
+      break;
+    }
+    if (first == NULL) {
+      first = nvpair_name(pair);
+    } else if (strcspn(first, "/@") != strcspn(nvpair_name(pair), "/@") ||
+        strncmp(first, nvpair_name(pair), strcspn(first, "/@")) != 0) {
+      ret = sim_error(lib, EZFS_CROSSTARGET, NULL, "cannot create snapshot '%s'", nvpair_name(pair));
+    }
+  }
+  while (ret == 0 && (pair = nvlist_next_nvpair(snaps, pair)) != NULL) {
+    sim_snapshot_create(lib, nvpair_name(pair), props);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zfs_clone(zfs_handle_t *zhp, const char *target, nvlist_t *props)
+{
+  sim_ds_t *snap, *parent, *clone;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_CLONE);
+  if (sim_name_error(zhp->lib, target, ZFS_TYPE_FILESYSTEM, "cannot create '%s'") != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((snap = sim_ds_of(zhp)) == NULL || snap->type != ZFS_TYPE_SNAPSHOT) {
+    ret = sim_error(zhp->lib, snap ? EZFS_BADTYPE : EZFS_NOENT, NULL, "cannot create '%s'", target);
+  } else if (sim_lookup(target) != NULL) {
+    ret = sim_error(zhp->lib, EZFS_EXISTS, "dataset already exists", "cannot create '%s'", target);
+  } else if ((parent = sim_parent_of(target)) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "parent does not exist", "cannot create '%s'", target);
+  } else if (parent->pool != snap->pool) {
+    ret = sim_error(zhp->lib, EZFS_CROSSTARGET, "source and target pools differ", "cannot create '%s'", target);
+  } else {
+    clone = sim_ds_alloc(target, snap->parent->type, parent->pool, parent);
+    clone->refer = snap->refer;
+    sim_clone_link(clone, snap);
+    if ((ret = sim_props_apply(zhp->lib, clone, props, "cannot create '%s'")) != 0) {
+      sim_ds_free(clone);
+    } else {
+      sim_count_io(clone->pool, SIM_OP_CLONE, 0);
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+/*
+ * The snapshots of the origin dataset, up to the clone origin, move to the
+ * clone, and the origin dataset becomes a clone of the (moved) snapshot.
+ */
+int zfs_promote(zfs_handle_t *zhp)
+{
+  sim_ds_t *clone, *origin = NULL, *fs = NULL, *snap, *next = NULL, *moved = NULL, *tail = NULL;
+  char name[ZFS_MAXNAMELEN];
+  size_t len;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_PROMOTE);
+  pthread_mutex_lock(&sim_lock);
+  if ((clone = sim_ds_of(zhp)) == NULL || clone->type == ZFS_TYPE_SNAPSHOT) {
+    ret = sim_error(zhp->lib, clone ? EZFS_BADTYPE : EZFS_NOENT, "snapshots can not be promoted",
+      "cannot promote '%s'", zhp->name);
+  } else if ((origin = clone->origin) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_BADTYPE, "not a cloned filesystem", "cannot promote '%s'", zhp->name);
+  } else {
+    fs = origin->parent;
+    for (snap = fs->snapshots; ret == 0 && snap != NULL; snap = snap->next) {
+      snprintf(name, sizeof(name), "%s%s", clone->name, strchr(snap->name, '@'));
+      if (sim_lookup(name) != NULL) {
+        ret = sim_error(zhp->lib, EZFS_EXISTS, "snapshot name collision", "cannot promote '%s'", zhp->name);
+      }
+      if (snap == origin) {
+        break;
+      }
+    }
+  }
+  if (ret == 0) {
+    len = strlen(fs->name);
+    for (snap = fs->snapshots; snap != NULL; snap = next) {
+      next = snap->next;
+      sim_ds_rename(snap, len, clone->name);
+      snap->parent = clone;
+      snap->next = NULL;
+      if (tail == NULL) {
+        moved = snap;
+      } else {
+        tail->next = snap;
+      }
+      tail = snap;
+      if (snap == origin) {
+        break;
+      }
+    }
+    fs->snapshots = next;
+    if (next == NULL) {
+      fs->snapshots_tail = NULL;
+    }
+    tail->next = clone->snapshots;
+    if (clone->snapshots == NULL) {
+      clone->snapshots_tail = tail;
+    }
+    clone->snapshots = moved;
+    sim_clone_unlink(clone);
+    if (fs->origin != NULL) {
+      snap = fs->origin;
+      sim_clone_unlink(fs);
+      sim_clone_link(clone, snap);
+    }
+    sim_clone_link(fs, origin);
+    sim_count_io(clone->pool, SIM_OP_PROMOTE, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zfs_rename(zfs_handle_t *zhp, const char *target, boolean_t recursive)
+{
+  sim_ds_t *ds, *parent, *item;
+  char name[ZFS_MAXNAMELEN];
+  const char *at;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_RENAME);
+  if (sim_name_error(zhp->lib, target, zhp->type, "cannot rename to '%s'") != 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "dataset does not exist", "cannot rename '%s'", zhp->name);
+  } else if (strcmp(ds->name, target) == 0) {
+    ret = 0;
+  } else if (sim_lookup(target) != NULL) {
+    ret = sim_error(zhp->lib, EZFS_EXISTS, "dataset already exists", "cannot rename to '%s'", target);
+  } else if ((parent = sim_parent_of(target)) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "parent does not exist", "cannot rename to '%s'", target);
+  } else if (ds->type == ZFS_TYPE_SNAPSHOT && parent != ds->parent) {
+    ret = sim_error(zhp->lib, EZFS_CROSSTARGET, "snapshots must be part of same dataset",
+      "cannot rename to '%s'", target);
+  } else if (parent->pool != ds->pool || ds->parent == NULL) {
+    ret = sim_error(zhp->lib, EZFS_CROSSTARGET, NULL, "cannot rename to '%s'", target);
+  } else if (ds->type != ZFS_TYPE_SNAPSHOT && strncmp(target, ds->name, strlen(ds->name)) == 0 &&
+      target[strlen(ds->name)] == '/') {
+    ret = sim_error(zhp->lib, EZFS_RECURSIVE, "New dataset name cannot be a descendant of current dataset name",
+      "cannot rename to '%s'", target);
+  } else if (ds->type == ZFS_TYPE_SNAPSHOT) {
+    at = strchr(target, '@');
+    if (recursive) {
+      // Every snapshot with the same name below the dataset:
+      sim_names_t list = { NULL, 0, 0 };
+      size_t i;
+      sim_snapshot_names(ds->parent, strchr(ds->name, '@') + 1, &list);
+      for (i = 0; i < list.count; i++) {
+        if ((item = sim_lookup(list.names[i])) != NULL && item != ds) {
+          snprintf(name, sizeof(name), "%s%s", item->parent->name, at);
+          if (sim_lookup(name) == NULL) {
+            sim_ds_rename(item, strlen(item->name), name);
+          }
+        }
+        free(list.names[i]);
+      }
+      free(list.names);
+    }
+    sim_ds_rename(ds, strlen(ds->name), target);
+  } else {
+    sim_ds_unlink(ds);
+    ds->parent = parent;
+    if (parent->children_tail == NULL) {
+      parent->children = ds;
+    } else {
+      parent->children_tail->next = ds;
+    }
+    parent->children_tail = ds;
+    sim_ds_rename(ds, strlen(ds->name), target);
+  }
+  if (ret == 0 && ds != NULL) {
+    snprintf(zhp->name, sizeof(zhp->name), "%s", target);
+    sim_count_io(ds->pool, SIM_OP_RENAME, 0);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+int zfs_rollback(zfs_handle_t *zhp, zfs_handle_t *snaphp, boolean_t force)
+{
+  sim_ds_t *fs, *snap, *item;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_ROLLBACK);
+  pthread_mutex_lock(&sim_lock);
+  fs = sim_ds_of(zhp);
+  snap = sim_ds_of(snaphp);
+  if (fs == NULL || snap == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "dataset does not exist", "cannot rollback '%s'", zhp->name);
+  } else if (snap->type != ZFS_TYPE_SNAPSHOT || snap->parent != fs) {
+    ret = sim_error(zhp->lib, EZFS_BADTYPE, NULL, "cannot rollback '%s'", zhp->name);
+  } else {
+    for (item = snap->next; ret == 0 && item != NULL; item = item->next) {
+      if (item->clones != NULL) {
+        ret = sim_error(zhp->lib, EZFS_BUSY, "snapshot has dependent clones", "cannot destroy '%s'", item->name);
+      }
+    }
+    while (ret == 0 && snap->next != NULL) {
+      sim_ds_free(snap->next);
+    }
+    if (ret == 0) {
+      fs->refer = snap->refer;
+      sim_count_io(fs->pool, SIM_OP_ROLLBACK, 0);
+    }
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+/*
+ * Send and receive.
+ *
+ * Streams are a text header followed by a payload as large as the snapshot,
+ * (up to SIM_STREAM_MAX bytes):
+ *
+ *   ZFSSIM 1
+ *   fs NAME
+ *   snap SNAPSHOT GUID REFERENCED
+ *   from GUID
+ *   prop NAME=VALUE
+ *   data BYTES
+ *   <BYTES bytes>
+ *   end
+ */
+#define SIM_STREAM_MAGIC "ZFSSIM 1"
+#define SIM_STREAM_MAX (4 << 20)
+
+static int sim_write(int fd, const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, buf, len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int sim_send_stream(int fd, const char *fs, const char *snap, uint64_t guid, uint64_t refer,
+  uint64_t fromguid, nvlist_t *props)
+{
+  char header[4096], chunk[64 * 1024];
+  nvpair_t *pair = NULL;
+  uint64_t size = refer < SIM_STREAM_MAX ? refer : SIM_STREAM_MAX, n;
+  size_t len;
+  char *value;
+
+  len = snprintf(header, sizeof(header), SIM_STREAM_MAGIC "\nfs %s\nsnap %s %llu %llu\nfrom %llu\n", fs, snap,
+    (unsigned long long)guid, (unsigned long long)refer, (unsigned long long)fromguid);
+  while ((pair = nvlist_next_nvpair(props, pair)) != NULL && len < sizeof(header) - 1) {
+    if (nvpair_value_string(pair, &value) == 0) {
+      len += snprintf(header + len, sizeof(header) - len, "prop %s=%s\n", nvpair_name(pair), value);
+    }
+  }
+  if (len < sizeof(header) - 1) {
+    len += snprintf(header + len, sizeof(header) - len, "data %llu\n", (unsigned long long)size);
+  }
+  if (len >= sizeof(header) || sim_write(fd, header, len) != 0) {
+    return -1;
+  }
+  memset(chunk, 'z', sizeof(chunk));
+  for (; size > 0; size -= n) {
+    n = size < sizeof(chunk) ? size : sizeof(chunk);
+    if (sim_write(fd, chunk, n) != 0) {
+      return -1;
+    }
+  }
+  return sim_write(fd, "end\n", 4);
+}
+
+int zfs_send(zfs_handle_t *zhp, const char *fromsnap, const char *tosnap, sendflags_t flags, int outfd,
+  snapfilter_cb_t filter, void *data)
+{
+  char name[ZFS_MAXNAMELEN];
+  sim_ds_t *fs, *snap, *from = NULL;
+  nvlist_t *props = NULL;
+  uint64_t guid = 0, refer = 0, fromguid = 0;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_SEND);
+  pthread_mutex_lock(&sim_lock);
+  snprintf(name, sizeof(name), "%s@%s", zhp->name, tosnap);
+  if ((fs = sim_ds_of(zhp)) == NULL || (snap = sim_lookup(name)) == NULL) {
+    ret = sim_error(zhp->lib, EZFS_NOENT, "dataset does not exist", "cannot send '%s'", name);
+  } else {
+    if (fromsnap != NULL) {
+      snprintf(name, sizeof(name), "%s%s%s", strchr(fromsnap, '@') ? "" : zhp->name,
+        strchr(fromsnap, '@') ? "" : "@", fromsnap);
+      from = sim_lookup(name);
+    }
+    if (fromsnap != NULL && (from == NULL || from->type != ZFS_TYPE_SNAPSHOT ||
+        from->createtxg >= snap->createtxg)) {
+      ret = sim_error(zhp->lib, EZFS_NOENT, "incremental source must be an earlier snapshot",
+        "cannot send '%s'", snap->name);
+    } else {
+      guid = snap->guid;
+      refer = snap->refer;
+      fromguid = from ? from->guid : 0;
+      if (flags.props) {
+        props = sim_user_props(snap);
+      }
+      sim_count_io(fs->pool, SIM_OP_SEND, refer);
+    }
+  }
+  if (ret == 0) {
+    snprintf(name, sizeof(name), "%s", snap->name);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  if (ret == 0) {
+    nvlist_t *values = NULL;
+    nvpair_t *pair = NULL;
+    nvlist_t *prop;
+    char *value;
+    if (props != NULL) {
+      nvlist_alloc(&values, NV_UNIQUE_NAME, 0);
+      while ((pair = nvlist_next_nvpair(props, pair)) != NULL) {
+        if (nvpair_value_nvlist(pair, &prop) == 0 && nvlist_lookup_string(prop, ZPROP_VALUE, &value) == 0) {
+          nvlist_add_string(values, nvpair_name(pair), value);
+        }
+      }
+    }
+    *strchr(name, '@') = '\0';
+    if (sim_send_stream(outfd, name, tosnap, guid, refer, fromguid, values) != 0) {
+      ret = sim_error(zhp->lib, EZFS_IO, NULL, "cannot send '%s'", zhp->name);
+    }
+    nvlist_free(values);
+  }
+  nvlist_free(props);
+  return ret;
+}
+
+// Read a header line, byte by byte so nothing past the stream is consumed:
+static int sim_read_line(int fd, char *buf, size_t len)
+{
+  size_t i = 0;
+  ssize_t n;
+  char c;
+
+  while (i < len - 1) {
+    if ((n = read(fd, &c, 1)) < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    if (c == '\n') {
+      break;
+    }
+    buf[i++] = c;
+  }
+  buf[i] = '\0';
+  return 0;
+}
+
+static int sim_skip(int fd, uint64_t size)
+{
+  char chunk[64 * 1024];
+  ssize_t n;
+
+  while (size > 0) {
+    n = read(fd, chunk, size < sizeof(chunk) ? size : sizeof(chunk));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    size -= n;
+  }
+  return 0;
+}
+
+int zfs_receive(libzfs_handle_t *lib, const char *tosnap, recvflags_t flags, int infd, avl_tree_t *stream_avl)
+{
+  char line[ZFS_MAXNAMELEN + 64], fsname[ZFS_MAXNAMELEN], snapname[ZFS_MAXNAMELEN];
+  char target[ZFS_MAXNAMELEN], name[ZFS_MAXNAMELEN];
+  unsigned long long guid = 0, refer = 0, fromguid = 0, size = 0;
+  sim_ds_t *fs, *parent, *snap;
+  nvlist_t *props;
+  const char *base;
+  char *eq;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_RECV);
+  if (sim_read_line(infd, line, sizeof(line)) != 0 || strcmp(line, SIM_STREAM_MAGIC) != 0) {
+    return sim_error(lib, EZFS_BADSTREAM, NULL, "cannot receive");
+  }
+  nvlist_alloc(&props, NV_UNIQUE_NAME, 0);
+  fsname[0] = snapname[0] = '\0';
+  while (ret == 0) {
+    if (sim_read_line(infd, line, sizeof(line)) != 0) {
+      ret = sim_error(lib, EZFS_BADSTREAM, "stream ended early", "cannot receive");
+    } else if (sscanf(line, "fs %255s", fsname) == 1) {
+    } else if (sscanf(line, "snap %255s %llu %llu", snapname, &guid, &refer) == 3) {
+    } else if (sscanf(line, "from %llu", &fromguid) == 1) {
+    } else if (strncmp(line, "prop ", 5) == 0 && (eq = strchr(line, '=')) != NULL) {
+      *eq++ = '\0';
+      nvlist_add_string(props, line + 5, eq);
+    } else if (sscanf(line, "data %llu", &size) == 1) {
+      if (sim_skip(infd, size) != 0 || sim_read_line(infd, line, sizeof(line)) != 0 ||
+          strcmp(line, "end") != 0) {
+        ret = sim_error(lib, EZFS_BADSTREAM, "stream ended early", "cannot receive");
+      }
+      break;
+    } else {
+      ret = sim_error(lib, EZFS_BADSTREAM, NULL, "cannot receive");
+    }
+  }
+  if (ret != 0) {
+    nvlist_free(props);
+    return ret;
+  }
+  // The target filesystem, and snapshot, names:
+  if (flags.isprefix) {
+    base = strrchr(fsname, '/') ? strrchr(fsname, '/') + 1 : fsname;
+    snprintf(target, sizeof(target), "%s/%s", tosnap, base);
+  } else {
+    snprintf(target, sizeof(target), "%.*s", (int)strcspn(tosnap, "@"), tosnap);
+  }
+  snprintf(name, sizeof(name), "%s@%s", target, strchr(tosnap, '@') ? strchr(tosnap, '@') + 1 : snapname);
+
+  pthread_mutex_lock(&sim_lock);
+  fs = sim_lookup(target);
+  if (sim_name_error(lib, name, ZFS_TYPE_SNAPSHOT, "cannot receive new filesystem stream") != 0) {
+    ret = -1;
+  } else if (fromguid == 0 && fs != NULL && !flags.force) {
+    snprintf(line, sizeof(line), "destination '%s' exists\nmust specify -F to overwrite it", target);
+    ret = sim_error(lib, EZFS_EXISTS, line, "cannot receive new filesystem stream");
+  } else if (fromguid == 0 && fs != NULL && (fs->children != NULL || fs->snapshots != NULL || fs->mounted)) {
+    ret = sim_error(lib, EZFS_BUSY, "destination has snapshots or children",
+      "cannot receive new filesystem stream");
+  } else if (fromguid != 0 && (fs == NULL || fs->snapshots_tail == NULL || fs->snapshots_tail->guid != fromguid)) {
+    snprintf(line, sizeof(line), "most recent snapshot of %s does not\nmatch incremental source", target);
+    ret = sim_error(lib, fs ? EZFS_BADRESTORE : EZFS_NOENT, fs ? line : "destination does not exist",
+      "cannot receive incremental stream");
+  } else if (sim_lookup(name) != NULL) {
+    snprintf(line, sizeof(line), "destination '%s' exists", name);
+    ret = sim_error(lib, EZFS_EXISTS, line, "cannot receive");
+  } else if (fs == NULL && ((parent = sim_parent_of(target)) == NULL || parent->type != ZFS_TYPE_FILESYSTEM)) {
+    ret = sim_error(lib, EZFS_NOENT, "destination's parent does not exist", "cannot receive new filesystem stream");
+  } else if (!flags.dryrun) {
+    if (fs == NULL) {
+      fs = sim_ds_alloc(target, ZFS_TYPE_FILESYSTEM, parent->pool, parent);
+    }
+    fs->refer = refer;
+    snap = sim_ds_alloc(name, ZFS_TYPE_SNAPSHOT, fs->pool, fs);
+    snap->guid = guid;
+    sim_props_apply(lib, fs, props, "cannot receive '%s'");
+    sim_count_io(fs->pool, SIM_OP_RECV, size);
+  }
+  pthread_mutex_unlock(&sim_lock);
+  nvlist_free(props);
+  return ret;
+}
+
+/*
+ * Userspace accounting: the quotas set, and every byte of a filesystem owned
+ * by root, (uid and gid 0), since nothing writes real files.
+ */
+int zfs_userspace(zfs_handle_t *zhp, zfs_userquota_prop_t type, zfs_userspace_cb_t func, void *arg)
+{
+  sim_quota_t *entries = NULL, *entry, *quota;
+  sim_ds_t *ds;
+  int ret = 0;
+
+  sim_ioctl(SIM_OP_GET);
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) == NULL) {
+    pthread_mutex_unlock(&sim_lock);
+    return sim_error(zhp->lib, EZFS_NOENT, "dataset does not exist", "cannot get used/quota for %s", zhp->name);
+  }
+  // Copied, callbacks run without the lock:
+  if ((type == ZFS_PROP_USERUSED || type == ZFS_PROP_GROUPUSED) && ds->refer > 0) {
+    if ((entries = calloc(1, sizeof(sim_quota_t))) != NULL) {
+      entries->quota = ds->refer;
+    }
+  }
+  for (quota = ds->quotas; quota != NULL; quota = quota->next) {
+    if (quota->type != type || (entry = malloc(sizeof(sim_quota_t))) == NULL) {
+      continue;
+    }
+    *entry = *quota;
+    entry->domain = strdup(quota->domain);
+    entry->next = entries;
+    entries = entry;
+  }
+  pthread_mutex_unlock(&sim_lock);
+
+  for (entry = entries; entry != NULL; entry = entries) {
+    if (ret == 0) {
+      ret = func(arg, entry->domain ? entry->domain : "", entry->rid, entry->quota);
+    }
+    entries = entry->next;
+    free(entry->domain);
+    free(entry);
+  }
+  return ret;
+}
+
+/*
+ * Mounts and shares, only flagged, nothing is really mounted or shared.
+ */
+static int sim_flag(zfs_handle_t *zhp, int mount, int set, boolean_t *value, char **where)
+{
+  char mountpoint[ZFS_MAXPROPLEN];
+  sim_ds_t *ds;
+  int ret = -1;
+
+  pthread_mutex_lock(&sim_lock);
+  if ((ds = sim_ds_of(zhp)) != NULL && ds->type == ZFS_TYPE_FILESYSTEM) {
+    switch (mount) {
+      case 0: *value = ds->mounted; if (set >= 0) ds->mounted = set; break;
+      case 1: *value = ds->shared_nfs; if (set >= 0) ds->shared_nfs = set; break;
+      case 2: *value = ds->shared_smb; if (set >= 0) ds->shared_smb = set; break;
+    }
+    if (where != NULL && *value) {
+      *where = strdup(sim_prop_resolve(ds, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0));
+    }
+    if (set >= 0) {
+      sim_count_io(ds->pool, mount ? SIM_OP_SHARE : SIM_OP_MOUNT, 0);
+    }
+    ret = 0;
+  }
+  pthread_mutex_unlock(&sim_lock);
+  return ret;
+}
+
+boolean_t zfs_is_mounted(zfs_handle_t *zhp, char **where)
+{
+  boolean_t value = B_FALSE;
+  sim_flag(zhp, 0, -1, &value, where);
+  return value;
+}
+
+int zfs_mount(zfs_handle_t *zhp, const char *options, int flags)
+{
+  char mountpoint[ZFS_MAXPROPLEN], canmount[16];
+  boolean_t value;
+
+  sim_ioctl(SIM_OP_MOUNT);
+  if (zfs_prop_get(zhp, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE) != 0 ||
+      zfs_prop_get(zhp, ZFS_PROP_CANMOUNT, canmount, sizeof(canmount), NULL, NULL, 0, B_FALSE) != 0) {
+    return sim_error(zhp->lib, EZFS_BADTYPE, NULL, "cannot mount '%s'", zhp->name);
+  }
+  if (mountpoint[0] != '/' || strcmp(canmount, "off") == 0) {
+    return 0;
+  }
+  return sim_flag(zhp, 0, 1, &value, NULL) == 0 ? 0 :
+    sim_error(zhp->lib, EZFS_MOUNTFAILED, NULL, "cannot mount '%s'", zhp->name);
+}
+
+// Lock held. Is any filesystem below mounted under the given mountpoint?:
+static int sim_mount_busy(const sim_ds_t *ds, const char *mountpoint)
+{
+  char path[ZFS_MAXPROPLEN];
+  size_t len = strlen(mountpoint);
+  const sim_ds_t *child;
+
+  for (child = ds->children; child != NULL; child = child->next) {
+    if (child->type != ZFS_TYPE_FILESYSTEM) {
+      continue;
+    }
+    if (child->mounted) {
+      sim_prop_resolve(child, ZFS_PROP_MOUNTPOINT, path, sizeof(path), NULL, NULL, 0);
+      if (strncmp(path, mountpoint, len) == 0 && (path[len] == '/' || mountpoint[len - 1] == '/')) {
+        return 1;
+      }
+    }
+    if (sim_mount_busy(child, mountpoint)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int zfs_unmount(zfs_handle_t *zhp, const char *mountpoint, int flags)
+{
+  char path[ZFS_MAXPROPLEN];
+  boolean_t value;
+  sim_ds_t *ds;
+  int busy;
+
+  sim_ioctl(SIM_OP_MOUNT);
+  // Filesystems mounted on top of this one have to be unmounted first:
+  pthread_mutex_lock(&sim_lock);
+  busy = (ds = sim_ds_of(zhp)) != NULL && ds->type == ZFS_TYPE_FILESYSTEM && ds->mounted &&
+    sim_mount_busy(ds, sim_prop_resolve(ds, ZFS_PROP_MOUNTPOINT, path, sizeof(path), NULL, NULL, 0));
+  pthread_mutex_unlock(&sim_lock);
+  if (busy) {
+    return sim_error(zhp->lib, EZFS_UMOUNTFAILED, "umount failed: device busy", "cannot unmount '%s'", zhp->name);
+  }
+  return sim_flag(zhp, 0, 0, &value, NULL) == 0 ? 0 :
+    sim_error(zhp->lib, EZFS_UMOUNTFAILED, NULL, "cannot unmount '%s'", zhp->name);
+}
+
+static int sim_share(zfs_handle_t *zhp, zfs_prop_t prop, int proto, int error)
+{
+  char value[ZFS_MAXPROPLEN];
+  boolean_t shared;
+
+  sim_ioctl(SIM_OP_SHARE);
+  if (zfs_prop_get(zhp, prop, value, sizeof(value), NULL, NULL, 0, B_FALSE) != 0) {
+    return sim_error(zhp->lib, error, NULL, "cannot share '%s'", zhp->name);
+  }
+  if (strcmp(value, "off") == 0) {
+    return 0;
+  }
+  return sim_flag(zhp, proto, 1, &shared, NULL) == 0 ? 0 : sim_error(zhp->lib, error, NULL, "cannot share '%s'",
+    zhp->name);
+}
+
+static int sim_unshare(zfs_handle_t *zhp, int proto, int error)
+{
+  boolean_t shared;
+
+  sim_ioctl(SIM_OP_SHARE);
+  return sim_flag(zhp, proto, 0, &shared, NULL) == 0 ? 0 : sim_error(zhp->lib, error, NULL,
+    "cannot unshare '%s'", zhp->name);
+}
+
+boolean_t zfs_is_shared_nfs(zfs_handle_t *zhp, char **where)
+{
+  boolean_t value = B_FALSE;
+  sim_flag(zhp, 1, -1, &value, where);
+  return value;
+}
+
+boolean_t zfs_is_shared_smb(zfs_handle_t *zhp, char **where)
+{
+  boolean_t value = B_FALSE;
+  sim_flag(zhp, 2, -1, &value, where);
+  return value;
+}
+
+boolean_t zfs_is_shared_iscsi(zfs_handle_t *zhp)
+{
+  return B_FALSE;
+}
+
+boolean_t zfs_is_shared(zfs_handle_t *zhp)
+{
+  return zfs_is_shared_nfs(zhp, NULL) || zfs_is_shared_smb(zhp, NULL);
+}
+
+int zfs_share_nfs(zfs_handle_t *zhp)
+{
+  return sim_share(zhp, ZFS_PROP_SHARENFS, 1, EZFS_SHARENFSFAILED);
+}
+
+int zfs_unshare_nfs(zfs_handle_t *zhp, const char *mountpoint)
+{
+  return sim_unshare(zhp, 1, EZFS_UNSHARENFSFAILED);
+}
+
+int zfs_share_smb(zfs_handle_t *zhp)
+{
+  return sim_share(zhp, ZFS_PROP_SHARESMB, 2, EZFS_SHARESMBFAILED);
+}
+
+int zfs_unshare_smb(zfs_handle_t *zhp, const char *mountpoint)
+{
+  return sim_unshare(zhp, 2, EZFS_UNSHARESMBFAILED);
+}
+
+// There is no iSCSI target daemon to talk to:
+int zfs_share_iscsi(zfs_handle_t *zhp)
+{
+  char value[ZFS_MAXPROPLEN];
+
+  sim_ioctl(SIM_OP_SHARE);
+  if (zfs_prop_get(zhp, ZFS_PROP_SHAREISCSI, value, sizeof(value), NULL, NULL, 0, B_FALSE) != 0 ||
+      strcmp(value, "off") == 0) {
+    return 0;
+  }
+  return sim_error(zhp->lib, EZFS_SHAREISCSIFAILED, NULL, "cannot share '%s'", zhp->name);
+}
+
+int zfs_unshare_iscsi(zfs_handle_t *zhp)
+{
+  return 0;
+}
+
+int zfs_share(zfs_handle_t *zhp)
+{
+  int ret = zfs_share_nfs(zhp);
+  return ret == 0 ? zfs_share_smb(zhp) : ret;
+}
+
+int zfs_unshare(zfs_handle_t *zhp)
+{
+  int ret = zfs_unshare_nfs(zhp, NULL);
+  return ret == 0 ? zfs_unshare_smb(zhp, NULL) : ret;
+}
+
+#ifdef ZFS_SIM_ZOL
+// Shares are in effect right away, committing them is just one more call:
+void zfs_commit_all_shares(void)
+{
+  sim_ioctl(SIM_OP_SHARE);
+}
+#endif
@@ -1,9 +1,36 @@
+#if defined(HAVE_SPLICE) && !defined(_GNU_SOURCE)
+  #define _GNU_SOURCE 1
+#endif
+
 #include <ruby.h>
+#ifdef HAVE_RUBY_THREAD_H
+  #include <ruby/thread.h>
+#endif
+// Removed from Ruby 1.9:
+#ifndef STR2CSTR
+  #define STR2CSTR(x) StringValuePtr(x)
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef HAVE_LIBZFS_H
   #include <libzfs.h>
 #endif
 
+#ifdef HAVE_LIBZFS_CORE_H
+  #include <libzfs_core.h>
+#endif
+
 // Define Error Classes:
 static VALUE cZfsError = Qnil;
 static VALUE cZfsNoMemoryError = Qnil;
@@ -183,407 +210,867 @@ static VALUE zetta_lib_select_error(int zetta_zfserrno)
 
 
 /*
- * Raise the proper Ruby error bassed into libzfs error.
- * (Extracted from zetta_lib_raise_error so we can raise ruby exceptions
- * directly from C functions).
+ * Handle locks.
+ *
+ * A libzfs_handle_t is not safe to use concurrently: besides the error state
+ * of the last failed operation, it keeps the mnttab and pool namespace
+ * caches. Every handle owned by a LibZfs instance has its own lock, taken
+ * around each libzfs call on that handle, (or on the zfs and zpool handles
+ * opened through it), both by zetta_call_blocking() and by the calls made
+ * while holding the interpreter lock. The handles created by the native
+ * workers are private to them, and are never registered.
+ *
+ * The lock is recursive, so a thread already owning the handle can take it
+ * again, and it is never held while yielding to Ruby. Threads holding the
+ * interpreter lock never block on it either: they wait for the owner with
+ * the interpreter lock released.
  */
-static VALUE zetta_lib_error_exception(libzfs_handle_t *handle)
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) || defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  #define ZETTA_RELEASE_GVL 1
+#endif
+
+typedef struct zetta_lib_lock {
+  libzfs_handle_t *libhandle;
+  pthread_mutex_t mutex;
+  struct zetta_lib_lock *next;
+} zetta_lib_lock_t;
+
+// Registered and looked up with the interpreter lock held only:
+static zetta_lib_lock_t *zetta_lib_locks = NULL;
+
+static zetta_lib_lock_t *zetta_lib_lock_for(libzfs_handle_t *libhandle)
 {
-  rb_raise(
-    zetta_lib_select_error(libzfs_errno(handle)),
-    "%s: %s", libzfs_error_action(handle), libzfs_error_description(handle));
+  zetta_lib_lock_t *lock;
+
+  for (lock = zetta_lib_locks; lock != NULL; lock = lock->next) {
+    if (lock->libhandle == libhandle) {
+      return lock;
+    }
+  }
+  return NULL;
 }
 
-// Internal method: used to make libzfs_handle argument optional.
-static VALUE zetta_lib_get_handle()
+static void zetta_lib_lock_register(libzfs_handle_t *libhandle)
 {
-  ID class_id = rb_intern("LibZfs");
-  VALUE class = rb_const_get(rb_cObject, class_id);
-  return rb_funcall(class, rb_intern("handle"), 0);
+  zetta_lib_lock_t *lock = ALLOC(zetta_lib_lock_t);
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&lock->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  lock->libhandle = libhandle;
+  lock->next = zetta_lib_locks;
+  zetta_lib_locks = lock;
 }
 
-// We have to merge alloc and init here because we want to allocate the space
-// for the C data structure, but we also need the arguments passed to
-// initialize to do so.
-//
-// FIXME: I'm still not sure this is the right way to do it!
+static void zetta_lib_lock_unregister(libzfs_handle_t *libhandle)
+{
+  zetta_lib_lock_t **lock, *found;
+
+  for (lock = &zetta_lib_locks; *lock != NULL; lock = &(*lock)->next) {
+    if ((*lock)->libhandle == libhandle) {
+      found = *lock;
+      *lock = found->next;
+      pthread_mutex_destroy(&found->mutex);
+      xfree(found);
+      return;
+    }
+  }
+}
+
+#ifdef ZETTA_RELEASE_GVL
+// Wait, without the interpreter lock, until the owner gives the handle
+// back. The lock is not kept: it's taken again with the interpreter lock
+// held, so the owner never waits for the interpreter lock while holding it.
+static void *zetta_lib_lock_wait(void *ptr)
+{
+  zetta_lib_lock_t *lock = (zetta_lib_lock_t *)ptr;
+
+  pthread_mutex_lock(&lock->mutex);
+  pthread_mutex_unlock(&lock->mutex);
+  return ptr;
+}
+
+static void zetta_lib_lock_ubf(void *ptr)
+{
+}
+#endif
+
 /*
- *
- * Document-class: Zpool
- *
- * <code>Zpool</code> provides access to ZFS storage pools.
- *
- * In adition to the expected zpool initialization, this class provides
- * facilities to iterate over all the storage pools on the system.
- *
- *    @zlib = LibZfs.new
- *    @zpool = Zpool.new('pool_name', @zlib)
- *
- *    Zpool.each do |zpool|
- *      # access to each zpool instance
- *    end
- *
+ * Take ownership of a LibZfs handle, with the interpreter lock held. Never
+ * raises, (pending interrupts are delivered by the next check), so it can be
+ * used to take the handle back after yielding.
  */
+static void zetta_lib_lock(libzfs_handle_t *libhandle)
+{
+#ifdef ZETTA_RELEASE_GVL
+  zetta_lib_lock_t *lock = zetta_lib_lock_for(libhandle);
+
+  if (lock == NULL) {
+    return;
+  }
+  while (pthread_mutex_trylock(&lock->mutex) != 0) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    if (rb_thread_call_without_gvl2(zetta_lib_lock_wait, lock, zetta_lib_lock_ubf, lock) == NULL) {
+#endif
+      // Interrupted before waiting: the owner never needs the interpreter
+      // lock to give the handle back, so just wait for it here.
+      pthread_mutex_lock(&lock->mutex);
+      return;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    }
+#endif
+  }
+#endif
+}
+
+static void zetta_lib_unlock(libzfs_handle_t *libhandle)
+{
+#ifdef ZETTA_RELEASE_GVL
+  zetta_lib_lock_t *lock = zetta_lib_lock_for(libhandle);
+
+  if (lock != NULL) {
+    pthread_mutex_unlock(&lock->mutex);
+  }
+#endif
+}
 
 /*
+ * Raise the proper Ruby error bassed into libzfs error.
+ * (Extracted from zetta_lib_raise_error so we can raise ruby exceptions
+ * directly from C functions).
  *
- * Document-method: Zpool#new
- *
- * call-seq:
- *   Zpool.new('pool_name')  => object
- *   Zpool.new(:pool_name)  => object
- *   Zpool.new('pool_name', @zlib)  => object
- *   Zpool.new(:pool_name, @zlib)  => object
- *
- *
- * Zpool initializer.
- * Raise <code>ArgumentError</code> when <code>pool_name</code> is not given.
- * Raise <code>TypeError</code> when <code>pool_name</code> is given and it is
- * not a <code>String</code> or <code>Symbol</code>.
- * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
- * is not an instance of <code>LibZfs</code>.
- * Raise <code>ZfsError::NoentError</code> when the ZFS storage pool does not
- * exist.
- *
+ * The error state is copied while owning the handle, the exception raised
+ * once the handle has been given back.
  */
-static VALUE zetta_pool_new(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_lib_error_exception(libzfs_handle_t *handle)
 {
-  VALUE pool_name, libzfs_handle;
-  libzfs_handle_t *libhandle;
-  zpool_handle_t  *zpool_handle;
+  char action[1024], description[1024];
+  int error;
 
-  if(argc < 1) {
-    rb_raise(rb_eArgError, "Zpool name is required.");
-  }
+  zetta_lib_lock(handle);
+  error = libzfs_errno(handle);
+  snprintf(action, sizeof(action), "%s", libzfs_error_action(handle));
+  snprintf(description, sizeof(description), "%s", libzfs_error_description(handle));
+  zetta_lib_unlock(handle);
 
-  pool_name = argv[0];
+  rb_raise(zetta_lib_select_error(error), "%s: %s", action, description);
+}
 
-  if (TYPE(pool_name)!=T_STRING && TYPE(pool_name)!=T_SYMBOL) {
-    rb_raise(rb_eTypeError, "Zpool name must be either a string or a symbol.");
-  }
+// Internal method: used to make libzfs_handle argument optional.
+static VALUE zetta_lib_get_handle()
+{
+  ID class_id = rb_intern("LibZfs");
+  VALUE class = rb_const_get(rb_cObject, class_id);
+  return rb_funcall(class, rb_intern("handle"), 0);
+}
 
-  // If name is a symbol, get the C string:
-  if(SYMBOL_P(pool_name)) {
-    pool_name = rb_funcall(pool_name, rb_intern("to_s"), 0);
+// Internal method: optional trailing arguments of the methods accepting an
+// options Hash and @zlib, (in any order). Return LibZfs.handle when @zlib is
+// not given.
+static VALUE zetta_lib_get_options_handle(int argc, VALUE *argv, int first, VALUE *options)
+{
+  VALUE libzfs_handle = Qnil;
+  int i;
+
+  *options = Qnil;
+  for (i = first; i < argc; i++) {
+    if (TYPE(argv[i]) == T_HASH) {
+      *options = argv[i];
+    } else {
+      libzfs_handle = argv[i];
+    }
   }
 
-  libzfs_handle = (argc == 1) ? zetta_lib_get_handle() : argv[1];
+  if (NIL_P(libzfs_handle)) {
+    libzfs_handle = zetta_lib_get_handle();
+  }
 
   if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
     rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
   }
+  return libzfs_handle;
+}
 
-  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+// Internal method: nvlist with the given Hash of String properties, (NULL
+// when the Hash is Nil), to be freed by the caller with nvlist_free.
+static nvlist_t *zetta_lib_props_nvlist(VALUE props)
+{
+  nvlist_t *nvl = NULL;
+  VALUE keys;
+  long i;
 
-  zpool_handle = zpool_open_canfail(libhandle, StringValuePtr(pool_name));
+  if (NIL_P(props)) {
+    return NULL;
+  }
+  if (TYPE(props) != T_HASH) {
+    rb_raise(rb_eTypeError, "Properties must be a Hash of strings.");
+  }
+  // Check everything before allocating anything:
+  keys = rb_funcall(props, rb_intern("keys"), 0);
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    if (TYPE(RARRAY_PTR(keys)[i]) != T_STRING || TYPE(rb_hash_aref(props, RARRAY_PTR(keys)[i])) != T_STRING) {
+      rb_raise(rb_eTypeError, "Properties must be a Hash of strings.");
+    }
+  }
 
-  if(zpool_handle != NULL) {
-    return Data_Wrap_Struct(klass, 0, zpool_close, zpool_handle);
+  if (nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0) != 0) {
+    rb_raise(cZfsNoMemoryError, "cannot allocate properties: out of memory");
   }
-  // Raise exception when cannot get a proper Zpool handle:
-  zetta_lib_error_exception(libhandle);
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    VALUE key = RARRAY_PTR(keys)[i];
+    VALUE value = rb_hash_aref(props, key);
+    if (nvlist_add_string(nvl, RSTRING_PTR(key), RSTRING_PTR(value)) != 0) {
+      nvlist_free(nvl);
+      rb_raise(cZfsNoMemoryError, "cannot allocate properties: out of memory");
+    }
+  }
+  return nvl;
 }
 
 /*
- * call-seq:
- *   @zpool.libzfs_handle  => object, zpool_handle
- *
- * Return <code>zpool_handle</code> associated with a <code>Zpool</code>
- * instance.
+ * Property cache.
  *
+ * ZFS and Zpool instances can keep the values already read into a Hash,
+ * (only once enabled with <code>cache_properties!</code>), so repeated
+ * reads become Hash lookups instead of formatting the value again. Nil
+ * values are kept as false, since nil means the property is not cached.
  */
-static VALUE zetta_pool_get_handle(VALUE self)
+static VALUE zetta_prop_cache(VALUE self)
 {
-  VALUE klass = rb_const_get(rb_cObject, rb_intern("LibZfs"));
-  libzfs_handle_t *handle;
-  zpool_handle_t *zpool_handle;
+  return rb_iv_get(self, "@property_cache");
+}
 
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+// Cached value for the given property, or Qundef when not cached:
+static VALUE zetta_prop_cache_get(VALUE self, VALUE name)
+{
+  VALUE cache = zetta_prop_cache(self);
+  VALUE value;
 
-  handle = zpool_get_handle(zpool_handle);
+  if (NIL_P(cache)) {
+    return Qundef;
+  }
+  value = rb_hash_aref(cache, name);
+  if (NIL_P(value)) {
+    return Qundef;
+  }
+  return (value == Qfalse) ? Qnil : value;
+}
 
-  // Note that we don't need to free the handle here, because it's just a
-  // copy of one that's already in the garbage collector.
-  return Data_Wrap_Struct(klass, 0, 0, handle);
+static VALUE zetta_prop_cache_set(VALUE self, VALUE name, VALUE value)
+{
+  VALUE cache = zetta_prop_cache(self);
+
+  if (!NIL_P(cache)) {
+    if (TYPE(value) == T_STRING) {
+      OBJ_FREEZE(value);
+    }
+    rb_hash_aset(cache, name, NIL_P(value) ? Qfalse : value);
+  }
+  return value;
 }
 
-/*
- * call-seq:
- *   @zpool.name  => string, zpool name.
- *
- * Return current <code>Zpool</code> instance name.
- *
- * The <code>name</code> pointer is stored in the <code>handle</code>, hence
- * we don't need to call <code>zpool.get('name')</code>. This method is
- * more effective.
- *
- */
-static VALUE zetta_pool_get_name(VALUE self)
+// Cache every value of the given properties Hash:
+static VALUE zetta_prop_cache_merge(VALUE self, VALUE props)
 {
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+  VALUE keys;
+  long i;
 
-  return rb_str_new2(zpool_get_name(zpool_handle));
+  if (!NIL_P(zetta_prop_cache(self))) {
+    keys = rb_funcall(props, rb_intern("keys"), 0);
+    for (i = 0; i < RARRAY_LEN(keys); i++) {
+      zetta_prop_cache_set(self, RARRAY_PTR(keys)[i], rb_hash_aref(props, RARRAY_PTR(keys)[i]));
+    }
+  }
+  return props;
+}
+
+// Internal method: take the trailing options Hash of the bulk property
+// getters out of argv, and return whether literal values were requested.
+static int zetta_prop_literal_option(int *argc, VALUE *argv)
+{
+  if (*argc > 0 && TYPE(argv[*argc - 1]) == T_HASH) {
+    (*argc)--;
+    return RTEST(rb_hash_aref(argv[*argc], ID2SYM(rb_intern("literal"))));
+  }
+  return 0;
 }
 
 /*
  * call-seq:
- *   @zpool.get('propname')  => string/integer, zpool property value or Nil.
- *
- * Given a zpool property name, return its value.
- * Values for properties +version+ and +guid+ will be integers. Any other
- * property value will be a string. For disk space related properties, this
- * string will be nicely formatted as in <code>ZfsLib.nicenum</code>.
+ *   @zfs.cache_properties!  => self
+ *   @zpool.cache_properties!  => self
  *
- * Raise <code>TypeError</code> when <code>propname</code>
- * is not a <code>String</code>.
- *
- * TODO:
+ * Keep the property values read through <code>get</code>,
+ * <code>get_many</code>, <code>properties</code> and, for datasets,
+ * <code>get_user_prop</code>, so further reads of the same properties don't
+ * go through libzfs again. Values written through <code>set</code> are
+ * updated into the cache.
  *
- *  - Ensure that the given property name is a valid zpool property.
+ * Cached values are frozen. Use <code>refresh!</code> to read fresh values
+ * from the kernel, or <code>invalidate</code> to just forget them.
  *
  */
-static VALUE zetta_pool_get_prop(VALUE self, VALUE name)
+static VALUE zetta_prop_cache_enable(VALUE self)
 {
-  zpool_handle_t *zpool_handle;
-
-  if( TYPE(name) != T_STRING )
-  {
-    rb_raise(rb_eTypeError, "Property name must be a string.");
-  }
-
-  char *propname = STR2CSTR(name);
-
-  char zpool_prop = zpool_name_to_prop(propname);
-
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
-  // FIXME: This needs to take into consideration the possibility
-  // of unavailable zpools.
-  if(zpool_prop == ZPOOL_PROP_GUID || zpool_prop == ZPOOL_PROP_VERSION)
-  {
-    return ULL2NUM(zpool_get_prop_int(zpool_handle, zpool_prop, NULL));
-  } else {
-    char propval[ZPOOL_MAXNAMELEN];
-    if ( zpool_get_prop(zpool_handle, zpool_prop, propval, sizeof (propval), NULL) != 0 ) {
-      return Qnil;
-    }
-    return ( strcmp( propval, "-" ) == 0 ) ? Qnil: rb_str_new2(propval);
+  if (NIL_P(zetta_prop_cache(self))) {
+    rb_iv_set(self, "@property_cache", rb_hash_new());
   }
+  return self;
 }
 
 /*
  * call-seq:
- *   @zpool.set('propname', "propval")  => Boolean
- *
- * Set the given value for the given zpool property.
+ *   @zfs.invalidate  => self
+ *   @zpool.invalidate  => self
  *
- * Raise <code>TypeError</code> when <code>propname</code>
- * is not a <code>String</code>.
- * Raise <code>TypeError</code> when <code>proval</code>
- * is not a <code>String</code>.
+ * Forget any cached property value. Caching remains enabled.
  *
  */
-static VALUE zetta_pool_set_prop(VALUE self, VALUE propname, VALUE propval)
+static VALUE zetta_prop_cache_invalidate(VALUE self)
 {
-  zpool_handle_t *zpool_handle;
-
-  if( TYPE(propname) != T_STRING )
-  {
-    rb_raise(rb_eTypeError, "Property name must be a string.");
-  }
-
-  if(TYPE(propval) != T_STRING )  // Maybe should also allow !FIXNUM_P(propval)
-  {
-    rb_raise(rb_eTypeError, "Property value must be a string or a number.");
+  if (!NIL_P(zetta_prop_cache(self))) {
+    rb_iv_set(self, "@property_cache", rb_hash_new());
   }
-
-  char *name = STR2CSTR(propname);
-  // FIXME: Property might require an integer value, so need to check the type.
-  char *val = STR2CSTR(propval);
-
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
-
-  return ( zpool_set_prop(zpool_handle, name, val) == 0 ) ? Qtrue : Qfalse;
+  return self;
 }
 
 /*
- * call-seq:
- *   @zpool.guid  => integer, zpool guid.
- *
- * Return current <code>Zpool</code> instance guid property.
+ * Open handles cache.
  *
- * Actually, this is the equivalent to <code>zpool.get_prop('guid')</code>.
- * This method is here just because it was defined at the old version of this
- * library, and will be removed when "method_missing" is implemented.
+ * Each libzfs handle can keep a bounded, least recently used, set of the
+ * ZFS and Zpool instances opened through it, keyed by name, so opening a
+ * hot name again doesn't need to go to the kernel. Entries are kept into
+ * Ruby Hashes, which preserve insertion order: a hit moves the entry to the
+ * end, and the entries at the beginning are the ones evicted. The cache is
+ * disabled until LibZfs#handle_cache_size= is set.
  *
+ * Caches are registered by libzfs_handle_t, (more than one LibZfs instance
+ * can wrap the same one), and go away with the libzfs handle.
  */
-static VALUE zetta_pool_get_guid(VALUE self)
+typedef struct zetta_handle_cache {
+  libzfs_handle_t *libhandle;
+  long max;
+  unsigned long hits;
+  unsigned long misses;
+  VALUE datasets;
+  VALUE pools;
+  struct zetta_handle_cache *next;
+} zetta_handle_cache_t;
+
+static zetta_handle_cache_t *zetta_handle_caches = NULL;
+static VALUE zetta_handle_caches_root = Qnil;
+
+static void zetta_handle_caches_mark(void *ptr)
 {
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+  zetta_handle_cache_t *cache;
 
-  return ULL2NUM(zpool_get_prop_int(zpool_handle, ZPOOL_PROP_GUID, NULL));
+  for (cache = zetta_handle_caches; cache != NULL; cache = cache->next) {
+    rb_gc_mark(cache->datasets);
+    rb_gc_mark(cache->pools);
+  }
 }
 
-static VALUE zetta_pool_get_space_used(VALUE self)
+static zetta_handle_cache_t *zetta_handle_cache_for(libzfs_handle_t *libhandle, int create)
 {
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+  zetta_handle_cache_t *cache;
 
-  return ULL2NUM(zpool_get_space_used(zpool_handle));
+  for (cache = zetta_handle_caches; cache != NULL; cache = cache->next) {
+    if (cache->libhandle == libhandle) {
+      return cache;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  if (NIL_P(zetta_handle_caches_root)) {
+    zetta_handle_caches_root = Data_Wrap_Struct(rb_cObject, zetta_handle_caches_mark, 0, NULL);
+    rb_global_variable(&zetta_handle_caches_root);
+  }
+  cache = ALLOC(zetta_handle_cache_t);
+  cache->libhandle = libhandle;
+  cache->max = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->datasets = rb_hash_new();
+  cache->pools = rb_hash_new();
+  cache->next = zetta_handle_caches;
+  zetta_handle_caches = cache;
+  return cache;
 }
 
-static VALUE zetta_pool_get_space_total(VALUE self)
+// Free function of the LibZfs instances owning a libzfs handle. Runs during
+// GC, hence only C memory is touched here:
+static void zetta_lib_free(libzfs_handle_t *libhandle)
 {
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+  zetta_handle_cache_t **cache, *found;
+
+  for (cache = &zetta_handle_caches; *cache != NULL; cache = &(*cache)->next) {
+    if ((*cache)->libhandle == libhandle) {
+      found = *cache;
+      *cache = found->next;
+      xfree(found);
+      break;
+    }
+  }
+  zetta_lib_lock_unregister(libhandle);
+  libzfs_fini(libhandle);
+}
 
-  return ULL2NUM(zpool_get_space_total(zpool_handle));
+static void zetta_handle_cache_evict(zetta_handle_cache_t *cache)
+{
+  while ((long)RHASH_SIZE(cache->datasets) > cache->max) {
+    rb_funcall(cache->datasets, rb_intern("shift"), 0);
+  }
+  while ((long)RHASH_SIZE(cache->pools) > cache->max) {
+    rb_funcall(cache->pools, rb_intern("shift"), 0);
+  }
 }
 
-/*
- * call-seq:
- *   @zpool.state  => integer, zpool state.
- *
- * Return current <code>Zpool</code> instance state as an integer.
- *
- * The value is one of the constants defined at module
- * <code>ZfsConsts::State::Pool</code>.
- *
- */
-static VALUE zetta_pool_get_state(VALUE self)
+// Cached instance for the given name, (Qnil on a miss), counting hits and
+// misses only while the cache is enabled:
+static VALUE zetta_handle_cache_get(libzfs_handle_t *libhandle, int pools, VALUE name)
 {
-  VALUE state = Qnil;
+  zetta_handle_cache_t *cache = zetta_handle_cache_for(libhandle, 0);
+  VALUE entries, instance;
 
-  VALUE cZfsConsts = rb_const_get(rb_cObject, rb_intern("ZfsConsts"));
-  VALUE mState = rb_const_get(cZfsConsts, rb_intern("State"));
-  VALUE mPoolState = rb_const_get(mState, rb_intern("Pool"));
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+  if (cache == NULL || cache->max == 0) {
+    return Qnil;
+  }
+  entries = pools ? cache->pools : cache->datasets;
+  instance = rb_hash_delete(entries, name);
+  if (NIL_P(instance)) {
+    cache->misses++;
+    return Qnil;
+  }
+  cache->hits++;
+  rb_hash_aset(entries, name, instance);
+  return instance;
+}
 
-  switch (zpool_get_state(zpool_handle)) {
-    case POOL_STATE_ACTIVE: state = rb_const_get(mPoolState, rb_intern("ACTIVE")); break;
-    case POOL_STATE_EXPORTED: state = rb_const_get(mPoolState, rb_intern("EXPORTED")); break;
-    case POOL_STATE_DESTROYED: state = rb_const_get(mPoolState, rb_intern("DESTROYED")); break;
-    case POOL_STATE_SPARE: state = rb_const_get(mPoolState, rb_intern("SPARE")); break;
-#ifdef SPA_VERSION_10
-    case POOL_STATE_L2CACHE: state = rb_const_get(mPoolState, rb_intern("L2CACHE")); break;
-#endif
-    case POOL_STATE_UNINITIALIZED: state = rb_const_get(mPoolState, rb_intern("UNINITIALIZED")); break;
-    case POOL_STATE_UNAVAIL: state = rb_const_get(mPoolState, rb_intern("UNAVAIL")); break;
-    case POOL_STATE_POTENTIALLY_ACTIVE: state = rb_const_get(mPoolState, rb_intern("POTENTIALLY_ACTIVE")); break;
-    default: state = rb_const_get(mPoolState, rb_intern("UNKNOWN"));
+static VALUE zetta_handle_cache_put(libzfs_handle_t *libhandle, int pools, VALUE name, VALUE instance)
+{
+  zetta_handle_cache_t *cache = zetta_handle_cache_for(libhandle, 0);
+
+  if (cache != NULL && cache->max > 0) {
+    rb_hash_aset(pools ? cache->pools : cache->datasets, name, instance);
+    zetta_handle_cache_evict(cache);
   }
+  return instance;
+}
 
-  return state;
+// Forget the given dataset, its descendants and its snapshots, (or
+// everything when name is NULL):
+static void zetta_handle_cache_invalidate(libzfs_handle_t *libhandle, const char *name)
+{
+  zetta_handle_cache_t *cache = zetta_handle_cache_for(libhandle, 0);
+  VALUE keys;
+  size_t len;
+  long i;
+
+  if (cache == NULL) {
+    return;
+  }
+  if (name == NULL) {
+    cache->datasets = rb_hash_new();
+    cache->pools = rb_hash_new();
+    return;
+  }
+  len = strlen(name);
+  keys = rb_funcall(cache->datasets, rb_intern("keys"), 0);
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    const char *key = RSTRING_PTR(RARRAY_PTR(keys)[i]);
+    if (strncmp(key, name, len) == 0 && (key[len] == '\0' || key[len] == '/' || key[len] == '@')) {
+      rb_hash_delete(cache->datasets, RARRAY_PTR(keys)[i]);
+    }
+  }
 }
 
 /*
- * call-seq:
- *   @zpool.health_status  => integer, zpool health status.
- *
- * Return current <code>Zpool</code> instance health status as an integer.
- *
- * The value is one of the constants defined at module
- * <code>ZfsConsts::HealthStatus::Pool</code>.
- *
+ * Call statistics.
+ *
+ * When enabled with LibZfs.stats_enabled = true, every libzfs operation run
+ * by the wrappers is timed with a monotonic clock and counted, together with
+ * its failures, into a log2 histogram of latencies: bucket i counts the
+ * calls which took from 2^i up to 2^(i+1) nanoseconds.
+ *
+ * Operations are run from any thread, with or without the interpreter lock,
+ * so counters are kept into per-thread shards which are only written by
+ * their own thread, and added up by LibZfs.stats. LibZfs.reset_stats starts
+ * a new epoch instead of clearing other threads' shards: each shard clears
+ * itself the next time it is written, and shards from a past epoch are not
+ * added up. When disabled, the cost for each operation is a single test.
  */
-static VALUE zetta_pool_get_health_status(VALUE self)
+#define ZETTA_STATS_OPS 96
+#define ZETTA_STATS_BUCKETS 40
+
+typedef struct zetta_stats_counter {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[ZETTA_STATS_BUCKETS];
+} zetta_stats_counter_t;
+
+typedef struct zetta_stats_shard {
+  struct zetta_stats_shard *next;
+  volatile uint64_t epoch;
+  // Owned by a running thread, otherwise it can be adopted by a new one:
+  int owned;
+  zetta_stats_counter_t ops[ZETTA_STATS_OPS];
+} zetta_stats_shard_t;
+
+static volatile int zetta_stats_enabled = 0;
+static volatile uint64_t zetta_stats_epoch = 1;
+static const char *zetta_stats_names[ZETTA_STATS_OPS];
+static int zetta_stats_nops = 0;
+static zetta_stats_shard_t *zetta_stats_shards = NULL;
+static pthread_mutex_t zetta_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t zetta_stats_key;
+
+static uint64_t zetta_stats_now(void)
 {
-  VALUE status = Qnil;
-  VALUE cZfsConsts = rb_const_get(rb_cObject, rb_intern("ZfsConsts"));
-  VALUE mHealthStatus = rb_const_get(cZfsConsts, rb_intern("HealthStatus"));
+#if defined(HAVE_GETHRTIME)
+  return gethrtime();
+#elif defined(HAVE_CLOCK_GETTIME)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+#endif
+}
 
-  char *msgid;
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+// The shard is given back when its thread exits, keeping its counters:
+static void zetta_stats_release(void *ptr)
+{
+  pthread_mutex_lock(&zetta_stats_lock);
+  ((zetta_stats_shard_t *)ptr)->owned = 0;
+  pthread_mutex_unlock(&zetta_stats_lock);
+}
 
-  switch (zpool_get_status(zpool_handle, &msgid)) {
-    case ZPOOL_STATUS_CORRUPT_CACHE: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_CACHE"));
-    case ZPOOL_STATUS_MISSING_DEV_R: status = rb_const_get(mHealthStatus, rb_intern("MISSING_DEV_R"));
-    case ZPOOL_STATUS_MISSING_DEV_NR: status = rb_const_get(mHealthStatus, rb_intern("MISSING_DEV_NR"));
-    case ZPOOL_STATUS_CORRUPT_LABEL_R: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_LABEL_R"));
-    case ZPOOL_STATUS_CORRUPT_LABEL_NR: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_LABEL_NR"));
-    case ZPOOL_STATUS_BAD_GUID_SUM: status = rb_const_get(mHealthStatus, rb_intern("BAD_GUID_SUM"));
-    case ZPOOL_STATUS_CORRUPT_POOL: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_POOL"));
-    case ZPOOL_STATUS_CORRUPT_DATA: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_DATA"));
-    case ZPOOL_STATUS_FAILING_DEV: status = rb_const_get(mHealthStatus, rb_intern("FAILING_DEV"));
-    case ZPOOL_STATUS_VERSION_NEWER: status = rb_const_get(mHealthStatus, rb_intern("VERSION_NEWER"));
-    case ZPOOL_STATUS_HOSTID_MISMATCH: status = rb_const_get(mHealthStatus, rb_intern("HOSTID_MISMATCH"));
-#ifdef SPA_VERSION_11
-    case ZPOOL_STATUS_IO_FAILURE_WAIT: status = rb_const_get(mHealthStatus, rb_intern("IO_FAILURE_WAIT"));
-    case ZPOOL_STATUS_IO_FAILURE_CONTINUE: status = rb_const_get(mHealthStatus, rb_intern("IO_FAILURE_CONTINUE"));
-#endif
+static zetta_stats_shard_t *zetta_stats_shard(void)
+{
+  zetta_stats_shard_t *shard = pthread_getspecific(zetta_stats_key);
+
+  if (shard == NULL) {
+    pthread_mutex_lock(&zetta_stats_lock);
+    for (shard = zetta_stats_shards; shard != NULL && shard->owned; shard = shard->next)
+      ;
+    if (shard == NULL && (shard = calloc(1, sizeof(zetta_stats_shard_t))) != NULL) {
+      shard->next = zetta_stats_shards;
+      zetta_stats_shards = shard;
+    }
+    if (shard != NULL) {
+      shard->owned = 1;
+      pthread_setspecific(zetta_stats_key, shard);
+    }
+    pthread_mutex_unlock(&zetta_stats_lock);
+  }
+  return shard;
+}
 
-#ifdef SPA_VERSION_14
-    case ZPOOL_STATUS_BAD_LOG: status = rb_const_get(mHealthStatus, rb_intern("BAD_LOG"));
+// Number of registered operations. Names are published before the count,
+// (release), so every index below it can be read without the lock, (acquire):
+static int zetta_stats_nops_get(void)
+{
+  int nops;
+#if defined(__ATOMIC_ACQUIRE)
+  nops = __atomic_load_n(&zetta_stats_nops, __ATOMIC_ACQUIRE);
+#else
+  pthread_mutex_lock(&zetta_stats_lock);
+  nops = zetta_stats_nops;
+  pthread_mutex_unlock(&zetta_stats_lock);
 #endif
+  return nops;
+}
 
-  // Older than SPA_VERSION, safe:
-    case ZPOOL_STATUS_FAULTED_DEV_R: status = rb_const_get(mHealthStatus, rb_intern("FAULTED_DEV_R"));
-    case ZPOOL_STATUS_FAULTED_DEV_NR: status = rb_const_get(mHealthStatus, rb_intern("FAULTED_DEV_NR"));
-    case ZPOOL_STATUS_VERSION_OLDER: status = rb_const_get(mHealthStatus, rb_intern("VERSION_OLDER"));
-    case ZPOOL_STATUS_RESILVERING: status = rb_const_get(mHealthStatus, rb_intern("RESILVERING"));
-    case ZPOOL_STATUS_OFFLINE_DEV: status = rb_const_get(mHealthStatus, rb_intern("OFFLINE_DEV"));
+// Index of the given operation name, (always a string literal), -1 when
+// there is no room for more operations:
+static int zetta_stats_op(const char *name)
+{
+  int i, nops = zetta_stats_nops_get();
 
-#ifdef SPA_VERSION_18
-    case ZPOOL_STATUS_REMOVED_DEV: status = rb_const_get(mHealthStatus, rb_intern("REMOVED_DEV"));
+  for (i = 0; i < nops; i++) {
+    if (zetta_stats_names[i] == name || strcmp(zetta_stats_names[i], name) == 0) {
+      return i;
+    }
+  }
+  pthread_mutex_lock(&zetta_stats_lock);
+  for (i = 0; i < zetta_stats_nops; i++) {
+    if (strcmp(zetta_stats_names[i], name) == 0) {
+      break;
+    }
+  }
+  if (i == zetta_stats_nops) {
+    if (i < ZETTA_STATS_OPS) {
+      zetta_stats_names[i] = name;
+#if defined(__ATOMIC_RELEASE)
+      __atomic_store_n(&zetta_stats_nops, i + 1, __ATOMIC_RELEASE);
+#else
+      zetta_stats_nops = i + 1;
 #endif
+    } else {
+      i = -1;
+    }
+  }
+  pthread_mutex_unlock(&zetta_stats_lock);
+  return i;
+}
+
+// Start timing an operation, 0 when stats are disabled:
+static uint64_t zetta_stats_begin(void)
+{
+  return zetta_stats_enabled ? zetta_stats_now() : 0;
+}
 
-    case ZPOOL_STATUS_OK: status = rb_const_get(mHealthStatus, rb_intern("OK"));
-    default: state = rb_const_get(mHealthStatus, rb_intern("UNKNOWN"));
+static void zetta_stats_end(const char *name, uint64_t start, int failed)
+{
+  zetta_stats_shard_t *shard;
+  zetta_stats_counter_t *counter;
+  uint64_t elapsed, epoch;
+  int op, bucket;
+
+  if (start == 0 || (op = zetta_stats_op(name)) < 0 || (shard = zetta_stats_shard()) == NULL) {
+    return;
   }
-  return status;
+  elapsed = zetta_stats_now() - start;
+
+  epoch = zetta_stats_epoch;
+  if (shard->epoch != epoch) {
+    memset(shard->ops, 0, sizeof(shard->ops));
+    shard->epoch = epoch;
+  }
+
+  for (bucket = 0; bucket < ZETTA_STATS_BUCKETS - 1 && (elapsed >> (bucket + 1)) != 0; bucket++)
+    ;
+  counter = &shard->ops[op];
+  counter->calls++;
+  counter->errors += failed ? 1 : 0;
+  counter->total_ns += elapsed;
+  if (elapsed > counter->max_ns) {
+    counter->max_ns = elapsed;
+  }
+  counter->buckets[bucket]++;
 }
 
 /*
- * call-seq:
- *   @zpool.version  => integer, zpool version.
- *
- * Return current <code>Zpool</code> instance version property.
+ * Blocking libzfs calls.
  *
- * Actually, this is the equivalent to <code>zpool.get_prop('version')</code>.
+ * Most of the libzfs functions end up into one or more ioctls which can take
+ * a long time to complete (think of a destroy on a busy pool). These calls
+ * are run through zetta_call_blocking(), which releases the interpreter lock
+ * when the running Ruby allows it, so other threads can keep running while
+ * ZFS does its I/O.
  *
+ * A libzfs_handle_t keeps the error state of the last failed operation and
+ * is not safe to use concurrently; the calling thread takes the handle lock
+ * for the whole call, and copies the error state before giving it back.
  */
-static VALUE zetta_pool_get_version(VALUE self)
+typedef struct zetta_call {
+  int (*func)(struct zetta_call *);
+  libzfs_handle_t *libhandle;
+  // Resolved with the interpreter lock held, NULL for private handles:
+  zetta_lib_lock_t *lock;
+  zfs_handle_t *zfs_handle;
+  zfs_handle_t *other_handle;
+  zfs_handle_t *result;
+  char name[ZFS_MAXNAMELEN];
+  int flags;
+  void *data;
+  int ret;
+  // Operation name for LibZfs.stats, the name of func:
+  const char *op;
+  // Copy of the libhandle error state, taken while the handle is owned:
+  int error;
+  char error_action[1024];
+  char error_description[1024];
+} zetta_call_t;
+
+// Run the call on a libzfs handle already owned by the current thread:
+static void *zetta_call_exec(void *ptr)
 {
-  zpool_handle_t *zpool_handle;
-  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+  zetta_call_t *call = (zetta_call_t *)ptr;
+  uint64_t start = zetta_stats_begin();
+
+  call->ret = call->func(call);
+  call->error = libzfs_errno(call->libhandle);
+  if (call->ret != 0 && call->error != 0) {
+    strncpy(call->error_action, libzfs_error_action(call->libhandle), sizeof(call->error_action) - 1);
+    strncpy(call->error_description, libzfs_error_description(call->libhandle), sizeof(call->error_description) - 1);
+  }
+  zetta_stats_end(call->op, start, call->ret != 0);
+  return NULL;
+}
+
+static void *zetta_call_run(void *ptr)
+{
+  zetta_call_t *call = (zetta_call_t *)ptr;
 
-  return ULL2NUM(zpool_get_prop_int(zpool_handle, ZPOOL_PROP_VERSION, NULL));
+  if (call->lock != NULL) {
+    pthread_mutex_lock(&call->lock->mutex);
+  }
+  zetta_call_exec(call);
+  if (call->lock != NULL) {
+    pthread_mutex_unlock(&call->lock->mutex);
+  }
+  return NULL;
 }
 
-static int zetta_pool_iter_f(zpool_handle_t *handle, void *klass)
+// Unblocking function: a ZFS ioctl must not be interrupted half the way (an
+// EINTR would be reported as a failure of an operation which could have
+// actually succeeded), hence Thread#kill/raise will be delivered as soon as
+// the libzfs call returns.
+static void zetta_call_ubf(void *ptr)
 {
-  rb_yield(Data_Wrap_Struct((VALUE)klass, 0, zpool_close, handle));
-  return 0;
 }
 
+// Run func(data) with the interpreter lock released, when possible, using
+// the given unblocking function:
+static void zetta_lib_without_gvl_ubf(void *(*func)(void *), void *data, void (*ubf)(void *), void *ubf_data)
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  rb_thread_call_without_gvl(func, data, ubf, ubf_data);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  rb_thread_blocking_region((rb_blocking_function_t *)func, data, ubf, ubf_data);
+#else
+  func(data);
+#endif
+}
+
+static void zetta_lib_without_gvl(void *(*func)(void *), void *data)
+{
+  zetta_lib_without_gvl_ubf(func, data, zetta_call_ubf, data);
+}
+
+static void zetta_call_init_op(zetta_call_t *call, int (*func)(zetta_call_t *), const char *op, libzfs_handle_t *libhandle)
+{
+  memset(call, 0, sizeof(zetta_call_t));
+  call->func = func;
+  call->op = op;
+  call->libhandle = libhandle;
+  call->lock = zetta_lib_lock_for(libhandle);
+}
+
+#define zetta_call_init(call, func, libhandle) zetta_call_init_op(call, func, #func, libhandle)
+
+// Ruby strings cannot be safely accessed once the interpreter lock has been
+// released, so dataset names are copied into the call itself:
+static void zetta_call_set_name(zetta_call_t *call, VALUE name)
+{
+  if (RSTRING_LEN(name) >= (long)sizeof(call->name)) {
+    rb_raise(cZfsNameTooLongError, "%s: dataset name is too long", StringValuePtr(name));
+  }
+  memcpy(call->name, RSTRING_PTR(name), RSTRING_LEN(name));
+  call->name[RSTRING_LEN(name)] = '\0';
+}
+
+// Calls which can be stopped safely, (i.e. by ending their input stream),
+// give their own unblocking function:
+static int zetta_call_blocking_ubf(zetta_call_t *call, void (*ubf)(void *), void *ubf_data)
+{
+  call->ret = -1;
+  call->error = 0;
+  call->error_action[0] = '\0';
+  call->error_description[0] = '\0';
+
+  zetta_lib_without_gvl_ubf(zetta_call_run, call, ubf, ubf_data);
+  return call->ret;
+}
+
+static int zetta_call_blocking(zetta_call_t *call)
+{
+  return zetta_call_blocking_ubf(call, zetta_call_ubf, call);
+}
+
+NORETURN(static VALUE zetta_call_error_exception(zetta_call_t *call));
+
+/*
+ * Raise the proper Ruby error for a failed blocking call, using the error
+ * state saved by zetta_call_blocking.
+ */
+static VALUE zetta_call_error_exception(zetta_call_t *call)
+{
+  rb_raise(
+    zetta_lib_select_error(call->error),
+    "%s: %s", call->error_action, call->error_description);
+}
+
+// We have to merge alloc and init here because we want to allocate the space
+// for the C data structure, but we also need the arguments passed to
+// initialize to do so.
+//
+// FIXME: I'm still not sure this is the right way to do it!
 /*
  *
- * Document-method: Zpool#each
+ * Document-class: Zpool
  *
- * call-seq:
- *   Zpool.each {|zpool| # ... }  => nil. Iterator.
- *   Zpool.each(@zlib) {|zpool| # ... }  => nil. Iterator.
+ * <code>Zpool</code> provides access to ZFS storage pools.
+ *
+ * In adition to the expected zpool initialization, this class provides
+ * facilities to iterate over all the storage pools on the system.
  *
- * Iterates over all the pools defined in the system.
+ *    @zlib = LibZfs.new
+ *    @zpool = Zpool.new('pool_name', @zlib)
  *
  *    Zpool.each do |zpool|
  *      # access to each zpool instance
  *    end
  *
+ */
+
+static int zetta_pool_open_call(zetta_call_t *call)
+{
+  call->data = zpool_open_canfail(call->libhandle, call->name);
+  return ( call->data == NULL ) ? -1 : 0;
+}
+
+/*
+ *
+ * Document-method: Zpool#new
+ *
+ * call-seq:
+ *   Zpool.new('pool_name')  => object
+ *   Zpool.new(:pool_name)  => object
+ *   Zpool.new('pool_name', @zlib)  => object
+ *   Zpool.new(:pool_name, @zlib)  => object
+ *
+ *
+ * Zpool initializer.
+ * Raise <code>ArgumentError</code> when <code>pool_name</code> is not given.
+ * Raise <code>TypeError</code> when <code>pool_name</code> is given and it is
+ * not a <code>String</code> or <code>Symbol</code>.
  * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
  * is not an instance of <code>LibZfs</code>.
+ * Raise <code>ZfsError::NoentError</code> when the ZFS storage pool does not
+ * exist.
  *
  */
-static VALUE zetta_pool_iter(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_pool_new(int argc, VALUE *argv, VALUE klass)
 {
-  VALUE libzfs_handle;
-
+  VALUE pool_name, libzfs_handle, zpool;
   libzfs_handle_t *libhandle;
+  zetta_call_t call;
 
-  libzfs_handle = (argc == 0) ? zetta_lib_get_handle() : argv[0];
+  if(argc < 1) {
+    rb_raise(rb_eArgError, "Zpool name is required.");
+  }
+
+  pool_name = argv[0];
+
+  if (TYPE(pool_name)!=T_STRING && TYPE(pool_name)!=T_SYMBOL) {
+    rb_raise(rb_eTypeError, "Zpool name must be either a string or a symbol.");
+  }
+
+  // If name is a symbol, get the C string:
+  if(SYMBOL_P(pool_name)) {
+    pool_name = rb_funcall(pool_name, rb_intern("to_s"), 0);
+  }
+
+  libzfs_handle = (argc == 1) ? zetta_lib_get_handle() : argv[1];
 
   if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
     rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
@@ -591,887 +1078,7312 @@ static VALUE zetta_pool_iter(int argc, VALUE *argv, VALUE klass)
 
   Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
 
-  zpool_iter(libhandle, zetta_pool_iter_f, (void *)klass);
+  zpool = zetta_handle_cache_get(libhandle, 1, pool_name);
+  if(!NIL_P(zpool)) {
+    return zpool;
+  }
 
-  return Qnil;
+  zetta_call_init_op(&call, zetta_pool_open_call, "zetta_pool_open", libhandle);
+  zetta_call_set_name(&call, pool_name);
+  if(zetta_call_blocking(&call) == 0) {
+    return zetta_handle_cache_put(libhandle, 1, pool_name,
+      Data_Wrap_Struct(klass, 0, zpool_close, (zpool_handle_t *)call.data));
+  }
+  // Raise exception when cannot get a proper Zpool handle:
+  zetta_call_error_exception(&call);
 }
 
-// static VALUE zetta_pool_create(VALUE libzfs_handle, VALUE name, VALUE vdevs, VALUE altroot)
-// {
-//   libzfs_handle_t *libhandle;
-//   nvlist_t *vdevs = NULL;
-//   Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
-//
-//   return INT2NUM(zpool_create(libzfs_handle, StringValuePtr(name), vdev_list, StringValuePtr(altroot)));
-// }
-
-// FIXME: Doesn't appear to work?  Maybe I actually need to offline it before
-// I can destroy?  If so, that's something for the higher level Ruby library.
-// static VALUE zetta_pool_destroy(VALUE self)
-// {
-//   zpool_handle_t *zpool_handle;
-//   Data_Get_Struct(self, zpool_handle_t, zpool_handle);
-//
-//   return INT2NUM(zpool_destroy(zpool_handle));
-// }
-
 /*
- * ZFS interface
+ * call-seq:
+ *   @zpool.libzfs_handle  => object, zpool_handle
+ *
+ * Return <code>zpool_handle</code> associated with a <code>Zpool</code>
+ * instance.
+ *
  */
+static VALUE zetta_pool_get_handle(VALUE self)
+{
+  VALUE klass = rb_const_get(rb_cObject, rb_intern("LibZfs"));
+  libzfs_handle_t *handle;
+  zpool_handle_t *zpool_handle;
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  handle = zpool_get_handle(zpool_handle);
+
+  // Note that we don't need to free the handle here, because it's just a
+  // copy of one that's already in the garbage collector.
+  return Data_Wrap_Struct(klass, 0, 0, handle);
+}
 
 /*
  * call-seq:
- *   @zfs.libzfs_handle  => object, zfs_handle
+ *   @zpool.name  => string, zpool name.
  *
- * Return <code>zfs_handle</code> associated with a <code>ZFS</code>
- * instance.
+ * Return current <code>Zpool</code> instance name.
+ *
+ * The <code>name</code> pointer is stored in the <code>handle</code>, hence
+ * we don't need to call <code>zpool.get('name')</code>. This method is
+ * more effective.
  *
  */
-static VALUE zetta_fs_get_handle(VALUE self)
+static VALUE zetta_pool_get_name(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  return rb_str_new2(zpool_get_name(zpool_handle));
+}
+
+// Raw numeric value of a pool property, Nil for string properties:
+static VALUE zetta_pool_prop_int(zpool_handle_t *zpool_handle, int zpool_prop)
+{
+  uint64_t value, start;
+
+  if (zpool_prop == ZPROP_INVAL || zpool_prop_get_type(zpool_prop) == PROP_TYPE_STRING) {
+    return Qnil;
+  }
+  start = zetta_stats_begin();
+  zetta_lib_lock(zpool_get_handle(zpool_handle));
+  value = zpool_get_prop_int(zpool_handle, zpool_prop, NULL);
+  zetta_lib_unlock(zpool_get_handle(zpool_handle));
+  zetta_stats_end("zetta_pool_get_prop_int", start, 0);
+  return ULL2NUM(value);
+}
+
+// Value of the given zpool property, as returned by @zpool.get:
+static VALUE zetta_pool_prop_value(zpool_handle_t *zpool_handle, int zpool_prop)
+{
+  // FIXME: This needs to take into consideration the possibility
+  // of unavailable zpools.
+  if(zpool_prop == ZPOOL_PROP_GUID || zpool_prop == ZPOOL_PROP_VERSION)
+  {
+    return zetta_pool_prop_int(zpool_handle, zpool_prop);
+  } else {
+    char propval[ZPOOL_MAXPROPLEN];
+    int ret;
+
+    zetta_lib_lock(zpool_get_handle(zpool_handle));
+    ret = zpool_get_prop(zpool_handle, zpool_prop, propval, sizeof (propval), NULL);
+    zetta_lib_unlock(zpool_get_handle(zpool_handle));
+    if ( ret != 0 ) {
+      return Qnil;
+    }
+    return ( strcmp( propval, "-" ) == 0 ) ? Qnil: rb_str_new2(propval);
+  }
+}
+
+
+// Literal value of a pool property: exact integers for numeric properties,
+// the same strings than zetta_pool_prop_value for everything else:
+static VALUE zetta_pool_prop_literal(zpool_handle_t *zpool_handle, int zpool_prop)
+{
+  if (zpool_prop != ZPROP_INVAL && zpool_prop_get_type(zpool_prop) == PROP_TYPE_NUMBER) {
+    return zetta_pool_prop_int(zpool_handle, zpool_prop);
+  }
+  return zetta_pool_prop_value(zpool_handle, zpool_prop);
+}
+
+/*
+ * call-seq:
+ *   @zpool.get('propname')  => string/integer, zpool property value or Nil.
+ *
+ * Given a zpool property name, return its value.
+ * Values for properties +version+ and +guid+ will be integers. Any other
+ * property value will be a string. For disk space related properties, this
+ * string will be nicely formatted as in <code>ZfsLib.nicenum</code>.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ *
+ * TODO:
+ *
+ *  - Ensure that the given property name is a valid zpool property.
+ *
+ */
+static VALUE zetta_pool_get_prop(VALUE self, VALUE name)
+{
+  zpool_handle_t *zpool_handle;
+  VALUE value;
+
+  if( TYPE(name) != T_STRING )
+  {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+
+  char *propname = STR2CSTR(name);
+
+  int zpool_prop = zpool_name_to_prop(propname);
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  if (zpool_prop == ZPROP_INVAL) {
+    return Qnil;
+  }
+  value = zetta_prop_cache_get(self, name);
+  if (value != Qundef) {
+    return value;
+  }
+  return zetta_prop_cache_set(self, name, zetta_pool_prop_value(zpool_handle, zpool_prop));
+}
+
+/*
+ * call-seq:
+ *   @zpool.get_int('propname')  => integer, raw zpool property value or Nil.
+ *
+ * Given a numeric zpool property name, return its exact value, (i.e. bytes
+ * for +size+ or +free+), without formatting it into a String. Index
+ * properties, (like +failmode+), return their numeric index. Unknown and
+ * string properties return Nil.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ *
+ */
+static VALUE zetta_pool_get_int(VALUE self, VALUE name)
+{
+  zpool_handle_t *zpool_handle;
+
+  if( TYPE(name) != T_STRING )
+  {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  return zetta_pool_prop_int(zpool_handle, zpool_name_to_prop(StringValuePtr(name)));
+}
+
+static VALUE zetta_pool_props_many(VALUE self, VALUE names, int literal)
+{
+  zpool_handle_t *zpool_handle;
+  VALUE props, value;
+  long i;
+
+  if( TYPE(names) != T_ARRAY )
+  {
+    rb_raise(rb_eTypeError, "Property names must be an array of strings.");
+  }
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  props = rb_hash_new();
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    VALUE name = rb_ary_entry(names, i);
+    int zpool_prop;
+
+    if( TYPE(name) != T_STRING )
+    {
+      rb_raise(rb_eTypeError, "Property names must be an array of strings.");
+    }
+    zpool_prop = zpool_name_to_prop(StringValuePtr(name));
+    if (zpool_prop == ZPROP_INVAL) {
+      rb_hash_aset(props, name, Qnil);
+    } else if (literal) {
+      rb_hash_aset(props, name, zetta_pool_prop_literal(zpool_handle, zpool_prop));
+    } else if ((value = zetta_prop_cache_get(self, name)) != Qundef) {
+      rb_hash_aset(props, name, value);
+    } else {
+      rb_hash_aset(props, name,
+        zetta_prop_cache_set(self, name, zetta_pool_prop_value(zpool_handle, zpool_prop)));
+    }
+  }
+  return props;
+}
+
+/*
+ * call-seq:
+ *   @zpool.get_many(['propname', ...])  => Hash, {'propname' => value}
+ *   @zpool.get_many(['propname', ...], :literal => true)  => Hash, {'propname' => value}
+ *
+ * Given an Array of zpool property names, return a Hash with the value of
+ * each one of them, in a single call. Values are the same returned by
+ * <code>@zpool.get</code>: integers for +version+ and +guid+, strings
+ * for everything else, and Nil for unknown or unavailable properties.
+ *
+ * With <code>:literal</code>, numeric properties are exact integers, (the
+ * same returned by <code>@zpool.get_int</code>), instead of formatted
+ * strings. Literal values are never cached.
+ *
+ * Raise <code>TypeError</code> when <code>propnames</code> is not an
+ * <code>Array</code> of <code>String</code>.
+ *
+ */
+static VALUE zetta_pool_get_many(int argc, VALUE *argv, VALUE self)
+{
+  int literal = zetta_prop_literal_option(&argc, argv);
+
+  if (argc != 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+  }
+  return zetta_pool_props_many(self, argv[0], literal);
+}
+
+typedef struct zetta_props_cb {
+  void *handle;
+  VALUE props;
+  int literal;
+} zetta_props_cb_t;
+
+static int zetta_pool_props_f(int zpool_prop, void *data)
+{
+  zetta_props_cb_t *cb = (zetta_props_cb_t *)data;
+
+  rb_hash_aset(cb->props, rb_str_new2(zpool_prop_to_name(zpool_prop)), cb->literal ?
+    zetta_pool_prop_literal((zpool_handle_t *)cb->handle, zpool_prop) :
+    zetta_pool_prop_value((zpool_handle_t *)cb->handle, zpool_prop));
+  return ZPROP_CONT;
+}
+
+/*
+ * call-seq:
+ *   @zpool.properties  => Hash, {'propname' => value}
+ *   @zpool.properties(:all)  => Hash, {'propname' => value}
+ *   @zpool.properties(['propname', ...])  => Hash, {'propname' => value}
+ *   @zpool.properties(:all, :literal => true)  => Hash, {'propname' => value}
+ *
+ * Return a Hash with the values of all the (non hidden) zpool properties,
+ * walking the zpool property table once. When an Array of property names
+ * is given, this is the same than <code>@zpool.get_many</code>, including
+ * the <code>:literal</code> option.
+ *
+ */
+static VALUE zetta_pool_get_props(int argc, VALUE *argv, VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  zetta_props_cb_t cb;
+  int literal = zetta_prop_literal_option(&argc, argv);
+
+  if (argc > 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+  }
+  if (argc == 1 && TYPE(argv[0]) == T_ARRAY) {
+    return zetta_pool_props_many(self, argv[0], literal);
+  }
+  if (argc == 1 && argv[0] != ID2SYM(rb_intern("all"))) {
+    rb_raise(rb_eArgError, "Properties must be either :all or an array of names.");
+  }
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  cb.handle = zpool_handle;
+  cb.props = rb_hash_new();
+  cb.literal = literal;
+  zprop_iter(zetta_pool_props_f, &cb, B_FALSE, B_FALSE, ZFS_TYPE_POOL);
+
+  return literal ? cb.props : zetta_prop_cache_merge(self, cb.props);
+}
+
+// Property assignment for a blocking call: the name goes into the call, and
+// both are copied out of the Ruby strings, (libzfs refuses values which
+// don't fit anyway):
+typedef struct zetta_prop_set {
+  void *handle;
+  char value[ZFS_MAXPROPLEN];
+} zetta_prop_set_t;
+
+static int zetta_prop_set_init(zetta_call_t *call, zetta_prop_set_t *set, void *handle, VALUE name, VALUE value)
+{
+  if (RSTRING_LEN(name) >= (long)sizeof(call->name) || RSTRING_LEN(value) >= (long)sizeof(set->value)) {
+    return -1;
+  }
+  memcpy(call->name, RSTRING_PTR(name), RSTRING_LEN(name));
+  call->name[RSTRING_LEN(name)] = '\0';
+  memcpy(set->value, RSTRING_PTR(value), RSTRING_LEN(value));
+  set->value[RSTRING_LEN(value)] = '\0';
+  set->handle = handle;
+  call->data = set;
+  return 0;
+}
+
+static int zetta_pool_set_call(zetta_call_t *call)
+{
+  zetta_prop_set_t *set = (zetta_prop_set_t *)call->data;
+
+  return zpool_set_prop((zpool_handle_t *)set->handle, call->name, set->value);
+}
+
+/*
+ * call-seq:
+ *   @zpool.set('propname', "propval")  => Boolean
+ *
+ * Set the given value for the given zpool property.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ * Raise <code>TypeError</code> when <code>proval</code>
+ * is not a <code>String</code>.
+ *
+ */
+static VALUE zetta_pool_set_prop(VALUE self, VALUE propname, VALUE propval)
+{
+  zpool_handle_t *zpool_handle;
+  zetta_prop_set_t set;
+  zetta_call_t call;
+
+  if( TYPE(propname) != T_STRING )
+  {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+
+  if(TYPE(propval) != T_STRING )  // Maybe should also allow !FIXNUM_P(propval)
+  {
+    rb_raise(rb_eTypeError, "Property value must be a string or a number.");
+  }
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  // FIXME: Property might require an integer value, so need to check the type.
+  zetta_call_init_op(&call, zetta_pool_set_call, "zetta_pool_set", zpool_get_handle(zpool_handle));
+  if ( zetta_prop_set_init(&call, &set, zpool_handle, propname, propval) != 0 ||
+       zetta_call_blocking(&call) != 0 ) {
+    return Qfalse;
+  }
+  // The handle has the new value already, (as the kernel formats it):
+  if ( !NIL_P(zetta_prop_cache(self)) && zpool_name_to_prop(call.name) != ZPROP_INVAL ) {
+    zetta_prop_cache_set(self, propname, zetta_pool_prop_value(zpool_handle, zpool_name_to_prop(call.name)));
+  }
+  return Qtrue;
+}
+
+static int zetta_pool_refresh_call(zetta_call_t *call)
+{
+  boolean_t missing;
+
+  return zpool_refresh_stats((zpool_handle_t *)call->data, &missing);
+}
+
+/*
+ * call-seq:
+ *   @zpool.refresh!  => self
+ *
+ * Read again the zpool status and properties from the kernel, and forget
+ * any cached property value.
+ *
+ * Raise <code>ZfsError</code> on failure.
+ *
+ */
+static VALUE zetta_pool_refresh(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  zetta_call_t call;
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  zetta_call_init(&call, zetta_pool_refresh_call, zpool_get_handle(zpool_handle));
+  call.data = zpool_handle;
+  if (zetta_call_blocking(&call) != 0) {
+    zetta_call_error_exception(&call);
+  }
+  return zetta_prop_cache_invalidate(self);
+}
+
+/*
+ * Pool I/O statistics.
+ *
+ * Each sample refreshes the pool configuration and copies the vdev_stat_t
+ * array of every vdev into a flat list, without the interpreter lock. Rates
+ * are computed against the previous sample of the same vdev guid, the same
+ * way than zpool iostat does: the first sample covers the time since the
+ * vdev was opened.
+ */
+
+// Zpool::IOStat, defined at Init_zetta:
+static VALUE cZpoolIOStat = Qnil;
+
+typedef struct zetta_iostat_vdev {
+  uint64_t guid;
+  int depth;
+  char name[ZPOOL_MAXNAMELEN];
+  vdev_stat_t vs;
+} zetta_iostat_vdev_t;
+
+typedef struct zetta_iostat {
+  zpool_handle_t *zpool_handle;
+  VALUE interval;
+  long count;
+  int missing;
+  // Previous and current samples:
+  zetta_iostat_vdev_t *prev;
+  size_t prev_count;
+  size_t prev_size;
+  zetta_iostat_vdev_t *vdevs;
+  size_t vdevs_count;
+  size_t vdevs_size;
+} zetta_iostat_t;
+
+// Name of a child vdev as zpool status shows it: devices by path, (with
+// /dev/dsk/ stripped), anything else as type-id.
+static int zetta_vdev_name(nvlist_t *vdev, char *buf, size_t len)
+{
+  uint64_t id = 0;
+  char *type, *path;
+
+  if (nvlist_lookup_string(vdev, ZPOOL_CONFIG_PATH, &path) == 0) {
+    snprintf(buf, len, "%s", strncmp(path, "/dev/dsk/", 9) == 0 ? path + 9 : path);
+  } else if (nvlist_lookup_string(vdev, ZPOOL_CONFIG_TYPE, &type) == 0) {
+    nvlist_lookup_uint64(vdev, ZPOOL_CONFIG_ID, &id);
+    snprintf(buf, len, "%s-%llu", type, (unsigned long long)id);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// Append the vdev, and its children, to the current sample:
+static int zetta_iostat_collect(zetta_iostat_t *iostat, nvlist_t *vdev, const char *name, int depth)
+{
+  zetta_iostat_vdev_t *item;
+  nvlist_t **children;
+  uint_t nchildren, c;
+  uint64_t *stats;
+  char child_name[ZPOOL_MAXNAMELEN];
+
+  if (nvlist_lookup_uint64_array(vdev, ZPOOL_CONFIG_STATS, &stats, &c) != 0) {
+    return 0;
+  }
+  if (iostat->vdevs_count == iostat->vdevs_size) {
+    size_t size = iostat->vdevs_size ? iostat->vdevs_size * 2 : 8;
+    item = realloc(iostat->vdevs, size * sizeof(zetta_iostat_vdev_t));
+    if (item == NULL) {
+      return -1;
+    }
+    iostat->vdevs = item;
+    iostat->vdevs_size = size;
+  }
+  item = &iostat->vdevs[iostat->vdevs_count++];
+  memset(item, 0, sizeof(zetta_iostat_vdev_t));
+  nvlist_lookup_uint64(vdev, ZPOOL_CONFIG_GUID, &item->guid);
+  item->depth = depth;
+  snprintf(item->name, sizeof(item->name), "%s", name);
+  // Older libzfs versions have shorter vdev_stat_t:
+  c = (c * sizeof(uint64_t) < sizeof(vdev_stat_t)) ? c * sizeof(uint64_t) : sizeof(vdev_stat_t);
+  memcpy(&item->vs, stats, c);
+
+  if (nvlist_lookup_nvlist_array(vdev, ZPOOL_CONFIG_CHILDREN, &children, &nchildren) != 0) {
+    return 0;
+  }
+  for (c = 0; c < nchildren; c++) {
+    if (zetta_vdev_name(children[c], child_name, sizeof(child_name)) != 0) {
+      continue;
+    }
+    if (zetta_iostat_collect(iostat, children[c], child_name, depth + 1) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int zetta_iostat_call(zetta_call_t *call)
+{
+  zetta_iostat_t *iostat = (zetta_iostat_t *)call->data;
+  nvlist_t *config, *vdev_tree;
+  boolean_t missing;
+
+  iostat->vdevs_count = 0;
+  if (zpool_refresh_stats(iostat->zpool_handle, &missing) != 0) {
+    return -1;
+  }
+  iostat->missing = missing;
+  config = zpool_get_config(iostat->zpool_handle, NULL);
+  if (missing || config == NULL || nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &vdev_tree) != 0) {
+    return 0;
+  }
+  return zetta_iostat_collect(iostat, vdev_tree, zpool_get_name(iostat->zpool_handle), 0);
+}
+
+// Counters going backwards, (a vdev reopened, or replaced by another one
+// with the same guid), give a zero rate instead of a huge one:
+static VALUE zetta_iostat_rate(uint64_t now, uint64_t before, double scale)
+{
+  if (now < before) {
+    return INT2FIX(0);
+  }
+  return ULL2NUM((uint64_t)((now - before) * scale + 0.5));
+}
+
+// Take a sample, and return the rates since the previous one:
+static VALUE zetta_iostat_sample(zetta_iostat_t *iostat)
+{
+  zetta_iostat_vdev_t *item, *prev, *swap;
+  const vdev_stat_t *old;
+  vdev_stat_t zero;
+  zetta_call_t call;
+  VALUE records;
+  int64_t tdelta;
+  double scale;
+  size_t i, j;
+
+  zetta_call_init(&call, zetta_iostat_call, zpool_get_handle(iostat->zpool_handle));
+  call.data = iostat;
+  if (zetta_call_blocking(&call) != 0) {
+    if (call.error == 0) {
+      rb_raise(cZfsNoMemoryError, "cannot get I/O statistics: out of memory");
+    }
+    zetta_call_error_exception(&call);
+  }
+  if (iostat->missing) {
+    rb_raise(cZfsNoentError, "cannot open '%s': no such pool", zpool_get_name(iostat->zpool_handle));
+  }
+
+  memset(&zero, 0, sizeof(zero));
+  records = rb_ary_new2(iostat->vdevs_count);
+  for (i = 0; i < iostat->vdevs_count; i++) {
+    item = &iostat->vdevs[i];
+    // Same position first, the vdev tree seldom changes:
+    prev = (i < iostat->prev_count && iostat->prev[i].guid == item->guid) ? &iostat->prev[i] : NULL;
+    for (j = 0; prev == NULL && j < iostat->prev_count; j++) {
+      if (iostat->prev[j].guid == item->guid) prev = &iostat->prev[j];
+    }
+    old = prev ? &prev->vs : &zero;
+    tdelta = item->vs.vs_timestamp - old->vs_timestamp;
+    scale = (tdelta > 0) ? 1000000000.0 / tdelta : 1.0;
+    rb_ary_push(records, rb_obj_freeze(rb_struct_new(cZpoolIOStat,
+      rb_str_new2(item->name),
+      INT2FIX(item->depth),
+      ULL2NUM(item->vs.vs_alloc),
+      ULL2NUM(item->vs.vs_space - item->vs.vs_alloc),
+      zetta_iostat_rate(item->vs.vs_ops[ZIO_TYPE_READ], old->vs_ops[ZIO_TYPE_READ], scale),
+      zetta_iostat_rate(item->vs.vs_ops[ZIO_TYPE_WRITE], old->vs_ops[ZIO_TYPE_WRITE], scale),
+      zetta_iostat_rate(item->vs.vs_bytes[ZIO_TYPE_READ], old->vs_bytes[ZIO_TYPE_READ], scale),
+      zetta_iostat_rate(item->vs.vs_bytes[ZIO_TYPE_WRITE], old->vs_bytes[ZIO_TYPE_WRITE], scale),
+      ULL2NUM(item->vs.vs_read_errors),
+      ULL2NUM(item->vs.vs_write_errors),
+      ULL2NUM(item->vs.vs_checksum_errors))));
+  }
+
+  // The current sample is the previous one from now on:
+  swap = iostat->prev;
+  iostat->prev = iostat->vdevs;
+  iostat->prev_count = iostat->vdevs_count;
+  iostat->vdevs = swap;
+  i = iostat->prev_size;
+  iostat->prev_size = iostat->vdevs_size;
+  iostat->vdevs_size = i;
+  return records;
+}
+
+static VALUE zetta_iostat_loop(VALUE arg)
+{
+  zetta_iostat_t *iostat = (zetta_iostat_t *)arg;
+  VALUE records = Qnil;
+  long n;
+
+  for (n = 0; iostat->count == 0 || n < iostat->count; n++) {
+    if (n > 0) {
+      rb_thread_wait_for(rb_time_interval(iostat->interval));
+    }
+    records = zetta_iostat_sample(iostat);
+    if (!rb_block_given_p()) {
+      return records;
+    }
+    rb_yield(records);
+  }
+  return (iostat->interval == Qnil) ? records : Qnil;
+}
+
+static VALUE zetta_iostat_free(VALUE arg)
+{
+  zetta_iostat_t *iostat = (zetta_iostat_t *)arg;
+
+  free(iostat->prev);
+  free(iostat->vdevs);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   @zpool.iostat  => Array of Zpool::IOStat
+ *   @zpool.iostat(:interval => 5, :count => 10) {|records| # ... }  => nil
+ *   @zpool.iostat(:interval => 5)  => Enumerator
+ *
+ * Equivalent to <code>zpool iostat -v pool [interval [count]]</code>. Each
+ * sample is an Array with one frozen <code>Zpool::IOStat</code> record for
+ * the pool itself, (depth 0), and another one for each of its vdevs, depth
+ * first. <code>read_ops</code>, <code>write_ops</code>,
+ * <code>read_bytes</code> and <code>write_bytes</code> are rates per second
+ * since the previous sample, (since the pool was loaded for the first one);
+ * <code>alloc</code>, <code>free</code> and the error counters are current
+ * values.
+ *
+ * Without <code>:interval</code> a single sample is returned, (or yielded).
+ * With <code>:interval</code> seconds, samples are yielded until
+ * <code>:count</code> of them have been taken, or forever when there is no
+ * <code>:count</code>. An <code>Enumerator</code> is returned when no block
+ * is given.
+ *
+ *    @zpool.iostat(:interval => 1, :count => 5) do |records|
+ *      records.each {|r| puts "#{'  ' * r.depth}#{r.name} #{r.read_ops} #{r.write_ops}" }
+ *    end
+ *
+ * Raise <code>TypeError</code> when <code>:interval</code> is not a positive
+ * number or <code>:count</code> is not a positive integer, and
+ * <code>ZfsError::NoentError</code> when the pool doesn't exist anymore.
+ */
+static VALUE zetta_pool_iostat(int argc, VALUE *argv, VALUE self)
+{
+  zetta_iostat_t iostat;
+  zpool_handle_t *zpool_handle;
+  VALUE options, interval = Qnil, count = Qnil;
+
+  rb_scan_args(argc, argv, "01", &options);
+  if (!NIL_P(options)) {
+    Check_Type(options, T_HASH);
+    interval = rb_hash_aref(options, ID2SYM(rb_intern("interval")));
+    count = rb_hash_aref(options, ID2SYM(rb_intern("count")));
+  }
+  if (!NIL_P(interval) && (!rb_obj_is_kind_of(interval, rb_cNumeric) || NUM2DBL(interval) <= 0)) {
+    rb_raise(rb_eTypeError, "interval must be a positive number of seconds");
+  }
+  if (!NIL_P(count) && (!FIXNUM_P(count) || FIX2LONG(count) <= 0)) {
+    rb_raise(rb_eTypeError, "count must be a positive integer");
+  }
+  if (!NIL_P(interval)) {
+    RETURN_ENUMERATOR(self, argc, argv);
+  }
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  memset(&iostat, 0, sizeof(iostat));
+  iostat.zpool_handle = zpool_handle;
+  iostat.interval = interval;
+  // A single sample unless there is an interval:
+  iostat.count = NIL_P(interval) ? 1 : (NIL_P(count) ? 0 : FIX2LONG(count));
+
+  return rb_ensure(zetta_iostat_loop, (VALUE)&iostat, zetta_iostat_free, (VALUE)&iostat);
+}
+
+/*
+ * Pool vdev tree.
+ *
+ * The vdev tree of the pool configuration is decoded once into a flat array
+ * of nodes, breadth first so the children of any node are contiguous, and
+ * kept while the configuration of the zpool handle doesn't change, (that is,
+ * until the next zpool_refresh_stats). Ruby objects are only created for the
+ * nodes which are accessed.
+ */
+
+// Zpool::Vdev, defined at Init_zetta:
+static VALUE cZpoolVdev = Qnil;
+
+typedef struct zetta_vdev_node {
+  nvlist_t *nvl;              // only valid while decoding
+  uint32_t type;              // offsets into the strings buffer
+  uint32_t path;
+  uint32_t name;
+  uint32_t depth;
+  uint64_t guid;
+  uint64_t state;
+  uint64_t aux;
+  uint64_t read_errors;
+  uint64_t write_errors;
+  uint64_t checksum_errors;
+  size_t first_child;
+  size_t nchildren;
+} zetta_vdev_node_t;
+
+typedef struct zetta_vdev_tree {
+  // Configuration the tree was decoded from, (compared, never dereferenced):
+  nvlist_t *config;
+  uint64_t timestamp;
+  zetta_vdev_node_t *nodes;
+  size_t count;
+  char *strings;
+  size_t strings_len;
+  size_t strings_size;
+} zetta_vdev_tree_t;
+
+// Zpool::Vdev instances just point to a node of the tree:
+typedef struct zetta_vdev {
+  VALUE tree;
+  size_t index;
+} zetta_vdev_t;
+
+static void zetta_vdev_tree_free(zetta_vdev_tree_t *tree)
+{
+  free(tree->nodes);
+  free(tree->strings);
+  free(tree);
+}
+
+static void zetta_vdev_mark(zetta_vdev_t *vdev)
+{
+  rb_gc_mark(vdev->tree);
+}
+
+// Copy the string into the tree, and return its offset, (0 is the empty one):
+static uint32_t zetta_vdev_tree_string(zetta_vdev_tree_t *tree, const char *str)
+{
+  size_t len = strlen(str) + 1, size;
+  char *strings;
+
+  if (len == 1 && tree->strings_len > 0) {
+    return 0;
+  }
+  if (tree->strings_len + len > tree->strings_size) {
+    size = tree->strings_size ? tree->strings_size : 256;
+    while (tree->strings_len + len > size) size *= 2;
+    if ((strings = realloc(tree->strings, size)) == NULL) {
+      rb_raise(cZfsNoMemoryError, "cannot decode the vdev tree: out of memory");
+    }
+    tree->strings = strings;
+    tree->strings_size = size;
+  }
+  memcpy(tree->strings + tree->strings_len, str, len);
+  tree->strings_len += len;
+  return (uint32_t)(tree->strings_len - len);
+}
+
+static int zetta_vdev_tree_decode(zetta_vdev_tree_t *tree, nvlist_t *root, const char *pool_name)
+{
+  zetta_vdev_node_t *node, *nodes;
+  nvlist_t **children;
+  vdev_stat_t *vs;
+  uint64_t *stats;
+  uint_t nchildren, c;
+  char *str, name[ZPOOL_MAXNAMELEN];
+  size_t i, size = 16;
+
+  if ((tree->nodes = calloc(size, sizeof(zetta_vdev_node_t))) == NULL) {
+    return -1;
+  }
+  zetta_vdev_tree_string(tree, "");
+  tree->nodes[0].nvl = root;
+  tree->count = 1;
+
+  // The array is its own queue: children are appended as parents are decoded.
+  for (i = 0; i < tree->count; i++) {
+    node = &tree->nodes[i];
+    if (nvlist_lookup_string(node->nvl, ZPOOL_CONFIG_TYPE, &str) == 0) {
+      node->type = zetta_vdev_tree_string(tree, str);
+    }
+    if (nvlist_lookup_string(node->nvl, ZPOOL_CONFIG_PATH, &str) == 0) {
+      node->path = zetta_vdev_tree_string(tree, str);
+    }
+    if (i == 0) {
+      node->name = zetta_vdev_tree_string(tree, pool_name);
+    } else if (zetta_vdev_name(node->nvl, name, sizeof(name)) == 0) {
+      node->name = zetta_vdev_tree_string(tree, name);
+    }
+    nvlist_lookup_uint64(node->nvl, ZPOOL_CONFIG_GUID, &node->guid);
+    if (nvlist_lookup_uint64_array(node->nvl, ZPOOL_CONFIG_STATS, &stats, &c) == 0 &&
+        c * sizeof(uint64_t) >= offsetof(vdev_stat_t, vs_checksum_errors) + sizeof(uint64_t)) {
+      vs = (vdev_stat_t *)stats;
+      node->state = vs->vs_state;
+      node->aux = vs->vs_aux;
+      node->read_errors = vs->vs_read_errors;
+      node->write_errors = vs->vs_write_errors;
+      node->checksum_errors = vs->vs_checksum_errors;
+      if (i == 0) {
+        tree->timestamp = vs->vs_timestamp;
+      }
+    }
+    if (nvlist_lookup_nvlist_array(node->nvl, ZPOOL_CONFIG_CHILDREN, &children, &nchildren) != 0) {
+      continue;
+    }
+    if (tree->count + nchildren > size) {
+      while (tree->count + nchildren > size) size *= 2;
+      if ((nodes = realloc(tree->nodes, size * sizeof(zetta_vdev_node_t))) == NULL) {
+        return -1;
+      }
+      tree->nodes = nodes;
+      node = &tree->nodes[i];
+    }
+    node->first_child = tree->count;
+    node->nchildren = nchildren;
+    for (c = 0; c < nchildren; c++) {
+      memset(&tree->nodes[tree->count], 0, sizeof(zetta_vdev_node_t));
+      tree->nodes[tree->count].nvl = children[c];
+      tree->nodes[tree->count].depth = node->depth + 1;
+      tree->count++;
+    }
+  }
+  for (i = 0; i < tree->count; i++) {
+    tree->nodes[i].nvl = NULL;
+  }
+  return 0;
+}
+
+// Timestamp of the root vdev stats, which changes with every refresh:
+static uint64_t zetta_vdev_tree_timestamp(nvlist_t *root)
+{
+  uint64_t *stats;
+  uint_t c;
+
+  if (nvlist_lookup_uint64_array(root, ZPOOL_CONFIG_STATS, &stats, &c) != 0 ||
+      c * sizeof(uint64_t) < offsetof(vdev_stat_t, vs_timestamp) + sizeof(uint64_t)) {
+    return 0;
+  }
+  return ((vdev_stat_t *)stats)->vs_timestamp;
+}
+
+static VALUE zetta_vdev_new(VALUE tree, size_t index)
+{
+  zetta_vdev_t *vdev;
+  VALUE self = Data_Make_Struct(cZpoolVdev, zetta_vdev_t, zetta_vdev_mark, -1, vdev);
+
+  vdev->tree = tree;
+  vdev->index = index;
+  return self;
+}
+
+static zetta_vdev_node_t *zetta_vdev_node(VALUE self, zetta_vdev_tree_t **treep)
+{
+  zetta_vdev_t *vdev;
+  zetta_vdev_tree_t *tree;
+
+  Data_Get_Struct(self, zetta_vdev_t, vdev);
+  Data_Get_Struct(vdev->tree, zetta_vdev_tree_t, tree);
+  if (treep != NULL) {
+    *treep = tree;
+  }
+  return &tree->nodes[vdev->index];
+}
+
+/*
+ * call-seq:
+ *   @zpool.vdev_tree  => Zpool::Vdev
+ *
+ * Return the root of the vdev tree of the pool, (as <code>zpool
+ * status</code> shows it), from the configuration read with the last
+ * refresh of the pool. The tree is decoded only once for each configuration,
+ * so the same <code>Zpool::Vdev</code> is returned until
+ * <code>refresh!</code> reads a new one from the kernel:
+ *
+ *    @zpool.refresh!
+ *    @zpool.vdev_tree.each_leaf do |vdev|
+ *      puts vdev.path unless vdev.healthy?
+ *    end
+ *
+ * Raise <code>ZfsError::NoentError</code> when the pool has no
+ * configuration.
+ *
+ */
+static VALUE zetta_pool_vdev_tree(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  zetta_vdev_tree_t *tree;
+  nvlist_t *config, *root;
+  VALUE cached, tree_value;
+  uint64_t start;
+  int ret;
+
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  // The config belongs to the pool handle, (a refresh replaces it), so it's
+  // decoded while owning the libzfs handle:
+  cached = rb_iv_get(self, "@vdev_tree");
+  start = zetta_stats_begin();
+  zetta_lib_lock(zpool_get_handle(zpool_handle));
+  config = zpool_get_config(zpool_handle, NULL);
+  if (config == NULL || nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE, &root) != 0) {
+    zetta_lib_unlock(zpool_get_handle(zpool_handle));
+    zetta_stats_end("zetta_pool_vdev_tree", start, 1);
+    rb_raise(cZfsNoentError, "cannot open '%s': no such pool", zpool_get_name(zpool_handle));
+  }
+
+  if (!NIL_P(cached)) {
+    zetta_vdev_node(cached, &tree);
+    if (tree->config == config && tree->timestamp == zetta_vdev_tree_timestamp(root)) {
+      zetta_lib_unlock(zpool_get_handle(zpool_handle));
+      zetta_stats_end("zetta_pool_vdev_tree", start, 0);
+      return cached;
+    }
+  }
+
+  tree = ALLOC(zetta_vdev_tree_t);
+  memset(tree, 0, sizeof(zetta_vdev_tree_t));
+  tree_value = Data_Wrap_Struct(rb_cObject, 0, zetta_vdev_tree_free, tree);
+  tree->config = config;
+  ret = zetta_vdev_tree_decode(tree, root, zpool_get_name(zpool_handle));
+  zetta_lib_unlock(zpool_get_handle(zpool_handle));
+  zetta_stats_end("zetta_pool_vdev_tree", start, ret != 0);
+  if (ret != 0) {
+    rb_raise(cZfsNoMemoryError, "cannot decode the vdev tree: out of memory");
+  }
+  cached = zetta_vdev_new(tree_value, 0);
+  rb_iv_set(self, "@vdev_tree", cached);
+  return cached;
+}
+
+/*
+ * call-seq:
+ *   vdev.name  => String
+ *
+ * The name <code>zpool status</code> uses for this vdev: the pool name for
+ * the root vdev, the path, (without <code>/dev/dsk/</code>), for devices,
+ * and <i>type-id</i>, (like <code>mirror-0</code>), for anything else.
+ *
+ */
+static VALUE zetta_vdev_get_name(VALUE self)
+{
+  zetta_vdev_tree_t *tree;
+  zetta_vdev_node_t *node = zetta_vdev_node(self, &tree);
+
+  return rb_str_new2(tree->strings + node->name);
+}
+
+/*
+ * call-seq:
+ *   vdev.type  => String
+ *
+ * The vdev type: <code>root</code>, <code>mirror</code>, <code>raidz</code>,
+ * <code>disk</code>, <code>file</code>...
+ *
+ */
+static VALUE zetta_vdev_get_type(VALUE self)
+{
+  zetta_vdev_tree_t *tree;
+  zetta_vdev_node_t *node = zetta_vdev_node(self, &tree);
+
+  return rb_str_new2(tree->strings + node->type);
+}
+
+/*
+ * call-seq:
+ *   vdev.path  => String or nil
+ *
+ * Device path, nil for vdevs which are not devices.
+ *
+ */
+static VALUE zetta_vdev_get_path(VALUE self)
+{
+  zetta_vdev_tree_t *tree;
+  zetta_vdev_node_t *node = zetta_vdev_node(self, &tree);
+
+  return node->path ? rb_str_new2(tree->strings + node->path) : Qnil;
+}
+
+/*
+ * call-seq:
+ *   vdev.guid  => integer
+ *
+ */
+static VALUE zetta_vdev_get_guid(VALUE self)
+{
+  return ULL2NUM(zetta_vdev_node(self, NULL)->guid);
+}
+
+/*
+ * call-seq:
+ *   vdev.state  => integer
+ *
+ * Any of the constants defined at <code>ZfsConsts::State::Vdev</code>.
+ *
+ */
+static VALUE zetta_vdev_get_state(VALUE self)
+{
+  return ULL2NUM(zetta_vdev_node(self, NULL)->state);
+}
+
+/*
+ * call-seq:
+ *   vdev.aux  => integer
+ *
+ * The reason for the current state, (<code>vdev_aux_t</code>), 0 when
+ * there is none.
+ *
+ */
+static VALUE zetta_vdev_get_aux(VALUE self)
+{
+  return ULL2NUM(zetta_vdev_node(self, NULL)->aux);
+}
+
+/*
+ * call-seq:
+ *   vdev.healthy?  => true or false
+ *
+ */
+static VALUE zetta_vdev_is_healthy(VALUE self)
+{
+  return (zetta_vdev_node(self, NULL)->state == VDEV_STATE_HEALTHY) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   vdev.errors  => [read_errors, write_errors, checksum_errors]
+ *
+ */
+static VALUE zetta_vdev_get_errors(VALUE self)
+{
+  zetta_vdev_node_t *node = zetta_vdev_node(self, NULL);
+
+  return rb_ary_new3(3, ULL2NUM(node->read_errors), ULL2NUM(node->write_errors),
+    ULL2NUM(node->checksum_errors));
+}
+
+/*
+ * call-seq:
+ *   vdev.depth  => integer
+ *
+ * 0 for the root vdev, 1 for its children, and so on.
+ *
+ */
+static VALUE zetta_vdev_get_depth(VALUE self)
+{
+  return INT2FIX(zetta_vdev_node(self, NULL)->depth);
+}
+
+/*
+ * call-seq:
+ *   vdev.leaf?  => true or false
+ *
+ */
+static VALUE zetta_vdev_is_leaf(VALUE self)
+{
+  return (zetta_vdev_node(self, NULL)->nchildren == 0) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   vdev.children  => Array of Zpool::Vdev
+ *
+ */
+static VALUE zetta_vdev_get_children(VALUE self)
+{
+  zetta_vdev_t *vdev;
+  zetta_vdev_node_t *node = zetta_vdev_node(self, NULL);
+  VALUE children = rb_ary_new2(node->nchildren);
+  size_t i;
+
+  Data_Get_Struct(self, zetta_vdev_t, vdev);
+  for (i = 0; i < node->nchildren; i++) {
+    rb_ary_push(children, zetta_vdev_new(vdev->tree, node->first_child + i));
+  }
+  return children;
+}
+
+static void zetta_vdev_yield_leaves(VALUE tree_value, zetta_vdev_tree_t *tree, size_t index)
+{
+  zetta_vdev_node_t *node = &tree->nodes[index];
+  size_t i;
+
+  if (node->nchildren == 0) {
+    rb_yield(zetta_vdev_new(tree_value, index));
+    return;
+  }
+  for (i = 0; i < node->nchildren; i++) {
+    zetta_vdev_yield_leaves(tree_value, tree, node->first_child + i);
+  }
+}
+
+/*
+ * call-seq:
+ *   vdev.each_leaf {|vdev| # ... }  => nil. Iterator.
+ *   vdev.each_leaf  => Enumerator
+ *
+ * Iterates, depth first, over the devices below this vdev, (or the vdev
+ * itself when it is a device). An <code>Enumerator</code> is returned when
+ * no block is given.
+ *
+ */
+static VALUE zetta_vdev_each_leaf(VALUE self)
+{
+  zetta_vdev_t *vdev;
+  zetta_vdev_tree_t *tree;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  Data_Get_Struct(self, zetta_vdev_t, vdev);
+  zetta_vdev_node(self, &tree);
+  zetta_vdev_yield_leaves(vdev->tree, tree, vdev->index);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   @zpool.guid  => integer, zpool guid.
+ *
+ * Return current <code>Zpool</code> instance guid property.
+ *
+ * Actually, this is the equivalent to <code>zpool.get_prop('guid')</code>.
+ * This method is here just because it was defined at the old version of this
+ * library, and will be removed when "method_missing" is implemented.
+ *
+ */
+static VALUE zetta_pool_get_guid(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  return zetta_pool_prop_int(zpool_handle, ZPOOL_PROP_GUID);
+}
+
+static VALUE zetta_pool_get_space_used(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  uint64_t used, start;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  start = zetta_stats_begin();
+  zetta_lib_lock(zpool_get_handle(zpool_handle));
+  used = zpool_get_space_used(zpool_handle);
+  zetta_lib_unlock(zpool_get_handle(zpool_handle));
+  zetta_stats_end("zetta_pool_get_space_used", start, 0);
+  return ULL2NUM(used);
+}
+
+static VALUE zetta_pool_get_space_total(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  uint64_t total, start;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  start = zetta_stats_begin();
+  zetta_lib_lock(zpool_get_handle(zpool_handle));
+  total = zpool_get_space_total(zpool_handle);
+  zetta_lib_unlock(zpool_get_handle(zpool_handle));
+  zetta_stats_end("zetta_pool_get_space_total", start, 0);
+  return ULL2NUM(total);
+}
+
+/*
+ * call-seq:
+ *   @zpool.state  => integer, zpool state.
+ *
+ * Return current <code>Zpool</code> instance state as an integer.
+ *
+ * The value is one of the constants defined at module
+ * <code>ZfsConsts::State::Pool</code>.
+ *
+ */
+static VALUE zetta_pool_get_state(VALUE self)
+{
+  VALUE state = Qnil;
+
+  VALUE cZfsConsts = rb_const_get(rb_cObject, rb_intern("ZfsConsts"));
+  VALUE mState = rb_const_get(cZfsConsts, rb_intern("State"));
+  VALUE mPoolState = rb_const_get(mState, rb_intern("Pool"));
+  zpool_handle_t *zpool_handle;
+  uint64_t start;
+  int pool_state;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  start = zetta_stats_begin();
+  zetta_lib_lock(zpool_get_handle(zpool_handle));
+  pool_state = zpool_get_state(zpool_handle);
+  zetta_lib_unlock(zpool_get_handle(zpool_handle));
+  zetta_stats_end("zetta_pool_get_state", start, 0);
+
+  switch (pool_state) {
+    case POOL_STATE_ACTIVE: state = rb_const_get(mPoolState, rb_intern("ACTIVE")); break;
+    case POOL_STATE_EXPORTED: state = rb_const_get(mPoolState, rb_intern("EXPORTED")); break;
+    case POOL_STATE_DESTROYED: state = rb_const_get(mPoolState, rb_intern("DESTROYED")); break;
+    case POOL_STATE_SPARE: state = rb_const_get(mPoolState, rb_intern("SPARE")); break;
+#ifdef SPA_VERSION_10
+    case POOL_STATE_L2CACHE: state = rb_const_get(mPoolState, rb_intern("L2CACHE")); break;
+#endif
+    case POOL_STATE_UNINITIALIZED: state = rb_const_get(mPoolState, rb_intern("UNINITIALIZED")); break;
+    case POOL_STATE_UNAVAIL: state = rb_const_get(mPoolState, rb_intern("UNAVAIL")); break;
+    case POOL_STATE_POTENTIALLY_ACTIVE: state = rb_const_get(mPoolState, rb_intern("POTENTIALLY_ACTIVE")); break;
+    default: state = rb_const_get(mPoolState, rb_intern("UNKNOWN"));
+  }
+
+  return state;
+}
+
+/*
+ * call-seq:
+ *   @zpool.health_status  => integer, zpool health status.
+ *
+ * Return current <code>Zpool</code> instance health status as an integer.
+ *
+ * The value is one of the constants defined at module
+ * <code>ZfsConsts::HealthStatus::Pool</code>.
+ *
+ */
+static VALUE zetta_pool_get_health_status(VALUE self)
+{
+  VALUE status = Qnil;
+  VALUE cZfsConsts = rb_const_get(rb_cObject, rb_intern("ZfsConsts"));
+  VALUE mHealthStatus = rb_const_get(cZfsConsts, rb_intern("HealthStatus"));
+
+  char *msgid;
+  zpool_handle_t *zpool_handle;
+  uint64_t start;
+  int pool_status;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  start = zetta_stats_begin();
+  zetta_lib_lock(zpool_get_handle(zpool_handle));
+  pool_status = zpool_get_status(zpool_handle, &msgid);
+  zetta_lib_unlock(zpool_get_handle(zpool_handle));
+  zetta_stats_end("zetta_pool_get_health_status", start, 0);
+
+  switch (pool_status) {
+    case ZPOOL_STATUS_CORRUPT_CACHE: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_CACHE")); break;
+    case ZPOOL_STATUS_MISSING_DEV_R: status = rb_const_get(mHealthStatus, rb_intern("MISSING_DEV_R")); break;
+    case ZPOOL_STATUS_MISSING_DEV_NR: status = rb_const_get(mHealthStatus, rb_intern("MISSING_DEV_NR")); break;
+    case ZPOOL_STATUS_CORRUPT_LABEL_R: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_LABEL_R")); break;
+    case ZPOOL_STATUS_CORRUPT_LABEL_NR: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_LABEL_NR")); break;
+    case ZPOOL_STATUS_BAD_GUID_SUM: status = rb_const_get(mHealthStatus, rb_intern("BAD_GUID_SUM")); break;
+    case ZPOOL_STATUS_CORRUPT_POOL: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_POOL")); break;
+    case ZPOOL_STATUS_CORRUPT_DATA: status = rb_const_get(mHealthStatus, rb_intern("CORRUPT_DATA")); break;
+    case ZPOOL_STATUS_FAILING_DEV: status = rb_const_get(mHealthStatus, rb_intern("FAILING_DEV")); break;
+    case ZPOOL_STATUS_VERSION_NEWER: status = rb_const_get(mHealthStatus, rb_intern("VERSION_NEWER")); break;
+    case ZPOOL_STATUS_HOSTID_MISMATCH: status = rb_const_get(mHealthStatus, rb_intern("HOSTID_MISMATCH")); break;
+#ifdef SPA_VERSION_11
+    case ZPOOL_STATUS_IO_FAILURE_WAIT: status = rb_const_get(mHealthStatus, rb_intern("IO_FAILURE_WAIT")); break;
+    case ZPOOL_STATUS_IO_FAILURE_CONTINUE: status = rb_const_get(mHealthStatus, rb_intern("IO_FAILURE_CONTINUE")); break;
+#endif
+
+#ifdef SPA_VERSION_14
+    case ZPOOL_STATUS_BAD_LOG: status = rb_const_get(mHealthStatus, rb_intern("BAD_LOG")); break;
+#endif
+
+  // Older than SPA_VERSION, safe:
+    case ZPOOL_STATUS_FAULTED_DEV_R: status = rb_const_get(mHealthStatus, rb_intern("FAULTED_DEV_R")); break;
+    case ZPOOL_STATUS_FAULTED_DEV_NR: status = rb_const_get(mHealthStatus, rb_intern("FAULTED_DEV_NR")); break;
+    case ZPOOL_STATUS_VERSION_OLDER: status = rb_const_get(mHealthStatus, rb_intern("VERSION_OLDER")); break;
+    case ZPOOL_STATUS_RESILVERING: status = rb_const_get(mHealthStatus, rb_intern("RESILVERING")); break;
+    case ZPOOL_STATUS_OFFLINE_DEV: status = rb_const_get(mHealthStatus, rb_intern("OFFLINE_DEV")); break;
+
+#ifdef SPA_VERSION_18
+    case ZPOOL_STATUS_REMOVED_DEV: status = rb_const_get(mHealthStatus, rb_intern("REMOVED_DEV")); break;
+#endif
+
+    case ZPOOL_STATUS_OK: status = rb_const_get(mHealthStatus, rb_intern("OK")); break;
+    default: status = rb_const_get(mHealthStatus, rb_intern("UNKNOWN"));
+  }
+  return status;
+}
+
+/*
+ * call-seq:
+ *   @zpool.version  => integer, zpool version.
+ *
+ * Return current <code>Zpool</code> instance version property.
+ *
+ * Actually, this is the equivalent to <code>zpool.get_prop('version')</code>.
+ *
+ */
+static VALUE zetta_pool_get_version(VALUE self)
+{
+  zpool_handle_t *zpool_handle;
+  Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+
+  return zetta_pool_prop_int(zpool_handle, ZPOOL_PROP_VERSION);
+}
+
+// Zpool handles are collected without the interpreter lock, and yielded
+// once zpool_iter has finished with all the pools:
+typedef struct zetta_pool_list {
+  VALUE klass;
+  zpool_handle_t **handles;
+  size_t count;
+  size_t size;
+  size_t next;
+} zetta_pool_list_t;
+
+static int zetta_pool_iter_f(zpool_handle_t *handle, void *data)
+{
+  zetta_pool_list_t *list = (zetta_pool_list_t *)data;
+
+  if (list->count == list->size) {
+    size_t size = list->size ? list->size * 2 : 8;
+    zpool_handle_t **handles = realloc(list->handles, size * sizeof(zpool_handle_t *));
+    if (handles == NULL) {
+      zpool_close(handle);
+      return -1;
+    }
+    list->handles = handles;
+    list->size = size;
+  }
+  list->handles[list->count++] = handle;
+  return 0;
+}
+
+static int zetta_pool_iter_call(zetta_call_t *call)
+{
+  return zpool_iter(call->libhandle, zetta_pool_iter_f, call->data);
+}
+
+static VALUE zetta_pool_list_yield(VALUE data)
+{
+  zetta_pool_list_t *list = (zetta_pool_list_t *)data;
+
+  while (list->next < list->count) {
+    VALUE zpool = Data_Wrap_Struct(list->klass, 0, zpool_close, list->handles[list->next]);
+    list->next++;
+    rb_yield(zpool);
+  }
+  return Qnil;
+}
+
+// Close the handles which have not been yielded (break, exceptions, ...):
+static VALUE zetta_pool_list_free(VALUE data)
+{
+  zetta_pool_list_t *list = (zetta_pool_list_t *)data;
+
+  while (list->next < list->count) {
+    zpool_close(list->handles[list->next++]);
+  }
+  free(list->handles);
+  return Qnil;
+}
+
+/*
+ *
+ * Document-method: Zpool#each
+ *
+ * call-seq:
+ *   Zpool.each {|zpool| # ... }  => nil. Iterator.
+ *   Zpool.each(@zlib) {|zpool| # ... }  => nil. Iterator.
+ *   Zpool.each  => Enumerator
+ *
+ * Iterates over all the pools defined in the system. An
+ * <code>Enumerator</code> is returned when no block is given.
+ *
+ *    Zpool.each do |zpool|
+ *      # access to each zpool instance
+ *    end
+ *
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ */
+static VALUE zetta_pool_iter(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE libzfs_handle;
+
+  libzfs_handle_t *libhandle;
+  zetta_pool_list_t list;
+  zetta_call_t call;
+
+  RETURN_ENUMERATOR(klass, argc, argv);
+
+  libzfs_handle = (argc == 0) ? zetta_lib_get_handle() : argv[0];
+
+  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
+    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  }
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&list, 0, sizeof(list));
+  list.klass = klass;
+  zetta_call_init(&call, zetta_pool_iter_call, libhandle);
+  call.data = &list;
+  zetta_call_blocking(&call);
+
+  rb_ensure(zetta_pool_list_yield, (VALUE)&list, zetta_pool_list_free, (VALUE)&list);
+
+  return Qnil;
+}
+
+/*
+ * Pool events.
+ *
+ * ZFS on Linux posts pool events, (vdev state changes, I/O and checksum
+ * errors, scrubs, pool history...), into a kernel channel which is read with
+ * zpool_events_next. Each reader has its own cursor into the events kept by
+ * the kernel, which can be positioned by event id with zpool_events_seek.
+ */
+#if defined(HAVE_ZPOOL_EVENTS_NEXT) && defined(HAVE_ZPOOL_EVENTS_SEEK)
+  #define ZETTA_HAVE_EVENTS 1
+#endif
+
+// Zpool::Event, defined at Init_zetta:
+static VALUE cZpoolEvent = Qnil;
+
+#ifdef ZETTA_HAVE_EVENTS
+typedef struct zetta_events {
+  libzfs_handle_t *libhandle;
+  int fd;
+  unsigned flags;
+  nvlist_t *event;
+  int dropped;
+  int ret;
+} zetta_events_t;
+
+static VALUE zetta_nvlist_to_hash(nvlist_t *nvl);
+
+// Ruby value of the pair, Qundef for the types we don't decode:
+static VALUE zetta_nvpair_value(nvpair_t *pair)
+{
+  VALUE values;
+  nvlist_t *nvl, **nvls;
+  int64_t i64, *i64s;
+  uint64_t u64, *u64s;
+  int32_t i32;
+  uint32_t u32;
+  boolean_t bool_value;
+  char *str;
+  uint_t count, i;
+
+  switch (nvpair_type(pair)) {
+    case DATA_TYPE_BOOLEAN:
+      return Qtrue;
+    case DATA_TYPE_BOOLEAN_VALUE:
+      nvpair_value_boolean_value(pair, &bool_value);
+      return bool_value ? Qtrue : Qfalse;
+    case DATA_TYPE_INT32:
+      nvpair_value_int32(pair, &i32);
+      return INT2NUM(i32);
+    case DATA_TYPE_UINT32:
+      nvpair_value_uint32(pair, &u32);
+      return UINT2NUM(u32);
+    case DATA_TYPE_INT64:
+      nvpair_value_int64(pair, &i64);
+      return LL2NUM(i64);
+    case DATA_TYPE_UINT64:
+      nvpair_value_uint64(pair, &u64);
+      return ULL2NUM(u64);
+    case DATA_TYPE_STRING:
+      nvpair_value_string(pair, &str);
+      return rb_obj_freeze(rb_str_new2(str));
+    case DATA_TYPE_NVLIST:
+      nvpair_value_nvlist(pair, &nvl);
+      return zetta_nvlist_to_hash(nvl);
+    case DATA_TYPE_INT64_ARRAY:
+      nvpair_value_int64_array(pair, &i64s, &count);
+      values = rb_ary_new2(count);
+      for (i = 0; i < count; i++) rb_ary_push(values, LL2NUM(i64s[i]));
+      return rb_obj_freeze(values);
+    case DATA_TYPE_UINT64_ARRAY:
+      nvpair_value_uint64_array(pair, &u64s, &count);
+      values = rb_ary_new2(count);
+      for (i = 0; i < count; i++) rb_ary_push(values, ULL2NUM(u64s[i]));
+      return rb_obj_freeze(values);
+    case DATA_TYPE_NVLIST_ARRAY:
+      nvpair_value_nvlist_array(pair, &nvls, &count);
+      values = rb_ary_new2(count);
+      for (i = 0; i < count; i++) rb_ary_push(values, zetta_nvlist_to_hash(nvls[i]));
+      return rb_obj_freeze(values);
+    default:
+      return Qundef;
+  }
+}
+
+static VALUE zetta_nvlist_to_hash(nvlist_t *nvl)
+{
+  VALUE hash = rb_hash_new(), value;
+  nvpair_t *pair = NULL;
+
+  while ((pair = nvlist_next_nvpair(nvl, pair)) != NULL) {
+    if ((value = zetta_nvpair_value(pair)) != Qundef) {
+      rb_hash_aset(hash, rb_str_new2(nvpair_name(pair)), value);
+    }
+  }
+  return rb_obj_freeze(hash);
+}
+
+static void *zetta_events_next(void *ptr)
+{
+  zetta_events_t *events = (zetta_events_t *)ptr;
+
+  events->ret = zpool_events_next(events->libhandle, &events->event, &events->dropped, events->flags, events->fd);
+  return NULL;
+}
+
+// Wait for the next event with the interpreter lock released. The wait is
+// interrupted, (EZFS_INTR), by Thread#kill/raise and signals:
+static int zetta_events_wait(zetta_events_t *events)
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  rb_thread_call_without_gvl(zetta_events_next, events, RUBY_UBF_IO, NULL);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  rb_thread_blocking_region((rb_blocking_function_t *)zetta_events_next, events, RUBY_UBF_IO, NULL);
+#else
+  // Green threads: never block the whole interpreter, poll instead.
+  unsigned flags = events->flags;
+  for (;;) {
+    events->flags |= ZEVENT_NONBLOCK;
+    zetta_events_next(events);
+    events->flags = flags;
+    if (events->ret != 0 || events->event != NULL || (flags & ZEVENT_NONBLOCK)) {
+      break;
+    }
+    rb_thread_wait_for(rb_time_interval(rb_float_new(0.1)));
+  }
+#endif
+  return events->ret;
+}
+
+static VALUE zetta_events_record(nvlist_t *event, int dropped)
+{
+  uint64_t eid = 0;
+  int64_t *tv;
+  uint_t count;
+  char *str;
+  VALUE time = Qnil;
+
+  nvlist_lookup_uint64(event, "eid", &eid);
+  if (nvlist_lookup_int64_array(event, "time", &tv, &count) == 0 && count == 2) {
+    time = rb_time_new(tv[0], tv[1] / 1000);
+  }
+  return rb_obj_freeze(rb_struct_new(cZpoolEvent,
+    ULL2NUM(eid),
+    nvlist_lookup_string(event, "class", &str) == 0 ? rb_str_new2(str) : Qnil,
+    time,
+    nvlist_lookup_string(event, "pool", &str) == 0 ? rb_str_new2(str) : Qnil,
+    INT2FIX(dropped),
+    zetta_nvlist_to_hash(event)));
+}
+
+typedef struct zetta_events_iter {
+  zetta_events_t events;
+  VALUE cursor;
+  const char *pool;
+} zetta_events_iter_t;
+
+static VALUE zetta_events_loop(VALUE arg)
+{
+  zetta_events_iter_t *iter = (zetta_events_iter_t *)arg;
+  zetta_events_t *events = &iter->events;
+  uint64_t eid = ZEVENT_SEEK_START;
+  VALUE record;
+  char *pool;
+
+  if (SYMBOL_P(iter->cursor)) {
+    eid = ZEVENT_SEEK_END;
+  } else if (!NIL_P(iter->cursor)) {
+    eid = NUM2ULL(iter->cursor);
+  }
+  // An event the kernel doesn't keep anymore: start from the oldest one.
+  if (zpool_events_seek(events->libhandle, eid, events->fd) != 0 &&
+      (libzfs_errno(events->libhandle) != EZFS_NOENT ||
+       zpool_events_seek(events->libhandle, ZEVENT_SEEK_START, events->fd) != 0)) {
+    zetta_lib_error_exception(events->libhandle);
+  }
+
+  for (;;) {
+    if (zetta_events_wait(events) != 0) {
+      if (libzfs_errno(events->libhandle) == EZFS_INTR) {
+        rb_thread_check_ints();
+        continue;
+      }
+      zetta_lib_error_exception(events->libhandle);
+    }
+    if (events->event == NULL) {
+      break;
+    }
+    if (iter->pool != NULL &&
+        (nvlist_lookup_string(events->event, "pool", &pool) != 0 || strcmp(pool, iter->pool) != 0)) {
+      nvlist_free(events->event);
+      events->event = NULL;
+      continue;
+    }
+    record = zetta_events_record(events->event, events->dropped);
+    nvlist_free(events->event);
+    events->event = NULL;
+    rb_yield(record);
+  }
+  return Qnil;
+}
+
+static VALUE zetta_events_close(VALUE arg)
+{
+  zetta_events_t *events = &((zetta_events_iter_t *)arg)->events;
+
+  nvlist_free(events->event);
+  close(events->fd);
+  libzfs_fini(events->libhandle);
+  return Qnil;
+}
+#endif
+
+/*
+ * call-seq:
+ *   Zpool.events {|event| # ... }  => nil. Iterator.
+ *   Zpool.events(:cursor => eid, :pool => 'tpool', :follow => false) {|event| # ... }  => nil. Iterator.
+ *   Zpool.events  => Enumerator
+ *
+ * Iterates over the pool events posted by the kernel, as
+ * <code>zpool events -f</code>. Each event is a frozen
+ * <code>Zpool::Event</code> with its id (<code>eid</code>), class, (<code>event_class</code>, like
+ * <code>resource.fs.zfs.statechange</code> or
+ * <code>ereport.fs.zfs.checksum</code>), time, pool name, the number of
+ * events the kernel dropped before this one, and the whole event payload as
+ * a frozen Hash.
+ *
+ * Events are read from the oldest one kept by the kernel, or right after the
+ * <code>:cursor</code> event id, (the <code>eid</code> of the last event
+ * seen, to resume), or only new events with <code>:cursor => :end</code>.
+ * With <code>:follow => false</code> the iteration stops once there are no
+ * more events; otherwise it waits for new ones, with the interpreter lock
+ * released, until the block breaks. Only the events of the given
+ * <code>:pool</code> are yielded, when given.
+ *
+ *    cursor = :end
+ *    Zpool.events(:cursor => cursor) do |event|
+ *      cursor = event.eid
+ *      alert(event.pool, event.payload) if event.event_class =~ /statechange/
+ *    end
+ *
+ * Raise <code>NotImplementedError</code> when the libzfs version has no
+ * event channel, (anything but ZFS on Linux), and <code>TypeError</code> for
+ * invalid options.
+ *
+ */
+static VALUE zetta_pool_events(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE options, cursor = Qnil, pool = Qnil, follow = Qtrue;
+#ifdef ZETTA_HAVE_EVENTS
+  zetta_events_iter_t iter;
+#endif
+
+  rb_scan_args(argc, argv, "01", &options);
+  if (!NIL_P(options)) {
+    Check_Type(options, T_HASH);
+    cursor = rb_hash_aref(options, ID2SYM(rb_intern("cursor")));
+    pool = rb_hash_aref(options, ID2SYM(rb_intern("pool")));
+    if (rb_funcall(options, rb_intern("has_key?"), 1, ID2SYM(rb_intern("follow")))) {
+      follow = rb_hash_aref(options, ID2SYM(rb_intern("follow")));
+    }
+  }
+  if (!NIL_P(cursor) && cursor != ID2SYM(rb_intern("end")) &&
+      (!rb_obj_is_kind_of(cursor, rb_cInteger) || RTEST(rb_funcall(cursor, rb_intern("<"), 1, INT2FIX(0))))) {
+    rb_raise(rb_eTypeError, "cursor must be an event id or :end");
+  }
+  if (SYMBOL_P(pool)) {
+    pool = rb_sym_to_s(pool);
+  }
+  if (!NIL_P(pool)) {
+    Check_Type(pool, T_STRING);
+  }
+
+  RETURN_ENUMERATOR(klass, argc, argv);
+
+#ifdef ZETTA_HAVE_EVENTS
+  memset(&iter, 0, sizeof(iter));
+  iter.cursor = cursor;
+  iter.pool = NIL_P(pool) ? NULL : StringValueCStr(pool);
+  iter.events.flags = RTEST(follow) ? ZEVENT_NONE : ZEVENT_NONBLOCK;
+  // A handle of its own: the wait can last forever.
+  if ((iter.events.libhandle = libzfs_init()) == NULL) {
+    rb_raise(cZfsNoMemoryError, "cannot get events: out of memory");
+  }
+  if ((iter.events.fd = open(ZFS_DEV, O_RDWR)) == -1) {
+    libzfs_fini(iter.events.libhandle);
+    rb_sys_fail(ZFS_DEV);
+  }
+  return rb_ensure(zetta_events_loop, (VALUE)&iter, zetta_events_close, (VALUE)&iter);
+#else
+  (void)follow;
+  rb_raise(rb_eNotImpError, "Pool events are not supported by this libzfs version.");
+#endif
+}
+
+// static VALUE zetta_pool_create(VALUE libzfs_handle, VALUE name, VALUE vdevs, VALUE altroot)
+// {
+//   libzfs_handle_t *libhandle;
+//   nvlist_t *vdevs = NULL;
+//   Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+//
+//   return INT2NUM(zpool_create(libzfs_handle, StringValuePtr(name), vdev_list, StringValuePtr(altroot)));
+// }
+
+// FIXME: Doesn't appear to work?  Maybe I actually need to offline it before
+// I can destroy?  If so, that's something for the higher level Ruby library.
+// static VALUE zetta_pool_destroy(VALUE self)
+// {
+//   zpool_handle_t *zpool_handle;
+//   Data_Get_Struct(self, zpool_handle_t, zpool_handle);
+//
+//   return INT2NUM(zpool_destroy(zpool_handle));
+// }
+
+/*
+ * ZFS interface
+ */
+
+/*
+ * call-seq:
+ *   @zfs.libzfs_handle  => object, zfs_handle
+ *
+ * Return <code>zfs_handle</code> associated with a <code>ZFS</code>
+ * instance.
+ *
+ */
+static VALUE zetta_fs_get_handle(VALUE self)
+{
+  VALUE klass = rb_const_get(rb_cObject, rb_intern("LibZfs"));
+  libzfs_handle_t *handle;
+  zfs_handle_t *zfs_handle;
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  handle = zfs_get_handle(zfs_handle);
+
+  // Note that we don't need to free the handle here, because it's just a
+  // copy of one that's already in the garbage collector.
+  return Data_Wrap_Struct(klass, 0, 0, handle);
+}
+
+/*
+ *
+ * Document-class: ZFS
+ *
+ * <code>ZFS</code> provides access to properties and operations over
+ * ZFS _filesystems_, _snapshots_ or _volumes_, (_ZFS datasets_).
+ *
+ * In adition to the expected dataset initialization, this class provides
+ * facilities to iterate over _root datasets_, and any of their associated
+ * dataset types.
+ *
+ *    [@zlib = LibZfs.new]
+ *    @zfs = ZFS.new('dataset/name', ZfsConsts::Types::FILESYSTEM[, @zlib])
+ *
+ *    @zfs.each_filesystem do |fs|
+ *      # access to all the children filesystems of @zfs dataset.
+ *    end
+ *
+ *    @zfs.each_snapshot do |sp|
+ *      # access to all the snapshots of @zfs dataset.
+ *    end
+ *
+ *    @zfs.each_dependent do |ds|
+ *      # access to all children filesystem, clones and snapshots of
+ *      # @zfs dataset.
+ *    end
+ *
+ * All the iterators return an <code>Enumerator</code> when no block is
+ * given. Leaving the block (<code>break</code>, <code>first(n)</code>, an
+ * exception...) stops the underlying libzfs walk, so no more datasets are
+ * opened after that point:
+ *
+ *    @snap = @zfs.each_snapshot.find { |sp| sp.name =~ /daily/ }
+ *
+ */
+
+static int zetta_fs_open_call(zetta_call_t *call)
+{
+  call->result = zfs_open(call->libhandle, call->name, call->flags);
+  return ( call->result == NULL ) ? -1 : 0;
+}
+
+/*
+ * call-seq:
+ *   @zfs = ZFS.new('dataset/name', ZfsConsts::Types)  => object
+ *   @zfs = ZFS.new('dataset/name', ZfsConsts::Types, @zlib)  => object
+ *
+ *
+ * ZFS initializer. Raises <code>ArgumentError</code> when
+ * <code>dataset_name</code> or <code>dataset_type</code> are not given.
+ *
+ * Raise <code>ArgumentError</code> when <code>dataset_name</code> and
+ * <code>dataset_type</code> are not given.
+ * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
+ * is not a <code>String</code>.
+ * Raise <code>TypeError</code> when <code>dataset_type</code> is given and it
+ * is not an <code>Integer</code>.
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ * TODO: Check that the given type is a valid type
+ *
+ */
+static VALUE zetta_fs_new(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE fs_name, libzfs_handle, types, zfs;
+  libzfs_handle_t *libhandle;
+  zfs_handle_t  *zfs_handle;
+  zetta_call_t call;
+
+  if(argc < 2) {
+    rb_raise(rb_eArgError, "Filesystem name and ZFS Type are required");
+  }
+  fs_name = argv[0];
+  types = argv[1];
+
+  if( TYPE(fs_name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "ZFS Dataset name must be a string.");
+  }
+
+  if( !FIXNUM_P(types) ) {
+    rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
+  }
+
+  libzfs_handle = (argc == 2) ? zetta_lib_get_handle() : argv[2];
+
+  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
+    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  }
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  // A cached instance of a type other than the requested ones is left to
+  // zfs_open, which will raise the proper error:
+  zfs = zetta_handle_cache_get(libhandle, 0, fs_name);
+  if(!NIL_P(zfs)) {
+    Data_Get_Struct(zfs, zfs_handle_t, zfs_handle);
+    if(zfs_get_type(zfs_handle) & NUM2INT(types)) {
+      return zfs;
+    }
+  }
+
+  zetta_call_init_op(&call, zetta_fs_open_call, "zetta_fs_open", libhandle);
+  zetta_call_set_name(&call, fs_name);
+  call.flags = NUM2INT(types);
+  // Prevent Segementation Faults when the given Dataset does not exist and
+  // somebody tries to access to a given property:
+  if(zetta_call_blocking(&call) == 0) {
+    return zetta_handle_cache_put(libhandle, 0, fs_name,
+      Data_Wrap_Struct(klass, 0, zfs_close, call.result));
+  }
+  // Raise exception when cannot get a proper ZFS handle:
+  zetta_call_error_exception(&call);
+}
+
+/*
+ * call-seq:
+ *   @zfs.name  => string, zfs dataset name.
+ *
+ * Return current <code>ZFS</code> instance name.
+ *
+ * The <code>name</code> pointer is stored in the <code>handle</code>, hence
+ * we don't need to call <code>zfs.get('name')</code>. This method is
+ * more effective.
+ *
+ */
+static VALUE zetta_fs_get_name(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  const char *name = NULL;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  name = zfs_get_name(zfs_handle);
+  if(name) {
+    return rb_str_new2(name);
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   @zfs.fs_type  => integer, zfs dataset type constant value
+ *
+ * Return the ZFS Dataset Type for the current <code>ZFS</code> dataset
+ * instance.
+ *
+ */
+static VALUE zetta_fs_get_type(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  return INT2NUM(zfs_get_type(zfs_handle));
+}
+
+// Value of the given zfs dataset property, as returned by @zfs.get:
+static VALUE zetta_fs_prop_value(zfs_handle_t *zfs_handle, int zfs_prop)
+{
+  char propval[ZFS_MAXPROPLEN];
+  int ret;
+
+  if ( zfs_prop == ZPROP_INVAL ) {
+    return Qnil;
+  }
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  ret = zfs_prop_get(zfs_handle, zfs_prop, propval, sizeof(propval), NULL, NULL, 0, B_FALSE);
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+  if ( ret != 0 ) {
+    return Qnil;
+  }
+  return ( strcmp( propval, "-" ) == 0 ) ? Qnil: rb_str_new2(propval);
+}
+
+// Raw numeric value of a dataset property, Nil for string properties:
+static VALUE zetta_fs_prop_int(zfs_handle_t *zfs_handle, int zfs_prop)
+{
+  uint64_t value;
+  int ret;
+
+  if ( zfs_prop == ZPROP_INVAL || zfs_prop_get_type(zfs_prop) == PROP_TYPE_STRING ) {
+    return Qnil;
+  }
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  ret = zfs_prop_get_numeric(zfs_handle, zfs_prop, &value, NULL, NULL, 0);
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+  if ( ret != 0 ) {
+    return Qnil;
+  }
+  return ULL2NUM(value);
+}
+
+// Literal value of a dataset property: exact integers for numeric
+// properties, unformatted strings for everything else:
+static VALUE zetta_fs_prop_literal(zfs_handle_t *zfs_handle, int zfs_prop)
+{
+  char propval[ZFS_MAXPROPLEN];
+  int ret;
+
+  if ( zfs_prop == ZPROP_INVAL ) {
+    return Qnil;
+  }
+  if ( zfs_prop_get_type(zfs_prop) == PROP_TYPE_NUMBER ) {
+    return zetta_fs_prop_int(zfs_handle, zfs_prop);
+  }
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  ret = zfs_prop_get(zfs_handle, zfs_prop, propval, sizeof(propval), NULL, NULL, 0, B_TRUE);
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+  if ( ret != 0 ) {
+    return Qnil;
+  }
+  return ( strcmp( propval, "-" ) == 0 ) ? Qnil: rb_str_new2(propval);
+}
+
+/*
+ * call-seq:
+ *   @zfs.get('propname')  => string/integer, zfs property value or Nil
+ *
+ * Given a zfs dataset property name, return its value.
+ *
+ * Any property value will be a string. For disk space related properties,
+ * this string will be nicely formatted as in <code>ZfsLib.nicenum</code>.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ *
+ * TODO:
+ *
+ * - Ensure that the given property name is a valid zfs dataset property.
+ *
+ */
+static VALUE zetta_fs_get_prop(VALUE self, VALUE name)
+{
+  zfs_handle_t *zfs_handle;
+  VALUE value;
+
+  if( TYPE(name) != T_STRING )
+  {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+
+  char *propname = STR2CSTR(name);
+  // Do not use this method to retrieve user properties.
+  if ( zfs_prop_user(propname) ) {
+    rb_raise(rb_eArgError, "Use 'get_user_prop' in order to access user defined properties");
+  }
+  int zfs_prop = zfs_name_to_prop(propname);
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  value = zetta_prop_cache_get(self, name);
+  if (value != Qundef) {
+    return value;
+  }
+  return zetta_prop_cache_set(self, name, zetta_fs_prop_value(zfs_handle, zfs_prop));
+}
+
+/*
+ * call-seq:
+ *   @zfs.get_int('propname')  => integer, raw zfs property value or Nil
+ *
+ * Given a numeric zfs dataset property name, return its exact value, (i.e.
+ * bytes for +used+ or +available+), without formatting it into a String.
+ * Index properties, (like +compression+), return their numeric index.
+ * Unknown and string properties return Nil.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ *
+ */
+static VALUE zetta_fs_get_int(VALUE self, VALUE name)
+{
+  zfs_handle_t *zfs_handle;
+
+  if( TYPE(name) != T_STRING )
+  {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  return zetta_fs_prop_int(zfs_handle, zfs_name_to_prop(StringValuePtr(name)));
+}
+
+// ZFS::SpaceStats, defined at Init_zetta:
+static VALUE cZfsSpaceStats = Qnil;
+
+
+/*
+ * call-seq:
+ *   @zfs.space_stats  => ZFS::SpaceStats
+ *
+ * Return the space accounting of the current dataset as a frozen
+ * <code>ZFS::SpaceStats</code> Struct, read in a single pass from the
+ * properties already loaded into the handle: +used+, +available+,
+ * +referenced+, +usedbysnapshots+, +usedbychildren+, +written+ and
+ * +logicalused+, in bytes, and +compressratio+ as a Float, (i.e. 1.5 for
+ * <code>1.50x</code>).
+ *
+ * Members not supported by the running libzfs version are Nil.
+ *
+ */
+static VALUE zetta_fs_space_stats(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  uint64_t space[8], start;
+  VALUE stats;
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  memset(space, 0, sizeof(space));
+  start = zetta_stats_begin();
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  space[0] = zfs_prop_get_int(zfs_handle, ZFS_PROP_USED);
+  space[1] = zfs_prop_get_int(zfs_handle, ZFS_PROP_AVAILABLE);
+  space[2] = zfs_prop_get_int(zfs_handle, ZFS_PROP_REFERENCED);
+#ifdef SPA_VERSION_13
+  space[3] = zfs_prop_get_int(zfs_handle, ZFS_PROP_USEDSNAP);
+  space[4] = zfs_prop_get_int(zfs_handle, ZFS_PROP_USEDCHILD);
+#endif
+#ifdef HAVE_CONST_ZFS_PROP_WRITTEN
+  space[5] = zfs_prop_get_int(zfs_handle, ZFS_PROP_WRITTEN);
+#endif
+#ifdef HAVE_CONST_ZFS_PROP_LOGICALUSED
+  space[6] = zfs_prop_get_int(zfs_handle, ZFS_PROP_LOGICALUSED);
+#endif
+  space[7] = zfs_prop_get_int(zfs_handle, ZFS_PROP_COMPRESSRATIO);
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+  zetta_stats_end("zetta_fs_space_stats", start, 0);
+
+  stats = rb_struct_new(cZfsSpaceStats,
+    ULL2NUM(space[0]),
+    ULL2NUM(space[1]),
+    ULL2NUM(space[2]),
+#ifdef SPA_VERSION_13
+    ULL2NUM(space[3]),
+    ULL2NUM(space[4]),
+#else
+    Qnil,
+    Qnil,
+#endif
+#ifdef HAVE_CONST_ZFS_PROP_WRITTEN
+    ULL2NUM(space[5]),
+#else
+    Qnil,
+#endif
+#ifdef HAVE_CONST_ZFS_PROP_LOGICALUSED
+    ULL2NUM(space[6]),
+#else
+    Qnil,
+#endif
+    rb_float_new(space[7] / 100.0));
+
+  return rb_obj_freeze(stats);
+}
+
+// Value of the given user property, or Nil when not set:
+static VALUE zetta_fs_user_prop_value(nvlist_t *user_props, const char *propname)
+{
+  nvlist_t *nv;
+  char *value;
+
+  if ( nvlist_lookup_nvlist(user_props, propname, &nv) == 0 ) {
+    if ( nvlist_lookup_string(nv, ZPROP_VALUE, &value) == 0 ) {
+      return rb_str_new2(value);
+    }
+    // TODO: This conditional must continue, and lookup additional types
+    // for user defined properties.
+  }
+  return Qnil;
+}
+
+// Value of a user property of the given dataset handle:
+static VALUE zetta_fs_user_prop_get(zfs_handle_t *zfs_handle, const char *propname)
+{
+  VALUE value;
+
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  value = zetta_fs_user_prop_value(zfs_get_user_props(zfs_handle), propname);
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+  return value;
+}
+
+static VALUE zetta_fs_props_many(VALUE self, VALUE names, int literal)
+{
+  zfs_handle_t *zfs_handle;
+  VALUE props, value;
+  long i;
+
+  if( TYPE(names) != T_ARRAY )
+  {
+    rb_raise(rb_eTypeError, "Property names must be an array of strings.");
+  }
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  props = rb_hash_new();
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    VALUE name = rb_ary_entry(names, i);
+    char *propname;
+
+    if( TYPE(name) != T_STRING )
+    {
+      rb_raise(rb_eTypeError, "Property names must be an array of strings.");
+    }
+    propname = StringValuePtr(name);
+
+    if ( literal && !zfs_prop_user(propname) ) {
+      rb_hash_aset(props, name, zetta_fs_prop_literal(zfs_handle, zfs_name_to_prop(propname)));
+    } else if ( (value = zetta_prop_cache_get(self, name)) != Qundef ) {
+      rb_hash_aset(props, name, value);
+    } else if ( zfs_prop_user(propname) ) {
+      rb_hash_aset(props, name,
+        zetta_prop_cache_set(self, name, zetta_fs_user_prop_get(zfs_handle, propname)));
+    } else {
+      rb_hash_aset(props, name,
+        zetta_prop_cache_set(self, name, zetta_fs_prop_value(zfs_handle, zfs_name_to_prop(propname))));
+    }
+  }
+  return props;
+}
+
+/*
+ * call-seq:
+ *   @zfs.get_many(['propname', ...])  => Hash, {'propname' => value}
+ *   @zfs.get_many(['propname', ...], :literal => true)  => Hash, {'propname' => value}
+ *
+ * Given an Array of zfs dataset property names, return a Hash with the
+ * value of each one of them, in a single call. Values are the same returned
+ * by <code>@zfs.get</code>. User defined properties can be requested here
+ * too, and their values are the same returned by
+ * <code>@zfs.get_user_prop</code>.
+ *
+ * With <code>:literal</code>, numeric properties are exact integers, (the
+ * same returned by <code>@zfs.get_int</code>), and any other property is
+ * not formatted, (the same than <code>zfs get -p</code>). Literal values
+ * are never cached.
+ *
+ * Raise <code>TypeError</code> when <code>propnames</code> is not an
+ * <code>Array</code> of <code>String</code>.
+ *
+ */
+static VALUE zetta_fs_get_many(int argc, VALUE *argv, VALUE self)
+{
+  int literal = zetta_prop_literal_option(&argc, argv);
+
+  if (argc != 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+  }
+  return zetta_fs_props_many(self, argv[0], literal);
+}
+
+static int zetta_fs_props_f(int zfs_prop, void *data)
+{
+  zetta_props_cb_t *cb = (zetta_props_cb_t *)data;
+
+  rb_hash_aset(cb->props, rb_str_new2(zfs_prop_to_name(zfs_prop)), cb->literal ?
+    zetta_fs_prop_literal((zfs_handle_t *)cb->handle, zfs_prop) :
+    zetta_fs_prop_value((zfs_handle_t *)cb->handle, zfs_prop));
+  return ZPROP_CONT;
+}
+
+/*
+ * call-seq:
+ *   @zfs.properties  => Hash, {'propname' => value}
+ *   @zfs.properties(:all)  => Hash, {'propname' => value}
+ *   @zfs.properties(['propname', ...])  => Hash, {'propname' => value}
+ *   @zfs.properties(:all, :literal => true)  => Hash, {'propname' => value}
+ *
+ * Return a Hash with the values of all the (non hidden) properties valid for
+ * the current dataset type, including any user defined property, walking
+ * the property table once. When an Array of property names is given, this
+ * is the same than <code>@zfs.get_many</code>, including the
+ * <code>:literal</code> option.
+ *
+ */
+static VALUE zetta_fs_get_props(int argc, VALUE *argv, VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_props_cb_t cb;
+  nvpair_t *pair = NULL;
+  nvlist_t *user_props;
+  int literal = zetta_prop_literal_option(&argc, argv);
+
+  if (argc > 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+  }
+  if (argc == 1 && TYPE(argv[0]) == T_ARRAY) {
+    return zetta_fs_props_many(self, argv[0], literal);
+  }
+  if (argc == 1 && argv[0] != ID2SYM(rb_intern("all"))) {
+    rb_raise(rb_eArgError, "Properties must be either :all or an array of names.");
+  }
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  cb.handle = zfs_handle;
+  cb.props = rb_hash_new();
+  cb.literal = literal;
+  zprop_iter(zetta_fs_props_f, &cb, B_FALSE, B_FALSE, zfs_get_type(zfs_handle));
+
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  user_props = zfs_get_user_props(zfs_handle);
+  while ((pair = nvlist_next_nvpair(user_props, pair)) != NULL) {
+    rb_hash_aset(cb.props, rb_str_new2(nvpair_name(pair)),
+      zetta_fs_user_prop_value(user_props, nvpair_name(pair)));
+  }
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+
+  return literal ? cb.props : zetta_prop_cache_merge(self, cb.props);
+}
+
+static int zetta_fs_set_call(zetta_call_t *call)
+{
+  zetta_prop_set_t *set = (zetta_prop_set_t *)call->data;
+
+  return zfs_prop_set((zfs_handle_t *)set->handle, call->name, set->value);
+}
+
+/*
+ * call-seq:
+ *   @zfs.set('propname', "propval")  => Boolean
+ *
+ * Set the given value for the given zfs dataset property.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ * Raise <code>TypeError</code> when <code>proval</code>
+ * is not a <code>String</code>.
+ *
+ */
+static VALUE zetta_fs_set_prop(VALUE self, VALUE propname, VALUE propval)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_prop_set_t set;
+  zetta_call_t call;
+
+  if( TYPE(propname) != T_STRING )
+  {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+
+  if(TYPE(propval) != T_STRING ) // Maybe should also allow !FIXNUM_P(propval)
+  {
+    rb_raise(rb_eTypeError, "Property value must be a string.");
+  }
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  // FIXME: Property might receive an integer value, so need to check the type.
+  zetta_call_init_op(&call, zetta_fs_set_call, "zetta_fs_set", zfs_get_handle(zfs_handle));
+  if ( zetta_prop_set_init(&call, &set, zfs_handle, propname, propval) != 0 ||
+       zetta_call_blocking(&call) != 0 ) {
+    return Qfalse;
+  }
+  // The handle has the new value already, (as the kernel formats it):
+  if ( !NIL_P(zetta_prop_cache(self)) ) {
+    zetta_prop_cache_set(self, propname, zfs_prop_user(call.name) ?
+      zetta_fs_user_prop_get(zfs_handle, call.name) :
+      zetta_fs_prop_value(zfs_handle, zfs_name_to_prop(call.name)));
+  }
+  return Qtrue;
+}
+
+static int zetta_fs_refresh_call(zetta_call_t *call)
+{
+  zfs_refresh_properties(call->zfs_handle);
+  return 0;
+}
+
+/*
+ * call-seq:
+ *   @zfs.refresh!  => self
+ *
+ * Read again the dataset properties from the kernel, and forget any cached
+ * property value.
+ *
+ */
+static VALUE zetta_fs_refresh(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init(&call, zetta_fs_refresh_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  zetta_call_blocking(&call);
+  return zetta_prop_cache_invalidate(self);
+}
+
+/*
+ * call-seq:
+ *   @zfs.get_user_prop('user:propname')  => string, user defined property value
+ *
+ * Given a zfs dataset property name set by user, return its value.
+ *
+ * <b>Warning:</b> This method relies into libzfs internals, and not the public
+ * library interface, using direct lookups into ZFS data type user properties;
+ * this is something which might perfectly change on future library versions,
+ * hence the word of caution.
+ *
+ * In order to set user defined properties for a ZFS Dataset, use the same
+ * method than for system properties, i.e:
+ *
+ *    @zfs.set('user_prefix:propname', 'propval')
+ *
+ * Only string user properties are supported for now.
+ *
+ * Raise <code>TypeError</code> when <code>propname</code>
+ * is not a <code>String</code>.
+ *
+ * TODO:
+ *
+ * - Support additional types for user properties.
+ *
+ */
+static VALUE zetta_fs_get_user_prop(VALUE self, VALUE name)
+{
+  zfs_handle_t *zfs_handle;
+
+  if( TYPE(name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "Property name must be a string.");
+  }
+  char *propname = STR2CSTR(name);
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  if ( zfs_prop_user(propname) ) {
+    VALUE value = zetta_prop_cache_get(self, name);
+    if (value != Qundef) {
+      return value;
+    }
+    return zetta_prop_cache_set(self, name, zetta_fs_user_prop_get(zfs_handle, propname));
+  }
+
+  return Qnil;
+}
+
+static int zetta_fs_rename_call(zetta_call_t *call)
+{
+  return zfs_rename(call->zfs_handle, call->name, call->flags);
+}
+
+/*
+ * call-seq:
+ *   @zfs.rename('dataset/name', [false|true])  => Boolean
+ *
+ * Rename ZFS Dataset using the given <code>dataset_name</code>.
+ * When <code>recursive</code> is true, also renames all the children
+ * datasets for the current one.
+ *
+ *
+ * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
+ * is not a <code>String</code>.
+ *
+ */
+static VALUE zetta_fs_rename(VALUE self, VALUE target, VALUE recursive)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+  char name[ZFS_MAXNAMELEN];
+
+  if( TYPE(target) != T_STRING ) {
+    rb_raise(rb_eTypeError, "Target dataset name must be a string.");
+  }
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init(&call, zetta_fs_rename_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  call.flags = RTEST(recursive) ? B_TRUE : B_FALSE;
+  zetta_call_set_name(&call, target);
+
+  // The handle takes the new name, so the old one has to be saved:
+  strncpy(name, zfs_get_name(zfs_handle), sizeof(name) - 1);
+  name[sizeof(name) - 1] = '\0';
+
+  if ( zetta_call_blocking(&call) != 0 ) {
+    return Qfalse;
+  }
+  zetta_handle_cache_invalidate(call.libhandle, name);
+  zetta_handle_cache_invalidate(call.libhandle, call.name);
+  return Qtrue;
+}
+
+static int zetta_fs_create_call(zetta_call_t *call)
+{
+  if (zfs_create(call->libhandle, call->name, call->flags, NULL) != 0) {
+    return -1;
+  }
+  call->result = zfs_open(call->libhandle, call->name, call->flags);
+  return ( call->result == NULL ) ? -1 : 0;
+}
+
+/*
+ * call-seq:
+ *   ZFS#create('dataset/name', ZfsConsts::Types)  => @zfs dataset instance.
+ *   ZFS#create('dataset/name', ZfsConsts::Types, @zlib)  => @zfs dataset instance.
+ *
+ * Given a <code>dataset_name</code>, and a <code>dataset_type</code>,
+ * create a zfs dataset.
+ *
+ * Return a new Zfs instance for the given dataset on success or raise
+ * exception on failure failure.
+ *
+ * Raise <code>ArgumentError</code> when <code>dataset_name</code> and
+ * <code>dataset_type</code> are not given.
+ * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
+ * is not a <code>String</code>.
+ * Raise <code>TypeError</code> when <code>dataset_type</code> is given and it
+ * is not an <code>Integer</code>.
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ */
+static VALUE zetta_fs_create(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE fs_name, libzfs_handle, types;
+  libzfs_handle_t *libhandle;
+  zetta_call_t call;
+
+  if(argc < 2) {
+    rb_raise(rb_eArgError, "Filesystem name and ZFS Type are required");
+  }
+  fs_name = argv[0];
+  types = argv[1];
+
+  if( TYPE(fs_name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "ZFS Dataset name must be a string.");
+  }
+
+  if( !FIXNUM_P(types) ) {
+    rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
+  }
+
+  libzfs_handle = (argc == 2) ? zetta_lib_get_handle() : argv[2];
+
+  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
+    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  }
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  zetta_call_init(&call, zetta_fs_create_call, libhandle);
+  call.flags = NUM2INT(types);
+  zetta_call_set_name(&call, fs_name);
+
+  if (0 == zetta_call_blocking(&call)){
+    return zetta_handle_cache_put(libhandle, 0, fs_name,
+      Data_Wrap_Struct(klass, 0, zfs_close, call.result));
+  }
+  // Raise exception when cannot get a proper ZFS handle:
+  zetta_call_error_exception(&call);
+}
+
+// A missing dataset is not a failed call, the answer goes into flags:
+static int zetta_fs_exists_call(zetta_call_t *call)
+{
+  call->flags = zfs_dataset_exists(call->libhandle, call->name, call->flags) ? 1 : 0;
+  return 0;
+}
+
+/*
+ * call-seq:
+ *   ZFS#exists?('dataset/name', ZfsConsts::Types)  => Boolean
+ *   ZFS#exists?('dataset/name', ZfsConsts::Types, @zlib)  => Boolean
+ *   ZFS#exist?('dataset/name', ZfsConsts::Types)  => Boolean
+ *   ZFS#exist?('dataset/name', ZfsConsts::Types, @zlib)  => Boolean
+ *
+ * Check if a dataset with the given <code>dataset_name</code>, of the given
+ * <code>dataset_type</code> exists.
+ *
+ * Return true on success or false on failure.
+ *
+ * Raise <code>ArgumentError</code> when <code>dataset_name</code> and
+ * <code>dataset_type</code> are not given.
+ * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
+ * is not a <code>String</code>.
+ * Raise <code>TypeError</code> when <code>dataset_type</code> is given and it
+ * is not an <code>Integer</code>.
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ */
+static VALUE zetta_fs_dataset_exists(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE fs_name, libzfs_handle, types;
+  libzfs_handle_t *libhandle;
+  zetta_call_t call;
+
+  if(argc < 2) {
+    rb_raise(rb_eArgError, "Filesystem name and ZFS Type are required");
+  }
+  fs_name = argv[0];
+  types = argv[1];
+
+  if( TYPE(fs_name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "ZFS Dataset name must be a string.");
+  }
+
+  if( !FIXNUM_P(types) ) {
+    rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
+  }
+
+  libzfs_handle = (argc == 2) ? zetta_lib_get_handle() : argv[2];
+
+  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
+    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  }
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  // Too long to be the name of any dataset:
+  if (RSTRING_LEN(fs_name) >= ZFS_MAXNAMELEN) {
+    return Qfalse;
+  }
+  zetta_call_init_op(&call, zetta_fs_exists_call, "zetta_fs_exists", libhandle);
+  zetta_call_set_name(&call, fs_name);
+  call.flags = NUM2INT(types);
+  zetta_call_blocking(&call);
+  return call.flags ? Qtrue : Qfalse;
+}
+
+// Snapshot options, (also used by ZFS.snapshot_many):
+typedef struct zetta_snapshots {
+  nvlist_t *snaps;
+  nvlist_t *props;
+  boolean_t recursive;
+  boolean_t open;
+  zfs_handle_t **handles;
+  size_t count;
+} zetta_snapshots_t;
+
+static void zetta_snapshots_options(zetta_snapshots_t *snapshots, VALUE options, boolean_t open)
+{
+  VALUE opt;
+
+  snapshots->open = open;
+  if (NIL_P(options)) {
+    return;
+  }
+  snapshots->recursive = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("recursive")))) ? B_TRUE : B_FALSE;
+  opt = rb_hash_aref(options, ID2SYM(rb_intern("open")));
+  if (!NIL_P(opt)) {
+    snapshots->open = RTEST(opt) ? B_TRUE : B_FALSE;
+  }
+  // Last one, the only allocating memory:
+  snapshots->props = zetta_lib_props_nvlist(rb_hash_aref(options, ID2SYM(rb_intern("props"))));
+}
+
+static int zetta_fs_snapshot_call(zetta_call_t *call)
+{
+  zetta_snapshots_t *snapshots = (zetta_snapshots_t *)call->data;
+
+  if (zfs_snapshot(call->libhandle, call->name, snapshots->recursive, snapshots->props) != 0) {
+    return -1;
+  }
+  if (snapshots->open) {
+    call->result = zfs_open(call->libhandle, call->name, ZFS_TYPE_SNAPSHOT);
+    return ( call->result == NULL ) ? -1 : 0;
+  }
+  return 0;
+}
+
+/*
+ * call-seq:
+ *   ZFS#snapshot('snap/shot@name')  => ZFS instance
+ *   ZFS#snapshot('snap/shot@name', @zlib)  => ZFS instance
+ *   ZFS#snapshot('snap/shot@name', options)  => ZFS instance
+ *   ZFS#snapshot('snap/shot@name', options, @zlib)  => ZFS instance
+ *   ZFS#snapshot('snap/shot@name', :open => false)  => true
+ *
+ * Create a snapshot with the given <code>snapshot_name</code>.
+ *
+ * Return a ZFS snapshot instance on success or raise error on failure.
+ *
+ * Options:
+ *
+ * - <code>:recursive</code>, when true, also snapshots all the descendant
+ *   datasets, atomically, (the same than <code>zfs snapshot -r</code>).
+ * - <code>:props</code>, Hash of String properties to set on the snapshot.
+ * - <code>:open</code>, when false, the new snapshot is not opened, and
+ *   true is returned instead of a ZFS instance.
+ *
+ * Raise <code>ArgumentError</code> when <code>snapshot_name</code> is not
+ * given.
+ * Raise <code>TypeError</code> when <code>snapshot_name</code> is given and it
+ * is not a <code>String</code>.
+ * Raise <code>TypeError</code> when <code>props</code> is not a Hash of
+ * <code>String</code>.
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ */
+static VALUE zetta_fs_snapshot(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE snapshot_name, libzfs_handle, options;
+  libzfs_handle_t *libhandle;
+  zetta_snapshots_t snapshots;
+  zetta_call_t call;
+  int ret;
+
+  if(argc < 1 || argc > 3) {
+    rb_raise(rb_eArgError, "Snapshot name is required required");
+  }
+
+  snapshot_name = argv[0];
+
+  if( TYPE(snapshot_name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "Snapshot name must be a string.");
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  zetta_call_init(&call, zetta_fs_snapshot_call, libhandle);
+  zetta_call_set_name(&call, snapshot_name);
+
+  memset(&snapshots, 0, sizeof(snapshots));
+  zetta_snapshots_options(&snapshots, options, B_TRUE);
+  call.data = &snapshots;
+
+  ret = zetta_call_blocking(&call);
+  nvlist_free(snapshots.props);
+
+  if ( 0 == ret ){
+    return snapshots.open ? zetta_handle_cache_put(libhandle, 0, snapshot_name,
+      Data_Wrap_Struct(klass, 0, zfs_close, call.result)) : Qtrue;
+  }
+  zetta_call_error_exception(&call);
+}
+
+// Add fs@snap for all the descendants of the given dataset:
+typedef struct zetta_snapshots_expand {
+  nvlist_t *snaps;
+  const char *snapname;
+  int ret;
+} zetta_snapshots_expand_t;
+
+static int zetta_snapshots_expand_f(zfs_handle_t *zfs_handle, void *data)
+{
+  zetta_snapshots_expand_t *expand = (zetta_snapshots_expand_t *)data;
+  char name[ZFS_MAXNAMELEN];
+
+  snprintf(name, sizeof(name), "%s@%s", zfs_get_name(zfs_handle), expand->snapname);
+  if (nvlist_add_boolean(expand->snaps, name) != 0) {
+    expand->ret = -1;
+  } else {
+    zfs_iter_filesystems(zfs_handle, zetta_snapshots_expand_f, expand);
+  }
+  zfs_close(zfs_handle);
+  return expand->ret;
+}
+
+static int zetta_fs_snapshot_many_call(zetta_call_t *call)
+{
+  zetta_snapshots_t *snapshots = (zetta_snapshots_t *)call->data;
+  nvpair_t *pair = NULL;
+  size_t i = 0;
+
+#ifdef HAVE_ZFS_SNAPSHOT_NVL
+  nvlist_t *snaps = snapshots->snaps;
+  int ret;
+
+  if (snapshots->recursive) {
+    zetta_snapshots_expand_t expand;
+
+    if (nvlist_alloc(&expand.snaps, NV_UNIQUE_NAME, 0) != 0) {
+      return -1;
+    }
+    expand.ret = 0;
+    while (expand.ret == 0 && (pair = nvlist_next_nvpair(snapshots->snaps, pair)) != NULL) {
+      char fsname[ZFS_MAXNAMELEN];
+      char *at;
+      zfs_handle_t *zfs_handle;
+
+      strncpy(fsname, nvpair_name(pair), sizeof(fsname) - 1);
+      fsname[sizeof(fsname) - 1] = '\0';
+      at = strchr(fsname, '@');
+      *at = '\0';
+      expand.snapname = at + 1;
+      zfs_handle = zfs_open(call->libhandle, fsname, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME);
+      if (zfs_handle == NULL) {
+        expand.ret = -1;
+      } else {
+        zetta_snapshots_expand_f(zfs_handle, &expand);
+      }
+    }
+    if (expand.ret != 0) {
+      nvlist_free(expand.snaps);
+      return -1;
+    }
+    snaps = expand.snaps;
+  }
+  // A single ioctl, all the snapshots are created, or none:
+  ret = zfs_snapshot_nvl(call->libhandle, snaps, snapshots->props);
+  if (snaps != snapshots->snaps) {
+    nvlist_free(snaps);
+  }
+  if (ret != 0) {
+    return ret;
+  }
+#else
+  // Older libzfs: one (atomic, when recursive) snapshot per name.
+  while ((pair = nvlist_next_nvpair(snapshots->snaps, pair)) != NULL) {
+    if (zfs_snapshot(call->libhandle, nvpair_name(pair), snapshots->recursive, snapshots->props) != 0) {
+      return -1;
+    }
+  }
+#endif
+
+  if (snapshots->open) {
+    pair = NULL;
+    while ((pair = nvlist_next_nvpair(snapshots->snaps, pair)) != NULL) {
+      snapshots->handles[i] = zfs_open(call->libhandle, nvpair_name(pair), ZFS_TYPE_SNAPSHOT);
+      if (snapshots->handles[i++] == NULL) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static VALUE zetta_snapshots_free(VALUE data)
+{
+  zetta_snapshots_t *snapshots = (zetta_snapshots_t *)data;
+  size_t i;
+
+  if (snapshots->handles != NULL) {
+    for (i = 0; i < snapshots->count; i++) {
+      if (snapshots->handles[i] != NULL) {
+        zfs_close(snapshots->handles[i]);
+      }
+    }
+    free(snapshots->handles);
+  }
+  nvlist_free(snapshots->snaps);
+  nvlist_free(snapshots->props);
+  return Qnil;
+}
+
+typedef struct zetta_snapshots_wrap {
+  zetta_snapshots_t *snapshots;
+  VALUE klass;
+} zetta_snapshots_wrap_t;
+
+static VALUE zetta_snapshots_wrap(VALUE data)
+{
+  zetta_snapshots_wrap_t *wrap = (zetta_snapshots_wrap_t *)data;
+  zetta_snapshots_t *snapshots = wrap->snapshots;
+  VALUE result = rb_ary_new();
+  size_t i;
+
+  for (i = 0; i < snapshots->count; i++) {
+    rb_ary_push(result, zetta_handle_cache_put(zfs_get_handle(snapshots->handles[i]), 0,
+      rb_str_new2(zfs_get_name(snapshots->handles[i])),
+      Data_Wrap_Struct(wrap->klass, 0, zfs_close, snapshots->handles[i])));
+    // The handle is owned by the ZFS instance now:
+    snapshots->handles[i] = NULL;
+  }
+  return result;
+}
+
+/*
+ * call-seq:
+ *   ZFS#snapshot_many(['snap/shot@name', ...])  => true
+ *   ZFS#snapshot_many(['snap/shot@name', ...], options)  => true
+ *   ZFS#snapshot_many(['snap/shot@name', ...], options, @zlib)  => true
+ *   ZFS#snapshot_many(['snap/shot@name', ...], :open => true)  => Array of ZFS
+ *
+ * Create all the given snapshots with a single request to the kernel, so
+ * either all of them are created, at the same point in time, or none of them
+ * is, (the equivalent to <code>zfs snapshot fs1@snap fs2@snap ...</code>).
+ *
+ * Options are the same than for <code>ZFS.snapshot</code>:
+ * <code>:recursive</code> also snapshots all the descendants of the given
+ * datasets, <code>:props</code> sets the given properties on all the new
+ * snapshots. New snapshots are not opened unless <code>:open</code> is
+ * true, on which case an Array with a ZFS instance for each one of the given
+ * names is returned.
+ *
+ * On libzfs versions without <code>zfs_snapshot_nvl</code>, each snapshot is
+ * created with its own request, (atomic for its descendants when
+ * <code>:recursive</code>), and the first failure stops the operation.
+ *
+ * Raise <code>TypeError</code> when <code>snapshot_names</code> is not an
+ * Array of <code>String</code>.
+ * Raise <code>ArgumentError</code> when any of the names is not a snapshot
+ * name, (<code>dataset@snapshot</code>).
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ */
+static VALUE zetta_fs_snapshot_many(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE names, libzfs_handle, options;
+  libzfs_handle_t *libhandle;
+  zetta_snapshots_t snapshots;
+  zetta_snapshots_wrap_t wrap;
+  zetta_call_t call;
+  long i;
+
+  if(argc < 1 || argc > 3) {
+    rb_raise(rb_eArgError, "Snapshot names are required");
+  }
+
+  names = argv[0];
+
+  if( TYPE(names) != T_ARRAY ) {
+    rb_raise(rb_eTypeError, "Snapshot names must be an array of strings.");
+  }
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    VALUE name = RARRAY_PTR(names)[i];
+    if( TYPE(name) != T_STRING ) {
+      rb_raise(rb_eTypeError, "Snapshot names must be an array of strings.");
+    }
+    if( RSTRING_LEN(name) >= ZFS_MAXNAMELEN ) {
+      rb_raise(cZfsNameTooLongError, "%s: dataset name is too long", StringValuePtr(name));
+    }
+    if( strchr(StringValuePtr(name), '@') == NULL ) {
+      rb_raise(rb_eArgError, "%s: not a snapshot name", StringValuePtr(name));
+    }
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&snapshots, 0, sizeof(snapshots));
+  zetta_snapshots_options(&snapshots, options, B_FALSE);
+
+  if (nvlist_alloc(&snapshots.snaps, NV_UNIQUE_NAME, 0) != 0) {
+    zetta_snapshots_free((VALUE)&snapshots);
+    rb_raise(cZfsNoMemoryError, "cannot create snapshots: out of memory");
+  }
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    if (nvlist_add_boolean(snapshots.snaps, RSTRING_PTR(RARRAY_PTR(names)[i])) != 0) {
+      zetta_snapshots_free((VALUE)&snapshots);
+      rb_raise(cZfsNoMemoryError, "cannot create snapshots: out of memory");
+    }
+  }
+  if (snapshots.open) {
+    // Duplicated names are only opened once, (NV_UNIQUE_NAME):
+    nvpair_t *pair = NULL;
+    while ((pair = nvlist_next_nvpair(snapshots.snaps, pair)) != NULL) {
+      snapshots.count++;
+    }
+    snapshots.handles = calloc(snapshots.count + 1, sizeof(zfs_handle_t *));
+    if (snapshots.handles == NULL) {
+      zetta_snapshots_free((VALUE)&snapshots);
+      rb_raise(cZfsNoMemoryError, "cannot create snapshots: out of memory");
+    }
+  }
+
+  zetta_call_init(&call, zetta_fs_snapshot_many_call, libhandle);
+  call.data = &snapshots;
+
+  if ( 0 != zetta_call_blocking(&call) ) {
+    zetta_snapshots_free((VALUE)&snapshots);
+    zetta_call_error_exception(&call);
+  }
+  if (!snapshots.open) {
+    zetta_snapshots_free((VALUE)&snapshots);
+    return Qtrue;
+  }
+  wrap.snapshots = &snapshots;
+  wrap.klass = klass;
+  return rb_ensure(zetta_snapshots_wrap, (VALUE)&wrap, zetta_snapshots_free, (VALUE)&snapshots);
+}
+
+static int zetta_fs_rollback_call(zetta_call_t *call)
+{
+  return zfs_rollback(call->zfs_handle, call->other_handle, call->flags);
+}
+
+/*
+ * call-seq:
+ *   @zfs.rollback(@zfs_snapshot, true|false)  => Boolean
+ *
+ * Rollback the current <code>ZFS</code> instance to the given
+ * ZFS Snapshot instance. Second argument <code>force</code> has the
+ * same efect than the <code>-Rf</code> option for <code>zfs rollback</code>.
+ *
+ *
+ * Raise <code>TypeError</code> when <code>snapshot</code>
+ * is not an instance of <code>ZFS</code>.
+ * Raise <code>TypeError</code> when <code>snapshot</code>
+ * instance of <code>ZFS</code> is not of type <i>snapshot</i>.
+ * Raise <code>NoMethodError</code> when the current <code>ZfsLib</code>
+ * instance is not a Filesystem or Volume.
+ *
+ */
+static VALUE zetta_fs_rollback(VALUE self, VALUE snapshot, VALUE force)
+{
+  zfs_handle_t *zfs_handle, *snapshot_zfs_handle;
+  zetta_call_t call;
+
+  if(CLASS_OF(snapshot) != rb_const_get(rb_cObject, rb_intern("ZFS"))) {
+    rb_raise(rb_eTypeError, "Snapshot must be an instance of ZFS.");
+  }
+  // Get the snapshot handle:
+  Data_Get_Struct(snapshot, zfs_handle_t, snapshot_zfs_handle);
+  // Get current volume/filesystem handle:
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  // Raise error if the given snapshot instance is not a Snapshot:
+  if(zfs_get_type(snapshot_zfs_handle) != ZFS_TYPE_SNAPSHOT) {
+    rb_raise(rb_eTypeError, "ZFS snapshot instance must be of type Snapshot.");
+  }
+  // Raise error when trying to rollback whatever not a volume/filesystem:
+  if( zfs_get_type(zfs_handle) != ZFS_TYPE_FILESYSTEM && zfs_get_type(zfs_handle) != ZFS_TYPE_VOLUME ) {
+    rb_raise(rb_eNoMethodError, "Rollback operation is only available for Datasets of type filesystem or volume.");
+  }
+
+  zetta_call_init(&call, zetta_fs_rollback_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  call.other_handle = snapshot_zfs_handle;
+  call.flags = RTEST(force) ? B_TRUE : B_FALSE;
+
+  if ( zetta_call_blocking(&call) != 0 ) {
+    return Qfalse;
+  }
+  // Snapshots newer than the given one are gone:
+  zetta_handle_cache_invalidate(call.libhandle, zfs_get_name(zfs_handle));
+  return Qtrue;
+}
+
+static int zetta_fs_clone_call(zetta_call_t *call)
+{
+  if (zfs_clone(call->zfs_handle, call->name, NULL) != 0) {
+    return -1;
+  }
+  call->result = zfs_open(call->libhandle, call->name, ZFS_TYPE_FILESYSTEM);
+  return ( call->result == NULL ) ? -1 : 0;
+}
+
+/*
+ * call-seq:
+ *   @zfs.clone!('clone_name')  => ZFS instance
+ *
+ * Create a clone with the given <code>clone_name</code> for the current
+ * ZFS Snapshot instance. Raise <code>ZfsError</code> on failure.
+ *
+ *
+ * Raise <code>TypeError</code> when <code>clone_name</code>
+ * is not a <code>String</code>.
+ * Raise <code>NoMethodError</code> when the current <code>ZfsLib</code>
+ * instance is not a Snapshot.
+ *
+ *
+ * NOTE: This method cannot be <i>clone</i> due to obvious Ruby reasons.
+ *
+ */
+static VALUE zetta_fs_clone(VALUE self, VALUE clone_name)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+
+  if( TYPE(clone_name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "Clone name must be a string.");
+  }
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  if(zfs_get_type(zfs_handle) != ZFS_TYPE_SNAPSHOT) {
+    rb_raise(rb_eNoMethodError, "Clone operation is only available for Datasets of type snapshot.");
+  }
+
+  zetta_call_init(&call, zetta_fs_clone_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  zetta_call_set_name(&call, clone_name);
+
+  if (0 == zetta_call_blocking(&call)){
+    return zetta_handle_cache_put(call.libhandle, 0, clone_name,
+      Data_Wrap_Struct(CLASS_OF(self), 0, zfs_close, call.result));
+  }
+  zetta_call_error_exception(&call);
+}
+
+static int zetta_fs_promote_call(zetta_call_t *call)
+{
+  // The origin snapshot, whose dataset gives its snapshots to the clone:
+  if (zfs_prop_get(call->zfs_handle, ZFS_PROP_ORIGIN, call->name, sizeof(call->name), NULL, NULL, 0, B_FALSE) != 0) {
+    call->name[0] = '\0';
+  }
+  return zfs_promote(call->zfs_handle);
+}
+
+/*
+ * call-seq:
+ *   @zfs.promote  => Boolean
+ *
+ * Promote the current clone to be no longer dependent on its origin.
+ *
+ */
+static VALUE zetta_fs_promote(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+  char *at;
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init(&call, zetta_fs_promote_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+
+  if (zetta_call_blocking(&call) != 0) {
+    return Qfalse;
+  }
+  // Snapshots moved from the origin dataset to the promoted one:
+  if ((at = strchr(call.name, '@')) != NULL) {
+    *at = '\0';
+    zetta_handle_cache_invalidate(call.libhandle, call.name);
+  }
+  zetta_handle_cache_invalidate(call.libhandle, zfs_get_name(zfs_handle));
+  return Qtrue;
+}
+
+/*
+ * Share state checks and (un)sharing go through the share tables and the
+ * sharing services, (exec'ing share(1M) or talking to the NFS/SMB servers on
+ * some systems), so they run as blocking calls. Checks leave their answer in
+ * call->flags and the shared path in call->data, (never a failure).
+ */
+static int zetta_fs_is_shared_call(zetta_call_t *call)
+{
+  call->flags = zfs_is_shared(call->zfs_handle);
+  return 0;
+}
+
+static int zetta_fs_is_shared_nfs_call(zetta_call_t *call)
+{
+  call->flags = zfs_is_shared_nfs(call->zfs_handle, (char **)&call->data);
+  return 0;
+}
+
+static int zetta_fs_share_call(zetta_call_t *call)
+{
+  return zfs_share(call->zfs_handle);
+}
+
+static int zetta_fs_unshare_call(zetta_call_t *call)
+{
+  return zfs_unshare(call->zfs_handle);
+}
+
+static int zetta_fs_share_nfs_call(zetta_call_t *call)
+{
+  return zfs_share_nfs(call->zfs_handle);
+}
+
+static int zetta_fs_unshare_nfs_call(zetta_call_t *call)
+{
+  return zfs_unshare_nfs(call->zfs_handle, NULL);
+}
+
+#ifdef SPA_VERSION_9
+static int zetta_fs_is_shared_smb_call(zetta_call_t *call)
+{
+  call->flags = zfs_is_shared_smb(call->zfs_handle, (char **)&call->data);
+  return 0;
+}
+
+static int zetta_fs_share_smb_call(zetta_call_t *call)
+{
+  return zfs_share_smb(call->zfs_handle);
+}
+
+static int zetta_fs_unshare_smb_call(zetta_call_t *call)
+{
+  return zfs_unshare_smb(call->zfs_handle, NULL);
+}
+#endif
+
+#ifndef SPA_VERSION_24
+static int zetta_fs_is_shared_iscsi_call(zetta_call_t *call)
+{
+  call->flags = zfs_is_shared_iscsi(call->zfs_handle);
+  return 0;
+}
+
+static int zetta_fs_share_iscsi_call(zetta_call_t *call)
+{
+  return zfs_share_iscsi(call->zfs_handle);
+}
+
+static int zetta_fs_unshare_iscsi_call(zetta_call_t *call)
+{
+  return zfs_unshare_iscsi(call->zfs_handle);
+}
+#endif
+
+// Run one of the above on the dataset, returning the call result:
+static int zetta_fs_share_run(zetta_call_t *call, VALUE self, int (*func)(zetta_call_t *), const char *op)
+{
+  zfs_handle_t *zfs_handle;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init_op(call, func, op, zfs_get_handle(zfs_handle));
+  call->zfs_handle = zfs_handle;
+  return zetta_call_blocking(call);
+}
+
+// Shared path of a share check, (allocated by libzfs):
+static VALUE zetta_fs_share_path(zetta_call_t *call)
+{
+  VALUE path = Qnil;
+
+  if (call->data != NULL) {
+    path = call->flags ? rb_str_new2((char *)call->data) : Qnil;
+    free(call->data);
+  }
+  return path;
+}
+
+static VALUE zetta_fs_is_shared(VALUE self)
+{
+  zetta_call_t call;
+  zetta_fs_share_run(&call, self, zetta_fs_is_shared_call, "zetta_fs_is_shared");
+  return call.flags ? Qtrue : Qfalse;
+}
+
+static VALUE zetta_fs_share(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_share_call, "zetta_fs_share"));
+}
+
+static VALUE zetta_fs_unshare(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_unshare_call, "zetta_fs_unshare"));
+}
+
+static VALUE zetta_fs_nfs_share_name(VALUE self)
+{
+  zetta_call_t call;
+  zetta_fs_share_run(&call, self, zetta_fs_is_shared_nfs_call, "zetta_fs_is_shared_nfs");
+  return zetta_fs_share_path(&call);
+}
+
+static VALUE zetta_fs_is_shared_nfs(VALUE self)
+{
+  zetta_call_t call;
+  zetta_fs_share_run(&call, self, zetta_fs_is_shared_nfs_call, "zetta_fs_is_shared_nfs");
+  zetta_fs_share_path(&call);
+  return call.flags ? Qtrue : Qfalse;
+}
+
+static VALUE zetta_fs_share_nfs(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_share_nfs_call, "zetta_fs_share_nfs"));
+}
+
+static VALUE zetta_fs_unshare_nfs(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_unshare_nfs_call, "zetta_fs_unshare_nfs"));
+}
+
+#ifdef SPA_VERSION_9
+static VALUE zetta_fs_is_shared_smb(VALUE self)
+{
+  zetta_call_t call;
+  zetta_fs_share_run(&call, self, zetta_fs_is_shared_smb_call, "zetta_fs_is_shared_smb");
+  zetta_fs_share_path(&call);
+  return call.flags ? Qtrue : Qfalse;
+}
+
+static VALUE zetta_fs_smb_share_name(VALUE self)
+{
+  zetta_call_t call;
+  zetta_fs_share_run(&call, self, zetta_fs_is_shared_smb_call, "zetta_fs_is_shared_smb");
+  return zetta_fs_share_path(&call);
+}
+
+static VALUE zetta_fs_share_smb(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_share_smb_call, "zetta_fs_share_smb"));
+}
+
+static VALUE zetta_fs_unshare_smb(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_unshare_smb_call, "zetta_fs_unshare_smb"));
+}
+#endif
+
+#ifndef SPA_VERSION_24
+static VALUE zetta_fs_is_shared_iscsi(VALUE self)
+{
+  zetta_call_t call;
+  zetta_fs_share_run(&call, self, zetta_fs_is_shared_iscsi_call, "zetta_fs_is_shared_iscsi");
+  return call.flags ? Qtrue : Qfalse;
+}
+
+static VALUE zetta_fs_share_iscsi(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_share_iscsi_call, "zetta_fs_share_iscsi"));
+}
+
+static VALUE zetta_fs_unshare_iscsi(VALUE self)
+{
+  zetta_call_t call;
+  return INT2NUM(zetta_fs_share_run(&call, self, zetta_fs_unshare_iscsi_call, "zetta_fs_unshare_iscsi"));
+}
+#endif
+
+/*
+ * call-seq:
+ *   @zfs.is_mounted?  => Boolean
+ *
+ * Checks if the current dataset instance is or not mounted
+ *
+ * TODO:
+ *
+ * - Actually, not taking into consideration anything but default mountpoints
+ *
+ */
+static VALUE zetta_fs_is_mounted(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  int ret;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_lib_lock(zfs_get_handle(zfs_handle));
+  ret = zfs_is_mounted(zfs_handle, NULL);
+  zetta_lib_unlock(zfs_get_handle(zfs_handle));
+  return ret ? Qtrue : Qfalse;
+}
+
+static int zetta_fs_mount_call(zetta_call_t *call)
+{
+  return zfs_mount(call->zfs_handle, NULL, 0);
+}
+
+/*
+ * call-seq:
+ *   @zfs.mount  => Boolean
+ *
+ * Mount the current dataset instance.
+ *
+ */
+static VALUE zetta_fs_mount(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init(&call, zetta_fs_mount_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+
+  return (zetta_call_blocking(&call) == 0) ? Qtrue : Qfalse;
+}
+
+static int zetta_fs_unmount_call(zetta_call_t *call)
+{
+  return zfs_unmount(call->zfs_handle, NULL, 0);
+}
+
+/*
+ * call-seq:
+ *   @zfs.unmount  => Boolean
+ *
+ * Unmount the current dataset instance.
+ *
+ */
+static VALUE zetta_fs_unmount(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init(&call, zetta_fs_unmount_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+
+  return (zetta_call_blocking(&call) == 0) ? Qtrue : Qfalse;
+}
+
+/*
+ * Parallel mounts and shares.
+ *
+ * ZFS.mount_all and ZFS.unmount_all collect the filesystems in a single
+ * traversal and sort them by mountpoint. Then a few native worker threads,
+ * each one with its own libzfs handle, mount (or unmount) them. A filesystem
+ * is mounted once the filesystem mounted right above it is done, and it is
+ * unmounted once every filesystem mounted below it is done, so independent
+ * subtrees progress concurrently.
+ *
+ * ZFS.share_all and ZFS.unshare_all use the same machinery, without any
+ * order between filesystems, but on a single worker: libshare is not thread
+ * safe, (it keeps the share table, and the NFS exports file, in process wide
+ * state). The worker keeps the share table loaded into its handle for all
+ * the filesystems, and when libzfs defers the share table updates,
+ * (zfs_commit_all_shares), they are committed once at the end.
+ */
+typedef enum {
+  ZETTA_MOUNT,
+  ZETTA_UNMOUNT,
+  ZETTA_SHARE,
+  ZETTA_UNSHARE
+} zetta_mount_op_t;
+
+#define ZETTA_SHARE_NFS 0x1
+#define ZETTA_SHARE_SMB 0x2
+
+typedef struct zetta_mount_item {
+  char *name;
+  char *mountpoint;
+  // Closest filesystem mounted above, and the ones mounted right below:
+  long parent;
+  long first_child;
+  long next_sibling;
+  // Filesystems to wait for:
+  long pending;
+  // "action: description" when it failed:
+  char *error;
+} zetta_mount_item_t;
+
+typedef struct zetta_mount {
+  zetta_mount_op_t op;
+  int flags;
+  int protocols;
+  char *root;
+  // Items given by name, nothing to collect:
+  int named;
+  zetta_mount_item_t *items;
+  size_t count;
+  size_t size;
+  // Queue of the items ready to go, shared by the workers:
+  long *ready;
+  size_t ready_head;
+  size_t ready_tail;
+  size_t done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int nthreads;
+  int error;
+} zetta_mount_t;
+
+static int zetta_mount_add(zetta_mount_t *mount, const char *name, char *where)
+{
+  zetta_mount_item_t *item;
+
+  if (mount->count == mount->size) {
+    size_t size = mount->size ? mount->size * 2 : 64;
+    zetta_mount_item_t *items = realloc(mount->items, size * sizeof(zetta_mount_item_t));
+    if (items == NULL) {
+      free(where);
+      return ENOMEM;
+    }
+    mount->items = items;
+    mount->size = size;
+  }
+  item = &mount->items[mount->count];
+  memset(item, 0, sizeof(zetta_mount_item_t));
+  item->mountpoint = where;
+  item->parent = item->first_child = -1;
+  if ((item->name = strdup(name)) == NULL) {
+    free(where);
+    return ENOMEM;
+  }
+  mount->count++;
+  return 0;
+}
+
+// Filesystems to share: mounted, with the share property of any of the
+// requested protocols on. Filesystems to unshare: shared by any of them.
+static int zetta_mount_shareable(zetta_mount_t *mount, zfs_handle_t *handle)
+{
+  char value[ZFS_MAXPROPLEN];
+
+  if (mount->op == ZETTA_UNSHARE) {
+    return ((mount->protocols & ZETTA_SHARE_NFS) && zfs_is_shared_nfs(handle, NULL))
+#ifdef SPA_VERSION_9
+      || ((mount->protocols & ZETTA_SHARE_SMB) && zfs_is_shared_smb(handle, NULL))
+#endif
+      ;
+  }
+  if (!zfs_is_mounted(handle, NULL)) {
+    return 0;
+  }
+  if ( (mount->protocols & ZETTA_SHARE_NFS) &&
+       zfs_prop_get(handle, ZFS_PROP_SHARENFS, value, sizeof(value), NULL, NULL, 0, B_FALSE) == 0 &&
+       strcmp(value, "off") != 0 ) {
+    return 1;
+  }
+#ifdef SPA_VERSION_9
+  if ( (mount->protocols & ZETTA_SHARE_SMB) &&
+       zfs_prop_get(handle, ZFS_PROP_SHARESMB, value, sizeof(value), NULL, NULL, 0, B_FALSE) == 0 &&
+       strcmp(value, "off") != 0 ) {
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+static int zetta_mount_collect_f(zfs_handle_t *handle, void *data)
+{
+  zetta_mount_t *mount = (zetta_mount_t *)data;
+  char mountpoint[ZFS_MAXPROPLEN], canmount[16], *where = NULL;
+  int ret = 0;
+
+  if (zfs_get_type(handle) != ZFS_TYPE_FILESYSTEM) {
+    zfs_close(handle);
+    return 0;
+  }
+  if (mount->op == ZETTA_UNMOUNT) {
+    zfs_is_mounted(handle, &where);
+  } else if (mount->op == ZETTA_SHARE || mount->op == ZETTA_UNSHARE) {
+    if (zetta_mount_shareable(mount, handle)) {
+      where = strdup("");
+    }
+  } else if ( !zfs_is_mounted(handle, NULL) &&
+              zfs_prop_get(handle, ZFS_PROP_CANMOUNT, canmount, sizeof(canmount), NULL, NULL, 0, B_FALSE) == 0 &&
+              strcmp(canmount, "on") == 0 &&
+              zfs_prop_get(handle, ZFS_PROP_MOUNTPOINT, mountpoint, sizeof(mountpoint), NULL, NULL, 0, B_FALSE) == 0 &&
+              mountpoint[0] == '/' ) {
+    where = strdup(mountpoint);
+  }
+
+  if (where != NULL && zetta_mount_add(mount, zfs_get_name(handle), where) != 0) {
+    zfs_close(handle);
+    return ENOMEM;
+  }
+
+  ret = zfs_iter_filesystems(handle, zetta_mount_collect_f, mount);
+  zfs_close(handle);
+  return ret;
+}
+
+// Mountpoints compared component by component, ('/' before any other
+// character), so "/a/b" comes right after "/a" and before "/a-x", (the same
+// order than OpenZFS mountpoint_cmp):
+static int zetta_mount_item_cmp(const void *a, const void *b)
+{
+  const char *x = ((const zetta_mount_item_t *)a)->mountpoint;
+  const char *y = ((const zetta_mount_item_t *)b)->mountpoint;
+
+  while (*x != '\0' && *x == *y) {
+    x++;
+    y++;
+  }
+  if (*x == *y) return 0;
+  if (*x == '\0' || *x == '/') return -1;
+  if (*y == '\0' || *y == '/') return 1;
+  return ((unsigned char)*x < (unsigned char)*y) ? -1 : 1;
+}
+
+// Is the parent mountpoint a path prefix of the child one?
+static int zetta_mount_contains(const char *parent, const char *child)
+{
+  size_t len = strlen(parent);
+
+  return strncmp(parent, child, len) == 0 &&
+    (child[len] == '/' || child[len] == '\0' || (len > 0 && parent[len - 1] == '/'));
+}
+
+// Link every item to the closest one mounted above, (items are sorted):
+static void zetta_mount_link(zetta_mount_t *mount)
+{
+  zetta_mount_item_t *items = mount->items;
+  long *stack = mount->ready, top = -1, i;
+  int unmount = (mount->op == ZETTA_UNMOUNT);
+
+  for (i = 0; i < (long)mount->count; i++) {
+    while (top >= 0 && !zetta_mount_contains(items[stack[top]].mountpoint, items[i].mountpoint)) top--;
+    items[i].parent = (top >= 0) ? stack[top] : -1;
+    stack[++top] = i;
+  }
+  // Backwards, so the children lists are sorted too:
+  for (i = (long)mount->count - 1; i >= 0; i--) {
+    if (items[i].parent >= 0) {
+      items[i].next_sibling = items[items[i].parent].first_child;
+      items[items[i].parent].first_child = i;
+      items[items[i].parent].pending += unmount;
+    }
+    items[i].pending += !unmount && items[i].parent >= 0;
+  }
+  for (i = 0; i < (long)mount->count; i++) {
+    if (items[i].pending == 0) {
+      mount->ready[mount->ready_tail++] = i;
+    }
+  }
+}
+
+// Lock held:
+static void zetta_mount_release(zetta_mount_t *mount, long i)
+{
+  if (i >= 0 && --mount->items[i].pending == 0) {
+    mount->ready[mount->ready_tail++] = i;
+  }
+}
+
+static int zetta_mount_one(zetta_mount_t *mount, zfs_handle_t *zfs_handle)
+{
+  int ret = 0;
+
+  switch (mount->op) {
+    case ZETTA_MOUNT:
+      return zfs_mount(zfs_handle, NULL, 0);
+    case ZETTA_UNMOUNT:
+      return zfs_unmount(zfs_handle, NULL, mount->flags);
+    case ZETTA_SHARE:
+      if (mount->protocols & ZETTA_SHARE_NFS) ret = zfs_share_nfs(zfs_handle);
+#ifdef SPA_VERSION_9
+      if (ret == 0 && (mount->protocols & ZETTA_SHARE_SMB)) ret = zfs_share_smb(zfs_handle);
+#endif
+      return ret;
+    case ZETTA_UNSHARE:
+      if (mount->protocols & ZETTA_SHARE_NFS) ret = zfs_unshare_nfs(zfs_handle, NULL);
+#ifdef SPA_VERSION_9
+      if (ret == 0 && (mount->protocols & ZETTA_SHARE_SMB)) ret = zfs_unshare_smb(zfs_handle, NULL);
+#endif
+      return ret;
+  }
+  return -1;
+}
+
+static void *zetta_mount_worker(void *data)
+{
+  zetta_mount_t *mount = (zetta_mount_t *)data;
+  zetta_mount_item_t *item;
+  libzfs_handle_t *libhandle;
+  zfs_handle_t *zfs_handle;
+  char error[2048];
+  long i, c;
+  int ret;
+
+  // Each worker has its own handle: libzfs handles are not thread safe.
+  if ((libhandle = libzfs_init()) == NULL) {
+    pthread_mutex_lock(&mount->lock);
+    mount->error = EZFS_NOMEM;
+    pthread_cond_broadcast(&mount->cond);
+    pthread_mutex_unlock(&mount->lock);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&mount->lock);
+    while (mount->ready_head == mount->ready_tail && mount->done < mount->count && mount->error == 0) {
+      pthread_cond_wait(&mount->cond, &mount->lock);
+    }
+    if (mount->ready_head == mount->ready_tail || mount->error != 0) {
+      pthread_mutex_unlock(&mount->lock);
+      break;
+    }
+    i = mount->ready[mount->ready_head++];
+    pthread_mutex_unlock(&mount->lock);
+
+    item = &mount->items[i];
+    if ((zfs_handle = zfs_open(libhandle, item->name, ZFS_TYPE_FILESYSTEM)) == NULL) {
+      ret = -1;
+    } else {
+      ret = zetta_mount_one(mount, zfs_handle);
+      zfs_close(zfs_handle);
+    }
+    if (ret != 0) {
+      snprintf(error, sizeof(error), "%s: %s", libzfs_error_action(libhandle), libzfs_error_description(libhandle));
+      item->error = strdup(error);
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    mount->done++;
+    if (mount->op == ZETTA_UNMOUNT) {
+      zetta_mount_release(mount, item->parent);
+    } else {
+      for (c = item->first_child; c >= 0; c = mount->items[c].next_sibling) {
+        zetta_mount_release(mount, c);
+      }
+    }
+    pthread_cond_broadcast(&mount->cond);
+    pthread_mutex_unlock(&mount->lock);
+  }
+
+  libzfs_fini(libhandle);
+  return NULL;
+}
+
+static int zetta_mount_call(zetta_call_t *call)
+{
+  zetta_mount_t *mount = (zetta_mount_t *)call->data;
+  zfs_handle_t *zfs_handle;
+  pthread_t *threads;
+  int i, ret, started = 0;
+
+  if (mount->named) {
+    ret = 0;
+  } else if (mount->root != NULL) {
+    if ((zfs_handle = zfs_open(call->libhandle, mount->root, ZFS_TYPE_FILESYSTEM)) == NULL) {
+      return -1;
+    }
+    ret = zetta_mount_collect_f(zfs_handle, mount);
+  } else {
+    ret = zfs_iter_root(call->libhandle, zetta_mount_collect_f, mount);
+  }
+  if (ret == ENOMEM) {
+    mount->error = EZFS_NOMEM;
+  }
+  if (mount->error != 0 || mount->count == 0) {
+    return mount->error;
+  }
+
+  if ((mount->ready = calloc(mount->count, sizeof(long))) == NULL) {
+    mount->error = EZFS_NOMEM;
+    return mount->error;
+  }
+  if (mount->op == ZETTA_MOUNT || mount->op == ZETTA_UNMOUNT) {
+    qsort(mount->items, mount->count, sizeof(zetta_mount_item_t), zetta_mount_item_cmp);
+    zetta_mount_link(mount);
+  } else {
+    for (mount->ready_tail = 0; mount->ready_tail < mount->count; mount->ready_tail++) {
+      mount->ready[mount->ready_tail] = mount->ready_tail;
+    }
+  }
+
+  if (mount->nthreads > (int)mount->count) {
+    mount->nthreads = mount->count;
+  }
+  threads = calloc(mount->nthreads, sizeof(pthread_t));
+  for (i = 0; threads != NULL && i < mount->nthreads; i++) {
+    if (pthread_create(&threads[started], NULL, zetta_mount_worker, mount) == 0) {
+      started++;
+    }
+  }
+  // Not a single thread could be started, do the job here:
+  if (started == 0) {
+    zetta_mount_worker(mount);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+#ifdef HAVE_ZFS_COMMIT_ALL_SHARES
+  // A single update of the share table for all of them:
+  if (mount->op == ZETTA_SHARE || mount->op == ZETTA_UNSHARE) {
+    zfs_commit_all_shares();
+  }
+#endif
+  return mount->error;
+}
+
+static VALUE zetta_mount_results(VALUE data)
+{
+  zetta_mount_t *mount = (zetta_mount_t *)data;
+  VALUE results = rb_hash_new();
+  size_t i, n;
+
+  for (n = 0; n < mount->count; n++) {
+    // Unmounted from the deepest mountpoints up:
+    i = (mount->op == ZETTA_UNMOUNT) ? mount->count - n - 1 : n;
+    rb_hash_aset(results, rb_str_new2(mount->items[i].name),
+      mount->items[i].error ? rb_str_new2(mount->items[i].error) : Qtrue);
+  }
+  return results;
+}
+
+static VALUE zetta_mount_free(VALUE data)
+{
+  zetta_mount_t *mount = (zetta_mount_t *)data;
+  size_t i;
+
+  for (i = 0; i < mount->count; i++) {
+    free(mount->items[i].name);
+    free(mount->items[i].mountpoint);
+    free(mount->items[i].error);
+  }
+  free(mount->items);
+  free(mount->ready);
+  pthread_mutex_destroy(&mount->lock);
+  pthread_cond_destroy(&mount->cond);
+  return Qnil;
+}
+
+// Protocol flags for the :protocols option, (both of them by default):
+static int zetta_share_protocols(VALUE protocols)
+{
+  VALUE name;
+  int flags = 0;
+  long i;
+
+  if (NIL_P(protocols)) {
+    return ZETTA_SHARE_NFS | ZETTA_SHARE_SMB;
+  }
+  protocols = rb_Array(protocols);
+  for (i = 0; i < RARRAY_LEN(protocols); i++) {
+    name = rb_funcall(RARRAY_PTR(protocols)[i], rb_intern("to_s"), 0);
+    if (strcmp(StringValueCStr(name), "nfs") == 0) {
+      flags |= ZETTA_SHARE_NFS;
+    } else if (strcmp(StringValueCStr(name), "smb") == 0) {
+      flags |= ZETTA_SHARE_SMB;
+    } else {
+      rb_raise(rb_eArgError, "%s: unknown share protocol, (nfs or smb)", StringValueCStr(name));
+    }
+  }
+  return flags;
+}
+
+static VALUE zetta_fs_mount_all_run(int argc, VALUE *argv, zetta_mount_op_t op)
+{
+  VALUE options, libzfs_handle, opt, root = Qnil, names = Qnil;
+  libzfs_handle_t *libhandle;
+  zetta_mount_t mount;
+  zetta_call_t call;
+  int first = 0, max = 2;
+  long i;
+
+  // Shares may take the list of filesystems first:
+  if (op == ZETTA_SHARE || op == ZETTA_UNSHARE) {
+    max = 3;
+    if (argc > 0 && (NIL_P(argv[0]) || TYPE(argv[0]) == T_ARRAY)) {
+      names = argv[0];
+      first = 1;
+    }
+  }
+  if(argc > max) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for %d)", argc, max);
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, first, &options);
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&mount, 0, sizeof(mount));
+  mount.op = op;
+  mount.nthreads = 4;
+  mount.protocols = zetta_share_protocols(NIL_P(options) ? Qnil :
+    rb_hash_aref(options, ID2SYM(rb_intern("protocols"))));
+#ifndef SPA_VERSION_9
+  mount.protocols &= ~ZETTA_SHARE_SMB;
+#endif
+  if (!NIL_P(options)) {
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("threads"))))) {
+      if (!FIXNUM_P(opt) || FIX2INT(opt) < 1) {
+        rb_raise(rb_eTypeError, "Number of threads must be a positive integer.");
+      }
+      mount.nthreads = FIX2INT(opt);
+    }
+    if (!NIL_P(root = rb_hash_aref(options, ID2SYM(rb_intern("root"))))) {
+      Check_Type(root, T_STRING);
+      mount.root = StringValueCStr(root);
+    }
+    if (op == ZETTA_UNMOUNT && RTEST(rb_hash_aref(options, ID2SYM(rb_intern("force"))))) {
+#ifdef MS_FORCE
+      mount.flags = MS_FORCE;
+#else
+      rb_raise(rb_eNotImpError, "Forced unmounts are not supported by this libzfs version.");
+#endif
+    }
+  }
+  if (op == ZETTA_SHARE || op == ZETTA_UNSHARE) {
+    mount.nthreads = 1;
+  }
+  // Nothing is allocated until every name is known to be good:
+  if (!NIL_P(names)) {
+    for (i = 0; i < RARRAY_LEN(names); i++) {
+      VALUE name = RARRAY_PTR(names)[i];
+      if (TYPE(name) != T_STRING) {
+        rb_raise(rb_eTypeError, "Filesystem names must be strings.");
+      }
+      StringValueCStr(name);
+    }
+  }
+  pthread_mutex_init(&mount.lock, NULL);
+  pthread_cond_init(&mount.cond, NULL);
+
+  if (!NIL_P(names)) {
+    mount.named = 1;
+    for (i = 0; i < RARRAY_LEN(names); i++) {
+      if (zetta_mount_add(&mount, RSTRING_PTR(RARRAY_PTR(names)[i]), NULL) != 0) {
+        zetta_mount_free((VALUE)&mount);
+        rb_raise(cZfsNoMemoryError, "cannot share filesystems: out of memory");
+      }
+    }
+  }
+
+  zetta_call_init(&call, zetta_mount_call, libhandle);
+  call.data = &mount;
+  if (zetta_call_blocking(&call) != 0) {
+    zetta_mount_free((VALUE)&mount);
+    if (call.error != 0) {
+      zetta_call_error_exception(&call);
+    }
+    rb_raise(cZfsNoMemoryError, "cannot %s filesystems: out of memory",
+      (op == ZETTA_MOUNT) ? "mount" : (op == ZETTA_UNMOUNT) ? "unmount" : (op == ZETTA_SHARE) ? "share" : "unshare");
+  }
+  RB_GC_GUARD(root);
+
+  return rb_ensure(zetta_mount_results, (VALUE)&mount, zetta_mount_free, (VALUE)&mount);
+}
+
+/*
+ * call-seq:
+ *   ZFS.mount_all  => Hash, {'fs' => true, 'other/fs' => 'error'}
+ *   ZFS.mount_all(:root => 'tpool/home', :threads => 8)  => Hash
+ *   ZFS.mount_all(options, @zlib)  => Hash
+ *
+ * Mount every filesystem which can be mounted and is not mounted yet, (the
+ * equivalent to <code>zfs mount -a</code>), or only the ones below the
+ * <code>:root</code> filesystem, included. Filesystems are mounted by up to
+ * <code>:threads</code> native threads, (4 by default), each one with its
+ * own libzfs handle. A filesystem is only mounted after the filesystem whose
+ * mountpoint contains its own, so independent subtrees are mounted
+ * concurrently.
+ *
+ * Return a Hash with an entry for each filesystem, in mountpoint order:
+ * <code>true</code> when it was mounted, or the error message.
+ *
+ *    failed = ZFS.mount_all(:threads => 16).reject { |name, result| result == true }
+ *
+ * Raise <code>TypeError</code> when the options have the wrong types, and
+ * <code>ZfsError::Error</code> when the <code>:root</code> filesystem cannot
+ * be opened.
+ *
+ */
+static VALUE zetta_fs_mount_all(int argc, VALUE *argv, VALUE klass)
+{
+  return zetta_fs_mount_all_run(argc, argv, ZETTA_MOUNT);
+}
+
+/*
+ * call-seq:
+ *   ZFS.unmount_all  => Hash, {'fs' => true, 'other/fs' => 'error'}
+ *   ZFS.unmount_all(:root => 'tpool/home', :threads => 8, :force => true)  => Hash
+ *   ZFS.unmount_all(options, @zlib)  => Hash
+ *
+ * Unmount every mounted filesystem, (the equivalent to <code>zfs unmount
+ * -a</code>), or only the ones below the <code>:root</code> filesystem,
+ * included, the same way than <code>ZFS.mount_all</code> mounts them: a
+ * filesystem is only unmounted after all the filesystems mounted below it.
+ * <code>:force</code> unmounts filesystems even when they are busy.
+ *
+ * Return a Hash with an entry for each filesystem, deepest mountpoints
+ * first: <code>true</code> when it was unmounted, or the error message.
+ *
+ */
+static VALUE zetta_fs_unmount_all(int argc, VALUE *argv, VALUE klass)
+{
+  return zetta_fs_mount_all_run(argc, argv, ZETTA_UNMOUNT);
+}
+
+/*
+ * call-seq:
+ *   ZFS.share_all  => Hash, {'fs' => true, 'other/fs' => 'error'}
+ *   ZFS.share_all(['fs', 'other/fs'], :protocols => [:nfs])  => Hash
+ *   ZFS.share_all(names, options, @zlib)  => Hash
+ *
+ * Share the given filesystems, or every mounted filesystem with the
+ * <code>sharenfs</code> or <code>sharesmb</code> property on, (the
+ * equivalent to <code>zfs share -a</code>), or only the ones below the
+ * <code>:root</code> filesystem. <code>:protocols</code> can be
+ * <code>:nfs</code>, <code>:smb</code> or both of them, (the default).
+ *
+ * Filesystems are shared by a single native thread, with its own libzfs
+ * handle, which loads the share table once for all of them: libshare is not
+ * thread safe, so <code>:threads</code> is ignored here. The share table is
+ * updated once at the end when libzfs supports it, (ZFS on Linux).
+ *
+ * Return a Hash with an entry for each filesystem: <code>true</code> when it
+ * was shared, (or there was nothing to share), or the error message.
+ *
+ * Raise <code>TypeError</code> when the options have the wrong types or any
+ * of the names is not a <code>String</code>, and <code>ArgumentError</code>
+ * for unknown protocols.
+ *
+ */
+static VALUE zetta_fs_share_all(int argc, VALUE *argv, VALUE klass)
+{
+  return zetta_fs_mount_all_run(argc, argv, ZETTA_SHARE);
+}
+
+/*
+ * call-seq:
+ *   ZFS.unshare_all  => Hash, {'fs' => true, 'other/fs' => 'error'}
+ *   ZFS.unshare_all(['fs', 'other/fs'], :protocols => [:nfs])  => Hash
+ *   ZFS.unshare_all(names, options, @zlib)  => Hash
+ *
+ * Unshare the given filesystems, or every shared filesystem, (or the ones
+ * below <code>:root</code>), the same way than <code>ZFS.share_all</code>
+ * shares them.
+ *
+ */
+static VALUE zetta_fs_unshare_all(int argc, VALUE *argv, VALUE klass)
+{
+  return zetta_fs_mount_all_run(argc, argv, ZETTA_UNSHARE);
+}
+
+static int zetta_fs_destroy_call(zetta_call_t *call)
+{
+// Boolean parameter was added to zfs_destroy:
+#ifdef SPA_VERSION_18
+  return zfs_destroy(call->zfs_handle, B_FALSE);
+#else
+  return zfs_destroy(call->zfs_handle);
+#endif
+}
+
+/*
+ * call-seq:
+ *   @zfs.destroy!  => Boolean
+ *
+ * Destroy the current dataset instance.
+ *
+ */
+static VALUE zetta_fs_destroy(VALUE self)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  zetta_call_init(&call, zetta_fs_destroy_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+
+  if (zetta_call_blocking(&call) != 0) {
+    return Qfalse;
+  }
+  zetta_handle_cache_invalidate(call.libhandle, zfs_get_name(zfs_handle));
+  return Qtrue;
+}
+
+/*
+ * Batched snapshot destruction.
+ */
+typedef struct zetta_destroy_snaps {
+  // Requested names, ranges included:
+  nvlist_t *names;
+  // Snapshots to destroy, ranges already expanded:
+  nvlist_t *snaps;
+  // Failures, name => error description:
+  nvlist_t *errors;
+  boolean_t defer;
+} zetta_destroy_snaps_t;
+
+static int zetta_destroy_snaps_range_f(zfs_handle_t *zfs_handle, void *data)
+{
+  int ret = nvlist_add_uint64((nvlist_t *)data, zfs_get_name(zfs_handle),
+    zfs_prop_get_int(zfs_handle, ZFS_PROP_CREATETXG));
+  zfs_close(zfs_handle);
+  return ret;
+}
+
+// Expand fs@first%last into all the snapshots of fs created between first
+// and last, (both included). Either side can be omitted, meaning from the
+// oldest or up to the newest snapshot respectively.
+static int zetta_destroy_snaps_range(zetta_call_t *call, zetta_destroy_snaps_t *destroy, const char *range)
+{
+  char fsname[ZFS_MAXNAMELEN], first[ZFS_MAXNAMELEN], last[ZFS_MAXNAMELEN];
+  const char *at = strchr(range, '@');
+  const char *percent = strchr(at, '%');
+  uint64_t min_txg = 0, max_txg = UINT64_MAX, txg;
+  zfs_handle_t *zfs_handle;
+  nvlist_t *txgs;
+  nvpair_t *pair = NULL;
+  int ret = 0;
+
+  snprintf(fsname, sizeof(fsname), "%.*s", (int)(at - range), range);
+  snprintf(first, sizeof(first), "%s@%.*s", fsname, (int)(percent - at - 1), at + 1);
+  snprintf(last, sizeof(last), "%s@%s", fsname, percent + 1);
+
+  zfs_handle = zfs_open(call->libhandle, fsname, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME);
+  if (zfs_handle == NULL) {
+    return nvlist_add_string(destroy->errors, range, libzfs_error_description(call->libhandle));
+  }
+  if (nvlist_alloc(&txgs, NV_UNIQUE_NAME, 0) != 0) {
+    zfs_close(zfs_handle);
+    return ENOMEM;
+  }
+  ret = zfs_iter_snapshots(zfs_handle, zetta_destroy_snaps_range_f, txgs);
+  zfs_close(zfs_handle);
+
+  if (ret == 0 && percent != at + 1 && nvlist_lookup_uint64(txgs, first, &min_txg) != 0) {
+    ret = nvlist_add_string(destroy->errors, range, "first snapshot of the range does not exist");
+  } else if (ret == 0 && *(percent + 1) != '\0' && nvlist_lookup_uint64(txgs, last, &max_txg) != 0) {
+    ret = nvlist_add_string(destroy->errors, range, "last snapshot of the range does not exist");
+  } else {
+    while (ret == 0 && (pair = nvlist_next_nvpair(txgs, pair)) != NULL) {
+      nvpair_value_uint64(pair, &txg);
+      if (txg >= min_txg && txg <= max_txg) {
+        ret = nvlist_add_boolean(destroy->snaps, nvpair_name(pair));
+      }
+    }
+  }
+  nvlist_free(txgs);
+  return ret;
+}
+
+// Destroy the given snapshots, all of them in the same pool:
+static int zetta_destroy_snaps_pool(zetta_call_t *call, zetta_destroy_snaps_t *destroy, nvlist_t *snaps)
+{
+  nvpair_t *pair = NULL;
+  int ret = 0;
+
+#if defined(HAVE_LZC_DESTROY_SNAPS)
+  // A single ioctl, (and txg sync), with a per snapshot errors list:
+  nvlist_t *errlist = NULL;
+  int32_t error;
+
+  if (lzc_destroy_snaps(snaps, destroy->defer, &errlist) != 0) {
+    while (ret == 0 && errlist != NULL && (pair = nvlist_next_nvpair(errlist, pair)) != NULL) {
+      nvpair_value_int32(pair, &error);
+      ret = nvlist_add_string(destroy->errors, nvpair_name(pair), strerror(error));
+    }
+  }
+  nvlist_free(errlist);
+#elif defined(HAVE_ZFS_DESTROY_SNAPS_NVL)
+  // A single request, but there is no way to tell which ones failed other
+  // than looking for the survivors:
+  if (zfs_destroy_snaps_nvl(call->libhandle, snaps, destroy->defer) != 0) {
+    const char *description = libzfs_error_description(call->libhandle);
+    while (ret == 0 && (pair = nvlist_next_nvpair(snaps, pair)) != NULL) {
+      if (zfs_dataset_exists(call->libhandle, nvpair_name(pair), ZFS_TYPE_SNAPSHOT)) {
+        ret = nvlist_add_string(destroy->errors, nvpair_name(pair), description);
+      }
+    }
+  }
+#else
+  // Older libzfs: one request per snapshot.
+  while (ret == 0 && (pair = nvlist_next_nvpair(snaps, pair)) != NULL) {
+    zfs_handle_t *zfs_handle = zfs_open(call->libhandle, nvpair_name(pair), ZFS_TYPE_SNAPSHOT);
+    if (zfs_handle == NULL) {
+      // Already gone, the same than for the other versions:
+      if (libzfs_errno(call->libhandle) != EZFS_NOENT) {
+        ret = nvlist_add_string(destroy->errors, nvpair_name(pair), libzfs_error_description(call->libhandle));
+      }
+      continue;
+    }
+#ifdef SPA_VERSION_18
+    if (zfs_destroy(zfs_handle, destroy->defer) != 0) {
+#else
+    if (zfs_destroy(zfs_handle) != 0) {
+#endif
+      ret = nvlist_add_string(destroy->errors, nvpair_name(pair), libzfs_error_description(call->libhandle));
+    }
+    zfs_close(zfs_handle);
+  }
+#endif
+  return ret;
+}
+
+static int zetta_destroy_snaps_call(zetta_call_t *call)
+{
+  zetta_destroy_snaps_t *destroy = (zetta_destroy_snaps_t *)call->data;
+  nvpair_t *pair = NULL, *next;
+  char pool[ZFS_MAXNAMELEN];
+  nvlist_t *snaps;
+  int ret = 0;
+
+  while (ret == 0 && (pair = nvlist_next_nvpair(destroy->names, pair)) != NULL) {
+    if (strchr(nvpair_name(pair), '%') != NULL) {
+      ret = zetta_destroy_snaps_range(call, destroy, nvpair_name(pair));
+    } else {
+      ret = nvlist_add_boolean(destroy->snaps, nvpair_name(pair));
+    }
+  }
+
+  // Snapshots are destroyed pool by pool, (a single request cannot span
+  // more than one pool):
+  while (ret == 0 && (pair = nvlist_next_nvpair(destroy->snaps, NULL)) != NULL) {
+    size_t len = strcspn(nvpair_name(pair), "/@");
+
+    snprintf(pool, sizeof(pool), "%.*s", (int)len, nvpair_name(pair));
+    if ((ret = nvlist_alloc(&snaps, NV_UNIQUE_NAME, 0)) != 0) {
+      break;
+    }
+    for (; ret == 0 && pair != NULL; pair = next) {
+      next = nvlist_next_nvpair(destroy->snaps, pair);
+      if (strcspn(nvpair_name(pair), "/@") == len && strncmp(nvpair_name(pair), pool, len) == 0) {
+        if ((ret = nvlist_add_boolean(snaps, nvpair_name(pair))) == 0) {
+          ret = nvlist_remove_all(destroy->snaps, nvpair_name(pair));
+        }
+      }
+    }
+    if (ret == 0) {
+      ret = zetta_destroy_snaps_pool(call, destroy, snaps);
+    }
+    nvlist_free(snaps);
+  }
+  return ret;
+}
+
+static VALUE zetta_destroy_snaps_errors(VALUE data)
+{
+  zetta_destroy_snaps_t *destroy = (zetta_destroy_snaps_t *)data;
+  VALUE errors = rb_hash_new();
+  nvpair_t *pair = NULL;
+  char *description;
+
+  while ((pair = nvlist_next_nvpair(destroy->errors, pair)) != NULL) {
+    nvpair_value_string(pair, &description);
+    rb_hash_aset(errors, rb_str_new2(nvpair_name(pair)), rb_str_new2(description));
+  }
+  return errors;
+}
+
+static VALUE zetta_destroy_snaps_free(VALUE data)
+{
+  zetta_destroy_snaps_t *destroy = (zetta_destroy_snaps_t *)data;
+
+  nvlist_free(destroy->names);
+  nvlist_free(destroy->snaps);
+  nvlist_free(destroy->errors);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   ZFS.destroy_snapshots(['fs@snap', ...])  => Hash, {'fs@snap' => 'error'}
+ *   ZFS.destroy_snapshots('fs@first%last')  => Hash, {'fs@snap' => 'error'}
+ *   ZFS.destroy_snapshots(snapshots, :defer => true)  => Hash, {'fs@snap' => 'error'}
+ *   ZFS.destroy_snapshots(snapshots, options, @zlib)  => Hash, {'fs@snap' => 'error'}
+ *
+ * Destroy all the given snapshots with a single request for each pool
+ * involved, (the equivalent to <code>zfs destroy fs@a,b,c</code>).
+ *
+ * Snapshot ranges can be given using the same syntax than
+ * <code>zfs destroy fs@first%last</code>: all the snapshots of
+ * <code>fs</code> created from <code>first</code> to <code>last</code>, both
+ * included. Any side of the range can be left empty, (<code>fs@%last</code>,
+ * <code>fs@first%</code>), meaning from the oldest snapshot or up to the
+ * newest one.
+ *
+ * When <code>:defer</code> is true, snapshots which cannot be destroyed
+ * right now, (held or with clones), are marked for deferred destruction, the
+ * same than <code>zfs destroy -d</code>.
+ *
+ * Return a Hash with the error description of each snapshot, (or range),
+ * which couldn't be destroyed. Hence, an empty Hash means everything has
+ * been destroyed. Snapshots which do not exist are ignored.
+ *
+ * Raise <code>TypeError</code> when <code>snapshots</code> is not a
+ * <code>String</code> or an Array of <code>String</code>.
+ * Raise <code>ArgumentError</code> when any of the names is not a snapshot
+ * name, (<code>dataset@snapshot</code>).
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ *
+ */
+static VALUE zetta_fs_destroy_snapshots(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE names, libzfs_handle, options;
+  libzfs_handle_t *libhandle;
+  zetta_destroy_snaps_t destroy;
+  zetta_call_t call;
+  long i;
+  int ret;
+
+  if(argc < 1 || argc > 3) {
+    rb_raise(rb_eArgError, "Snapshot names are required");
+  }
+
+  names = (TYPE(argv[0]) == T_STRING) ? rb_ary_new3(1, argv[0]) : argv[0];
+
+  if( TYPE(names) != T_ARRAY ) {
+    rb_raise(rb_eTypeError, "Snapshot names must be a string or an array of strings.");
+  }
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    VALUE name = RARRAY_PTR(names)[i];
+    if( TYPE(name) != T_STRING ) {
+      rb_raise(rb_eTypeError, "Snapshot names must be a string or an array of strings.");
+    }
+    if( RSTRING_LEN(name) >= ZFS_MAXNAMELEN ) {
+      rb_raise(cZfsNameTooLongError, "%s: dataset name is too long", StringValuePtr(name));
+    }
+    if( strchr(StringValuePtr(name), '@') == NULL ||
+        (strchr(StringValuePtr(name), '%') != NULL && strchr(StringValuePtr(name), '%') < strchr(StringValuePtr(name), '@')) ) {
+      rb_raise(rb_eArgError, "%s: not a snapshot name", StringValuePtr(name));
+    }
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&destroy, 0, sizeof(destroy));
+  if (!NIL_P(options)) {
+    destroy.defer = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("defer")))) ? B_TRUE : B_FALSE;
+  }
+
+  if (nvlist_alloc(&destroy.names, NV_UNIQUE_NAME, 0) != 0 ||
+      nvlist_alloc(&destroy.snaps, NV_UNIQUE_NAME, 0) != 0 ||
+      nvlist_alloc(&destroy.errors, NV_UNIQUE_NAME, 0) != 0) {
+    zetta_destroy_snaps_free((VALUE)&destroy);
+    rb_raise(cZfsNoMemoryError, "cannot destroy snapshots: out of memory");
+  }
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    if (nvlist_add_boolean(destroy.names, RSTRING_PTR(RARRAY_PTR(names)[i])) != 0) {
+      zetta_destroy_snaps_free((VALUE)&destroy);
+      rb_raise(cZfsNoMemoryError, "cannot destroy snapshots: out of memory");
+    }
+  }
+
+  zetta_call_init(&call, zetta_destroy_snaps_call, libhandle);
+  call.data = &destroy;
+
+  ret = zetta_call_blocking(&call);
+
+  // Ranges invalidate every cached snapshot of their dataset:
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    char name[ZFS_MAXNAMELEN];
+    strcpy(name, RSTRING_PTR(RARRAY_PTR(names)[i]));
+    if (strchr(name, '%') != NULL) {
+      *strchr(name, '@') = '\0';
+    }
+    zetta_handle_cache_invalidate(libhandle, name);
+  }
+
+  // Per snapshot failures are in the errors list, this is a failed request:
+  if (ret != 0) {
+    zetta_destroy_snaps_free((VALUE)&destroy);
+    if (call.error != 0) {
+      zetta_call_error_exception(&call);
+    }
+    rb_raise(cZfsNoMemoryError, "cannot destroy snapshots: out of memory");
+  }
+
+  return rb_ensure(zetta_destroy_snaps_errors, (VALUE)&destroy, zetta_destroy_snaps_free, (VALUE)&destroy);
+}
+
+/*
+ * Send streams.
+ *
+ * zfs_send() writes the stream straight into regular files from the kernel,
+ * which is as fast as it gets. For any other target, (pipes and sockets,
+ * which can stall for as long as the peer wants), or when progress has to be
+ * reported, the stream is sent into a pipe from a native thread instead, and
+ * pumped from there into the target by the calling thread, using splice()
+ * when available so the data is never copied into user space. The pump can
+ * be interrupted, while the kernel writing into the target cannot.
+ */
+#define ZETTA_SEND_CHUNK (1 << 20)
+
+typedef struct zetta_send {
+  char fromsnap[ZFS_MAXNAMELEN];
+  char tosnap[ZFS_MAXNAMELEN];
+  sendflags_t flags;
+  // Target file descriptor, and the one given to zfs_send():
+  int fd;
+  int outfd;
+  // Pump state, when sending through a pipe:
+  int pipe[2];
+  int splice;
+  char *buffer;
+  // Part of the buffer not written yet, kept when the pump is interrupted:
+  size_t pending;
+  size_t written;
+  uint64_t bytes;
+  uint64_t slice_bytes;
+  uint64_t slice_usec;
+  int eof;
+  int error;
+  pthread_t thread;
+  VALUE progress;
+} zetta_send_t;
+
+static int zetta_fs_send_call(zetta_call_t *call)
+{
+  zetta_send_t *send = (zetta_send_t *)call->data;
+  zfs_handle_t *zfs_handle;
+  int ret = -1;
+
+  zfs_handle = zfs_open(call->libhandle, call->name, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME);
+  if (zfs_handle != NULL) {
+    ret = zfs_send(zfs_handle, (send->fromsnap[0] != '\0') ? send->fromsnap : NULL,
+      send->tosnap, send->flags, send->outfd, NULL, NULL);
+    zfs_close(zfs_handle);
+  }
+  // Let the pump know the stream is complete:
+  if (send->outfd == send->pipe[1]) {
+    close(send->pipe[1]);
+    send->pipe[1] = -1;
+  }
+  return ret;
+}
+
+// The pump gives up the current slice on timeouts and interrupts:
+#define ZETTA_SEND_AGAIN (-2)
+#define ZETTA_SEND_INTR (-3)
+
+// Wait up to 100ms for the given descriptor to be ready. The pump runs with
+// RUBY_UBF_IO, which interrupts poll() on Thread#raise/kill, so the stream
+// never keeps the thread from handling them, (unlike a wait forever):
+static int zetta_send_wait(int fd, short events)
+{
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = fd;
+  pfd.events = events;
+  n = poll(&pfd, 1, 100);
+  if (n > 0) {
+    return 0;
+  }
+  if (n == 0) {
+    return ZETTA_SEND_AGAIN;
+  }
+  return (errno == EINTR) ? ZETTA_SEND_INTR : -1;
+}
+
+// Move up to ZETTA_SEND_CHUNK bytes from the pipe into the target, returning
+// the number of bytes moved, 0 at the end of the stream, -1 on failure, or
+// ZETTA_SEND_AGAIN/INTR when nothing could be moved right now:
+static ssize_t zetta_send_move(zetta_send_t *send)
+{
+  ssize_t n, w;
+  int ret;
+
+#ifdef HAVE_SPLICE
+  while (send->splice) {
+    if ((ret = zetta_send_wait(send->fd, POLLOUT)) != 0) {
+      return ret;
+    }
+    n = splice(send->pipe[0], NULL, send->fd, NULL, ZETTA_SEND_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+    if (n >= 0) {
+      return n;
+    } else if (errno == EAGAIN) {
+      // Nothing in the pipe yet:
+      if ((ret = zetta_send_wait(send->pipe[0], POLLIN)) != 0) {
+        return ret;
+      }
+    } else if (errno == EINVAL) {
+      // The target doesn't support splice, copy the stream instead:
+      send->splice = 0;
+    } else if (errno == EINTR) {
+      return ZETTA_SEND_INTR;
+    } else {
+      return -1;
+    }
+  }
+#endif
+
+  if (send->pending == 0) {
+    if ((ret = zetta_send_wait(send->pipe[0], POLLIN)) != 0) {
+      return ret;
+    }
+    n = read(send->pipe[0], send->buffer, ZETTA_SEND_CHUNK);
+    if (n <= 0) {
+      return (n < 0 && errno == EINTR) ? ZETTA_SEND_INTR : n;
+    }
+    send->pending = n;
+    send->written = 0;
+  }
+
+  for (n = 0; send->written < send->pending; ) {
+    if ((ret = zetta_send_wait(send->fd, POLLOUT)) != 0) {
+      return (n > 0) ? n : ret;
+    }
+    w = write(send->fd, send->buffer + send->written, send->pending - send->written);
+    if (w >= 0) {
+      send->written += w;
+      n += w;
+    } else if (errno == EINTR) {
+      return (n > 0) ? n : ZETTA_SEND_INTR;
+    } else if (errno != EAGAIN) {
+      return -1;
+    }
+  }
+  send->pending = 0;
+  return n;
+}
+
+// Pump the stream for about a second, so progress can be reported, (less
+// when interrupted, in order to let Ruby handle the interrupt):
+static void *zetta_send_pump(void *ptr)
+{
+  zetta_send_t *send = (zetta_send_t *)ptr;
+  struct timeval start, now;
+  ssize_t n;
+
+  gettimeofday(&start, NULL);
+  send->slice_bytes = 0;
+  send->slice_usec = 0;
+
+  while (send->slice_usec < 1000000) {
+    n = zetta_send_move(send);
+    if (n == ZETTA_SEND_INTR) {
+      break;
+    } else if (n == 0 || n == -1) {
+      send->eof = 1;
+      send->error = (n < 0) ? errno : 0;
+    } else if (n > 0) {
+      send->bytes += n;
+      send->slice_bytes += n;
+    }
+    gettimeofday(&now, NULL);
+    send->slice_usec = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+    if (send->eof) break;
+  }
+  return NULL;
+}
+
+static VALUE zetta_send_pump_loop(VALUE data)
+{
+  zetta_send_t *send = (zetta_send_t *)data;
+  uint64_t rate;
+
+  while (!send->eof) {
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+    rb_thread_call_without_gvl(zetta_send_pump, send, RUBY_UBF_IO, NULL);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+    rb_thread_blocking_region((rb_blocking_function_t *)zetta_send_pump, send, RUBY_UBF_IO, NULL);
+#else
+    zetta_send_pump(send);
+#endif
+    if (!NIL_P(send->progress)) {
+      rate = (send->slice_usec > 0) ? (send->slice_bytes * 1000000 / send->slice_usec) : 0;
+      rb_funcall(send->progress, rb_intern("call"), 2, ULL2NUM(send->bytes), ULL2NUM(rate));
+    }
+  }
+  return Qnil;
+}
+
+static void *zetta_send_join(void *ptr)
+{
+  zetta_send_t *send = (zetta_send_t *)ptr;
+
+  pthread_join(send->thread, NULL);
+  return NULL;
+}
+
+// Closing the read side makes a send still in progress fail, (i.e. when the
+// progress callback raises), so the thread can always be joined:
+static VALUE zetta_send_pump_finish(VALUE data)
+{
+  zetta_send_t *send = (zetta_send_t *)data;
+
+  close(send->pipe[0]);
+  send->pipe[0] = -1;
+  zetta_lib_without_gvl(zetta_send_join, send);
+  free(send->buffer);
+  return Qnil;
+}
+
+// File descriptor of the given IO, (or the given file descriptor itself):
+static int zetta_lib_io_fd(VALUE io)
+{
+  if( FIXNUM_P(io) ) {
+    return FIX2INT(io);
+  }
+  if( !rb_respond_to(io, rb_intern("fileno")) ) {
+    rb_raise(rb_eTypeError, "Stream must be an IO or a file descriptor.");
+  }
+  // Whatever is buffered must be written before the stream:
+  if( rb_respond_to(io, rb_intern("flush")) ) {
+    rb_funcall(io, rb_intern("flush"), 0);
+  }
+  return NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+}
+
+static void zetta_send_options(zetta_send_t *send, VALUE options)
+{
+  VALUE from, flags;
+  const char *at;
+
+  send->fd = zetta_lib_io_fd(rb_hash_aref(options, ID2SYM(rb_intern("to"))));
+
+  from = rb_hash_aref(options, ID2SYM(rb_intern("from")));
+  if( !NIL_P(from) ) {
+    if( TYPE(from) != T_STRING ) {
+      rb_raise(rb_eTypeError, "Incremental source must be a snapshot name.");
+    }
+    // Either the full name or just the part after the '@':
+    at = strchr(StringValuePtr(from), '@');
+    at = (at != NULL) ? at + 1 : RSTRING_PTR(from);
+    if( strlen(at) >= sizeof(send->fromsnap) ) {
+      rb_raise(cZfsNameTooLongError, "%s: dataset name is too long", RSTRING_PTR(from));
+    }
+    strcpy(send->fromsnap, at);
+  }
+
+  flags = rb_hash_aref(options, ID2SYM(rb_intern("flags")));
+  if( !NIL_P(flags) ) {
+    if( TYPE(flags) != T_HASH ) {
+      rb_raise(rb_eTypeError, "Send flags must be a Hash.");
+    }
+    send->flags.replicate = RTEST(rb_hash_aref(flags, ID2SYM(rb_intern("replicate"))));
+    send->flags.doall = RTEST(rb_hash_aref(flags, ID2SYM(rb_intern("doall"))));
+    send->flags.fromorigin = RTEST(rb_hash_aref(flags, ID2SYM(rb_intern("fromorigin"))));
+    send->flags.dedup = RTEST(rb_hash_aref(flags, ID2SYM(rb_intern("dedup"))));
+    send->flags.props = RTEST(rb_hash_aref(flags, ID2SYM(rb_intern("props"))));
+  }
+
+  send->progress = rb_hash_aref(options, ID2SYM(rb_intern("progress")));
+}
+
+/*
+ * call-seq:
+ *   @snap.send_stream(:to => io_or_fd)  => true
+ *   @snap.send_stream(:to => io_or_fd, :from => 'fs@older')  => true
+ *   @snap.send_stream(:to => io_or_fd, :flags => {:replicate => true})  => true
+ *   @snap.send_stream(:to => io_or_fd) {|bytes, bytes_per_sec| ... }  => true
+ *
+ * Write a stream representation of the current ZFS Snapshot instance into
+ * the given IO or file descriptor, (the equivalent of <code>zfs send</code>).
+ * The stream is never copied into Ruby strings.
+ *
+ * Options:
+ * - <code>:to</code>: IO instance, (anything responding to
+ *   <code>fileno</code>), or file descriptor the stream is written to.
+ * - <code>:from</code>: generate an incremental stream from the given
+ *   snapshot, (either <code>fs@snap</code> or just <code>snap</code>).
+ * - <code>:flags</code>: Hash with any of <code>:replicate</code>
+ *   (<code>-R</code>), <code>:doall</code> (<code>-I</code>),
+ *   <code>:fromorigin</code>, <code>:dedup</code> (<code>-D</code>) and
+ *   <code>:props</code> (<code>-p</code>).
+ * - <code>:progress</code>: callable receiving the total bytes sent so far
+ *   and the current rate in bytes per second, about once per second. A block
+ *   can be given instead.
+ *
+ * Sending into pipes and sockets can be interrupted with Thread#kill and
+ * Thread#raise, even when the peer stops reading.
+ *
+ * Raise <code>ZfsError</code> on failure, or <code>SystemCallError</code>
+ * when writing into the target fails.
+ *
+ * Raise <code>TypeError</code> when <code>:to</code> is not an IO or a file
+ * descriptor.
+ * Raise <code>NoMethodError</code> when the current <code>ZFS</code>
+ * instance is not a Snapshot.
+ *
+ * NOTE: This method cannot be <i>send</i> since it would hide Object#send.
+ *
+ */
+static VALUE zetta_fs_send_stream(VALUE self, VALUE options)
+{
+  zfs_handle_t *zfs_handle;
+  zetta_send_t send;
+  zetta_call_t call;
+  struct stat st;
+  const char *at;
+
+  if( TYPE(options) != T_HASH ) {
+    rb_raise(rb_eTypeError, "Send options must be a Hash.");
+  }
+
+  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+
+  if(zfs_get_type(zfs_handle) != ZFS_TYPE_SNAPSHOT) {
+    rb_raise(rb_eNoMethodError, "Send operation is only available for Datasets of type snapshot.");
+  }
+
+  memset(&send, 0, sizeof(send));
+  send.pipe[0] = send.pipe[1] = -1;
+  zetta_send_options(&send, options);
+  if( rb_block_given_p() ) {
+    send.progress = rb_block_proc();
+  }
+
+  // Dataset and snapshot names, zfs_send() takes the dataset handle:
+  at = strchr(zfs_get_name(zfs_handle), '@');
+  zetta_call_init(&call, zetta_fs_send_call, zfs_get_handle(zfs_handle));
+  call.data = &send;
+  snprintf(call.name, sizeof(call.name), "%.*s", (int)(at - zfs_get_name(zfs_handle)), zfs_get_name(zfs_handle));
+  strcpy(send.tosnap, at + 1);
+
+  if( fstat(send.fd, &st) != 0 ) {
+    rb_sys_fail("send");
+  }
+
+  if( NIL_P(send.progress) && S_ISREG(st.st_mode) ) {
+    send.outfd = send.fd;
+    if (zetta_call_blocking(&call) != 0) {
+      zetta_call_error_exception(&call);
+    }
+    return Qtrue;
+  }
+
+  if( pipe(send.pipe) != 0 ) {
+    rb_sys_fail("send");
+  }
+#ifdef F_SETPIPE_SZ
+  fcntl(send.pipe[1], F_SETPIPE_SZ, ZETTA_SEND_CHUNK);
+#endif
+#ifdef HAVE_SPLICE
+  send.splice = 1;
+#endif
+  send.outfd = send.pipe[1];
+  send.buffer = malloc(ZETTA_SEND_CHUNK);
+  // The sending thread gets its own libzfs handle: the progress callback is
+  // free to use any other handle while the stream is in progress.
+  call.libhandle = libzfs_init();
+  if( send.buffer == NULL || call.libhandle == NULL ||
+      pthread_create(&send.thread, NULL, zetta_call_exec, &call) != 0 ) {
+    free(send.buffer);
+    close(send.pipe[0]);
+    close(send.pipe[1]);
+    if (call.libhandle != NULL) libzfs_fini(call.libhandle);
+    rb_raise(cZfsNoMemoryError, "cannot send: out of memory");
+  }
+
+  rb_ensure(zetta_send_pump_loop, (VALUE)&send, zetta_send_pump_finish, (VALUE)&send);
+  libzfs_fini(call.libhandle);
+
+  // A failed send is reported before the broken pipe it leads to:
+  if (call.ret != 0) {
+    zetta_call_error_exception(&call);
+  }
+  if (send.error != 0) {
+    errno = send.error;
+    rb_sys_fail("send");
+  }
+  return Qtrue;
+}
+
+/*
+ * Receive streams.
+ *
+ * zfs_receive() reads the stream from a pipe, which is fed from a bounded
+ * ring buffer by a writer thread, while a reader thread fills the ring from
+ * the source as fast as the source allows. Hence, jitter on the source side,
+ * (think of a network socket), doesn't stall the kernel side as long as the
+ * ring buffer doesn't run empty.
+ */
+#define ZETTA_RECV_BUFFER (8 << 20)
+
+typedef struct zetta_recv {
+  recvflags_t flags;
+  int fd;
+  int pipe[2];
+  // Ring buffer, head and tail are absolute stream offsets:
+  char *ring;
+  size_t size;
+  uint64_t head;
+  uint64_t tail;
+  int eof;
+  int abort;
+  int error;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t reader;
+  pthread_t writer;
+} zetta_recv_t;
+
+static int zetta_fs_receive_call(zetta_call_t *call)
+{
+  zetta_recv_t *recv = (zetta_recv_t *)call->data;
+
+#ifdef HAVE_RECVFLAGS_T_RESUMABLE
+  return zfs_receive(call->libhandle, call->name, NULL, &recv->flags, recv->pipe[0], NULL);
+#else
+  return zfs_receive(call->libhandle, call->name, recv->flags, recv->pipe[0], NULL);
+#endif
+}
+
+// Fill the ring from the source. The source is polled, so the reader can
+// be stopped when the receive finishes before the source does:
+static void *zetta_recv_reader(void *ptr)
+{
+  zetta_recv_t *recv = (zetta_recv_t *)ptr;
+  struct pollfd pfd;
+  size_t space;
+  ssize_t n = 0;
+
+  pfd.fd = recv->fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    pthread_mutex_lock(&recv->lock);
+    if (n > 0) {
+      recv->head += n;
+      pthread_cond_broadcast(&recv->cond);
+    }
+    while (!recv->abort && !recv->eof && recv->head - recv->tail == recv->size) {
+      pthread_cond_wait(&recv->cond, &recv->lock);
+    }
+    if (recv->abort || recv->eof) {
+      pthread_mutex_unlock(&recv->lock);
+      break;
+    }
+    space = recv->size - (recv->head - recv->tail);
+    if (space > recv->size - (recv->head % recv->size)) {
+      space = recv->size - (recv->head % recv->size);
+    }
+    pthread_mutex_unlock(&recv->lock);
+
+    // The reader is the only one writing past head, the lock isn't needed:
+    n = -1;
+    if (poll(&pfd, 1, 100) > 0) {
+      n = read(recv->fd, recv->ring + (recv->head % recv->size), space);
+      if (n == 0) {
+        // Mark the end of the stream, even for an empty one:
+        pthread_mutex_lock(&recv->lock);
+        recv->eof = 1;
+        pthread_cond_broadcast(&recv->cond);
+        pthread_mutex_unlock(&recv->lock);
+        break;
+      }
+      if (n < 0 && errno != EINTR && errno != EAGAIN) {
+        pthread_mutex_lock(&recv->lock);
+        recv->error = errno;
+        recv->eof = 1;
+        pthread_cond_broadcast(&recv->cond);
+        pthread_mutex_unlock(&recv->lock);
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Drain the ring into the pipe read by zfs_receive():
+static void *zetta_recv_writer(void *ptr)
+{
+  zetta_recv_t *recv = (zetta_recv_t *)ptr;
+  size_t len;
+  ssize_t n = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&recv->lock);
+    if (n > 0) {
+      recv->tail += n;
+      pthread_cond_broadcast(&recv->cond);
+    }
+    while (!recv->abort && !recv->eof && recv->head == recv->tail) {
+      pthread_cond_wait(&recv->cond, &recv->lock);
+    }
+    if (recv->abort || recv->head == recv->tail) {
+      pthread_mutex_unlock(&recv->lock);
+      break;
+    }
+    len = recv->head - recv->tail;
+    if (len > recv->size - (recv->tail % recv->size)) {
+      len = recv->size - (recv->tail % recv->size);
+    }
+    pthread_mutex_unlock(&recv->lock);
+
+    n = write(recv->pipe[1], recv->ring + (recv->tail % recv->size), len);
+    if (n < 0 && errno == EINTR) {
+      n = 0;
+    } else if (n < 0) {
+      // zfs_receive() is done with the stream:
+      break;
+    }
+  }
+  close(recv->pipe[1]);
+  recv->pipe[1] = -1;
+  return NULL;
+}
+
+// Once zfs_receive() returns, stop both threads and wait for them:
+static void *zetta_recv_finish(void *ptr)
+{
+  zetta_recv_t *recv = (zetta_recv_t *)ptr;
+
+  close(recv->pipe[0]);
+  recv->pipe[0] = -1;
+  pthread_mutex_lock(&recv->lock);
+  recv->abort = 1;
+  pthread_cond_broadcast(&recv->cond);
+  pthread_mutex_unlock(&recv->lock);
+  pthread_join(recv->reader, NULL);
+  pthread_join(recv->writer, NULL);
+  return NULL;
+}
+
+// Unblocking function: stopping both threads ends the stream read by
+// zfs_receive(), (the writer closes its end of the pipe), which then fails
+// and returns, so Thread#kill/raise are never held by a stalled source:
+static void zetta_recv_ubf(void *ptr)
+{
+  zetta_recv_t *recv = (zetta_recv_t *)ptr;
+
+  pthread_mutex_lock(&recv->lock);
+  recv->abort = 1;
+  pthread_cond_broadcast(&recv->cond);
+  pthread_mutex_unlock(&recv->lock);
+}
+
+typedef struct zetta_recv_run {
+  zetta_recv_t *recv;
+  zetta_call_t *call;
+  libzfs_handle_t *libhandle;
+} zetta_recv_run_t;
+
+static VALUE zetta_recv_run(VALUE data)
+{
+  zetta_recv_run_t *run = (zetta_recv_run_t *)data;
+
+  zetta_call_blocking_ubf(run->call, zetta_recv_ubf, run->recv);
+  return Qnil;
+}
+
+// Pending interrupts are raised right after the call, so the threads are
+// stopped from here:
+static VALUE zetta_recv_cleanup(VALUE data)
+{
+  zetta_recv_run_t *run = (zetta_recv_run_t *)data;
+
+  zetta_lib_without_gvl(zetta_recv_finish, run->recv);
+  // A forced receive can rollback or destroy snapshots of the target:
+  zetta_handle_cache_invalidate(run->libhandle, run->call->name);
+
+  free(run->recv->ring);
+  pthread_mutex_destroy(&run->recv->lock);
+  pthread_cond_destroy(&run->recv->cond);
+  return Qnil;
+}
+
+static void zetta_recv_options(zetta_recv_t *recv, VALUE options)
+{
+  VALUE buffer;
+
+  recv->fd = zetta_lib_io_fd(rb_hash_aref(options, ID2SYM(rb_intern("from"))));
+  recv->flags.force = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("force"))));
+  recv->flags.isprefix = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("isprefix"))));
+  recv->flags.nomount = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("nomount"))));
+  recv->flags.dryrun = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("dryrun"))));
+
+  if( RTEST(rb_hash_aref(options, ID2SYM(rb_intern("resumable")))) ) {
+#ifdef HAVE_RECVFLAGS_T_RESUMABLE
+    recv->flags.resumable = B_TRUE;
+#else
+    rb_raise(rb_eNotImpError, "Resumable receive is not supported by this libzfs version.");
+#endif
+  }
+
+  buffer = rb_hash_aref(options, ID2SYM(rb_intern("buffer")));
+  recv->size = NIL_P(buffer) ? ZETTA_RECV_BUFFER : NUM2ULONG(buffer);
+  if( recv->size == 0 ) {
+    rb_raise(rb_eArgError, "Receive buffer size must be greater than zero.");
+  }
+}
+
+/*
+ * call-seq:
+ *   ZFS.receive('pool/fs', :from => io_or_fd)  => true
+ *   ZFS.receive('pool/fs@snap', :from => io_or_fd, :force => true)  => true
+ *   ZFS.receive('pool/fs', {:from => io_or_fd}, @zlib)  => true
+ *
+ * Create a snapshot whose contents are read from the stream given by the
+ * <code>:from</code> IO or file descriptor, (the equivalent of
+ * <code>zfs receive</code>), usually generated by ZFS#send_stream.
+ *
+ * The stream is read by a native thread into a bounded buffer, so the
+ * receive keeps going while the source stalls for a while. Thread#kill and
+ * Thread#raise end the stream, (which makes the receive fail), even when
+ * the source never sends anything.
+ *
+ * Options:
+ * - <code>:from</code>: IO instance, (anything responding to
+ *   <code>fileno</code>), or file descriptor the stream is read from.
+ * - <code>:force</code>: rollback the target to its most recent snapshot
+ *   first, (<code>-F</code>).
+ * - <code>:isprefix</code>: use the target as a prefix for the names in the
+ *   stream, (<code>-d</code>).
+ * - <code>:nomount</code>: do not mount the received file system,
+ *   (<code>-u</code>).
+ * - <code>:dryrun</code>: do not actually receive the stream,
+ *   (<code>-n</code>).
+ * - <code>:resumable</code>: keep the partial state of an interrupted
+ *   receive, (<code>-s</code>), when supported by libzfs.
+ * - <code>:buffer</code>: size in bytes of the read-ahead buffer, (8 MB by
+ *   default).
+ *
+ * Raise <code>ZfsError::BadStreamError</code> or
+ * <code>ZfsError::BadRestoreError</code> when the stream cannot be
+ * received, any other <code>ZfsError</code> on other failures, or
+ * <code>SystemCallError</code> when reading from the source fails.
+ *
+ * Raise <code>TypeError</code> when <code>:from</code> is not an IO or a
+ * file descriptor.
+ * Raise <code>NotImplementedError</code> when <code>:resumable</code> is
+ * given and libzfs doesn't support it.
+ *
+ */
+static VALUE zetta_fs_receive(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE name, options, libzfs_handle;
+  libzfs_handle_t *libhandle;
+  zetta_recv_t recv;
+  zetta_recv_run_t run;
+  zetta_call_t call;
+
+  if(argc < 2 || argc > 3) {
+    rb_raise(rb_eArgError, "Target name and options are required");
+  }
+
+  name = argv[0];
+  if( TYPE(name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "Dataset name must be a string.");
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+  if( NIL_P(options) ) {
+    rb_raise(rb_eArgError, "The stream source is required");
+  }
+
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&recv, 0, sizeof(recv));
+  zetta_recv_options(&recv, options);
+
+  zetta_call_init(&call, zetta_fs_receive_call, libhandle);
+  zetta_call_set_name(&call, name);
+  call.data = &recv;
+
+  recv.ring = malloc(recv.size);
+  if( recv.ring == NULL ) {
+    rb_raise(cZfsNoMemoryError, "cannot receive: out of memory");
+  }
+  if( pipe(recv.pipe) != 0 ) {
+    free(recv.ring);
+    rb_sys_fail("receive");
+  }
+  pthread_mutex_init(&recv.lock, NULL);
+  pthread_cond_init(&recv.cond, NULL);
+
+  if( pthread_create(&recv.reader, NULL, zetta_recv_reader, &recv) != 0 ) {
+    recv.abort = 1;
+  } else if( pthread_create(&recv.writer, NULL, zetta_recv_writer, &recv) != 0 ) {
+    pthread_mutex_lock(&recv.lock);
+    recv.abort = 1;
+    pthread_cond_broadcast(&recv.cond);
+    pthread_mutex_unlock(&recv.lock);
+    pthread_join(recv.reader, NULL);
+  }
+  if( recv.abort ) {
+    close(recv.pipe[0]);
+    close(recv.pipe[1]);
+    free(recv.ring);
+    pthread_mutex_destroy(&recv.lock);
+    pthread_cond_destroy(&recv.cond);
+    rb_raise(cZfsNoMemoryError, "cannot receive: out of memory");
+  }
+
+  run.recv = &recv;
+  run.call = &call;
+  run.libhandle = libhandle;
+  rb_ensure(zetta_recv_run, (VALUE)&run, zetta_recv_cleanup, (VALUE)&run);
+
+  // A broken source is reported before the broken stream it leads to:
+  if( recv.error != 0 ) {
+    errno = recv.error;
+    rb_sys_fail("receive");
+  }
+  if( call.ret != 0 ) {
+    zetta_call_error_exception(&call);
+  }
+  return Qtrue;
+}
+
+/*
+ * Dataset iterators collect the handles without the interpreter lock, the
+ * same way than Zpool.each, and yield them once zfs_iter_* has returned.
+ */
+typedef struct zetta_fs_handles {
+  VALUE klass;
+  zfs_handle_t **handles;
+  size_t count;
+  size_t size;
+  size_t next;
+} zetta_fs_handles_t;
+
+static int zetta_fs_handles_f(zfs_handle_t *handle, void *data)
+{
+  zetta_fs_handles_t *list = (zetta_fs_handles_t *)data;
+
+  if (list->count == list->size) {
+    size_t size = list->size ? list->size * 2 : 32;
+    zfs_handle_t **handles = realloc(list->handles, size * sizeof(zfs_handle_t *));
+    if (handles == NULL) {
+      zfs_close(handle);
+      return -1;
+    }
+    list->handles = handles;
+    list->size = size;
+  }
+  list->handles[list->count++] = handle;
+  return 0;
+}
+
+static int zetta_fs_iter_root_call(zetta_call_t *call)
+{
+  return zfs_iter_root(call->libhandle, zetta_fs_handles_f, call->data);
+}
+
+static int zetta_fs_iter_filesystems_call(zetta_call_t *call)
+{
+  return zfs_iter_filesystems(call->zfs_handle, zetta_fs_handles_f, call->data);
+}
+
+static int zetta_fs_iter_snapshots_call(zetta_call_t *call)
+{
+  return zfs_iter_snapshots(call->zfs_handle, zetta_fs_handles_f, call->data);
+}
+
+static int zetta_fs_iter_dependents_call(zetta_call_t *call)
+{
+  // TODO: Allow recursion should be configurable by user?
+  return zfs_iter_dependents(call->zfs_handle, B_TRUE, zetta_fs_handles_f, call->data);
+}
+
+static VALUE zetta_fs_handles_yield(VALUE data)
+{
+  zetta_fs_handles_t *list = (zetta_fs_handles_t *)data;
+
+  while (list->next < list->count) {
+    VALUE zfs = Data_Wrap_Struct(list->klass, 0, zfs_close, list->handles[list->next]);
+    list->next++;
+    rb_yield(zfs);
+  }
+  return Qnil;
+}
+
+// Close the handles which have not been yielded (break, exceptions, ...):
+static VALUE zetta_fs_handles_free(VALUE data)
 {
-  VALUE klass = rb_const_get(rb_cObject, rb_intern("LibZfs"));
-  libzfs_handle_t *handle;
-  zfs_handle_t *zfs_handle;
+  zetta_fs_handles_t *list = (zetta_fs_handles_t *)data;
 
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  while (list->next < list->count) {
+    zfs_close(list->handles[list->next++]);
+  }
+  free(list->handles);
+  return Qnil;
+}
 
-  handle = zfs_get_handle(zfs_handle);
+// Collect with the given call, (already set up), and yield the datasets:
+static VALUE zetta_fs_handles_each(zetta_call_t *call, VALUE klass)
+{
+  zetta_fs_handles_t list;
 
-  // Note that we don't need to free the handle here, because it's just a
-  // copy of one that's already in the garbage collector.
-  return Data_Wrap_Struct(klass, 0, 0, handle);
+  memset(&list, 0, sizeof(list));
+  list.klass = klass;
+  call->data = &list;
+  zetta_call_blocking(call);
+
+  return rb_ensure(zetta_fs_handles_yield, (VALUE)&list, zetta_fs_handles_free, (VALUE)&list);
 }
 
 /*
- *
- * Document-class: ZFS
- *
- * <code>ZFS</code> provides access to properties and operations over
- * ZFS _filesystems_, _snapshots_ or _volumes_, (_ZFS datasets_).
- *
- * In adition to the expected dataset initialization, this class provides
- * facilities to iterate over _root datasets_, and any of their associated
- * dataset types.
- *
- *    [@zlib = LibZfs.new]
- *    @zfs = ZFS.new('dataset/name', ZfsConsts::Types::FILESYSTEM[, @zlib])
- *
- *    @zfs.each_filesystem do |fs|
- *      # access to all the children filesystems of @zfs dataset.
- *    end
- *
- *    @zfs.each_snapshot do |sp|
- *      # access to all the snapshots of @zfs dataset.
- *    end
- *
- *    @zfs.each_dependent do |ds|
- *      # access to all children filesystem, clones and snapshots of
- *      # @zfs dataset.
- *    end
- *
+ * Walks visit every dataset from inside the libzfs zfs_iter_* callbacks, so
+ * visits are run protected: a break, throw or exception raised from the
+ * block must not jump over the libzfs frames. The pending jump is saved into
+ * the iterator state instead, the callback returns non-zero to stop the walk
+ * right away, and the jump is resumed by zetta_fs_iter_end once libzfs has
+ * returned.
+ *
+ * The libzfs handle is owned for the whole walk, but given back while the
+ * block runs.
  */
+typedef struct zetta_fs_iter {
+  VALUE klass;
+  libzfs_handle_t *libhandle;
+  zfs_handle_t *handle;
+  int state;
+} zetta_fs_iter_t;
+
+static void zetta_fs_iter_init(zetta_fs_iter_t *iter, VALUE klass, libzfs_handle_t *libhandle)
+{
+  iter->klass = klass;
+  iter->libhandle = libhandle;
+  iter->handle = NULL;
+  iter->state = 0;
+}
+
+static VALUE zetta_fs_iter_end(zetta_fs_iter_t *iter)
+{
+  if (iter->state != 0) {
+    rb_jump_tag(iter->state);
+  }
+  return Qnil;
+}
 
 /*
  * call-seq:
- *   @zfs = ZFS.new('dataset/name', ZfsConsts::Types)  => object
- *   @zfs = ZFS.new('dataset/name', ZfsConsts::Types, @zlib)  => object
+ *   ZFS.each {|zfs| # ... }  => nil. Iterator.
+ *   ZFS.each(@zlib) {|zfs| # ... }  => nil. Iterator.
+ *   ZFS.each  => Enumerator
  *
+ * Iterates over all the root datasets defined in the system.
+ * An <code>Enumerator</code> is returned when no block is given.
  *
- * ZFS initializer. Raises <code>ArgumentError</code> when
- * <code>dataset_name</code> or <code>dataset_type</code> are not given.
+ *    ZFS.each do |zfs|
+ *      # access to each zfs instance
+ *    end
  *
- * Raise <code>ArgumentError</code> when <code>dataset_name</code> and
- * <code>dataset_type</code> are not given.
- * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
- * is not a <code>String</code>.
- * Raise <code>TypeError</code> when <code>dataset_type</code> is given and it
- * is not an <code>Integer</code>.
  * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
  * is not an instance of <code>LibZfs</code>.
  *
- * TODO: Check that the given type is a valid type
- *
  */
-static VALUE zetta_fs_new(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_fs_iter_root(int argc, VALUE *argv, VALUE klass)
 {
-  VALUE fs_name, libzfs_handle, types;
+  VALUE libzfs_handle;
   libzfs_handle_t *libhandle;
-  zfs_handle_t  *zfs_handle;
-
-  if(argc < 2) {
-    rb_raise(rb_eArgError, "Filesystem name and ZFS Type are required");
-  }
-  fs_name = argv[0];
-  types = argv[1];
-
-  if( TYPE(fs_name) != T_STRING ) {
-    rb_raise(rb_eTypeError, "ZFS Dataset name must be a string.");
-  }
+  zetta_call_t call;
 
-  if( !FIXNUM_P(types) ) {
-    rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
-  }
+  RETURN_ENUMERATOR(klass, argc, argv);
 
-  libzfs_handle = (argc == 2) ? zetta_lib_get_handle() : argv[2];
+  libzfs_handle = (argc == 0) ? zetta_lib_get_handle() : argv[0];
 
   if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
     rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
   }
 
   Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
-  zfs_handle = zfs_open(libhandle, StringValuePtr(fs_name), NUM2INT(types));
-  // Prevent Segementation Faults when the given Dataset does not exist and
-  // somebody tries to access to a given property:
-  if(zfs_handle != NULL) {
-    return Data_Wrap_Struct(klass, 0, zfs_close, zfs_handle);
-  }
-  // Raise exception when cannot get a proper ZFS handle:
-  zetta_lib_error_exception(libhandle);
+
+  zetta_call_init(&call, zetta_fs_iter_root_call, libhandle);
+  zetta_fs_handles_each(&call, klass);
+
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   @zfs.name  => string, zfs dataset name.
+ *   @zfs.each_filesystem {|zfs| # ... }  => nil. Iterator.
+ *   @zfs.each_filesystem  => Enumerator
  *
- * Return current <code>ZFS</code> instance name.
+ * Iterates over all the children datasets of type filesystem for
+ * the current one.
  *
- * The <code>name</code> pointer is stored in the <code>handle</code>, hence
- * we don't need to call <code>zfs.get('name')</code>. This method is
- * more effective.
+ *    @zfs.each_filesystem do |zfs|
+ *      # access to each zfs instance
+ *    end
  *
  */
-static VALUE zetta_fs_get_name(VALUE self)
+static VALUE zetta_fs_iter_filesystems(VALUE self)
 {
   zfs_handle_t *zfs_handle;
-  const char *name = NULL;
+  zetta_call_t call;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
   Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-  name = zfs_get_name(zfs_handle);
-  if(name) {
-    return rb_str_new2(name);
-  }
+
+  zetta_call_init(&call, zetta_fs_iter_filesystems_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  zetta_fs_handles_each(&call, rb_class_of(self));
+
   return Qnil;
 }
 
 /*
  * call-seq:
- *   @zfs.fs_type  => integer, zfs dataset type constant value
+ *   @zfs.each_snapshot {|zfs| # ... }  => nil. Iterator.
+ *   @zfs.each_snapshot  => Enumerator
  *
- * Return the ZFS Dataset Type for the current <code>ZFS</code> dataset
- * instance.
+ * Iterates over all the children datasets of type snapshot for
+ * the current one.
+ *
+ *    @zfs.each_snapshot do |snap|
+ *      # access to each zfs instance
+ *    end
  *
  */
-static VALUE zetta_fs_get_type(VALUE self)
+static VALUE zetta_fs_iter_snapshots(VALUE self)
 {
   zfs_handle_t *zfs_handle;
+  zetta_call_t call;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
   Data_Get_Struct(self, zfs_handle_t, zfs_handle);
 
-  return INT2NUM(zfs_get_type(zfs_handle));
+  zetta_call_init(&call, zetta_fs_iter_snapshots_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  zetta_fs_handles_each(&call, rb_class_of(self));
+
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   @zfs.get('propname')  => string/integer, zfs property value or Nil
- *
- * Given a zfs dataset property name, return its value.
- *
- * Any property value will be a string. For disk space related properties,
- * this string will be nicely formatted as in <code>ZfsLib.nicenum</code>.
- *
- * Raise <code>TypeError</code> when <code>propname</code>
- * is not a <code>String</code>.
+ *   @zfs.each_dependent {|zfs| # ... }  => nil. Iterator.
+ *   @zfs.each_dependent  => Enumerator
  *
- * TODO:
+ * Iterates over all the datasets depending on the current one.
+ * This includes filesystems, snapshots and clones.
  *
- * - Ensure that the given property name is a valid zfs dataset property.
+ *    @zfs.each_dependent do |dataset|
+ *      # access to each zfs instance
+ *    end
  *
  */
-static VALUE zetta_fs_get_prop(VALUE self, VALUE name)
+static VALUE zetta_fs_iter_dependents(VALUE self)
 {
   zfs_handle_t *zfs_handle;
+  zetta_call_t call;
 
-  if( TYPE(name) != T_STRING )
-  {
-    rb_raise(rb_eTypeError, "Property name must be a string.");
-  }
-
-  char *propname = STR2CSTR(name);
-  // Do not use this method to retrieve user properties.
-  if ( zfs_prop_user(propname) ) {
-    rb_raise(rb_eArgError, "Use 'get_user_prop' in order to access user defined properties");
-  }
-  char zfs_prop = zfs_name_to_prop(propname);
-  char propval[ZFS_MAXNAMELEN];
+  RETURN_ENUMERATOR(self, 0, 0);
 
   Data_Get_Struct(self, zfs_handle_t, zfs_handle);
 
-  if ( zfs_prop_get(zfs_handle, zfs_prop, propval, sizeof(propval), NULL, NULL, 0, B_FALSE) != 0 ) {
-    return Qnil;
-  }
-  return ( strcmp( propval, "-" ) == 0 ) ? Qnil: rb_str_new2(propval);
+  zetta_call_init(&call, zetta_fs_iter_dependents_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  zetta_fs_handles_each(&call, rb_class_of(self));
+
+  return Qnil;
 }
 
 /*
- * call-seq:
- *   @zfs.set('propname', "propval")  => Boolean
- *
- * Set the given value for the given zfs dataset property.
- *
- * Raise <code>TypeError</code> when <code>propname</code>
- * is not a <code>String</code>.
- * Raise <code>TypeError</code> when <code>proval</code>
- * is not a <code>String</code>.
+ * Recursive dataset walker.
  *
+ * ZFS.walk traverses a dataset tree natively, the same way that
+ * <code>zfs list -r -d depth -t types -o props</code> does, without creating
+ * a <code>ZFS</code> instance for each dataset: every handle is closed as
+ * soon as its properties have been read.
  */
-
-static VALUE zetta_fs_set_prop(VALUE self, VALUE propname, VALUE propval)
+typedef struct zetta_fs_walk {
+  zetta_fs_iter_t iter;
+  libzfs_handle_t *libhandle;
+  // Name of the root dataset:
+  VALUE root;
+  int types;
+  int depth;
+  int current_depth;
+  // Requested properties: names (frozen strings, shared as Hash keys by all
+  // the records) and their resolved zfs_prop_t, ZPROP_CONT for user props.
+  VALUE prop_names;
+  int *props;
+  long nprops;
+  long batch;
+  VALUE records;
+  // Called (protected) for each dataset walked, zetta_fs_walk_yield unless
+  // the caller collects the datasets some other way:
+  VALUE (*visit)(VALUE);
+  // Set while the libzfs handle is given back to run the block:
+  int yielding;
+} zetta_fs_walk_t;
+
+static VALUE zetta_fs_walk_record(zetta_fs_walk_t *walk, zfs_handle_t *zfs_handle)
 {
-  zfs_handle_t *zfs_handle;
+  VALUE props = rb_hash_new();
+  nvlist_t *user_props = NULL;
+  long i;
 
-  if( TYPE(propname) != T_STRING )
-  {
-    rb_raise(rb_eTypeError, "Property name must be a string.");
+  for (i = 0; i < walk->nprops; i++) {
+    VALUE name = RARRAY_PTR(walk->prop_names)[i];
+    VALUE value;
+
+    if (walk->props[i] == ZPROP_CONT) {
+      if (user_props == NULL) {
+        user_props = zfs_get_user_props(zfs_handle);
+      }
+      value = zetta_fs_user_prop_value(user_props, RSTRING_PTR(name));
+    } else {
+      value = zetta_fs_prop_value(zfs_handle, walk->props[i]);
+    }
+    rb_hash_aset(props, name, value);
   }
 
-  if(TYPE(propval) != T_STRING ) // Maybe should also allow !FIXNUM_P(propval)
-  {
-    rb_raise(rb_eTypeError, "Property value must be a string.");
+  return rb_ary_new3(3, rb_str_new2(zfs_get_name(zfs_handle)),
+    INT2NUM(zfs_get_type(zfs_handle)), props);
+}
+
+// Yield (or collect) the record for the dataset being walked:
+static VALUE zetta_fs_walk_yield(VALUE data)
+{
+  zetta_fs_walk_t *walk = (zetta_fs_walk_t *)data;
+  VALUE record = zetta_fs_walk_record(walk, walk->iter.handle);
+  VALUE yield = Qundef;
+
+  if (!rb_block_given_p()) {
+    rb_ary_push(walk->records, record);
+  } else if (walk->batch > 0) {
+    rb_ary_push(walk->records, record);
+    if (RARRAY_LEN(walk->records) >= walk->batch) {
+      yield = walk->records;
+      walk->records = rb_ary_new();
+    }
+  } else {
+    yield = record;
+  }
+  if (yield != Qundef) {
+    // Taken back by zetta_fs_walk_f when the block breaks out of the walk:
+    walk->yielding = 1;
+    zetta_lib_unlock(walk->libhandle);
+    rb_yield(yield);
+    zetta_lib_lock(walk->libhandle);
+    walk->yielding = 0;
   }
+  return Qnil;
+}
 
-  char *name = STR2CSTR(propname);
-  // FIXME: Property might receive an integer value, so need to check the type.
-  char *val = STR2CSTR(propval);
+static int zetta_fs_walk_f(zfs_handle_t *handle, void *data);
 
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-  return ( zfs_prop_set(zfs_handle, name, val) == 0 ) ? Qtrue : Qfalse;
+static int zetta_fs_walk_children(zetta_fs_walk_t *walk, zfs_handle_t *handle)
+{
+  if (walk->depth >= 0 && walk->current_depth >= walk->depth) {
+    return 0;
+  }
+  walk->current_depth++;
+  zfs_iter_filesystems(handle, zetta_fs_walk_f, walk);
+  if (walk->iter.state == 0 && (walk->types & ZFS_TYPE_SNAPSHOT)) {
+    zfs_iter_snapshots(handle, zetta_fs_walk_f, walk);
+  }
+  walk->current_depth--;
+  return walk->iter.state;
 }
 
-/*
- * call-seq:
- *   @zfs.get_user_prop('user:propname')  => string, user defined property value
- *
- * Given a zfs dataset property name set by user, return its value.
- *
- * <b>Warning:</b> This method relies into libzfs internals, and not the public
- * library interface, using direct lookups into ZFS data type user properties;
- * this is something which might perfectly change on future library versions,
- * hence the word of caution.
- *
- * In order to set user defined properties for a ZFS Dataset, use the same
- * method than for system properties, i.e:
- *
- *    @zfs.set('user_prefix:propname', 'propval')
- *
- * Only string user properties are supported for now.
- *
- * Raise <code>TypeError</code> when <code>propname</code>
- * is not a <code>String</code>.
- *
- * TODO:
- *
- * - Support additional types for user properties.
- *
- */
-static VALUE zetta_fs_get_user_prop(VALUE self, VALUE name)
+static int zetta_fs_walk_f(zfs_handle_t *handle, void *data)
 {
-  zfs_handle_t *zfs_handle;
+  zetta_fs_walk_t *walk = (zetta_fs_walk_t *)data;
+
+  if (walk->iter.state == 0 && (zfs_get_type(handle) & walk->types)) {
+    walk->iter.handle = handle;
+    rb_protect(walk->visit, (VALUE)walk, &walk->iter.state);
+    if (walk->yielding) {
+      zetta_lib_lock(walk->libhandle);
+      walk->yielding = 0;
+    }
+  }
+  if (walk->iter.state == 0 && zfs_get_type(handle) != ZFS_TYPE_SNAPSHOT) {
+    zetta_fs_walk_children(walk, handle);
+  }
+  walk->iter.handle = NULL;
+  zfs_close(handle);
+  return walk->iter.state;
+}
 
-  if( TYPE(name) != T_STRING ) {
-    rb_raise(rb_eTypeError, "Property name must be a string.");
+// Open the root dataset of a walk, raise when it cannot be opened:
+static void zetta_fs_walk_open(zetta_call_t *call, zetta_fs_walk_t *walk, VALUE fs_name)
+{
+  zetta_call_init_op(call, zetta_fs_open_call, "zetta_fs_open", walk->libhandle);
+  zetta_call_set_name(call, fs_name);
+  call->flags = ZFS_TYPE_DATASET;
+  if (zetta_call_blocking(call) != 0) {
+    zetta_call_error_exception(call);
   }
-  char *propname = STR2CSTR(name);
+}
 
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+// Walk the tree from the opened root dataset, counted into LibZfs.stats
+// under op, (including the time spent into blocks called while walking):
+static void zetta_fs_walk_run(zetta_fs_walk_t *walk, zfs_handle_t *root, const char *op)
+{
+  uint64_t start = zetta_stats_begin();
 
-  if ( zfs_prop_user(propname) ) {
-    nvlist_t *user_props = zfs_get_user_props(zfs_handle);
-    nvlist_t *nv;
-    char *value;
+  zetta_lib_lock(walk->libhandle);
+  zetta_fs_walk_f(root, walk);
+  zetta_lib_unlock(walk->libhandle);
+  zetta_stats_end(op, start, walk->iter.state != 0);
+  zetta_fs_iter_end(&walk->iter);
+}
+
+// Walk options, (depth, types, props and batch):
+static void zetta_fs_walk_options(zetta_fs_walk_t *walk, VALUE options)
+{
+  VALUE opt;
+  int i;
+
+  walk->types = ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME;
+  walk->depth = -1;
+  walk->prop_names = rb_ary_new();
+  walk->records = rb_ary_new();
+  walk->visit = zetta_fs_walk_yield;
+
+  if (!NIL_P(options)) {
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("depth"))))) {
+      if (!FIXNUM_P(opt)) {
+        rb_raise(rb_eTypeError, "Walk depth must be an integer.");
+      }
+      walk->depth = FIX2INT(opt);
+    }
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("types"))))) {
+      if (!FIXNUM_P(opt)) {
+        rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
+      }
+      walk->types = FIX2INT(opt);
+    }
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("batch"))))) {
+      if (!FIXNUM_P(opt)) {
+        rb_raise(rb_eTypeError, "Walk batch size must be an integer.");
+      }
+      walk->batch = FIX2LONG(opt);
+    }
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("props"))))) {
+      if (TYPE(opt) != T_ARRAY) {
+        rb_raise(rb_eTypeError, "Property names must be an array of strings.");
+      }
+      for (i = 0; i < RARRAY_LEN(opt); i++) {
+        VALUE name = rb_ary_entry(opt, i);
+        if (TYPE(name) != T_STRING) {
+          rb_raise(rb_eTypeError, "Property names must be an array of strings.");
+        }
+        rb_ary_push(walk->prop_names, rb_obj_freeze(rb_str_dup(name)));
+      }
+    }
+  }
+  walk->nprops = RARRAY_LEN(walk->prop_names);
+}
+
+// Property names are resolved just once for the whole walk, into an array
+// freed by zetta_fs_walk_free, (from an ensure, the walk can raise):
+static void zetta_fs_walk_resolve_props(zetta_fs_walk_t *walk)
+{
+  long i;
 
-    if ( nvlist_lookup_nvlist(user_props, propname, &nv) == 0 ) {
-      if ( nvlist_lookup_string(nv, ZPROP_VALUE, &value) == 0 ) {
-        return rb_str_new2(value);
-      }
-      // TODO: This conditional must continue, and lookup additional types
-      // for user defined properties.
-    }
+  walk->props = ALLOC_N(int, walk->nprops + 1);
+  for (i = 0; i < walk->nprops; i++) {
+    char *propname = RSTRING_PTR(RARRAY_PTR(walk->prop_names)[i]);
+    walk->props[i] = zfs_prop_user(propname) ? ZPROP_CONT : zfs_name_to_prop(propname);
   }
+}
 
+static VALUE zetta_fs_walk_free(VALUE data)
+{
+  zetta_fs_walk_t *walk = (zetta_fs_walk_t *)data;
+
+  xfree(walk->props);
+  walk->props = NULL;
   return Qnil;
 }
 
-/*
- * call-seq:
- *   @zfs.rename('dataset/name', [false|true])  => Boolean
- *
- * Rename ZFS Dataset using the given <code>dataset_name</code>.
- * When <code>recursive</code> is true, also renames all the children
- * datasets for the current one.
- *
- *
- * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
- * is not a <code>String</code>.
- *
- */
-static VALUE zetta_fs_rename(VALUE self, VALUE target, VALUE recursive)
+static VALUE zetta_fs_walk_tree(VALUE data)
 {
-  zfs_handle_t *zfs_handle;
-  if( TYPE(target) != T_STRING ) {
-    rb_raise(rb_eTypeError, "Target dataset name must be a string.");
-  }
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_fs_walk_t *walk = (zetta_fs_walk_t *)data;
+  zetta_call_t call;
 
-  return ( zfs_rename(zfs_handle, StringValuePtr(target), RTEST(recursive)) == 0 ) ? Qtrue : Qfalse;
+  zetta_fs_walk_open(&call, walk, walk->root);
+  // The root dataset is walked (and closed) the same way than its children:
+  zetta_fs_walk_run(walk, call.result, "zetta_fs_walk");
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   ZFS#create('dataset/name', ZfsConsts::Types)  => @zfs dataset instance.
- *   ZFS#create('dataset/name', ZfsConsts::Types, @zlib)  => @zfs dataset instance.
- *
- * Given a <code>dataset_name</code>, and a <code>dataset_type</code>,
- * create a zfs dataset.
- *
- * Return a new Zfs instance for the given dataset on success or raise
- * exception on failure failure.
+ *   ZFS.walk('dataset/name') {|name, type, props| # ... }  => nil. Iterator.
+ *   ZFS.walk('dataset/name', options) {|name, type, props| # ... }  => nil. Iterator.
+ *   ZFS.walk('dataset/name', options, @zlib) {|name, type, props| # ... }  => nil. Iterator.
+ *   ZFS.walk('dataset/name', :batch => 1000) {|records| # ... }  => nil. Iterator.
+ *   ZFS.walk('dataset/name', options)  => Array of [name, type, props]
+ *
+ * Walk the dataset tree starting at (and including) <code>dataset_name</code>,
+ * yielding a <code>[name, type, props]</code> record for each dataset, where
+ * <code>props</code> is a Hash with the values of the requested properties
+ * (the same values returned by <code>@zfs.get_many</code>). This is the
+ * equivalent to <code>zfs list -r -d depth -t types -o props</code>. Records
+ * are returned as an Array when no block is given.
+ *
+ * Options:
+ *
+ * - <code>:depth</code>, how many levels below the given dataset to walk.
+ *   Snapshots are one level below their dataset. Unlimited by default.
+ * - <code>:types</code>, mask of <code>ZfsConsts::Types</code> to report.
+ *   Filesystems and volumes by default.
+ * - <code>:props</code>, Array of property names to read for each dataset.
+ * - <code>:batch</code>, when given, records are yielded in Arrays of up
+ *   to <code>batch</code> elements instead of one by one.
+ *
+ *    ZFS.walk('tpool', :depth => 1, :props => ['used', 'available']) do |name, type, props|
+ *      puts "#{name} #{props['used']}"
+ *    end
  *
- * Raise <code>ArgumentError</code> when <code>dataset_name</code> and
- * <code>dataset_type</code> are not given.
- * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
- * is not a <code>String</code>.
- * Raise <code>TypeError</code> when <code>dataset_type</code> is given and it
- * is not an <code>Integer</code>.
+ * Raise <code>ArgumentError</code> when <code>dataset_name</code> is not
+ * given.
+ * Raise <code>TypeError</code> when <code>dataset_name</code> is not a
+ * <code>String</code>, or the options have the wrong types.
  * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
  * is not an instance of <code>LibZfs</code>.
+ * Raise <code>ZfsError::NoentError</code> when the dataset does not exist.
  *
  */
-static VALUE zetta_fs_create(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_fs_walk(int argc, VALUE *argv, VALUE klass)
 {
-  VALUE fs_name, libzfs_handle, types;
-  libzfs_handle_t *libhandle;
+  VALUE fs_name, options, libzfs_handle;
+  zetta_fs_walk_t walk;
 
-  if(argc < 2) {
-    rb_raise(rb_eArgError, "Filesystem name and ZFS Type are required");
+  if(argc < 1 || argc > 3) {
+    rb_raise(rb_eArgError, "Dataset name is required");
   }
   fs_name = argv[0];
-  types = argv[1];
 
   if( TYPE(fs_name) != T_STRING ) {
     rb_raise(rb_eTypeError, "ZFS Dataset name must be a string.");
   }
 
-  if( !FIXNUM_P(types) ) {
-    rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+
+  memset(&walk, 0, sizeof(walk));
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, walk.libhandle);
+  zetta_fs_iter_init(&walk.iter, klass, walk.libhandle);
+  zetta_fs_walk_options(&walk, options);
+  walk.root = fs_name;
+  zetta_fs_walk_resolve_props(&walk);
+  rb_ensure(zetta_fs_walk_tree, (VALUE)&walk, zetta_fs_walk_free, (VALUE)&walk);
+
+  if (!rb_block_given_p()) {
+    return walk.records;
   }
+  if (walk.batch > 0 && RARRAY_LEN(walk.records) > 0) {
+    rb_yield(walk.records);
+  }
+  return Qnil;
+}
 
-  libzfs_handle = (argc == 2) ? zetta_lib_get_handle() : argv[2];
+/*
+ * Columnar listing.
+ *
+ * ZFS.list walks the same way than ZFS.walk, but collects each property
+ * into a column instead of building a record per dataset. Numeric columns
+ * are kept packed into plain C arrays of uint64_t while walking, and become
+ * a single binary String each at the end.
+ */
+typedef struct zetta_fs_list {
+  zetta_fs_walk_t walk;
+  // One Array per column, Qnil for packed columns:
+  VALUE columns;
+  uint64_t **packed;
+  size_t count;
+  size_t size;
+} zetta_fs_list_t;
+
+static VALUE zetta_fs_list_row(VALUE data)
+{
+  zetta_fs_list_t *list = (zetta_fs_list_t *)data;
+  zfs_handle_t *zfs_handle = list->walk.iter.handle;
+  nvlist_t *user_props = NULL;
+  uint64_t value;
+  size_t size;
+  long i;
+
+  if (list->count == list->size) {
+    size = (list->size == 0) ? 1024 : list->size * 2;
+    for (i = 0; i < list->walk.nprops; i++) {
+      if (NIL_P(RARRAY_PTR(list->columns)[i])) {
+        uint64_t *packed = realloc(list->packed[i], size * sizeof(uint64_t));
+        if (packed == NULL) {
+          rb_raise(cZfsNoMemoryError, "cannot list datasets: out of memory");
+        }
+        list->packed[i] = packed;
+      }
+    }
+    list->size = size;
+  }
 
-  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
-    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  for (i = 0; i < list->walk.nprops; i++) {
+    VALUE column = RARRAY_PTR(list->columns)[i];
+    int prop = list->walk.props[i];
+
+    if (NIL_P(column)) {
+      if (!zfs_prop_valid_for_type(prop, zfs_get_type(zfs_handle)) ||
+          zfs_prop_get_numeric(zfs_handle, prop, &value, NULL, NULL, 0) != 0) {
+        value = UINT64_MAX;
+      }
+      list->packed[i][list->count] = value;
+    } else if (prop == ZFS_PROP_NAME) {
+      rb_ary_push(column, rb_str_new2(zfs_get_name(zfs_handle)));
+    } else if (prop == ZPROP_CONT) {
+      if (user_props == NULL) {
+        user_props = zfs_get_user_props(zfs_handle);
+      }
+      rb_ary_push(column, zetta_fs_user_prop_value(user_props, RSTRING_PTR(RARRAY_PTR(list->walk.prop_names)[i])));
+    } else {
+      rb_ary_push(column, zetta_fs_prop_value(zfs_handle, prop));
+    }
   }
+  list->count++;
+  return Qnil;
+}
 
-  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+static VALUE zetta_fs_list_walk(VALUE data)
+{
+  zetta_fs_list_t *list = (zetta_fs_list_t *)data;
+  VALUE result = rb_hash_new();
+  zetta_call_t call;
+  long i;
+
+  list->packed = ALLOC_N(uint64_t *, list->walk.nprops + 1);
+  MEMZERO(list->packed, uint64_t *, list->walk.nprops + 1);
+  for (i = 0; i < list->walk.nprops; i++) {
+    if (list->walk.props[i] == ZPROP_INVAL) {
+      rb_raise(rb_eArgError, "%s: not a property name", RSTRING_PTR(RARRAY_PTR(list->walk.prop_names)[i]));
+    }
+    rb_ary_push(list->columns, (list->walk.props[i] != ZPROP_CONT &&
+      zfs_prop_get_type(list->walk.props[i]) == PROP_TYPE_NUMBER) ? Qnil : rb_ary_new());
+  }
+
+  zetta_fs_walk_open(&call, &list->walk, list->walk.root);
+  zetta_fs_walk_run(&list->walk, call.result, "zetta_fs_list");
 
-  if (0 == zfs_create(libhandle, StringValuePtr(fs_name), NUM2INT(types), NULL)){
-    zfs_handle_t  *zfs_handle;
-    zfs_handle = zfs_open(libhandle, StringValuePtr(fs_name), NUM2INT(types));
-    return Data_Wrap_Struct(klass, 0, zfs_close, zfs_handle);
+  for (i = 0; i < list->walk.nprops; i++) {
+    VALUE column = RARRAY_PTR(list->columns)[i];
+    if (NIL_P(column)) {
+      column = rb_str_new((char *)list->packed[i], list->count * sizeof(uint64_t));
+    }
+    rb_hash_aset(result, RARRAY_PTR(list->walk.prop_names)[i], column);
   }
-  // Raise exception when cannot get a proper ZFS handle:
-  zetta_lib_error_exception(libhandle);
+  return result;
+}
+
+static VALUE zetta_fs_list_free(VALUE data)
+{
+  zetta_fs_list_t *list = (zetta_fs_list_t *)data;
+  long i;
+
+  for (i = 0; list->packed != NULL && i < list->walk.nprops; i++) {
+    free(list->packed[i]);
+  }
+  xfree(list->packed);
+  return zetta_fs_walk_free((VALUE)&list->walk);
+}
+
+// List columns, 'name', 'used', 'available' and 'referenced' by default:
+static void zetta_fs_list_options(zetta_fs_list_t *list, VALUE options)
+{
+  VALUE columns = Qnil, recursive = Qnil;
+  long i;
+
+  zetta_fs_walk_options(&list->walk, options);
+  list->walk.visit = zetta_fs_list_row;
+
+  if (!NIL_P(options)) {
+    columns = rb_hash_aref(options, ID2SYM(rb_intern("columns")));
+    recursive = rb_hash_aref(options, ID2SYM(rb_intern("recursive")));
+    // Only the given dataset unless asked otherwise, the same than zfs list:
+    if (NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("depth"))))) {
+      list->walk.depth = RTEST(recursive) ? -1 : 0;
+    }
+  } else {
+    list->walk.depth = 0;
+  }
+
+  if (NIL_P(columns)) {
+    columns = rb_ary_new3(4, rb_str_new2("name"), rb_str_new2("used"),
+      rb_str_new2("available"), rb_str_new2("referenced"));
+  }
+  if (TYPE(columns) != T_ARRAY) {
+    rb_raise(rb_eTypeError, "Columns must be an array of property names.");
+  }
+
+  list->walk.prop_names = rb_ary_new();
+  list->columns = rb_ary_new();
+  for (i = 0; i < RARRAY_LEN(columns); i++) {
+    VALUE name = rb_ary_entry(columns, i);
+    if (TYPE(name) != T_STRING) {
+      rb_raise(rb_eTypeError, "Columns must be an array of property names.");
+    }
+    rb_ary_push(list->walk.prop_names, rb_obj_freeze(rb_str_dup(name)));
+  }
+  list->walk.nprops = RARRAY_LEN(list->walk.prop_names);
 }
 
 /*
  * call-seq:
- *   ZFS#exists?('dataset/name', ZfsConsts::Types)  => Boolean
- *   ZFS#exists?('dataset/name', ZfsConsts::Types, @zlib)  => Boolean
- *   ZFS#exist?('dataset/name', ZfsConsts::Types)  => Boolean
- *   ZFS#exist?('dataset/name', ZfsConsts::Types, @zlib)  => Boolean
- *
- * Check if a dataset with the given <code>dataset_name</code>, of the given
- * <code>dataset_type</code> exists.
- *
- * Return true on success or false on failure.
- *
- * Raise <code>ArgumentError</code> when <code>dataset_name</code> and
- * <code>dataset_type</code> are not given.
- * Raise <code>TypeError</code> when <code>dataset_name</code> is given and it
- * is not a <code>String</code>.
- * Raise <code>TypeError</code> when <code>dataset_type</code> is given and it
- * is not an <code>Integer</code>.
+ *   ZFS.list('dataset/name')  => Hash, {'column' => values}
+ *   ZFS.list('dataset/name', :recursive => true, :columns => ['name', 'used'])  => Hash, {'column' => values}
+ *   ZFS.list('dataset/name', options, @zlib)  => Hash, {'column' => values}
+ *
+ * List datasets by columns, (the equivalent to
+ * <code>zfs list -Hp -r -o columns -t types</code>), returning a Hash with
+ * the values of each column for all the datasets listed, in the same
+ * order, without creating a <code>ZFS</code> instance for each dataset.
+ *
+ * Numeric property columns are returned packed into a binary String of
+ * native 64 bits unsigned integers, with one exact value per dataset, (use
+ * <code>unpack('Q*')</code> to get an Array). Values not available for a
+ * dataset are <code>ZFS::UNAVAILABLE</code>. Any other column is an Array
+ * with the same values returned by <code>@zfs.get_many</code>.
+ *
+ * Options:
+ *
+ * - <code>:columns</code>, Array of property names, including
+ *   <code>name</code> and user properties. By default
+ *   <code>['name', 'used', 'available', 'referenced']</code>.
+ * - <code>:recursive</code>, list all the descendants of the given dataset
+ *   too. Only the given dataset is listed by default.
+ * - <code>:depth</code>, the same than for <code>ZFS.walk</code>, implies
+ *   <code>:recursive</code>.
+ * - <code>:types</code>, mask of <code>ZfsConsts::Types</code> to list.
+ *   Filesystems and volumes by default.
+ *
+ *    list = ZFS.list('tpool', :recursive => true, :types => ZfsConsts::Types::DATASET)
+ *    list['name'].zip(list['used'].unpack('Q*'))
+ *
+ * Raise <code>ArgumentError</code> when any column is not a property name.
+ * Raise <code>TypeError</code> when <code>dataset_name</code> is not a
+ * <code>String</code>, or the options have the wrong types.
  * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
  * is not an instance of <code>LibZfs</code>.
+ * Raise <code>ZfsError::NoentError</code> when the dataset does not exist.
  *
  */
-static VALUE zetta_fs_dataset_exists(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_fs_list(int argc, VALUE *argv, VALUE klass)
 {
-  VALUE fs_name, libzfs_handle, types;
-  libzfs_handle_t *libhandle;
+  VALUE fs_name, options, libzfs_handle;
+  zetta_fs_list_t list;
 
-  if(argc < 2) {
-    rb_raise(rb_eArgError, "Filesystem name and ZFS Type are required");
+  if(argc < 1 || argc > 3) {
+    rb_raise(rb_eArgError, "Dataset name is required");
   }
   fs_name = argv[0];
-  types = argv[1];
 
   if( TYPE(fs_name) != T_STRING ) {
     rb_raise(rb_eTypeError, "ZFS Dataset name must be a string.");
   }
 
-  if( !FIXNUM_P(types) ) {
-    rb_raise(rb_eTypeError, "ZFS Dataset type must be an integer.");
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+
+  memset(&list, 0, sizeof(list));
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, list.walk.libhandle);
+  zetta_fs_iter_init(&list.walk.iter, klass, list.walk.libhandle);
+  zetta_fs_list_options(&list, options);
+  list.walk.root = fs_name;
+  zetta_fs_walk_resolve_props(&list.walk);
+  return rb_ensure(zetta_fs_list_walk, (VALUE)&list, zetta_fs_list_free, (VALUE)&list);
+}
+
+/*
+ * Dataset catalog.
+ *
+ * ZFS::Catalog.write walks a dataset tree the same way than ZFS.walk, and
+ * saves the name, guid, createtxg, type and the requested numeric properties
+ * of every dataset into a compact binary file. ZFS::Catalog.open maps that
+ * file into memory, so opening a catalog costs nothing up front: records are
+ * only decoded when read.
+ *
+ * File layout, (native byte order and word size):
+ *
+ *   header             zetta_catalog_header_t, (root dataset, pool guid and
+ *                      the walk types and depth, to check it later)
+ *   property names     nprops * ZETTA_CATALOG_PROPLEN bytes
+ *   records            count * (4 + nprops) uint64_t: name offset, guid,
+ *                      createtxg, type and the property values
+ *   index              count * uint64_t, record numbers sorted by name
+ *   names              names_size bytes, NUL terminated names
+ */
+#define ZETTA_CATALOG_MAGIC "ZETTACAT"
+#define ZETTA_CATALOG_VERSION 2
+#define ZETTA_CATALOG_PROPLEN 64
+
+typedef struct zetta_catalog_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nprops;
+  uint64_t count;
+  uint64_t pool_guid;
+  uint32_t types;
+  int32_t depth;
+  uint64_t names_size;
+  char root[ZFS_MAXNAMELEN];
+} zetta_catalog_header_t;
+
+typedef struct zetta_catalog {
+  void *addr;
+  size_t length;
+  zetta_catalog_header_t *header;
+  char *prop_names;
+  uint64_t *records;
+  uint64_t *index;
+  char *names;
+} zetta_catalog_t;
+
+// ZFS::Catalog, defined at Init_zetta:
+static VALUE cZfsCatalog = Qnil;
+
+typedef struct zetta_catalog_writer {
+  zetta_fs_walk_t walk;
+  VALUE path;
+  uint64_t *records;
+  size_t count;
+  size_t size;
+  char *names;
+  size_t names_size;
+  size_t names_alloc;
+} zetta_catalog_writer_t;
+
+typedef struct zetta_catalog_sort {
+  const char *name;
+  uint64_t record;
+} zetta_catalog_sort_t;
+
+static int zetta_catalog_sort_cmp(const void *a, const void *b)
+{
+  return strcmp(((const zetta_catalog_sort_t *)a)->name, ((const zetta_catalog_sort_t *)b)->name);
+}
+
+// Saved value of a numeric property, UINT64_MAX when not available:
+static uint64_t zetta_catalog_value(zfs_handle_t *zfs_handle, int prop)
+{
+  uint64_t value;
+
+  if (prop == ZPROP_INVAL || !zfs_prop_valid_for_type(prop, zfs_get_type(zfs_handle)) ||
+      zfs_prop_get_numeric(zfs_handle, prop, &value, NULL, NULL, 0) != 0) {
+    value = UINT64_MAX;
   }
+  return value;
+}
 
-  libzfs_handle = (argc == 2) ? zetta_lib_get_handle() : argv[2];
+static VALUE zetta_catalog_row(VALUE data)
+{
+  zetta_catalog_writer_t *writer = (zetta_catalog_writer_t *)data;
+  zfs_handle_t *zfs_handle = writer->walk.iter.handle;
+  size_t words = 4 + writer->walk.nprops;
+  const char *name = zfs_get_name(zfs_handle);
+  size_t len = strlen(name) + 1;
+  uint64_t *record;
+  long i;
+
+  if (writer->count == writer->size) {
+    size_t size = (writer->size == 0) ? 1024 : writer->size * 2;
+    uint64_t *records = realloc(writer->records, size * words * sizeof(uint64_t));
+    if (records == NULL) {
+      rb_raise(cZfsNoMemoryError, "cannot write the catalog: out of memory");
+    }
+    writer->records = records;
+    writer->size = size;
+  }
+  if (writer->names_size + len > writer->names_alloc) {
+    size_t alloc = (writer->names_alloc == 0) ? 65536 : writer->names_alloc * 2;
+    char *names;
+    while (writer->names_size + len > alloc) {
+      alloc *= 2;
+    }
+    if ((names = realloc(writer->names, alloc)) == NULL) {
+      rb_raise(cZfsNoMemoryError, "cannot write the catalog: out of memory");
+    }
+    writer->names = names;
+    writer->names_alloc = alloc;
+  }
 
-  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
-    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  record = writer->records + writer->count * words;
+  record[0] = writer->names_size;
+  record[1] = zfs_prop_get_int(zfs_handle, ZFS_PROP_GUID);
+  record[2] = zfs_prop_get_int(zfs_handle, ZFS_PROP_CREATETXG);
+  record[3] = zfs_get_type(zfs_handle);
+  for (i = 0; i < writer->walk.nprops; i++) {
+    record[4 + i] = zetta_catalog_value(zfs_handle, writer->walk.props[i]);
   }
+  memcpy(writer->names + writer->names_size, name, len);
+  writer->names_size += len;
+  writer->count++;
+  return Qnil;
+}
 
-  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+// Guid of the pool of the given dataset, (the pool name is up to the first
+// '/' or '@'), to tell it from another pool with the same name later:
+static int zetta_catalog_pool_guid(libzfs_handle_t *libhandle, const char *root, uint64_t *guid)
+{
+  zpool_handle_t *zpool_handle;
+  char pool[ZFS_MAXNAMELEN];
+
+  snprintf(pool, sizeof(pool), "%.*s", (int)strcspn(root, "/@"), root);
+  if ((zpool_handle = zpool_open_canfail(libhandle, pool)) == NULL) {
+    return -1;
+  }
+  *guid = zpool_get_prop_int(zpool_handle, ZPOOL_PROP_GUID, NULL);
+  zpool_close(zpool_handle);
+  return 0;
+}
+
+static VALUE zetta_catalog_write_file(VALUE data)
+{
+  zetta_catalog_writer_t *writer = (zetta_catalog_writer_t *)data;
+  zetta_catalog_header_t header;
+  zetta_catalog_sort_t *sorted;
+  char prop_name[ZETTA_CATALOG_PROPLEN];
+  size_t words = 4 + writer->walk.nprops;
+  zetta_call_t call;
+  VALUE tmp_path;
+  uint64_t record;
+  FILE *file;
+  size_t i;
+  long j;
+
+  for (j = 0; j < writer->walk.nprops; j++) {
+    if (writer->walk.props[j] == ZPROP_INVAL || writer->walk.props[j] == ZPROP_CONT ||
+        zfs_prop_get_type(writer->walk.props[j]) != PROP_TYPE_NUMBER) {
+      rb_raise(rb_eArgError, "%s: not a numeric property", RSTRING_PTR(RARRAY_PTR(writer->walk.prop_names)[j]));
+    }
+  }
+
+  zetta_fs_walk_open(&call, &writer->walk, writer->walk.root);
+  zetta_fs_walk_run(&writer->walk, call.result, "zetta_catalog_write");
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ZETTA_CATALOG_MAGIC, sizeof(header.magic));
+  header.version = ZETTA_CATALOG_VERSION;
+  header.nprops = writer->walk.nprops;
+  header.count = writer->count;
+  header.names_size = writer->names_size;
+  header.types = writer->walk.types;
+  header.depth = writer->walk.depth;
+  snprintf(header.root, sizeof(header.root), "%s", RSTRING_PTR(writer->walk.root));
+  zetta_lib_lock(writer->walk.libhandle);
+  if (zetta_catalog_pool_guid(writer->walk.libhandle, header.root, &header.pool_guid) != 0) {
+    zetta_lib_unlock(writer->walk.libhandle);
+    zetta_lib_error_exception(writer->walk.libhandle);
+  }
+  zetta_lib_unlock(writer->walk.libhandle);
+
+  sorted = ALLOC_N(zetta_catalog_sort_t, writer->count + 1);
+  for (i = 0; i < writer->count; i++) {
+    sorted[i].name = writer->names + writer->records[i * words];
+    sorted[i].record = i;
+  }
+  qsort(sorted, writer->count, sizeof(zetta_catalog_sort_t), zetta_catalog_sort_cmp);
+
+  // Written aside and renamed, so readers never map a partial catalog:
+  tmp_path = rb_str_plus(writer->path, rb_str_new2(".tmp"));
+  if ((file = fopen(RSTRING_PTR(tmp_path), "wb")) == NULL) {
+    xfree(sorted);
+    rb_sys_fail(RSTRING_PTR(tmp_path));
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  for (j = 0; j < writer->walk.nprops; j++) {
+    memset(prop_name, 0, sizeof(prop_name));
+    strncpy(prop_name, RSTRING_PTR(RARRAY_PTR(writer->walk.prop_names)[j]), sizeof(prop_name) - 1);
+    fwrite(prop_name, sizeof(prop_name), 1, file);
+  }
+  fwrite(writer->records, words * sizeof(uint64_t), writer->count, file);
+  for (i = 0; i < writer->count; i++) {
+    record = sorted[i].record;
+    fwrite(&record, sizeof(record), 1, file);
+  }
+  fwrite(writer->names, 1, writer->names_size, file);
+  xfree(sorted);
 
-  return zfs_dataset_exists(libhandle, StringValuePtr(fs_name), NUM2INT(types)) ? Qtrue : Qfalse;
+  if (ferror(file) || fclose(file) != 0) {
+    unlink(RSTRING_PTR(tmp_path));
+    rb_sys_fail(RSTRING_PTR(writer->path));
+  }
+  if (rename(RSTRING_PTR(tmp_path), RSTRING_PTR(writer->path)) != 0) {
+    unlink(RSTRING_PTR(tmp_path));
+    rb_sys_fail(RSTRING_PTR(writer->path));
+  }
+  return ULL2NUM(writer->count);
+}
+
+static VALUE zetta_catalog_writer_free(VALUE data)
+{
+  zetta_catalog_writer_t *writer = (zetta_catalog_writer_t *)data;
+
+  free(writer->records);
+  free(writer->names);
+  return zetta_fs_walk_free((VALUE)&writer->walk);
 }
 
 /*
  * call-seq:
- *   ZFS#snapshot('snap/shot@name')  => ZFS instance
- *   ZFS#snapshot('snap/shot@name', @zlib)  => ZFS instance
+ *   ZFS::Catalog.write('/path/to/catalog', 'pool/fs')  => Integer, number of datasets
+ *   ZFS::Catalog.write('/path/to/catalog', 'pool/fs', :props => ['used', 'quota'])  => Integer
+ *   ZFS::Catalog.write('/path/to/catalog', 'pool/fs', options, @zlib)  => Integer
  *
- * Check if a dataset with the given <code>dataset_name</code>, of the given
- * <code>dataset_type</code> exists.
+ * Walk the dataset tree starting at (and including) <code>dataset_name</code>
+ * and save the name, guid, createtxg and type of every dataset, together
+ * with the exact values of the requested numeric properties, into the given
+ * catalog file, replacing it atomically. The pool txg is saved too, in order
+ * to tell later whether the catalog is still current. Use
+ * <code>ZFS::Catalog.open</code> to read it.
  *
- * Return a ZFS snapshot instance on success or raise error on failure.
+ * Options are the same than for <code>ZFS.walk</code>, except that all the
+ * dataset types are saved by default, and <code>:props</code> can only
+ * include numeric properties.
  *
- * Raise <code>ArgumentError</code> when <code>snapshot_name</code> is not
- * given.
- * Raise <code>TypeError</code> when <code>snapshot_name</code> is given and it
- * is not a <code>String</code>.
- * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
- * is not an instance of <code>LibZfs</code>.
+ * Raise <code>ArgumentError</code> when a property is not numeric.
+ * Raise <code>ZfsError::NoentError</code> when the dataset does not exist,
+ * or <code>SystemCallError</code> when the file cannot be written.
  *
  */
-static VALUE zetta_fs_snapshot(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_catalog_write(int argc, VALUE *argv, VALUE klass)
 {
-  VALUE snapshot_name, libzfs_handle;
-  libzfs_handle_t *libhandle;
+  VALUE path, fs_name, options, libzfs_handle;
+  zetta_catalog_writer_t writer;
 
-  if(argc < 1) {
-    rb_raise(rb_eArgError, "Snapshot name is required required");
+  if(argc < 2 || argc > 4) {
+    rb_raise(rb_eArgError, "Catalog path and dataset name are required");
   }
+  path = argv[0];
+  fs_name = argv[1];
 
-  snapshot_name = argv[0];
+  if( TYPE(path) != T_STRING || TYPE(fs_name) != T_STRING ) {
+    rb_raise(rb_eTypeError, "Catalog path and dataset name must be strings.");
+  }
 
-  if( TYPE(snapshot_name) != T_STRING ) {
-    rb_raise(rb_eTypeError, "Snapshot name must be a string.");
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 2, &options);
+
+  memset(&writer, 0, sizeof(writer));
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, writer.walk.libhandle);
+  zetta_fs_iter_init(&writer.walk.iter, rb_const_get(rb_cObject, rb_intern("ZFS")), writer.walk.libhandle);
+  zetta_fs_walk_options(&writer.walk, options);
+  if (NIL_P(options) || NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("types"))))) {
+    writer.walk.types = ZFS_TYPE_DATASET;
   }
+  writer.walk.visit = zetta_catalog_row;
+  writer.walk.root = fs_name;
+  writer.path = path;
+  zetta_fs_walk_resolve_props(&writer.walk);
+  return rb_ensure(zetta_catalog_write_file, (VALUE)&writer, zetta_catalog_writer_free, (VALUE)&writer);
+}
 
-  libzfs_handle = (argc == 1) ? zetta_lib_get_handle() : argv[1];
+static void zetta_catalog_free(zetta_catalog_t *catalog)
+{
+  if (catalog->addr != NULL) {
+    munmap(catalog->addr, catalog->length);
+  }
+  xfree(catalog);
+}
 
-  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
-    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+// Check the mapped file is a complete catalog, and find its sections:
+static int zetta_catalog_map(zetta_catalog_t *catalog)
+{
+  zetta_catalog_header_t *header = (zetta_catalog_header_t *)catalog->addr;
+  uint64_t words, length;
+
+  if (catalog->length < sizeof(zetta_catalog_header_t) ||
+      memcmp(header->magic, ZETTA_CATALOG_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != ZETTA_CATALOG_VERSION) {
+    return -1;
+  }
+  words = 4 + header->nprops;
+  if (header->count > catalog->length / sizeof(uint64_t) / (words + 1)) {
+    return -1;
+  }
+  length = sizeof(zetta_catalog_header_t) + (uint64_t)header->nprops * ZETTA_CATALOG_PROPLEN +
+    header->count * (words + 1) * sizeof(uint64_t) + header->names_size;
+  if (length != catalog->length || (header->names_size > 0 &&
+      ((char *)catalog->addr)[catalog->length - 1] != '\0')) {
+    return -1;
   }
 
-  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+  catalog->header = header;
+  catalog->prop_names = (char *)catalog->addr + sizeof(zetta_catalog_header_t);
+  catalog->records = (uint64_t *)(catalog->prop_names + header->nprops * ZETTA_CATALOG_PROPLEN);
+  catalog->index = catalog->records + header->count * words;
+  catalog->names = (char *)(catalog->index + header->count);
+  return 0;
+}
 
-  if ( 0 == zfs_snapshot(libhandle, StringValuePtr(snapshot_name), B_FALSE, NULL) ){
-    zfs_handle_t  *zfs_handle;
-    zfs_handle = zfs_open(libhandle, StringValuePtr(snapshot_name), ZFS_TYPE_SNAPSHOT);
-    return Data_Wrap_Struct(klass, 0, zfs_close, zfs_handle);
+static zetta_catalog_t *zetta_catalog_get(VALUE self)
+{
+  zetta_catalog_t *catalog;
+
+  Data_Get_Struct(self, zetta_catalog_t, catalog);
+  if (catalog->header == NULL) {
+    rb_raise(rb_eIOError, "catalog not opened");
   }
-  zetta_lib_error_exception(libhandle);
+  return catalog;
+}
+
+static VALUE zetta_catalog_alloc(VALUE klass)
+{
+  zetta_catalog_t *catalog = ALLOC(zetta_catalog_t);
+
+  memset(catalog, 0, sizeof(zetta_catalog_t));
+  return Data_Wrap_Struct(klass, 0, zetta_catalog_free, catalog);
 }
 
 /*
  * call-seq:
- *   @zfs.rollback(@zfs_snapshot, true|false)  => Boolean
- *
- * Rollback the current <code>ZFS</code> instance to the given
- * ZFS Snapshot instance. Second argument <code>force</code> has the
- * same efect than the <code>-Rf</code> option for <code>zfs rollback</code>.
+ *   ZFS::Catalog.open('/path/to/catalog')  => ZFS::Catalog
  *
+ * Map the given catalog file, (as saved by <code>ZFS::Catalog.write</code>),
+ * into memory. The file is not read up front: records are decoded on demand,
+ * so opening a catalog takes the same time whatever the number of datasets.
  *
- * Raise <code>TypeError</code> when <code>snapshot</code>
- * is not an instance of <code>ZFS</code>.
- * Raise <code>TypeError</code> when <code>snapshot</code>
- * instance of <code>ZFS</code> is not of type <i>snapshot</i>.
- * Raise <code>NoMethodError</code> when the current <code>ZfsLib</code>
- * instance is not a Filesystem or Volume.
+ * Raise <code>ArgumentError</code> when the file is not a catalog, or it was
+ * written by a different version, and <code>SystemCallError</code> when the
+ * file cannot be opened.
  *
  */
-static VALUE zetta_fs_rollback(VALUE self, VALUE snapshot, VALUE force)
+static VALUE zetta_catalog_open(VALUE klass, VALUE path)
 {
-  zfs_handle_t *zfs_handle, *snapshot_zfs_handle;
+  VALUE self = zetta_catalog_alloc(klass);
+  zetta_catalog_t *catalog;
+  struct stat st;
+  int fd;
 
-  if(CLASS_OF(snapshot) != rb_const_get(rb_cObject, rb_intern("ZFS"))) {
-    rb_raise(rb_eTypeError, "Snapshot must be an instance of ZFS.");
+  Data_Get_Struct(self, zetta_catalog_t, catalog);
+
+  if ((fd = open(StringValueCStr(path), O_RDONLY)) == -1) {
+    rb_sys_fail(RSTRING_PTR(path));
   }
-  // Get the snapshot handle:
-  Data_Get_Struct(snapshot, zfs_handle_t, snapshot_zfs_handle);
-  // Get current volume/filesystem handle:
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-  // Raise error if the given snapshot instance is not a Snapshot:
-  if(zfs_get_type(snapshot_zfs_handle) != ZFS_TYPE_SNAPSHOT) {
-    rb_raise(rb_eTypeError, "ZFS snapshot instance must be of type Snapshot.");
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    rb_sys_fail(RSTRING_PTR(path));
   }
-  // Raise error when trying to rollback whatever not a volume/filesystem:
-  if( zfs_get_type(zfs_handle) != ZFS_TYPE_FILESYSTEM && zfs_get_type(zfs_handle) != ZFS_TYPE_VOLUME ) {
-    rb_raise(rb_eNoMethodError, "Rollback operation is only available for Datasets of type filesystem or volume.");
+  catalog->length = st.st_size;
+  if (catalog->length > 0) {
+    catalog->addr = mmap(NULL, catalog->length, PROT_READ, MAP_SHARED, fd, 0);
   }
+  close(fd);
+  if (catalog->addr == MAP_FAILED) {
+    catalog->addr = NULL;
+    rb_sys_fail(RSTRING_PTR(path));
+  }
+  if (catalog->addr == NULL || zetta_catalog_map(catalog) != 0) {
+    rb_raise(rb_eArgError, "%s: not a dataset catalog", RSTRING_PTR(path));
+  }
+  rb_iv_set(self, "@path", rb_obj_freeze(rb_str_dup(path)));
+  return self;
+}
+
+// [name, type, guid, createtxg, props] for the given record number. Records
+// are only checked when decoded, so opening a catalog doesn't read them all:
+static VALUE zetta_catalog_record(zetta_catalog_t *catalog, uint64_t n)
+{
+  uint64_t words = 4 + catalog->header->nprops;
+  uint64_t *record = catalog->records + n * words;
+  VALUE props;
+  uint32_t i;
 
-  return ( zfs_rollback(zfs_handle, snapshot_zfs_handle, RTEST(force)) == 0 ) ? Qtrue : Qfalse;
+  if (n >= catalog->header->count || record[0] >= catalog->header->names_size) {
+    rb_raise(rb_eArgError, "corrupted dataset catalog");
+  }
+  props = rb_hash_new();
+  for (i = 0; i < catalog->header->nprops; i++) {
+    char *name = catalog->prop_names + i * ZETTA_CATALOG_PROPLEN;
+    rb_hash_aset(props, rb_str_new(name, strnlen(name, ZETTA_CATALOG_PROPLEN)),
+      record[4 + i] == UINT64_MAX ? Qnil : ULL2NUM(record[4 + i]));
+  }
+  return rb_ary_new3(5, rb_str_new2(catalog->names + record[0]), INT2NUM((int)record[3]),
+    ULL2NUM(record[1]), ULL2NUM(record[2]), props);
 }
 
 /*
  * call-seq:
- *   @zfs.clone!('clone_name')  => ZFS instance
+ *   catalog.size  => Integer
  *
- * Create a clone with the given <code>clone_name</code> for the current
- * ZFS Snapshot instance. Raise <code>ZfsError</code> on failure.
+ * Number of datasets saved into the catalog.
  *
+ */
+static VALUE zetta_catalog_size(VALUE self)
+{
+  return ULL2NUM(zetta_catalog_get(self)->header->count);
+}
+
+/*
+ * call-seq:
+ *   catalog.pool  => String
  *
- * Raise <code>TypeError</code> when <code>clone_name</code>
- * is not a <code>String</code>.
- * Raise <code>NoMethodError</code> when the current <code>ZfsLib</code>
- * instance is not a Snapshot.
+ * Name of the pool the catalog was written from.
  *
+ */
+static VALUE zetta_catalog_pool(VALUE self)
+{
+  zetta_catalog_t *catalog = zetta_catalog_get(self);
+  return rb_str_new(catalog->header->root, strcspn(catalog->header->root, "/@"));
+}
+
+/*
+ * call-seq:
+ *   catalog.props  => Array of property names
  *
- * NOTE: This method cannot be <i>clone</i> due to obvious Ruby reasons.
+ * The names of the properties saved for every dataset.
  *
  */
-static VALUE zetta_fs_clone(VALUE self, VALUE clone_name)
+static VALUE zetta_catalog_props(VALUE self)
 {
-  zfs_handle_t *zfs_handle;
-
-  if( TYPE(clone_name) != T_STRING ) {
-    rb_raise(rb_eTypeError, "Clone name must be a string.");
-  }
-
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_catalog_t *catalog = zetta_catalog_get(self);
+  VALUE props = rb_ary_new();
+  uint32_t i;
 
-  if(zfs_get_type(zfs_handle) != ZFS_TYPE_SNAPSHOT) {
-    rb_raise(rb_eNoMethodError, "Clone operation is only available for Datasets of type snapshot.");
+  for (i = 0; i < catalog->header->nprops; i++) {
+    char *name = catalog->prop_names + i * ZETTA_CATALOG_PROPLEN;
+    rb_ary_push(props, rb_str_new(name, strnlen(name, ZETTA_CATALOG_PROPLEN)));
   }
+  return props;
+}
 
-  libzfs_handle_t *libhandle = zfs_get_handle(zfs_handle);
+/*
+ * call-seq:
+ *   catalog.each {|name, type, guid, createtxg, props| # ... }  => nil. Iterator.
+ *   catalog.each  => Enumerator
+ *
+ * Iterates over the datasets saved into the catalog, in walk order, (each
+ * dataset followed by its descendants). <code>props</code> is a Hash with
+ * the saved values, <code>nil</code> for values not available.
+ * An <code>Enumerator</code> is returned when no block is given.
+ *
+ */
+static VALUE zetta_catalog_each(VALUE self)
+{
+  zetta_catalog_t *catalog;
+  uint64_t i;
 
-  if (0 == zfs_clone(zfs_handle, StringValuePtr(clone_name), NULL)){
-    zfs_handle_t  *zfs_clone_handle;
+  RETURN_ENUMERATOR(self, 0, 0);
 
-    zfs_clone_handle = zfs_open(libhandle, StringValuePtr(clone_name), ZFS_TYPE_FILESYSTEM);
-    return Data_Wrap_Struct(CLASS_OF(self), 0, zfs_close, zfs_clone_handle);
+  catalog = zetta_catalog_get(self);
+  for (i = 0; i < catalog->header->count; i++) {
+    rb_yield(zetta_catalog_record(catalog, i));
   }
-  zetta_lib_error_exception(libhandle);
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   @zfs.promote  => Boolean
+ *   catalog['dataset/name']  => [name, type, guid, createtxg, props]
  *
- * Promote the current clone to be no longer dependent on its origin.
+ * Find the given dataset into the catalog, without decoding any other
+ * record. Return <code>nil</code> when the dataset is not in the catalog.
  *
  */
-static VALUE zetta_fs_promote(VALUE self)
+static VALUE zetta_catalog_aref(VALUE self, VALUE name)
 {
-  zfs_handle_t *zfs_handle;
-
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-
-  return (zfs_promote(zfs_handle) == 0) ? Qtrue : Qfalse;
+  zetta_catalog_t *catalog = zetta_catalog_get(self);
+  uint64_t words = 4 + catalog->header->nprops;
+  uint64_t low = 0, high = catalog->header->count;
+  const char *key = StringValueCStr(name);
+
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    uint64_t n = catalog->index[middle];
+    int cmp;
+
+    if (n >= catalog->header->count || catalog->records[n * words] >= catalog->header->names_size) {
+      rb_raise(rb_eArgError, "corrupted dataset catalog");
+    }
+    cmp = strcmp(key, catalog->names + catalog->records[n * words]);
+    if (cmp == 0) {
+      return zetta_catalog_record(catalog, n);
+    }
+    if (cmp < 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return Qnil;
 }
 
-static VALUE zetta_fs_is_shared(VALUE self)
+/*
+ * Catalog check: the tree is walked again natively, (the same way it was
+ * written), comparing every dataset against the next record and stopping
+ * at the first difference.
+ */
+typedef struct zetta_catalog_check {
+  zetta_catalog_t *catalog;
+  int *props;
+  uint64_t next;
+  int current_depth;
+  int stale;
+} zetta_catalog_check_t;
+
+static int zetta_catalog_check_f(zfs_handle_t *handle, void *data)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-
-  return zfs_is_shared(zfs_handle) ? Qtrue : Qfalse;
+  zetta_catalog_check_t *check = (zetta_catalog_check_t *)data;
+  zetta_catalog_header_t *header = check->catalog->header;
+  uint64_t words = 4 + header->nprops;
+  uint64_t *record;
+  uint32_t i;
+
+  if (zfs_get_type(handle) & header->types) {
+    record = check->catalog->records + check->next * words;
+    if (check->next >= header->count || record[0] >= header->names_size ||
+        strcmp(zfs_get_name(handle), check->catalog->names + record[0]) != 0 ||
+        record[1] != zfs_prop_get_int(handle, ZFS_PROP_GUID) ||
+        record[2] != zfs_prop_get_int(handle, ZFS_PROP_CREATETXG) ||
+        record[3] != (uint64_t)zfs_get_type(handle)) {
+      check->stale = 1;
+    }
+    for (i = 0; !check->stale && i < header->nprops; i++) {
+      check->stale = (record[4 + i] != zetta_catalog_value(handle, check->props[i]));
+    }
+    check->next++;
+  }
+  if (!check->stale && zfs_get_type(handle) != ZFS_TYPE_SNAPSHOT &&
+      (header->depth < 0 || check->current_depth < header->depth)) {
+    check->current_depth++;
+    zfs_iter_filesystems(handle, zetta_catalog_check_f, check);
+    if (!check->stale && (header->types & ZFS_TYPE_SNAPSHOT)) {
+      zfs_iter_snapshots(handle, zetta_catalog_check_f, check);
+    }
+    check->current_depth--;
+  }
+  zfs_close(handle);
+  return check->stale;
 }
 
-static VALUE zetta_fs_share(VALUE self)
+// The answer is left in call->flags, this call never fails:
+static int zetta_catalog_check_call(zetta_call_t *call)
 {
+  zetta_catalog_check_t *check = (zetta_catalog_check_t *)call->data;
   zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  uint64_t guid;
+
+  check->stale = 1;
+  if (zetta_catalog_pool_guid(call->libhandle, call->name, &guid) == 0 &&
+      guid == check->catalog->header->pool_guid &&
+      (zfs_handle = zfs_open(call->libhandle, call->name, ZFS_TYPE_DATASET)) != NULL) {
+    check->stale = 0;
+    zetta_catalog_check_f(zfs_handle, check);
+    if (check->next != check->catalog->header->count) {
+      check->stale = 1;
+    }
+  }
+  call->flags = check->stale;
+  return 0;
+}
 
-  return INT2NUM(zfs_share(zfs_handle));
+static VALUE zetta_catalog_check_free(VALUE data)
+{
+  xfree(((zetta_catalog_check_t *)data)->props);
+  return Qnil;
 }
 
-static VALUE zetta_fs_unshare(VALUE self)
+static VALUE zetta_catalog_check(VALUE data)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_call_t *call = (zetta_call_t *)data;
 
-  return INT2NUM(zfs_unshare(zfs_handle));
+  zetta_call_blocking(call);
+  return call->flags ? Qtrue : Qfalse;
 }
 
-static VALUE zetta_fs_nfs_share_name(VALUE self)
+/*
+ * call-seq:
+ *   catalog.stale?  => boolean
+ *   catalog.stale?(@zlib)  => boolean
+ *
+ * Check the catalog against the datasets it was written from: it is stale
+ * when the pool no longer exists or it is a different pool with the same
+ * name, when datasets have been created, destroyed or renamed, or when any
+ * of the saved values has changed since the catalog was written.
+ *
+ * The tree is walked again to tell, (natively and without holding the
+ * interpreter lock), which is still much cheaper than writing the catalog.
+ *
+ */
+static VALUE zetta_catalog_stale_p(int argc, VALUE *argv, VALUE self)
 {
-  zfs_handle_t *zfs_handle;
-  char *path;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_catalog_t *catalog = zetta_catalog_get(self);
+  libzfs_handle_t *libhandle;
+  zetta_catalog_check_t check;
+  zetta_call_t call;
+  VALUE options;
+  uint32_t i;
 
-  return zfs_is_shared_nfs(zfs_handle, &path) ? rb_str_new2(path) : Qnil;
+  if (argc > 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+  }
+  Data_Get_Struct(zetta_lib_get_options_handle(argc, argv, 0, &options), libzfs_handle_t, libhandle);
+
+  memset(&check, 0, sizeof(check));
+  check.catalog = catalog;
+  zetta_call_init(&call, zetta_catalog_check_call, libhandle);
+  snprintf(call.name, sizeof(call.name), "%.*s", (int)sizeof(catalog->header->root), catalog->header->root);
+  call.data = &check;
+
+  check.props = ALLOC_N(int, catalog->header->nprops + 1);
+  for (i = 0; i < catalog->header->nprops; i++) {
+    char name[ZETTA_CATALOG_PROPLEN + 1];
+    snprintf(name, sizeof(name), "%.*s", ZETTA_CATALOG_PROPLEN, catalog->prop_names + i * ZETTA_CATALOG_PROPLEN);
+    check.props[i] = zfs_name_to_prop(name);
+  }
+  return rb_ensure(zetta_catalog_check, (VALUE)&call, zetta_catalog_check_free, (VALUE)&check);
 }
 
-static VALUE zetta_fs_is_shared_nfs(VALUE self)
+/*
+ * Parallel scan.
+ *
+ * ZFS.scan walks every pool in the system the same way than ZFS.walk does,
+ * but each pool is walked by a native worker thread with its own
+ * libzfs_handle_t, so the ioctl latency of the different pools overlaps.
+ * Workers never touch Ruby objects: they collect plain C records, which are
+ * converted into Ruby records, sorted by pool name, once all of them have
+ * finished.
+ */
+typedef struct zetta_scan_record {
+  char *name;
+  int type;
+  char **values;
+} zetta_scan_record_t;
+
+typedef struct zetta_scan_pool {
+  char name[ZPOOL_MAXNAMELEN];
+  zetta_scan_record_t *records;
+  size_t count;
+  size_t size;
+} zetta_scan_pool_t;
+
+typedef struct zetta_scan {
+  int types;
+  int depth;
+  char **prop_names;
+  int *props;
+  long nprops;
+  zetta_scan_pool_t *pools;
+  size_t npools;
+  size_t pools_size;
+  // Next pool to be walked, shared by the workers:
+  size_t next;
+  pthread_mutex_t lock;
+  int nthreads;
+  int error;
+} zetta_scan_t;
+
+typedef struct zetta_scan_walk {
+  zetta_scan_t *scan;
+  zetta_scan_pool_t *pool;
+  int current_depth;
+} zetta_scan_walk_t;
+
+static void zetta_scan_set_error(zetta_scan_t *scan, int error)
 {
-  zfs_handle_t *zfs_handle;
-  char *path;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-  return zfs_is_shared_nfs(zfs_handle, &path) ? Qtrue : Qfalse;
+  pthread_mutex_lock(&scan->lock);
+  if (scan->error == 0) {
+    scan->error = error;
+  }
+  pthread_mutex_unlock(&scan->lock);
 }
 
-static VALUE zetta_fs_share_nfs(VALUE self)
+// C string copy of a property value, NULL when the property has no value
+// (what zetta_fs_prop_value and zetta_fs_user_prop_value return as Nil):
+static char *zetta_fs_prop_strdup(zfs_handle_t *zfs_handle, int zfs_prop, const char *propname, nvlist_t **user_props)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  char propval[ZFS_MAXPROPLEN];
+  nvlist_t *nv;
+  char *value;
 
-  return INT2NUM(zfs_share_nfs(zfs_handle));
+  if (zfs_prop == ZPROP_CONT) {
+    if (*user_props == NULL) {
+      *user_props = zfs_get_user_props(zfs_handle);
+    }
+    if ( nvlist_lookup_nvlist(*user_props, propname, &nv) == 0 &&
+         nvlist_lookup_string(nv, ZPROP_VALUE, &value) == 0 ) {
+      return strdup(value);
+    }
+    return NULL;
+  }
+  if ( zfs_prop == ZPROP_INVAL ||
+       zfs_prop_get(zfs_handle, zfs_prop, propval, sizeof(propval), NULL, NULL, 0, B_FALSE) != 0 ||
+       strcmp( propval, "-" ) == 0 ) {
+    return NULL;
+  }
+  return strdup(propval);
 }
 
-static VALUE zetta_fs_unshare_nfs(VALUE self)
+static int zetta_scan_add_record(zetta_scan_walk_t *walk, zfs_handle_t *zfs_handle)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_scan_t *scan = walk->scan;
+  zetta_scan_pool_t *pool = walk->pool;
+  zetta_scan_record_t *record;
+  nvlist_t *user_props = NULL;
+  long i;
+
+  if (pool->count == pool->size) {
+    size_t size = pool->size ? pool->size * 2 : 64;
+    zetta_scan_record_t *records = realloc(pool->records, size * sizeof(zetta_scan_record_t));
+    if (records == NULL) {
+      return ENOMEM;
+    }
+    pool->records = records;
+    pool->size = size;
+  }
 
-  return INT2NUM(zfs_unshare_nfs(zfs_handle, NULL));
-}
+  record = &pool->records[pool->count];
+  record->type = zfs_get_type(zfs_handle);
+  record->name = strdup(zfs_get_name(zfs_handle));
+  record->values = calloc(scan->nprops + 1, sizeof(char *));
+  if (record->name == NULL || record->values == NULL) {
+    free(record->name);
+    free(record->values);
+    return ENOMEM;
+  }
+  pool->count++;
 
-#ifdef SPA_VERSION_9
-static VALUE zetta_fs_is_shared_smb(VALUE self)
-{
-  zfs_handle_t *zfs_handle;
-  char *path;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-  return zfs_is_shared_smb(zfs_handle, &path) ? Qtrue : Qfalse;
+  for (i = 0; i < scan->nprops; i++) {
+    record->values[i] = zetta_fs_prop_strdup(zfs_handle, scan->props[i], scan->prop_names[i], &user_props);
+  }
+  return 0;
 }
 
-static VALUE zetta_fs_smb_share_name(VALUE self)
+static int zetta_scan_walk_f(zfs_handle_t *handle, void *data)
 {
-  zfs_handle_t *zfs_handle;
-  char *path;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_scan_walk_t *walk = (zetta_scan_walk_t *)data;
+  zetta_scan_t *scan = walk->scan;
+  int ret = 0;
 
-  return zfs_is_shared_smb(zfs_handle, &path) ? rb_str_new2(path) : Qnil;
+  if (zfs_get_type(handle) & scan->types) {
+    ret = zetta_scan_add_record(walk, handle);
+  }
+  if (ret == 0 && zfs_get_type(handle) != ZFS_TYPE_SNAPSHOT &&
+      (scan->depth < 0 || walk->current_depth < scan->depth)) {
+    walk->current_depth++;
+    ret = zfs_iter_filesystems(handle, zetta_scan_walk_f, walk);
+    if (ret == 0 && (scan->types & ZFS_TYPE_SNAPSHOT)) {
+      ret = zfs_iter_snapshots(handle, zetta_scan_walk_f, walk);
+    }
+    walk->current_depth--;
+  }
+  zfs_close(handle);
+  return ret;
 }
 
-static VALUE zetta_fs_share_smb(VALUE self)
+static void *zetta_scan_worker(void *data)
 {
+  zetta_scan_t *scan = (zetta_scan_t *)data;
+  libzfs_handle_t *libhandle;
+  zetta_scan_walk_t walk;
   zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  size_t next;
+  int ret;
+
+  // Each worker has its own handle: libzfs handles are not thread safe.
+  if ((libhandle = libzfs_init()) == NULL) {
+    zetta_scan_set_error(scan, EZFS_NOMEM);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&scan->lock);
+    next = scan->next++;
+    ret = scan->error;
+    pthread_mutex_unlock(&scan->lock);
+
+    if (ret != 0 || next >= scan->npools) {
+      break;
+    }
 
-  return INT2NUM(zfs_share_smb(zfs_handle));
+    walk.scan = scan;
+    walk.pool = &scan->pools[next];
+    walk.current_depth = 0;
+    // Pools exported or destroyed meanwhile are just skipped:
+    zfs_handle = zfs_open(libhandle, walk.pool->name, ZFS_TYPE_FILESYSTEM);
+    if (zfs_handle != NULL && zetta_scan_walk_f(zfs_handle, &walk) == ENOMEM) {
+      zetta_scan_set_error(scan, EZFS_NOMEM);
+    }
+  }
+
+  libzfs_fini(libhandle);
+  return NULL;
 }
 
-static VALUE zetta_fs_unshare_smb(VALUE self)
+static int zetta_scan_pools_f(zpool_handle_t *handle, void *data)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_scan_t *scan = (zetta_scan_t *)data;
+
+  if (scan->npools == scan->pools_size) {
+    size_t size = scan->pools_size ? scan->pools_size * 2 : 8;
+    zetta_scan_pool_t *pools = realloc(scan->pools, size * sizeof(zetta_scan_pool_t));
+    if (pools == NULL) {
+      zpool_close(handle);
+      scan->error = EZFS_NOMEM;
+      return -1;
+    }
+    scan->pools = pools;
+    scan->pools_size = size;
+  }
+  memset(&scan->pools[scan->npools], 0, sizeof(zetta_scan_pool_t));
+  strncpy(scan->pools[scan->npools].name, zpool_get_name(handle), ZPOOL_MAXNAMELEN - 1);
+  scan->npools++;
+  zpool_close(handle);
+  return 0;
+}
 
-  return INT2NUM(zfs_unshare_smb(zfs_handle, NULL));
+static int zetta_scan_pool_cmp(const void *a, const void *b)
+{
+  return strcmp(((const zetta_scan_pool_t *)a)->name, ((const zetta_scan_pool_t *)b)->name);
 }
-#endif
 
-#ifndef SPA_VERSION_24
-static VALUE zetta_fs_is_shared_iscsi(VALUE self)
+static int zetta_scan_call(zetta_call_t *call)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_scan_t *scan = (zetta_scan_t *)call->data;
+  pthread_t *threads;
+  int i, started = 0;
 
-  return zfs_is_shared_iscsi(zfs_handle) ? Qtrue : Qfalse;
+  // A failure other than ENOMEM is left by libzfs in the call error state:
+  if (zpool_iter(call->libhandle, zetta_scan_pools_f, scan) != 0) {
+    return scan->error ? scan->error : -1;
+  }
+  if (scan->npools == 0) {
+    return 0;
+  }
+  qsort(scan->pools, scan->npools, sizeof(zetta_scan_pool_t), zetta_scan_pool_cmp);
+
+  if (scan->nthreads > (int)scan->npools) {
+    scan->nthreads = scan->npools;
+  }
+  threads = calloc(scan->nthreads, sizeof(pthread_t));
+  for (i = 0; threads != NULL && i < scan->nthreads; i++) {
+    if (pthread_create(&threads[started], NULL, zetta_scan_worker, scan) == 0) {
+      started++;
+    }
+  }
+  // Not a single thread could be started, do the job here:
+  if (started == 0) {
+    zetta_scan_worker(scan);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  return scan->error;
 }
 
-static VALUE zetta_fs_share_iscsi(VALUE self)
+static VALUE zetta_scan_records(VALUE data)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_scan_t *scan = (zetta_scan_t *)data;
+  VALUE records = rb_ary_new();
+  VALUE prop_names = rb_ary_new();
+  size_t p, r;
+  long i;
+
+  for (i = 0; i < scan->nprops; i++) {
+    rb_ary_push(prop_names, rb_obj_freeze(rb_str_new2(scan->prop_names[i])));
+  }
 
-  return INT2NUM(zfs_share_iscsi(zfs_handle));
+  for (p = 0; p < scan->npools; p++) {
+    zetta_scan_pool_t *pool = &scan->pools[p];
+    for (r = 0; r < pool->count; r++) {
+      zetta_scan_record_t *record = &pool->records[r];
+      VALUE props = rb_hash_new();
+
+      for (i = 0; i < scan->nprops; i++) {
+        rb_hash_aset(props, RARRAY_PTR(prop_names)[i],
+          record->values[i] ? rb_str_new2(record->values[i]) : Qnil);
+      }
+      rb_ary_push(records, rb_ary_new3(3, rb_str_new2(record->name), INT2NUM(record->type), props));
+    }
+  }
+  return records;
 }
 
-static VALUE zetta_fs_unshare_iscsi(VALUE self)
+static VALUE zetta_scan_free(VALUE data)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-
-  return INT2NUM(zfs_unshare_iscsi(zfs_handle));
+  zetta_scan_t *scan = (zetta_scan_t *)data;
+  size_t p, r;
+  long i;
+
+  for (p = 0; p < scan->npools; p++) {
+    zetta_scan_pool_t *pool = &scan->pools[p];
+    for (r = 0; r < pool->count; r++) {
+      for (i = 0; i < scan->nprops; i++) {
+        free(pool->records[r].values[i]);
+      }
+      free(pool->records[r].values);
+      free(pool->records[r].name);
+    }
+    free(pool->records);
+  }
+  free(scan->pools);
+  for (i = 0; scan->prop_names != NULL && i < scan->nprops; i++) {
+    free(scan->prop_names[i]);
+  }
+  free(scan->prop_names);
+  xfree(scan->props);
+  pthread_mutex_destroy(&scan->lock);
+  return Qnil;
 }
-#endif
 
 /*
  * call-seq:
- *   @zfs.is_mounted?  => Boolean
- *
- * Checks if the current dataset instance is or not mounted
- *
- * TODO:
+ *   ZFS.scan  => Array of [name, type, props]
+ *   ZFS.scan(options)  => Array of [name, type, props]
+ *   ZFS.scan(options, @zlib)  => Array of [name, type, props]
+ *   ZFS.scan(options) {|name, type, props| # ... }  => nil. Iterator.
+ *
+ * Walk all the pools in the system, (starting at their root datasets), using
+ * up to <code>:threads</code> native threads, each one of them with its own
+ * libzfs handle, and return the records in the same format than
+ * <code>ZFS.walk</code> does. Records are sorted by pool name, and each pool
+ * follows the same order than <code>ZFS.walk</code>, so the result doesn't
+ * depend on the number of threads.
+ *
+ * Other than <code>:threads</code>, (4 by default, never more than the
+ * number of pools), options are the same than for <code>ZFS.walk</code>,
+ * (<code>:batch</code> excepted), with depth relative to each root dataset.
+ *
+ *    ZFS.scan(:threads => 8, :props => ['used']).each do |name, type, props|
+ *      # ...
+ *    end
  *
- * - Actually, not taking into consideration anything but default mountpoints
+ * Raise <code>TypeError</code> when the options have the wrong types, and
+ * <code>ArgumentError</code> when <code>:threads</code> is not positive.
+ * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
+ * is not an instance of <code>LibZfs</code>.
+ * Raise the libzfs error when the pools cannot be iterated over.
  *
  */
-static VALUE zetta_fs_is_mounted(VALUE self)
+static VALUE zetta_fs_scan(int argc, VALUE *argv, VALUE klass)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  VALUE options, libzfs_handle, records, opt;
+  libzfs_handle_t *libhandle;
+  zetta_fs_walk_t walk;
+  zetta_scan_t scan;
+  zetta_call_t call;
+  long i;
+
+  if(argc > 2) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 2)", argc);
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 0, &options);
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&walk, 0, sizeof(walk));
+  zetta_fs_walk_options(&walk, options);
+
+  memset(&scan, 0, sizeof(scan));
+  scan.types = walk.types;
+  scan.depth = walk.depth;
+  scan.nprops = walk.nprops;
+  scan.nthreads = 4;
+  if (!NIL_P(options) && !NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("threads"))))) {
+    if (!FIXNUM_P(opt)) {
+      rb_raise(rb_eTypeError, "Number of threads must be a positive integer.");
+    }
+    if (FIX2LONG(opt) < 1 || FIX2LONG(opt) > INT_MAX) {
+      rb_raise(rb_eArgError, "Number of threads must be a positive integer.");
+    }
+    scan.nthreads = FIX2INT(opt);
+  }
+  // Freed by zetta_scan_free from now on:
+  zetta_fs_walk_resolve_props(&walk);
+  scan.props = walk.props;
+  pthread_mutex_init(&scan.lock, NULL);
+
+  // The workers run without the GVL, so they get C copies of the names:
+  scan.prop_names = calloc(walk.nprops + 1, sizeof(char *));
+  for (i = 0; scan.prop_names != NULL && i < walk.nprops; i++) {
+    if ((scan.prop_names[i] = strdup(RSTRING_PTR(RARRAY_PTR(walk.prop_names)[i]))) == NULL) {
+      break;
+    }
+  }
+  if (scan.prop_names == NULL || i < walk.nprops) {
+    zetta_scan_free((VALUE)&scan);
+    rb_raise(cZfsNoMemoryError, "cannot scan pools: out of memory");
+  }
+
+  zetta_call_init(&call, zetta_scan_call, libhandle);
+  call.data = &scan;
+  zetta_call_blocking(&call);
+
+  if (scan.error != 0 || call.ret != 0) {
+    zetta_scan_free((VALUE)&scan);
+    if (scan.error == 0 && call.error != 0) {
+      zetta_call_error_exception(&call);
+    }
+    if (scan.error != 0) {
+      rb_raise(zetta_lib_select_error(scan.error), "cannot scan pools: out of memory");
+    }
+    rb_raise(cZfsError, "cannot scan pools");
+  }
+
+  records = rb_ensure(zetta_scan_records, (VALUE)&scan, zetta_scan_free, (VALUE)&scan);
 
-  return zfs_is_mounted(zfs_handle, NULL) ? Qtrue : Qfalse;
+  if (!rb_block_given_p()) {
+    return records;
+  }
+  for (i = 0; i < RARRAY_LEN(records); i++) {
+    rb_yield(RARRAY_PTR(records)[i]);
+  }
+  return Qnil;
 }
 
 /*
- * call-seq:
- *   @zfs.mount  => Boolean
- *
- * Mount the current dataset instance.
- *
+ * Userspace accounting.
+ *
+ * ZFS#each_userspace and ZFS.userspace report the space used by, and the
+ * quota of, every user and group of a filesystem, (what zfs userspace and
+ * zfs groupspace print). libzfs reports used space and quotas through
+ * separate zfs_userspace() passes, collected into plain C records which are
+ * sorted and merged by type, domain and id, so each one is reported once.
+ * ZFS.userspace reads a whole subtree on native worker threads, each one
+ * with its own libzfs handle, and returns the entries as parallel arrays.
  */
-static VALUE zetta_fs_mount(VALUE self)
+#ifdef SPA_VERSION_15
+
+#define ZETTA_USERSPACE_USER  0x1
+#define ZETTA_USERSPACE_GROUP 0x2
+
+typedef struct zetta_userspace_entry {
+  int group;
+  // Index into domains, -1 for POSIX ids:
+  int domain;
+  uid_t rid;
+  uint64_t used;
+  uint64_t quota;
+} zetta_userspace_entry_t;
+
+typedef struct zetta_userspace {
+  char *name;
+  zfs_userquota_prop_t prop;
+  zetta_userspace_entry_t *entries;
+  size_t count;
+  size_t size;
+  char **domains;
+  int ndomains;
+  // Error message, ZFS.userspace only:
+  char *error;
+} zetta_userspace_t;
+
+typedef struct zetta_userspace_tree {
+  int types;
+  int depth;
+  char *root;
+  zetta_userspace_t *datasets;
+  size_t count;
+  size_t size;
+  // Next dataset to be read, shared by the workers:
+  size_t next;
+  pthread_mutex_t lock;
+  int nthreads;
+  int error;
+} zetta_userspace_tree_t;
+
+static int zetta_userspace_f(void *data, const char *domain, uid_t rid, uint64_t space)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-
-  return (zfs_mount(zfs_handle, NULL, 0) == 0) ? Qtrue : Qfalse;
+  zetta_userspace_t *us = (zetta_userspace_t *)data;
+  zetta_userspace_entry_t *entry;
+  int i = -1;
+
+  if (domain != NULL && domain[0] != '\0') {
+    for (i = 0; i < us->ndomains && strcmp(us->domains[i], domain) != 0; i++);
+    if (i == us->ndomains) {
+      char **domains = realloc(us->domains, (us->ndomains + 1) * sizeof(char *));
+      if (domains == NULL) {
+        return ENOMEM;
+      }
+      us->domains = domains;
+      if ((us->domains[i] = strdup(domain)) == NULL) {
+        return ENOMEM;
+      }
+      us->ndomains++;
+    }
+  }
+  if (us->count == us->size) {
+    size_t size = us->size ? us->size * 2 : 64;
+    zetta_userspace_entry_t *entries = realloc(us->entries, size * sizeof(zetta_userspace_entry_t));
+    if (entries == NULL) {
+      return ENOMEM;
+    }
+    us->entries = entries;
+    us->size = size;
+  }
+  entry = &us->entries[us->count++];
+  entry->group = (us->prop == ZFS_PROP_GROUPUSED || us->prop == ZFS_PROP_GROUPQUOTA);
+  entry->domain = i;
+  entry->rid = rid;
+  entry->used = (us->prop == ZFS_PROP_USERUSED || us->prop == ZFS_PROP_GROUPUSED) ? space : 0;
+  entry->quota = (us->prop == ZFS_PROP_USERQUOTA || us->prop == ZFS_PROP_GROUPQUOTA) ? space : 0;
+  return 0;
 }
 
-/*
- * call-seq:
- *   @zfs.unmount  => Boolean
- *
- * Unmount the current dataset instance.
- *
- */
-static VALUE zetta_fs_unmount(VALUE self)
+// Users first, then groups, POSIX ids first, (domains are only compared
+// within the same dataset):
+static int zetta_userspace_entry_cmp(const void *a, const void *b)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  const zetta_userspace_entry_t *x = (const zetta_userspace_entry_t *)a;
+  const zetta_userspace_entry_t *y = (const zetta_userspace_entry_t *)b;
 
-  return (zfs_unmount(zfs_handle, NULL, 0) == 0) ? Qtrue : Qfalse;
+  if (x->group != y->group) return x->group - y->group;
+  if (x->domain != y->domain) return x->domain - y->domain;
+  return (x->rid > y->rid) - (x->rid < y->rid);
 }
 
-/*
- * call-seq:
- *   @zfs.destroy!  => Boolean
- *
- * Destroy the current dataset instance.
- *
- */
-static VALUE zetta_fs_destroy(VALUE self)
+// Read every requested property, and merge used and quota of the same id.
+// Return ENOMEM, -1 on libzfs errors, (with the handle error set):
+static int zetta_userspace_collect(zfs_handle_t *zfs_handle, zetta_userspace_t *us, int types)
 {
-  zfs_handle_t *zfs_handle;
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  static const zfs_userquota_prop_t props[] = {
+    ZFS_PROP_USERUSED, ZFS_PROP_USERQUOTA, ZFS_PROP_GROUPUSED, ZFS_PROP_GROUPQUOTA
+  };
+  size_t i, n;
+  int p, ret;
+
+  for (p = 0; p < 4; p++) {
+    if (!(types & ((p < 2) ? ZETTA_USERSPACE_USER : ZETTA_USERSPACE_GROUP))) {
+      continue;
+    }
+    us->prop = props[p];
+    if ((ret = zfs_userspace(zfs_handle, props[p], zetta_userspace_f, us)) != 0) {
+      return (ret == ENOMEM) ? ENOMEM : -1;
+    }
+  }
+  if (us->count == 0) {
+    return 0;
+  }
+  qsort(us->entries, us->count, sizeof(zetta_userspace_entry_t), zetta_userspace_entry_cmp);
+  for (i = 1, n = 0; i < us->count; i++) {
+    if (zetta_userspace_entry_cmp(&us->entries[n], &us->entries[i]) == 0) {
+      us->entries[n].used += us->entries[i].used;
+      us->entries[n].quota += us->entries[i].quota;
+    } else {
+      us->entries[++n] = us->entries[i];
+    }
+  }
+  us->count = n + 1;
+  return 0;
+}
 
-// Boolean parameter was added to zfs_destroy:
-#ifdef SPA_VERSION_18
-  return (zfs_destroy(zfs_handle,B_FALSE) == 0) ? Qtrue : Qfalse;
-#else
-  return (zfs_destroy(zfs_handle) == 0) ? Qtrue : Qfalse;
-#endif
+static void zetta_userspace_release(zetta_userspace_t *us)
+{
+  int i;
+
+  for (i = 0; i < us->ndomains; i++) {
+    free(us->domains[i]);
+  }
+  free(us->domains);
+  free(us->entries);
+  free(us->error);
+  free(us->name);
 }
 
-static int zetta_fs_iter_f(zfs_handle_t *handle, void *klass)
+static int zetta_fs_userspace_call(zetta_call_t *call)
 {
-  rb_yield(Data_Wrap_Struct((VALUE)klass, 0, zfs_close, handle));
-  return 0;
+  zetta_userspace_t *us = (zetta_userspace_t *)call->data;
+  return zetta_userspace_collect(call->zfs_handle, us, call->flags);
 }
 
-/*
- * call-seq:
- *   ZFS.each {|zfs| # ... }  => nil. Iterator.
- *   ZFS.each(@zlib) {|zfs| # ... }  => nil. Iterator.
- *
- * Iterates over all the root datasets defined in the system.
- *
- *    ZFS.each do |zfs|
- *      # access to each zfs instance
- *    end
- *
- * Raise <code>TypeError</code> when <code>@zlib</code> handle is given and it
- * is not an instance of <code>LibZfs</code>.
- *
- */
-static VALUE zetta_fs_iter_root(int argc, VALUE *argv, VALUE klass)
+static VALUE zetta_userspace_types(VALUE options)
 {
-  VALUE libzfs_handle;
-  libzfs_handle_t *libhandle;
+  VALUE types, name;
+  int flags = 0;
+  long i;
+
+  if (NIL_P(options) || NIL_P(types = rb_hash_aref(options, ID2SYM(rb_intern("types"))))) {
+    return INT2FIX(ZETTA_USERSPACE_USER | ZETTA_USERSPACE_GROUP);
+  }
+  types = rb_Array(types);
+  for (i = 0; i < RARRAY_LEN(types); i++) {
+    name = rb_funcall(RARRAY_PTR(types)[i], rb_intern("to_s"), 0);
+    if (strcmp(StringValueCStr(name), "user") == 0) {
+      flags |= ZETTA_USERSPACE_USER;
+    } else if (strcmp(StringValueCStr(name), "group") == 0) {
+      flags |= ZETTA_USERSPACE_GROUP;
+    } else {
+      rb_raise(rb_eArgError, "%s: unknown userspace type, (user or group)", StringValueCStr(name));
+    }
+  }
+  return INT2FIX(flags);
+}
 
-  libzfs_handle = (argc == 0) ? zetta_lib_get_handle() : argv[0];
+// Frozen Ruby copies of the dataset domains:
+static VALUE zetta_userspace_domains(zetta_userspace_t *us)
+{
+  VALUE domains = rb_ary_new2(us->ndomains);
+  int i;
 
-  if(CLASS_OF(libzfs_handle) != rb_const_get(rb_cObject, rb_intern("LibZfs"))) {
-    rb_raise(rb_eTypeError, "ZFS Lib handle must be an instance of LibZfs.");
+  for (i = 0; i < us->ndomains; i++) {
+    rb_ary_push(domains, rb_obj_freeze(rb_str_new2(us->domains[i])));
   }
+  return domains;
+}
 
-  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
-
-  zfs_iter_root(libhandle, zetta_fs_iter_f, (void *)klass);
+static VALUE zetta_userspace_entries(VALUE data)
+{
+  zetta_userspace_t *us = (zetta_userspace_t *)data;
+  VALUE entries = rb_ary_new2(us->count);
+  VALUE domains = zetta_userspace_domains(us);
+  VALUE user = ID2SYM(rb_intern("user")), group = ID2SYM(rb_intern("group"));
+  zetta_userspace_entry_t *entry;
+  size_t i;
+
+  for (i = 0; i < us->count; i++) {
+    entry = &us->entries[i];
+    rb_ary_push(entries, rb_ary_new3(5, entry->group ? group : user,
+      (entry->domain < 0) ? Qnil : RARRAY_PTR(domains)[entry->domain],
+      ULONG2NUM(entry->rid), ULL2NUM(entry->used), entry->quota ? ULL2NUM(entry->quota) : Qnil));
+  }
+  return entries;
+}
 
+static VALUE zetta_userspace_free(VALUE data)
+{
+  zetta_userspace_release((zetta_userspace_t *)data);
   return Qnil;
 }
 
+#endif
+
 /*
  * call-seq:
- *   @zfs.each_filesystem {|zfs| # ... }  => nil. Iterator.
+ *   @zfs.each_userspace {|type, domain, rid, used, quota| # ... }  => nil
+ *   @zfs.each_userspace(:types => [:user]) {|type, domain, rid, used, quota| # ... }  => nil
+ *   @zfs.each_userspace  => Enumerator
  *
- * Iterates over all the children datasets of type filesystem for
- * the current one.
+ * Iterate over the space accounting of every user and group of the current
+ * filesystem, (or snapshot), like <code>zfs userspace</code> and
+ * <code>zfs groupspace</code> do. <code>type</code> is <code>:user</code>
+ * or <code>:group</code>, <code>domain</code> is Nil for POSIX ids, (or the
+ * SID domain), <code>rid</code> the numeric id, <code>used</code> the space
+ * used in bytes, and <code>quota</code> its quota in bytes, or Nil. Users
+ * come before groups, sorted by domain and id.
  *
- *    @zfs.each_filesystem do |zfs|
- *      # access to each zfs instance
- *    end
+ * <code>:types</code> can be <code>:user</code>, <code>:group</code>, or
+ * both of them, (the default).
+ *
+ * Raise <code>ArgumentError</code> for unknown types, and
+ * <code>NotImplementedError</code> when libzfs has no userspace accounting.
  *
  */
-static VALUE zetta_fs_iter_filesystems(VALUE self)
+static VALUE zetta_fs_each_userspace(int argc, VALUE *argv, VALUE self)
 {
+#ifdef SPA_VERSION_15
+  VALUE options, entries;
   zfs_handle_t *zfs_handle;
-  VALUE klass = rb_class_of(self);
+  zetta_userspace_t us;
+  zetta_call_t call;
+  long i;
+
+  RETURN_ENUMERATOR(self, argc, argv);
+  rb_scan_args(argc, argv, "01", &options);
+  if (!NIL_P(options)) {
+    Check_Type(options, T_HASH);
+  }
   Data_Get_Struct(self, zfs_handle_t, zfs_handle);
 
-  zfs_iter_filesystems(zfs_handle, zetta_fs_iter_f, (void *)klass);
+  memset(&us, 0, sizeof(us));
+  zetta_call_init(&call, zetta_fs_userspace_call, zfs_get_handle(zfs_handle));
+  call.zfs_handle = zfs_handle;
+  call.flags = FIX2INT(zetta_userspace_types(options));
+  call.data = &us;
 
+  if (zetta_call_blocking(&call) != 0) {
+    zetta_userspace_release(&us);
+    if (call.ret == ENOMEM) {
+      rb_raise(cZfsNoMemoryError, "cannot get used/quota for %s: out of memory", zfs_get_name(zfs_handle));
+    }
+    zetta_call_error_exception(&call);
+  }
+  entries = rb_ensure(zetta_userspace_entries, (VALUE)&us, zetta_userspace_free, (VALUE)&us);
+  for (i = 0; i < RARRAY_LEN(entries); i++) {
+    rb_yield(RARRAY_PTR(entries)[i]);
+  }
   return Qnil;
+#else
+  rb_raise(rb_eNotImpError, "Userspace accounting is not supported by this libzfs version.");
+#endif
 }
 
-/*
- * call-seq:
- *   @zfs.each_snapshot {|zfs| # ... }  => nil. Iterator.
- *
- * Iterates over all the children datasets of type snapshot for
- * the current one.
- *
- *    @zfs.each_snapshot do |snap|
- *      # access to each zfs instance
- *    end
- *
- */
-static VALUE zetta_fs_iter_snapshots(VALUE self)
+#ifdef SPA_VERSION_15
+
+// ZFS::Userspace, defined at Init_zetta:
+static VALUE cZfsUserspace = Qnil;
+
+static void zetta_userspace_tree_set_error(zetta_userspace_tree_t *tree, int error)
+{
+  pthread_mutex_lock(&tree->lock);
+  if (tree->error == 0) {
+    tree->error = error;
+  }
+  pthread_mutex_unlock(&tree->lock);
+}
+
+static int zetta_userspace_tree_f(zfs_handle_t *handle, void *data)
 {
+  zetta_userspace_tree_t *tree = (zetta_userspace_tree_t *)data;
+  const char *name = zfs_get_name(handle);
+  const char *c;
+  int depth = 0, ret = 0;
+
+  if (zfs_get_type(handle) != ZFS_TYPE_FILESYSTEM) {
+    zfs_close(handle);
+    return 0;
+  }
+  if (tree->count == tree->size) {
+    size_t size = tree->size ? tree->size * 2 : 64;
+    zetta_userspace_t *datasets = realloc(tree->datasets, size * sizeof(zetta_userspace_t));
+    if (datasets == NULL) {
+      zfs_close(handle);
+      return ENOMEM;
+    }
+    tree->datasets = datasets;
+    tree->size = size;
+  }
+  memset(&tree->datasets[tree->count], 0, sizeof(zetta_userspace_t));
+  if ((tree->datasets[tree->count].name = strdup(name)) == NULL) {
+    zfs_close(handle);
+    return ENOMEM;
+  }
+  tree->count++;
+
+  for (c = name + strlen(tree->root); *c != '\0'; c++) {
+    depth += (*c == '/');
+  }
+  if (tree->depth < 0 || depth < tree->depth) {
+    ret = zfs_iter_filesystems(handle, zetta_userspace_tree_f, tree);
+  }
+  zfs_close(handle);
+  return ret;
+}
+
+static void *zetta_userspace_worker(void *data)
+{
+  zetta_userspace_tree_t *tree = (zetta_userspace_tree_t *)data;
+  libzfs_handle_t *libhandle;
   zfs_handle_t *zfs_handle;
-  VALUE klass = rb_class_of(self);
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
+  zetta_userspace_t *us;
+  size_t next;
+  int ret;
+
+  // Each worker has its own handle: libzfs handles are not thread safe.
+  if ((libhandle = libzfs_init()) == NULL) {
+    zetta_userspace_tree_set_error(tree, EZFS_NOMEM);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&tree->lock);
+    next = tree->next++;
+    ret = tree->error;
+    pthread_mutex_unlock(&tree->lock);
+
+    if (ret != 0 || next >= tree->count) {
+      break;
+    }
+    us = &tree->datasets[next];
+    // Filesystems destroyed meanwhile are just skipped:
+    if ((zfs_handle = zfs_open(libhandle, us->name, ZFS_TYPE_FILESYSTEM)) == NULL) {
+      continue;
+    }
+    ret = zetta_userspace_collect(zfs_handle, us, tree->types);
+    if (ret == ENOMEM) {
+      zetta_userspace_tree_set_error(tree, EZFS_NOMEM);
+    } else if (ret != 0) {
+      us->error = strdup(libzfs_error_description(libhandle));
+    }
+    zfs_close(zfs_handle);
+  }
+
+  libzfs_fini(libhandle);
+  return NULL;
+}
+
+static int zetta_userspace_tree_call(zetta_call_t *call)
+{
+  zetta_userspace_tree_t *tree = (zetta_userspace_tree_t *)call->data;
+  zfs_handle_t *zfs_handle;
+  pthread_t *threads;
+  int i, ret, started = 0;
+
+  if ((zfs_handle = zfs_open(call->libhandle, tree->root, ZFS_TYPE_FILESYSTEM)) == NULL) {
+    return -1;
+  }
+  if ((ret = zetta_userspace_tree_f(zfs_handle, tree)) == ENOMEM) {
+    tree->error = EZFS_NOMEM;
+    return 0;
+  } else if (ret != 0) {
+    return -1;
+  }
+
+  if (tree->nthreads > (int)tree->count) {
+    tree->nthreads = tree->count;
+  }
+  threads = calloc(tree->nthreads, sizeof(pthread_t));
+  for (i = 0; threads != NULL && i < tree->nthreads; i++) {
+    if (pthread_create(&threads[started], NULL, zetta_userspace_worker, tree) == 0) {
+      started++;
+    }
+  }
+  // Not a single thread could be started, do the job here:
+  if (started == 0) {
+    zetta_userspace_worker(tree);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  return 0;
+}
+
+static VALUE zetta_userspace_tree_records(VALUE data)
+{
+  zetta_userspace_tree_t *tree = (zetta_userspace_tree_t *)data;
+  VALUE datasets = rb_ary_new2(tree->count), errors = rb_hash_new();
+  VALUE index = rb_ary_new(), types = rb_ary_new(), domains = rb_ary_new();
+  VALUE rids = rb_ary_new(), used = rb_ary_new(), quotas = rb_ary_new();
+  VALUE user = ID2SYM(rb_intern("user")), group = ID2SYM(rb_intern("group"));
+  VALUE names;
+  zetta_userspace_entry_t *entry;
+  size_t d, i;
+
+  for (d = 0; d < tree->count; d++) {
+    zetta_userspace_t *us = &tree->datasets[d];
+    VALUE name = rb_obj_freeze(rb_str_new2(us->name));
+
+    rb_ary_push(datasets, name);
+    if (us->error != NULL) {
+      rb_hash_aset(errors, name, rb_str_new2(us->error));
+    }
+    names = zetta_userspace_domains(us);
+    for (i = 0; i < us->count; i++) {
+      entry = &us->entries[i];
+      rb_ary_push(index, LONG2NUM((long)d));
+      rb_ary_push(types, entry->group ? group : user);
+      rb_ary_push(domains, (entry->domain < 0) ? Qnil : RARRAY_PTR(names)[entry->domain]);
+      rb_ary_push(rids, ULONG2NUM(entry->rid));
+      rb_ary_push(used, ULL2NUM(entry->used));
+      rb_ary_push(quotas, entry->quota ? ULL2NUM(entry->quota) : Qnil);
+    }
+  }
+  return rb_obj_freeze(rb_struct_new(cZfsUserspace, rb_obj_freeze(datasets), rb_obj_freeze(index),
+    rb_obj_freeze(types), rb_obj_freeze(domains), rb_obj_freeze(rids), rb_obj_freeze(used),
+    rb_obj_freeze(quotas), rb_obj_freeze(errors)));
+}
 
-  zfs_iter_snapshots(zfs_handle, zetta_fs_iter_f, (void *)klass);
+static VALUE zetta_userspace_tree_free(VALUE data)
+{
+  zetta_userspace_tree_t *tree = (zetta_userspace_tree_t *)data;
+  size_t d;
 
+  for (d = 0; d < tree->count; d++) {
+    zetta_userspace_release(&tree->datasets[d]);
+  }
+  free(tree->datasets);
+  pthread_mutex_destroy(&tree->lock);
   return Qnil;
 }
 
+#endif
+
 /*
  * call-seq:
- *   @zfs.each_dependent {|zfs| # ... }  => nil. Iterator.
- *
- * Iterates over all the datasets depending on the current one.
- * This includes filesystems, snapshots and clones.
- *
- *    @zfs.each_dependent do |dataset|
- *      # access to each zfs instance
- *    end
+ *   ZFS.userspace('tpool/home')  => ZFS::Userspace
+ *   ZFS.userspace('tpool/home', :types => [:user], :depth => 1, :threads => 8)  => ZFS::Userspace
+ *   ZFS.userspace(root, options, @zlib)  => ZFS::Userspace
+ *
+ * Read the userspace accounting of the <code>root</code> filesystem and
+ * every filesystem below it, (up to <code>:depth</code> levels, all of them
+ * by default), using up to <code>:threads</code> native threads, (4 by
+ * default), each one with its own libzfs handle.
+ *
+ * Return a frozen <code>ZFS::Userspace</code> Struct of parallel arrays,
+ * one element for each entry, in the same order than
+ * <code>ZFS#each_userspace</code> yields them, filesystem after filesystem:
+ * +dataset+, (index into +datasets+, the filesystem names), +type+,
+ * +domain+, +rid+, +used+ and +quota+. +errors+ is a Hash with the error
+ * message of the filesystems which could not be read.
+ *
+ *    us = ZFS.userspace('tpool/home', :types => :user)
+ *    usage = Hash.new(0)
+ *    us.rid.each_with_index { |rid, i| usage[rid] += us.used[i] }
+ *
+ * Raise <code>TypeError</code> when the options have the wrong types,
+ * <code>ArgumentError</code> for unknown types, and
+ * <code>NotImplementedError</code> when libzfs has no userspace accounting.
  *
  */
-static VALUE zetta_fs_iter_dependents(VALUE self)
+static VALUE zetta_fs_userspace(int argc, VALUE *argv, VALUE klass)
 {
-  zfs_handle_t *zfs_handle;
-  VALUE klass = rb_class_of(self);
-  Data_Get_Struct(self, zfs_handle_t, zfs_handle);
-  // TODO: Allow recursion should be configurable by user?
-  zfs_iter_dependents(zfs_handle, B_TRUE, zetta_fs_iter_f, (void *)klass);
+#ifdef SPA_VERSION_15
+  VALUE root, options, libzfs_handle, opt;
+  libzfs_handle_t *libhandle;
+  zetta_userspace_tree_t tree;
+  zetta_call_t call;
 
-  return Qnil;
+  if(argc < 1 || argc > 3) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1..3)", argc);
+  }
+  root = argv[0];
+  if (TYPE(root) != T_STRING) {
+    rb_raise(rb_eTypeError, "Dataset name must be a string.");
+  }
+
+  libzfs_handle = zetta_lib_get_options_handle(argc, argv, 1, &options);
+  Data_Get_Struct(libzfs_handle, libzfs_handle_t, libhandle);
+
+  memset(&tree, 0, sizeof(tree));
+  tree.types = FIX2INT(zetta_userspace_types(options));
+  tree.depth = -1;
+  tree.nthreads = 4;
+  if (!NIL_P(options)) {
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("depth"))))) {
+      if (!FIXNUM_P(opt) || FIX2INT(opt) < 0) {
+        rb_raise(rb_eTypeError, "Depth must be a non negative integer.");
+      }
+      tree.depth = FIX2INT(opt);
+    }
+    if (!NIL_P(opt = rb_hash_aref(options, ID2SYM(rb_intern("threads"))))) {
+      if (!FIXNUM_P(opt) || FIX2INT(opt) < 1) {
+        rb_raise(rb_eTypeError, "Number of threads must be a positive integer.");
+      }
+      tree.nthreads = FIX2INT(opt);
+    }
+  }
+  // Copied, the interpreter lock is released:
+  tree.root = ALLOCA_N(char, RSTRING_LEN(root) + 1);
+  memcpy(tree.root, RSTRING_PTR(root), RSTRING_LEN(root));
+  tree.root[RSTRING_LEN(root)] = '\0';
+  pthread_mutex_init(&tree.lock, NULL);
+
+  zetta_call_init(&call, zetta_userspace_tree_call, libhandle);
+  call.data = &tree;
+  if (zetta_call_blocking(&call) != 0) {
+    zetta_userspace_tree_free((VALUE)&tree);
+    zetta_call_error_exception(&call);
+  }
+  if (tree.error != 0) {
+    zetta_userspace_tree_free((VALUE)&tree);
+    rb_raise(zetta_lib_select_error(tree.error), "cannot get used/quota for %s: out of memory", tree.root);
+  }
+  return rb_ensure(zetta_userspace_tree_records, (VALUE)&tree, zetta_userspace_tree_free, (VALUE)&tree);
+#else
+  rb_raise(rb_eNotImpError, "Userspace accounting is not supported by this libzfs version.");
+#endif
 }
 
 /*
@@ -1495,8 +8407,9 @@ static VALUE zetta_fs_iter_dependents(VALUE self)
  *
  * When the <code>libzfs_handle</code> argument is not given to any of the
  * methods using it, the library will use <code>LibZfs.handle</code> class
- * method in order to create and reuse a <code>LibZfs</code> instance into
- * the class variable "@@handle".
+ * method in order to create and reuse a <code>LibZfs</code> instance for
+ * the current thread, (or fiber), from a pool of up to
+ * <code>LibZfs.pool_size</code> instances.
  *
  */
 
@@ -1514,7 +8427,8 @@ static VALUE zetta_fs_iter_dependents(VALUE self)
 static VALUE zetta_lib_alloc(VALUE klass)
 {
   libzfs_handle_t *handle = libzfs_init();
-  return Data_Wrap_Struct(klass, 0, libzfs_fini, handle);
+  zetta_lib_lock_register(handle);
+  return Data_Wrap_Struct(klass, 0, zetta_lib_free, handle);
 }
 
 /*
@@ -1528,8 +8442,13 @@ static VALUE zetta_lib_alloc(VALUE klass)
 static VALUE zetta_lib_errno(VALUE self)
 {
   libzfs_handle_t *handle;
+  int error;
   Data_Get_Struct(self, libzfs_handle_t, handle);
-  return INT2NUM(libzfs_errno(handle));
+
+  zetta_lib_lock(handle);
+  error = libzfs_errno(handle);
+  zetta_lib_unlock(handle);
+  return INT2NUM(error);
 }
 
 /*
@@ -1544,7 +8463,9 @@ static VALUE zetta_lib_print_on_error(VALUE self, VALUE b)
   libzfs_handle_t *handle;
   Data_Get_Struct(self, libzfs_handle_t, handle);
 
+  zetta_lib_lock(handle);
   libzfs_print_on_error(handle, RTEST(b));
+  zetta_lib_unlock(handle);
   return Qnil;
 }
 
@@ -1559,9 +8480,13 @@ static VALUE zetta_lib_print_on_error(VALUE self, VALUE b)
 static VALUE zetta_lib_error_action(VALUE self)
 {
   libzfs_handle_t *handle;
+  char action[1024];
   Data_Get_Struct(self, libzfs_handle_t, handle);
 
-  return rb_str_new2(libzfs_error_action(handle));
+  zetta_lib_lock(handle);
+  snprintf(action, sizeof(action), "%s", libzfs_error_action(handle));
+  zetta_lib_unlock(handle);
+  return rb_str_new2(action);
 }
 
 /*
@@ -1576,9 +8501,13 @@ static VALUE zetta_lib_error_action(VALUE self)
 static VALUE zetta_lib_error_description(VALUE self)
 {
   libzfs_handle_t *handle;
+  char description[1024];
   Data_Get_Struct(self, libzfs_handle_t, handle);
 
-  return rb_str_new2(libzfs_error_description(handle));
+  zetta_lib_lock(handle);
+  snprintf(description, sizeof(description), "%s", libzfs_error_description(handle));
+  zetta_lib_unlock(handle);
+  return rb_str_new2(description);
 }
 
 /*
@@ -1607,9 +8536,16 @@ static VALUE zetta_lib_raise_error(VALUE self)
  * Return <code>libzfs_handle</code> object, which can be used by some other
  * methods like <code>Zpool</code> and <code>ZFS</code> initializers.
  *
- * This method will create an instance of <code>LibZfs</code> the fist time
- * it's invoked and will store it into the class variable <code>@@handle</code>,
- * in order to reuse it every time it's required.
+ * A libzfs handle keeps the error state of the last failed operation, and
+ * cannot be used concurrently. Hence, each thread, (or fiber), gets its own
+ * <code>LibZfs</code> instance the first time it calls this method, and
+ * keeps it from there on. A handle is never given to two live threads, (or
+ * fibers), at the same time: it goes back to the pool once its owner has
+ * finished, and is handed out again from there. The pool keeps up to
+ * <code>LibZfs.pool_size</code> instances: when every one of them is in use,
+ * a new one is created anyway, and dropped once its owner has finished. The
+ * first handle of the pool is kept into the class variable
+ * <code>@@handle</code>.
  *
  * This is the method used from any other methods when a <code>ZfsLib</code>
  * instance is required and none is supplied on the method call.
@@ -1617,11 +8553,330 @@ static VALUE zetta_lib_raise_error(VALUE self)
  */
 static VALUE zetta_lib_handle(VALUE klass)
 {
-  if( rb_cv_get(klass, "@@handle") == Qnil ) {
+  VALUE thread = rb_thread_current();
+  ID key = rb_intern("__zetta_libzfs_handle");
+  VALUE handle = rb_thread_local_aref(thread, key);
+  VALUE handles, owners, current;
+  long i, size;
+
+  if( !NIL_P(handle) ) {
+    return handle;
+  }
+
+  // Thread#[] is fiber local, and so are the handles:
+#ifdef HAVE_RB_FIBER_CURRENT
+  current = rb_fiber_current();
+#else
+  current = thread;
+#endif
+  handles = rb_cv_get(klass, "@@handles");
+  owners = rb_cv_get(klass, "@@handle_owners");
+  size = NUM2LONG(rb_cv_get(klass, "@@pool_size"));
+
+  // Reuse the handle of a finished owner, dropping the ones over the size:
+  for (i = 0; i < RARRAY_LEN(handles); i++) {
+    if( RTEST(rb_funcall(RARRAY_PTR(owners)[i], rb_intern("alive?"), 0)) ) {
+      continue;
+    }
+    if( RARRAY_LEN(handles) <= size ) {
+      break;
+    }
+    rb_ary_delete_at(handles, i);
+    rb_ary_delete_at(owners, i--);
+  }
+
+  if( i < RARRAY_LEN(handles) ) {
+    handle = RARRAY_PTR(handles)[i];
+    rb_ary_store(owners, i, current);
+  } else {
     VALUE args[] = {};
-    rb_cv_set(klass, "@@handle", rb_class_new_instance(0, args, klass));
+    handle = rb_class_new_instance(0, args, klass);
+    rb_ary_push(handles, handle);
+    rb_ary_push(owners, current);
+    if( NIL_P(rb_cv_get(klass, "@@handle")) ) {
+      rb_cv_set(klass, "@@handle", handle);
+    }
+  }
+  rb_thread_local_aset(thread, key, handle);
+  return handle;
+}
+
+/*
+ * call-seq:
+ *   LibZfs.pool_size  => Integer
+ *
+ * Maximum number of <code>LibZfs</code> instances handed out by
+ * <code>LibZfs.handle</code>, (8 by default).
+ *
+ */
+static VALUE zetta_lib_get_pool_size(VALUE klass)
+{
+  return rb_cv_get(klass, "@@pool_size");
+}
+
+/*
+ * call-seq:
+ *   LibZfs.pool_size = 16  => 16
+ *
+ * Set the maximum number of <code>LibZfs</code> instances handed out by
+ * <code>LibZfs.handle</code>. It should be, at least, the number of threads
+ * working with ZFS at the same time without their own <code>LibZfs</code>,
+ * otherwise additional handles are created and dropped as those threads
+ * come and go. Shrinking the pool doesn't take the handles away from the
+ * threads already using them.
+ *
+ * Raise <code>ArgumentError</code> when <code>size</code> is lower than 1.
+ *
+ */
+static VALUE zetta_lib_set_pool_size(VALUE klass, VALUE size)
+{
+  VALUE handles = rb_cv_get(klass, "@@handles");
+  VALUE owners = rb_cv_get(klass, "@@handle_owners");
+
+  if( NUM2LONG(size) < 1 ) {
+    rb_raise(rb_eArgError, "LibZfs pool size must be at least 1.");
+  }
+  while( RARRAY_LEN(handles) > NUM2LONG(size) ) {
+    rb_ary_pop(handles);
+    rb_ary_pop(owners);
+  }
+  rb_cv_set(klass, "@@pool_size", LONG2NUM(NUM2LONG(size)));
+  return size;
+}
+
+/*
+ * call-seq:
+ *   LibZfs.stats_enabled = true  => true
+ *
+ * Enable or disable the call statistics returned by <code>LibZfs.stats</code>,
+ * (disabled by default). Counters are kept while disabled.
+ *
+ */
+static VALUE zetta_lib_set_stats_enabled(VALUE klass, VALUE enabled)
+{
+  zetta_stats_enabled = RTEST(enabled);
+  return enabled;
+}
+
+/*
+ * call-seq:
+ *   LibZfs.stats_enabled?  => boolean
+ *
+ * Whether the call statistics are being collected.
+ *
+ */
+static VALUE zetta_lib_stats_enabled_p(VALUE klass)
+{
+  return zetta_stats_enabled ? Qtrue : Qfalse;
+}
+
+// Operation names without the 'zetta_' prefix and the '_call' suffix:
+static VALUE zetta_stats_op_name(const char *name)
+{
+  size_t len;
+
+  if (strncmp(name, "zetta_", 6) == 0) {
+    name += 6;
+  }
+  len = strlen(name);
+  if (len > 5 && strcmp(name + len - 5, "_call") == 0) {
+    len -= 5;
+  }
+  return rb_str_new(name, len);
+}
+
+/*
+ * call-seq:
+ *   LibZfs.stats  => Hash, {'operation' => {:calls, :errors, :total_ns, :max_ns, :histogram}}
+ *
+ * Return the call statistics of every libzfs operation run since the last
+ * <code>LibZfs.reset_stats</code>, by all the threads, while stats were
+ * enabled. Operations are named after the wrapper running them, (for example
+ * <code>fs_rename</code> or <code>pool_refresh</code>). Iterators and walks
+ * count once each, (<code>fs_iter_filesystems</code>, <code>fs_walk</code>,
+ * <code>fs_list</code>, <code>scan</code> or <code>catalog_write</code>),
+ * walks including the time spent into the block.
+ *
+ * For each operation: the number of calls, how many of them failed, the total
+ * and maximum time spent, in nanoseconds, and a latency histogram: an Array
+ * where the element <code>i</code> is the number of calls which took from
+ * <code>2**i</code> up to <code>2**(i+1)</code> nanoseconds, (the last one
+ * counts any longer call too).
+ *
+ *    LibZfs.stats_enabled = true
+ *    ZFS.new('tpool/home').rename('tpool/users')
+ *    LibZfs.stats['fs_rename'][:calls]  # => 1
+ *
+ */
+static VALUE zetta_lib_stats(VALUE klass)
+{
+  zetta_stats_counter_t total;
+  zetta_stats_shard_t *shard;
+  VALUE stats = rb_hash_new();
+  uint64_t epoch = zetta_stats_epoch;
+  int op, nops = zetta_stats_nops_get();
+  int i;
+
+  for (op = 0; op < nops; op++) {
+    VALUE stat, histogram;
+
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&zetta_stats_lock);
+    for (shard = zetta_stats_shards; shard != NULL; shard = shard->next) {
+      zetta_stats_counter_t *counter = &shard->ops[op];
+      if (shard->epoch != epoch) {
+        continue;
+      }
+      total.calls += counter->calls;
+      total.errors += counter->errors;
+      total.total_ns += counter->total_ns;
+      if (counter->max_ns > total.max_ns) {
+        total.max_ns = counter->max_ns;
+      }
+      for (i = 0; i < ZETTA_STATS_BUCKETS; i++) {
+        total.buckets[i] += counter->buckets[i];
+      }
+    }
+    pthread_mutex_unlock(&zetta_stats_lock);
+
+    if (total.calls == 0) {
+      continue;
+    }
+    histogram = rb_ary_new2(ZETTA_STATS_BUCKETS);
+    for (i = 0; i < ZETTA_STATS_BUCKETS; i++) {
+      rb_ary_push(histogram, ULL2NUM(total.buckets[i]));
+    }
+    stat = rb_hash_new();
+    rb_hash_aset(stat, ID2SYM(rb_intern("calls")), ULL2NUM(total.calls));
+    rb_hash_aset(stat, ID2SYM(rb_intern("errors")), ULL2NUM(total.errors));
+    rb_hash_aset(stat, ID2SYM(rb_intern("total_ns")), ULL2NUM(total.total_ns));
+    rb_hash_aset(stat, ID2SYM(rb_intern("max_ns")), ULL2NUM(total.max_ns));
+    rb_hash_aset(stat, ID2SYM(rb_intern("histogram")), histogram);
+    rb_hash_aset(stats, zetta_stats_op_name(zetta_stats_names[op]), stat);
+  }
+  return stats;
+}
+
+/*
+ * call-seq:
+ *   LibZfs.reset_stats  => nil
+ *
+ * Clear the call statistics of all the threads.
+ *
+ */
+static VALUE zetta_lib_reset_stats(VALUE klass)
+{
+  pthread_mutex_lock(&zetta_stats_lock);
+  zetta_stats_epoch++;
+  pthread_mutex_unlock(&zetta_stats_lock);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   libzfs_handle.handle_cache_size = 512  => 512
+ *
+ * Keep up to the given number of ZFS instances, (and as many Zpool
+ * instances), opened through this libzfs handle, so <code>ZFS.new</code>
+ * and <code>Zpool.new</code> return the cached instance for names already
+ * opened instead of opening them again. The least recently used ones are
+ * dropped when the cache is full. Datasets created, snapshotted or cloned
+ * are cached too.
+ *
+ * Cached datasets are forgotten when renamed, destroyed or rolled back
+ * through this library. Changes made elsewhere, (like the <code>zfs</code>
+ * command), are not noticed: use <code>invalidate_handles</code> then.
+ *
+ * Note that the very same object is returned to every caller opening the
+ * same name through this handle, even unrelated ones: its property cache,
+ * (see <code>cache_properties!</code>), instance variables and
+ * <code>refresh!</code> are shared by all of them. Use a separate LibZfs
+ * handle for code which needs instances of its own.
+ *
+ * Zero, (the default), disables the cache.
+ *
+ */
+static VALUE zetta_lib_set_handle_cache_size(VALUE self, VALUE size)
+{
+  libzfs_handle_t *handle;
+  zetta_handle_cache_t *cache;
+
+  if( NUM2LONG(size) < 0 ) {
+    rb_raise(rb_eArgError, "Handle cache size cannot be negative.");
+  }
+  Data_Get_Struct(self, libzfs_handle_t, handle);
+  cache = zetta_handle_cache_for(handle, 1);
+  cache->max = NUM2LONG(size);
+  zetta_handle_cache_evict(cache);
+  return size;
+}
+
+/*
+ * call-seq:
+ *   libzfs_handle.handle_cache_size  => Integer
+ *
+ * Maximum number of cached instances, 0 when the cache is disabled.
+ *
+ */
+static VALUE zetta_lib_get_handle_cache_size(VALUE self)
+{
+  libzfs_handle_t *handle;
+  zetta_handle_cache_t *cache;
+
+  Data_Get_Struct(self, libzfs_handle_t, handle);
+  cache = zetta_handle_cache_for(handle, 0);
+  return LONG2NUM(cache == NULL ? 0 : cache->max);
+}
+
+/*
+ * call-seq:
+ *   libzfs_handle.handle_cache_stats  => Hash, {:hits => 12, :misses => 3, :size => 3}
+ *
+ * Number of lookups served from the cache, lookups which had to open the
+ * dataset or pool, and instances currently cached.
+ *
+ */
+static VALUE zetta_lib_handle_cache_stats(VALUE self)
+{
+  libzfs_handle_t *handle;
+  zetta_handle_cache_t *cache;
+  VALUE stats = rb_hash_new();
+
+  Data_Get_Struct(self, libzfs_handle_t, handle);
+  cache = zetta_handle_cache_for(handle, 0);
+
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(cache == NULL ? 0 : cache->hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(cache == NULL ? 0 : cache->misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("size")), LONG2NUM(cache == NULL ? 0 :
+    (long)(RHASH_SIZE(cache->datasets) + RHASH_SIZE(cache->pools))));
+  return stats;
+}
+
+/*
+ * call-seq:
+ *   libzfs_handle.invalidate_handles  => self
+ *   libzfs_handle.invalidate_handles('pool/fs')  => self
+ *
+ * Forget every cached instance, or just the given dataset together with
+ * its descendants and snapshots.
+ *
+ * Raise <code>TypeError</code> when <code>name</code> is not a
+ * <code>String</code>.
+ *
+ */
+static VALUE zetta_lib_invalidate_handles(int argc, VALUE *argv, VALUE self)
+{
+  libzfs_handle_t *handle;
+
+  if (argc > 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
   }
-  return rb_cv_get(klass, "@@handle");
+  if (argc == 1 && TYPE(argv[0]) != T_STRING) {
+    rb_raise(rb_eTypeError, "Dataset name must be a string.");
+  }
+  Data_Get_Struct(self, libzfs_handle_t, handle);
+  zetta_handle_cache_invalidate(handle, (argc == 1) ? StringValuePtr(argv[0]) : NULL);
+  return self;
 }
 
 static void Init_libzfs_consts()
@@ -1631,6 +8886,7 @@ static void Init_libzfs_consts()
   VALUE mHealthStatus = rb_define_module_under(cZfsConsts, "HealthStatus");
   VALUE mState = rb_define_module_under(cZfsConsts, "State");
   VALUE mPoolState = rb_define_module_under(mState, "Pool");
+  VALUE mVdevState = rb_define_module_under(mState, "Vdev");
 
 // Current version
 // ZFS_VERSION has been replaced with SPA_VERSION:
@@ -1688,6 +8944,16 @@ static void Init_libzfs_consts()
   rb_define_const(mPoolState, "POTENTIALLY_ACTIVE", INT2NUM(6));
   rb_define_const(mPoolState, "UNKNOWN", INT2NUM(7));
   rb_define_const(mPoolState, "L2CACHE", INT2NUM(8));
+
+  /* Vdev state codes */
+  rb_define_const(mVdevState, "UNKNOWN", INT2NUM(VDEV_STATE_UNKNOWN));
+  rb_define_const(mVdevState, "CLOSED", INT2NUM(VDEV_STATE_CLOSED));
+  rb_define_const(mVdevState, "OFFLINE", INT2NUM(VDEV_STATE_OFFLINE));
+  rb_define_const(mVdevState, "REMOVED", INT2NUM(VDEV_STATE_REMOVED));
+  rb_define_const(mVdevState, "CANT_OPEN", INT2NUM(VDEV_STATE_CANT_OPEN));
+  rb_define_const(mVdevState, "FAULTED", INT2NUM(VDEV_STATE_FAULTED));
+  rb_define_const(mVdevState, "DEGRADED", INT2NUM(VDEV_STATE_DEGRADED));
+  rb_define_const(mVdevState, "HEALTHY", INT2NUM(VDEV_STATE_HEALTHY));
 }
 
 static void Init_libzfs_errors()
@@ -1773,22 +9039,77 @@ void Init_zetta()
   VALUE cZpool = rb_define_class("Zpool", rb_cObject);
   VALUE cZFS = rb_define_class("ZFS", rb_cObject);
 
+  cZfsSpaceStats = rb_struct_define(NULL, "used", "available", "referenced",
+    "usedbysnapshots", "usedbychildren", "written", "logicalused", "compressratio", NULL);
+  rb_define_const(cZFS, "SpaceStats", cZfsSpaceStats);
+#ifdef SPA_VERSION_15
+  cZfsUserspace = rb_struct_define(NULL, "datasets", "dataset", "type", "domain", "rid",
+    "used", "quota", "errors", NULL);
+  rb_define_const(cZFS, "Userspace", cZfsUserspace);
+#endif
+  cZpoolIOStat = rb_struct_define(NULL, "name", "depth", "alloc", "free", "read_ops",
+    "write_ops", "read_bytes", "write_bytes", "read_errors", "write_errors", "checksum_errors", NULL);
+  rb_define_const(cZpool, "IOStat", cZpoolIOStat);
+  cZpoolEvent = rb_struct_define(NULL, "eid", "event_class", "time", "pool", "dropped", "payload", NULL);
+  rb_define_const(cZpool, "Event", cZpoolEvent);
+  cZpoolVdev = rb_define_class_under(cZpool, "Vdev", rb_cObject);
+  rb_undef_alloc_func(cZpoolVdev);
+  rb_define_method(cZpoolVdev, "name", zetta_vdev_get_name, 0);
+  rb_define_method(cZpoolVdev, "type", zetta_vdev_get_type, 0);
+  rb_define_method(cZpoolVdev, "path", zetta_vdev_get_path, 0);
+  rb_define_method(cZpoolVdev, "guid", zetta_vdev_get_guid, 0);
+  rb_define_method(cZpoolVdev, "state", zetta_vdev_get_state, 0);
+  rb_define_method(cZpoolVdev, "aux", zetta_vdev_get_aux, 0);
+  rb_define_method(cZpoolVdev, "healthy?", zetta_vdev_is_healthy, 0);
+  rb_define_method(cZpoolVdev, "errors", zetta_vdev_get_errors, 0);
+  rb_define_method(cZpoolVdev, "depth", zetta_vdev_get_depth, 0);
+  rb_define_method(cZpoolVdev, "leaf?", zetta_vdev_is_leaf, 0);
+  rb_define_method(cZpoolVdev, "children", zetta_vdev_get_children, 0);
+  rb_define_method(cZpoolVdev, "each_leaf", zetta_vdev_each_leaf, 0);
+
   Init_libzfs_consts();
   Init_libzfs_errors();
 
+#ifdef HAVE_LZC_DESTROY_SNAPS
+  libzfs_core_init();
+#endif
+
+  pthread_key_create(&zetta_stats_key, zetta_stats_release);
+
   rb_define_alloc_func(cLibZfs, zetta_lib_alloc);
   rb_define_class_variable(cLibZfs, "@@handle", Qnil);
+  rb_define_class_variable(cLibZfs, "@@handles", rb_ary_new());
+  rb_define_class_variable(cLibZfs, "@@handle_owners", rb_ary_new());
+  rb_define_class_variable(cLibZfs, "@@pool_size", INT2FIX(8));
   rb_define_singleton_method(cLibZfs, "handle", zetta_lib_handle, 0);
+  rb_define_singleton_method(cLibZfs, "pool_size", zetta_lib_get_pool_size, 0);
+  rb_define_singleton_method(cLibZfs, "stats_enabled=", zetta_lib_set_stats_enabled, 1);
+  rb_define_singleton_method(cLibZfs, "stats_enabled?", zetta_lib_stats_enabled_p, 0);
+  rb_define_singleton_method(cLibZfs, "stats", zetta_lib_stats, 0);
+  rb_define_singleton_method(cLibZfs, "reset_stats", zetta_lib_reset_stats, 0);
+  rb_define_singleton_method(cLibZfs, "pool_size=", zetta_lib_set_pool_size, 1);
   rb_define_method(cLibZfs, "errno", zetta_lib_errno, 0);
   rb_define_method(cLibZfs, "print_on_error", zetta_lib_print_on_error, 1);
   rb_define_method(cLibZfs, "error_action", zetta_lib_error_action, 0);
   rb_define_method(cLibZfs, "error_description", zetta_lib_error_description, 0);
   rb_define_method(cLibZfs, "raise_error", zetta_lib_raise_error, 0);
+  rb_define_method(cLibZfs, "handle_cache_size=", zetta_lib_set_handle_cache_size, 1);
+  rb_define_method(cLibZfs, "handle_cache_size", zetta_lib_get_handle_cache_size, 0);
+  rb_define_method(cLibZfs, "handle_cache_stats", zetta_lib_handle_cache_stats, 0);
+  rb_define_method(cLibZfs, "invalidate_handles", zetta_lib_invalidate_handles, -1);
 
   rb_define_singleton_method(cZpool, "new", zetta_pool_new, -1);
   rb_define_method(cZpool, "name", zetta_pool_get_name, 0);
   rb_define_method(cZpool, "get", zetta_pool_get_prop, 1);
   rb_define_method(cZpool, "set", zetta_pool_set_prop, 2);
+  rb_define_method(cZpool, "get_int", zetta_pool_get_int, 1);
+  rb_define_method(cZpool, "get_many", zetta_pool_get_many, -1);
+  rb_define_method(cZpool, "properties", zetta_pool_get_props, -1);
+  rb_define_method(cZpool, "cache_properties!", zetta_prop_cache_enable, 0);
+  rb_define_method(cZpool, "invalidate", zetta_prop_cache_invalidate, 0);
+  rb_define_method(cZpool, "refresh!", zetta_pool_refresh, 0);
+  rb_define_method(cZpool, "iostat", zetta_pool_iostat, -1);
+  rb_define_method(cZpool, "vdev_tree", zetta_pool_vdev_tree, 0);
   rb_define_method(cZpool, "guid", zetta_pool_get_guid, 0);
   rb_define_method(cZpool, "space_used", zetta_pool_get_space_used, 0);
   rb_define_method(cZpool, "space_total", zetta_pool_get_space_total, 0);
@@ -1799,6 +9120,7 @@ void Init_zetta()
   // rb_define_method(cZpool, "destroy!", zetta_pool_destroy, 0);
 
   rb_define_singleton_method(cZpool, "each", zetta_pool_iter, -1);
+  rb_define_singleton_method(cZpool, "events", zetta_pool_events, -1);
 
   rb_define_singleton_method(cZFS, "new", zetta_fs_new, -1);
   rb_define_method(cZFS, "libzfs_handle", zetta_fs_get_handle, 0);
@@ -1837,17 +9159,50 @@ void Init_zetta()
   rb_define_singleton_method(cZFS, "exists?", zetta_fs_dataset_exists, -1);
   rb_define_singleton_method(cZFS, "exist?", zetta_fs_dataset_exists, -1);
   rb_define_method(cZFS, "destroy!", zetta_fs_destroy, 0);
+  rb_define_singleton_method(cZFS, "destroy_snapshots", zetta_fs_destroy_snapshots, -1);
+  rb_define_method(cZFS, "send_stream", zetta_fs_send_stream, 1);
+  rb_define_singleton_method(cZFS, "receive", zetta_fs_receive, -1);
   // Properties:
   rb_define_method(cZFS, "get", zetta_fs_get_prop, 1);
   rb_define_method(cZFS, "get_user_prop", zetta_fs_get_user_prop, 1);
   rb_define_method(cZFS, "set", zetta_fs_set_prop, 2);
+  rb_define_method(cZFS, "get_int", zetta_fs_get_int, 1);
+  rb_define_method(cZFS, "space_stats", zetta_fs_space_stats, 0);
+  rb_define_method(cZFS, "each_userspace", zetta_fs_each_userspace, -1);
+  rb_define_singleton_method(cZFS, "userspace", zetta_fs_userspace, -1);
+  rb_define_method(cZFS, "get_many", zetta_fs_get_many, -1);
+  rb_define_method(cZFS, "properties", zetta_fs_get_props, -1);
+  rb_define_method(cZFS, "cache_properties!", zetta_prop_cache_enable, 0);
+  rb_define_method(cZFS, "invalidate", zetta_prop_cache_invalidate, 0);
+  rb_define_method(cZFS, "refresh!", zetta_fs_refresh, 0);
   // ZFS Iteration:
   rb_define_singleton_method(cZFS, "each", zetta_fs_iter_root, -1);
   rb_define_method(cZFS, "each_filesystem", zetta_fs_iter_filesystems, 0);
   rb_define_method(cZFS, "each_snapshot", zetta_fs_iter_snapshots, 0);
   rb_define_method(cZFS, "each_dependent", zetta_fs_iter_dependents, 0);
+  rb_define_singleton_method(cZFS, "walk", zetta_fs_walk, -1);
+  rb_define_singleton_method(cZFS, "scan", zetta_fs_scan, -1);
+  rb_define_singleton_method(cZFS, "mount_all", zetta_fs_mount_all, -1);
+  rb_define_singleton_method(cZFS, "unmount_all", zetta_fs_unmount_all, -1);
+  rb_define_singleton_method(cZFS, "share_all", zetta_fs_share_all, -1);
+  rb_define_singleton_method(cZFS, "unshare_all", zetta_fs_unshare_all, -1);
+  rb_define_singleton_method(cZFS, "list", zetta_fs_list, -1);
+  rb_define_const(cZFS, "UNAVAILABLE", ULL2NUM(UINT64_MAX));
+  // Dataset catalogs:
+  cZfsCatalog = rb_define_class_under(cZFS, "Catalog", rb_cObject);
+  rb_undef_alloc_func(cZfsCatalog);
+  rb_define_singleton_method(cZfsCatalog, "write", zetta_catalog_write, -1);
+  rb_define_singleton_method(cZfsCatalog, "open", zetta_catalog_open, 1);
+  rb_define_method(cZfsCatalog, "size", zetta_catalog_size, 0);
+  rb_define_method(cZfsCatalog, "pool", zetta_catalog_pool, 0);
+  rb_define_method(cZfsCatalog, "props", zetta_catalog_props, 0);
+  rb_define_method(cZfsCatalog, "each", zetta_catalog_each, 0);
+  rb_define_method(cZfsCatalog, "[]", zetta_catalog_aref, 1);
+  rb_define_method(cZfsCatalog, "stale?", zetta_catalog_stale_p, -1);
+  rb_include_module(cZfsCatalog, rb_mEnumerable);
   // Snapshots:
   rb_define_singleton_method(cZFS, "snapshot", zetta_fs_snapshot, -1);
+  rb_define_singleton_method(cZFS, "snapshot_many", zetta_fs_snapshot_many, -1);
   rb_define_method(cZFS, "rollback", zetta_fs_rollback, 2);
   // Clones:
   rb_define_method(cZFS, "clone!", zetta_fs_clone, 1);
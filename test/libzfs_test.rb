@@ -35,4 +35,75 @@ class LibZfsTest < Test::Unit::TestCase
     assert_equal @hdl1, @hdl2
   end
 
+  def test_handle_per_thread
+    main = LibZfs.handle
+    others = (1..2).map { Thread.new { [LibZfs.handle, LibZfs.handle] }.value }
+    others.each do |first, again|
+      assert_kind_of LibZfs, first
+      assert_same first, again
+    end
+    assert_not_same main, others.first.first
+    assert_equal 8, LibZfs.pool_size
+    assert_raise(ArgumentError) { LibZfs.pool_size = 0 }
+    LibZfs.pool_size = 1
+    # Handles in use are never shared, even once the pool is full:
+    gate = Queue.new
+    threads = (1..2).map { Thread.new { handle = LibZfs.handle; gate.pop; handle } }
+    sleep 0.01 until threads.all? { |thread| thread.status == 'sleep' }
+    threads.size.times { gate << true }
+    handles = threads.map { |thread| thread.value }
+    assert_not_same handles.first, handles.last
+    assert !handles.include?(main)
+    assert_not_same main, Fiber.new { LibZfs.handle }.resume
+    LibZfs.pool_size = 8
+  end
+
+  def test_handle_cache
+    assert_equal 0, @zlib.handle_cache_size
+    @zlib.handle_cache_size = 2
+    home = ZFS.new('tpool/home', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert_same home, ZFS.new('tpool/home', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert_same Zpool.new('tpool', @zlib), Zpool.new('tpool', @zlib)
+    assert_equal({:hits => 2, :misses => 2, :size => 2}, @zlib.handle_cache_stats)
+    # Least recently used entries are evicted:
+    thome = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    ZFS.new('tpool/rollback', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert_not_same home, ZFS.new('tpool/home', ZfsConsts::Types::FILESYSTEM, @zlib)
+    # Asking for another type opens the dataset again:
+    assert_raise(ZfsError::InvalidDatasetTypeError) { ZFS.new('tpool/home', ZfsConsts::Types::SNAPSHOT, @zlib) }
+    @zlib.invalidate_handles('tpool')
+    assert_not_same thome, ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    @zlib.handle_cache_size = 0
+    assert_equal 0, @zlib.handle_cache_stats[:size]
+  end
+
+  def test_stats
+    assert !LibZfs.stats_enabled?
+    LibZfs.reset_stats
+    ZFS.new('tpool/home', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert_equal({}, LibZfs.stats)
+    LibZfs.stats_enabled = true
+    ZFS.new('tpool/home', ZfsConsts::Types::FILESYSTEM, @zlib).refresh!
+    Thread.new { ZFS.new('tpool/home', ZfsConsts::Types::FILESYSTEM, LibZfs.new) }.join
+    assert_raise(ZfsError::NoentError) { ZFS.new('tpool/this_will_probably_not_exist', ZfsConsts::Types::FILESYSTEM, @zlib) }
+    stats = LibZfs.stats
+    assert_equal 3, stats['fs_open'][:calls]
+    assert_equal 1, stats['fs_open'][:errors]
+    assert_equal 1, stats['fs_refresh'][:calls]
+    assert_equal 3, stats['fs_open'][:histogram].inject(0) { |sum, n| sum + n }
+    assert stats['fs_open'][:max_ns] <= stats['fs_open'][:total_ns]
+    LibZfs.reset_stats
+    ZFS.new('tpool', ZfsConsts::Types::FILESYSTEM, @zlib).each_filesystem { |fs| fs.name }
+    ZFS.walk('tpool', {:props => ['used']}, @zlib)
+    Zpool.new('tpool', @zlib).vdev_tree
+    stats = LibZfs.stats
+    assert_equal 1, stats['fs_iter_filesystems'][:calls]
+    assert_equal 1, stats['fs_walk'][:calls]
+    assert_equal 0, stats['fs_walk'][:errors]
+    assert_equal 1, stats['pool_vdev_tree'][:calls]
+    LibZfs.reset_stats
+    assert_equal({}, LibZfs.stats)
+  ensure
+    LibZfs.stats_enabled = false
+  end
 end
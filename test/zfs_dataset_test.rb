@@ -1,4 +1,5 @@
 require 'test/unit'
+require 'io/nonblock'
 require 'zetta'
 
 # In order to run the tests on this file need to do:
@@ -10,6 +11,11 @@ require 'zetta'
 # sudo zfs set zfs_rb:sample=test tpool/thome
 # sudo zfs create tpool/rollback
 #
+# Send/receive round trips also need a second, file backed, pool:
+#
+# sudo mkfile 64m /export/vdev/d2
+# sudo zpool create tpool2 /export/vdev/d2
+#
 # Might have sense to add 'File.exists?('/tpool')' check.
 
 class ZfsDatasetTest < Test::Unit::TestCase
@@ -98,6 +104,31 @@ class ZfsDatasetTest < Test::Unit::TestCase
     assert_raise(ArgumentError) { @zfs.get('zfs_rb:sample') }
   end
 
+  def test_get_many
+    @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    props = @zfs.get_many(['type', 'mountpoint', 'origin', 'zfs_rb:sample', 'fakeprop'])
+    assert_kind_of Hash, props
+    assert_equal 'filesystem', props['type']
+    assert_equal "/tpool/thome", props['mountpoint']
+    assert_nil props['origin']
+    assert_equal 'test', props['zfs_rb:sample']
+    assert_nil props['fakeprop']
+    assert_raise(TypeError) { @zfs.get_many('type') }
+    assert_raise(TypeError) { @zfs.get_many([1234]) }
+  end
+
+  def test_properties
+    @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    props = @zfs.properties
+    assert_kind_of Hash, props
+    assert_equal props, @zfs.properties(:all)
+    assert_equal 'filesystem', props['type']
+    assert_equal @zfs.get('used'), props['used']
+    assert_equal 'test', props['zfs_rb:sample']
+    assert_equal({'type' => 'filesystem'}, @zfs.properties(['type']))
+    assert_raise(ArgumentError) { @zfs.properties(:some) }
+  end
+
   # Root Filesystems: rpool, tpool
   def test_root_fs_iteration
     ZFS.each(@zlib) do |zfs|
@@ -153,6 +184,138 @@ class ZfsDatasetTest < Test::Unit::TestCase
     assert !children_fs.empty?
   end
 
+  def test_iteration_enumerators
+    @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert_kind_of Enumerable, ZFS.each(@zlib)
+    assert_kind_of Enumerable, @zfs.each_filesystem
+    assert_kind_of Enumerable, @zfs.each_snapshot
+    assert_kind_of Enumerable, @zfs.each_dependent
+    assert_equal 'tpool/thome@snap', @zfs.each_snapshot.find { |sp| sp.name == 'tpool/thome@snap' }.name
+    assert_equal 1, @zfs.each_dependent.first(1).size
+  end
+
+  def test_iteration_break
+    tpool = ZFS.new('tpool', ZfsConsts::Types::FILESYSTEM, @zlib)
+    seen = 0
+    found = tpool.each_filesystem do |zfs|
+      seen += 1
+      break zfs
+    end
+    assert_equal 1, seen
+    assert_kind_of ZFS, found
+    assert_raise(RuntimeError) { tpool.each_filesystem { |zfs| raise 'stop' } }
+    # The library is still usable after the walk has been stopped:
+    assert_equal 'tpool/thome', ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib).name
+  end
+
+  def test_walk
+    records = ZFS.walk('tpool', {:props => ['used', 'zfs_rb:sample']}, @zlib)
+    assert_kind_of Array, records
+    names = records.map { |name, type, props| name }
+    assert_equal 'tpool', names.first
+    assert names.include?('tpool/thome')
+    assert !names.include?('tpool/thome@snap')
+    name, type, props = records.find { |record| record.first == 'tpool/thome' }
+    assert_equal ZfsConsts::Types::FILESYSTEM, type
+    assert_equal ['used', 'zfs_rb:sample'], props.keys.sort
+    assert_equal 'test', props['zfs_rb:sample']
+  end
+
+  def test_walk_depth_and_types
+    names = ZFS.walk('tpool', :depth => 0).map { |record| record.first }
+    assert_equal ['tpool'], names
+    snaps = ZFS.walk('tpool/thome', :depth => 1, :types => ZfsConsts::Types::SNAPSHOT)
+    assert snaps.map { |record| record.first }.include?('tpool/thome@snap')
+    snaps.each { |name, type, props| assert_equal ZfsConsts::Types::SNAPSHOT, type }
+    assert_raise(TypeError) { ZFS.walk('tpool', :depth => 'all') }
+    assert_raise(ZfsError::NoentError) { ZFS.walk('tpool/this_will_probably_not_exist') }
+  end
+
+  def test_walk_block_and_batches
+    seen = []
+    ZFS.walk('tpool', :types => ZfsConsts::Types::ANY) { |name, type, props| seen << name }
+    assert seen.include?('tpool/thome@snap')
+    batches = []
+    ZFS.walk('tpool', :types => ZfsConsts::Types::ANY, :batch => 2) { |records| batches << records }
+    assert batches.all? { |records| records.size <= 2 }
+    assert_equal seen, batches.flatten(1).map { |record| record.first }
+    first = ZFS.walk('tpool') { |name, type, props| break name }
+    assert_equal 'tpool', first
+  end
+
+  def test_list
+    list = ZFS.list('tpool', :recursive => true, :columns => ['name', 'used', 'zfs_rb:sample'], :types => ZfsConsts::Types::DATASET)
+    assert_equal ['name', 'used', 'zfs_rb:sample'].sort, list.keys.sort
+    names = ZFS.walk('tpool', :types => ZfsConsts::Types::DATASET).map { |name, type, props| name }
+    assert_equal names, list['name']
+    used = list['used'].unpack('Q*')
+    assert_equal names.size, used.size
+    at = names.index('tpool/thome')
+    assert_equal ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib).get_int('used'), used[at]
+    assert_equal 'test', list['zfs_rb:sample'][at]
+    # Only the given dataset by default, and values not available for snapshots:
+    assert_equal ['tpool'], ZFS.list('tpool', @zlib)['name']
+    snap = ZFS.list('tpool/thome@snap', {:columns => ['available'], :types => ZfsConsts::Types::SNAPSHOT}, @zlib)
+    assert_equal [ZFS::UNAVAILABLE], snap['available'].unpack('Q*')
+    assert_raise(ArgumentError) { ZFS.list('tpool', :columns => ['this_is_not_a_property']) }
+  end
+
+  def test_catalog
+    path = "/tmp/zetta_catalog_#{$$}"
+    count = ZFS::Catalog.write(path, 'tpool', {:props => ['used', 'quota']}, @zlib)
+    walked = ZFS.walk('tpool', :types => ZfsConsts::Types::DATASET)
+    assert_equal walked.size, count
+    catalog = ZFS::Catalog.open(path)
+    assert_equal count, catalog.size
+    assert_equal 'tpool', catalog.pool
+    assert_equal ['used', 'quota'], catalog.props
+    assert_equal walked.map { |name, type, props| name }, catalog.map { |record| record.first }
+    name, type, guid, createtxg, props = catalog['tpool/thome']
+    zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert_equal ZfsConsts::Types::FILESYSTEM, type
+    assert_equal zfs.get_int('guid'), guid
+    assert_equal zfs.get_int('used'), props['used']
+    assert_nil catalog['tpool/this_will_probably_not_exist']
+    assert !catalog.stale?(@zlib)
+    # New datasets, and changes to the saved values, make it stale:
+    fs_name = "tpool/catalog_#{rand(1000)}"
+    assert ZFS.create(fs_name, ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert catalog.stale?(@zlib)
+    assert ZFS.new(fs_name, ZfsConsts::Types::FILESYSTEM, @zlib).destroy!
+    assert !catalog.stale?(@zlib)
+    assert zfs.set('quota', '1G')
+    assert catalog.stale?(@zlib)
+    assert zfs.set('quota', 'none')
+    assert !catalog.stale?(@zlib)
+    assert_raise(ArgumentError) { ZFS::Catalog.write(path, 'tpool', :props => ['mountpoint']) }
+    # A name offset out of the names section, (the first word of the first
+    # record, right after the 304 bytes header and the property names):
+    ZFS::Catalog.write(path, 'tpool', {:props => ['used', 'quota']}, @zlib)
+    File.open(path, 'r+b') { |f| f.seek(304 + 2 * 64); f.write([2 ** 62].pack('Q')) }
+    assert_raise(ArgumentError) { ZFS::Catalog.open(path).each {} }
+    File.open(path, 'w') { |f| f.write('not a catalog') }
+    assert_raise(ArgumentError) { ZFS::Catalog.open(path) }
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+
+  def test_scan
+    records = ZFS.scan({:threads => 2, :types => ZfsConsts::Types::ANY, :props => ['used']}, @zlib)
+    assert_kind_of Array, records
+    names = records.map { |record| record.first }
+    assert names.include?('tpool')
+    assert names.include?('tpool/thome@snap')
+    # Same records, in the same order, than walking every root dataset:
+    walked = ZFS.each.map { |root| root.name }.sort.map do |root|
+      ZFS.walk(root, :types => ZfsConsts::Types::ANY, :props => ['used'])
+    end
+    assert_equal walked.flatten(1), records
+    assert_equal records, ZFS.scan(:threads => 1, :types => ZfsConsts::Types::ANY, :props => ['used'])
+    assert_raise(ArgumentError) { ZFS.scan(:threads => 0) }
+    assert_raise(ArgumentError) { ZFS.scan(:threads => -2) }
+    assert_raise(TypeError) { ZFS.scan(:threads => 'x') }
+  end
+
   def test_dataset_exists
     assert ZFS.exists?('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
     assert !ZFS.exists?('tpool/this_will_probably_not_exists', ZfsConsts::Types::FILESYSTEM, @zlib)
@@ -216,6 +379,262 @@ class ZfsDatasetTest < Test::Unit::TestCase
     assert !ZFS.exists?(snap_name, ZfsConsts::Types::SNAPSHOT, @zlib)
   end
 
+  # Snapshot and destroy run without holding the interpreter lock:
+  def test_snapshot_destroy_from_threads
+    names = (1..4).map { |i| "tpool/thome@thread_snap_#{i}_#{rand(1000)}" }
+    threads = names.map do |snap_name|
+      Thread.new { ZFS.snapshot(snap_name, @zlib) }
+    end
+    snaps = threads.map { |t| t.value }
+    snaps.each do |snap|
+      assert_kind_of ZFS, snap
+      assert_equal(ZfsConsts::Types::SNAPSHOT, snap.fs_type)
+    end
+    snaps.map { |snap| Thread.new { snap.destroy! } }.each { |t| assert t.value }
+    names.each do |snap_name|
+      assert !ZFS.exists?(snap_name, ZfsConsts::Types::SNAPSHOT, @zlib)
+    end
+  end
+
+  def test_shared_handle_from_threads
+    tpool = ZFS.new('tpool', ZfsConsts::Types::FILESYSTEM, @zlib)
+    # The handle is given back while the block runs, so other threads can
+    # use it from inside a walk, and after leaving the walk with break:
+    names = []
+    tpool.each_filesystem do |zfs|
+      names << Thread.new { ZFS.new(zfs.name, ZfsConsts::Types::FILESYSTEM, @zlib).get('used') && zfs.name }.value
+    end
+    assert names.include?('tpool/thome')
+    ZFS.walk('tpool', {}, @zlib) { |name, type, props| break }
+    threads = (1..4).map do |i|
+      Thread.new do
+        (1..10).map do
+          [ZFS.walk('tpool', {:props => ['used']}, @zlib).size,
+           ZFS.exists?('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib),
+           tpool.set('zfs_rb:shared', "thread#{i}")]
+        end
+      end
+    end
+    threads.each { |t| assert t.value.all? { |size, exists, set| size > 0 && exists && set } }
+  end
+
+  def test_snapshot_options
+    snap_name = "tpool@rsnap_#{rand(1000)}"
+    assert_equal true, ZFS.snapshot(snap_name, {:recursive => true, :open => false,
+                                                :props => {'zfs_rb:sample' => 'snap'}}, @zlib)
+    assert ZFS.exists?(snap_name, ZfsConsts::Types::SNAPSHOT, @zlib)
+    child_snap = snap_name.sub('tpool@', 'tpool/thome@')
+    assert ZFS.exists?(child_snap, ZfsConsts::Types::SNAPSHOT, @zlib)
+    assert_equal 'snap', ZFS.new(snap_name, ZfsConsts::Types::SNAPSHOT, @zlib).get_user_prop('zfs_rb:sample')
+    ZFS.walk('tpool', :types => ZfsConsts::Types::SNAPSHOT).each do |name, type, props|
+      ZFS.new(name, type, @zlib).destroy! if name =~ /@#{snap_name.split('@').last}$/
+    end
+    assert !ZFS.exists?(child_snap, ZfsConsts::Types::SNAPSHOT, @zlib)
+    assert_raise(TypeError) { ZFS.snapshot(snap_name, :props => {'zfs_rb:sample' => 1}) }
+  end
+
+  def test_snapshot_many
+    suffix = "many_#{rand(1000)}"
+    names = ["tpool/home@#{suffix}", "tpool/thome@#{suffix}"]
+    assert_equal true, ZFS.snapshot_many(names, @zlib)
+    names.each { |name| assert ZFS.exists?(name, ZfsConsts::Types::SNAPSHOT, @zlib) }
+    # A failure doesn't create any of the (new) snapshots:
+    fresh = ["tpool/home@#{suffix}_new", "tpool/thome@#{suffix}_new"]
+    assert_raise(ZfsError::DatasetExistsError) { ZFS.snapshot_many(fresh + [names.last], @zlib) }
+    fresh.each { |name| assert !ZFS.exists?(name, ZfsConsts::Types::SNAPSHOT, @zlib) }
+    names.each { |name| assert ZFS.new(name, ZfsConsts::Types::SNAPSHOT, @zlib).destroy! }
+    snaps = ZFS.snapshot_many(names, {:open => true}, @zlib)
+    assert_equal names, snaps.map { |snap| snap.name }
+    snaps.each { |snap| assert snap.destroy! }
+    assert_raise(TypeError) { ZFS.snapshot_many('tpool/home@snap') }
+    assert_raise(ArgumentError) { ZFS.snapshot_many(['tpool/home']) }
+  end
+
+  def test_destroy_snapshots
+    suffix = "destroy_#{rand(1000)}"
+    names = ["tpool/home@#{suffix}", "tpool/thome@#{suffix}"]
+    assert_equal true, ZFS.snapshot_many(names, @zlib)
+    assert_equal({}, ZFS.destroy_snapshots(names, @zlib))
+    names.each { |name| assert !ZFS.exists?(name, ZfsConsts::Types::SNAPSHOT, @zlib) }
+    # Ranges, (both ends included) and open ended ranges:
+    range = (1..3).map { |i| "tpool/home@#{suffix}_#{i}" }
+    range.each { |name| ZFS.snapshot(name, {:open => false}, @zlib) }
+    assert_equal({}, ZFS.destroy_snapshots("tpool/home@#{suffix}_2%#{suffix}_3", {:defer => true}, @zlib))
+    assert ZFS.exists?(range.first, ZfsConsts::Types::SNAPSHOT, @zlib)
+    assert !ZFS.exists?(range.last, ZfsConsts::Types::SNAPSHOT, @zlib)
+    errors = ZFS.destroy_snapshots("tpool/home@#{suffix}_1%not_there", @zlib)
+    assert_equal ["tpool/home@#{suffix}_1%not_there"], errors.keys
+    assert_equal({}, ZFS.destroy_snapshots("tpool/home@%#{suffix}_1", @zlib))
+    assert !ZFS.exists?(range.first, ZfsConsts::Types::SNAPSHOT, @zlib)
+    # A snapshot with clones cannot be destroyed, and it is reported, (with
+    # every other snapshot of its pool the request couldn't destroy):
+    busy, free = "tpool/home@#{suffix}_busy", "tpool/home@#{suffix}_free"
+    assert_equal true, ZFS.snapshot_many([busy, free], @zlib)
+    clone = ZFS.new(busy, ZfsConsts::Types::SNAPSHOT, @zlib).clone!("tpool/clone_#{suffix}")
+    errors = ZFS.destroy_snapshots([busy, free], @zlib)
+    assert errors.has_key?(busy)
+    assert_kind_of String, errors[busy]
+    errors.keys.each { |name| assert ZFS.exists?(name, ZfsConsts::Types::SNAPSHOT, @zlib) }
+    # Unless its destruction is deferred, (until the clone is gone):
+    assert_equal({}, ZFS.destroy_snapshots([busy, free], {:defer => true}, @zlib))
+    assert !ZFS.exists?(free, ZfsConsts::Types::SNAPSHOT, @zlib)
+    assert_equal 'on', ZFS.new(busy, ZfsConsts::Types::SNAPSHOT, @zlib).get('defer_destroy')
+    assert clone.destroy!
+    assert !ZFS.exists?(busy, ZfsConsts::Types::SNAPSHOT, @zlib)
+    assert_raise(TypeError) { ZFS.destroy_snapshots(1) }
+    assert_raise(ArgumentError) { ZFS.destroy_snapshots(['tpool/home']) }
+  end
+
+  def test_send_stream
+    @zfs = ZFS.new('tpool/thome@snap', ZfsConsts::Types::SNAPSHOT, @zlib)
+    File.open('/dev/null', 'w') do |null|
+      assert_equal true, @zfs.send_stream(:to => null)
+    end
+    # Through the pump, with progress:
+    reports = []
+    r, w = IO.pipe
+    reader = Thread.new { r.read.size }
+    assert_equal true, @zfs.send_stream(:to => w) { |bytes, rate| reports << bytes }
+    w.close
+    assert reader.value > 0
+    assert_equal reader.value, reports.last
+    # A target which is never read doesn't keep the thread from being raised,
+    # with or without progress, (and blocking or not):
+    [true, false].each do |progress|
+      r, w = IO.pipe
+      begin
+        loop { w.write_nonblock('x' * 4096) }
+      rescue IO::WaitWritable
+      end
+      w.nonblock = progress
+      sender = Thread.new do
+        begin
+          progress ? @zfs.send_stream(:to => w) { |bytes, rate| } : @zfs.send_stream(:to => w)
+        rescue RuntimeError => e
+          e
+        end
+      end
+      sleep 0.2
+      sender.raise(RuntimeError, 'stop sending')
+      assert_not_nil sender.join(5)
+      assert_equal 'stop sending', sender.value.message
+      r.close
+      w.close
+    end
+    assert_raise(TypeError) { @zfs.send_stream(:to => 'nowhere') }
+    assert_raise(NoMethodError) {
+      ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib).send_stream(:to => 1)
+    }
+  end
+
+  def test_send_receive_round_trip
+    target = "tpool2/thome_#{rand(1000)}"
+    @zfs = ZFS.new('tpool/thome@snap', ZfsConsts::Types::SNAPSHOT, @zlib)
+    r, w = IO.pipe
+    sender = Thread.new { @zfs.send_stream(:to => w); w.close }
+    assert_equal true, ZFS.receive(target, {:from => r, :buffer => 64 * 1024}, @zlib)
+    sender.join
+    r.close
+    assert ZFS.exists?("#{target}@snap", ZfsConsts::Types::SNAPSHOT, @zlib)
+    # The same stream again can only be a broken one for the existing target:
+    File.open('/dev/null') do |null|
+      assert_raise(ZfsError::BadStreamError) { ZFS.receive(target, :from => null) }
+    end
+    # A filesystem with snapshots cannot be destroyed, (the dataset is busy):
+    assert ZFS.new("#{target}@snap", ZfsConsts::Types::SNAPSHOT, @zlib).destroy!
+    assert ZFS.new(target, ZfsConsts::Types::FILESYSTEM, @zlib).destroy!
+    assert_raise(TypeError) { ZFS.receive(target, :from => 'nowhere') }
+    assert_raise(ArgumentError) { ZFS.receive(target) }
+    # A source which never sends anything doesn't keep the thread from dying:
+    r, w = IO.pipe
+    receiver = Thread.new { ZFS.receive(target, {:from => r}, @zlib) }
+    sleep 0.2
+    receiver.kill
+    assert_not_nil receiver.join(5)
+    assert !ZFS.exists?(target, ZfsConsts::Types::FILESYSTEM, @zlib)
+    r.close
+    w.close
+  end
+
+  def test_get_int
+    @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    used = @zfs.get_int('used')
+    assert_kind_of Integer, used
+    assert_nil @zfs.get_int('mountpoint')
+    assert_nil @zfs.get_int('this_is_not_a_property')
+    literal = @zfs.get_many(['used', 'mountpoint', 'zfs_rb:sample'], :literal => true)
+    assert_equal used, literal['used']
+    assert_equal @zfs.get('mountpoint'), literal['mountpoint']
+    assert_equal 'test', literal['zfs_rb:sample']
+    assert_equal used, @zfs.properties(:all, :literal => true)['used']
+    assert_equal used, @zfs.properties(['used'], :literal => true)['used']
+  end
+
+  def test_space_stats
+    @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    stats = @zfs.space_stats
+    assert_kind_of ZFS::SpaceStats, stats
+    assert stats.frozen?
+    assert_equal @zfs.get_int('used'), stats.used
+    assert_equal @zfs.get_int('available'), stats.available
+    assert_equal @zfs.get_int('referenced'), stats.referenced
+    assert_kind_of Float, stats.compressratio
+    # FrozenError, (a RuntimeError), on Ruby 2.5 and later:
+    assert_raise_kind_of(TypeError, RuntimeError) { stats.used = 0 }
+  end
+
+  def test_userspace
+    root = "tpool/userspace_#{rand(1000)}"
+    assert ZFS.create(root, ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert ZFS.create("#{root}/a", ZfsConsts::Types::FILESYSTEM, @zlib)
+    @zfs = ZFS.new(root, ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert @zfs.set('userquota@1001', '10M')
+    assert @zfs.set('groupquota@0', '1G')
+    entries = @zfs.each_userspace.to_a
+    assert_equal [:user, nil, 1001, 0, 10 * 1024 * 1024], entries.find { |entry| entry[2] == 1001 }
+    # Space charged to a group depends on who owns the files, not the quota:
+    groups = @zfs.each_userspace(:types => :group).to_a
+    assert_equal 1, groups.size
+    type, domain, rid, used, quota = groups.first
+    assert_equal [:group, nil, 0, 1024 ** 3], [type, domain, rid, quota]
+    assert_kind_of Integer, used
+    assert used >= 0
+    assert_equal entries.sort_by { |type, domain, rid| [type == :user ? 0 : 1, rid] }, entries
+    assert_raise(ArgumentError) { @zfs.each_userspace(:types => [:other]) {} }
+
+    us = ZFS.userspace(root, {:threads => 2}, @zlib)
+    assert_kind_of ZFS::Userspace, us
+    assert us.frozen?
+    assert_equal [root, "#{root}/a"], us.datasets
+    assert_equal us.dataset.size, us.used.size
+    assert_equal entries, (0...us.rid.size).select { |i| us.dataset[i] == 0 }.map { |i|
+      [us.type[i], us.domain[i], us.rid[i], us.used[i], us.quota[i]] }
+    assert_equal({}, us.errors)
+    assert_equal [root], ZFS.userspace(root, :depth => 0, :types => :user).datasets
+    assert_raise(ZfsError::NoentError) { ZFS.userspace("#{root}/none") }
+
+    assert @zfs.set('userquota@1001', 'none')
+    assert !@zfs.each_userspace.any? { |type, domain, rid| rid == 1001 }
+    ["#{root}/a", root].each { |name| assert ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).destroy! }
+  end
+
+  def test_property_cache
+    @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    @zfs.cache_properties!
+    used = @zfs.get('used')
+    assert_same used, @zfs.get('used')
+    assert_same @zfs.get_user_prop('zfs_rb:sample'), @zfs.get_user_prop('zfs_rb:sample')
+    # Writes go through the cache:
+    assert @zfs.set('zfs_rb:cached', 'one')
+    assert_equal 'one', @zfs.get_many(['zfs_rb:cached'])['zfs_rb:cached']
+    # Changes made through other handles are only seen after refresh!:
+    other = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
+    assert other.set('zfs_rb:cached', 'two')
+    assert_equal 'one', @zfs.get_user_prop('zfs_rb:cached')
+    assert_equal 'two', @zfs.refresh!.get_user_prop('zfs_rb:cached')
+    assert_equal @zfs.properties['used'], @zfs.get('used')
+  end
+
   def test_snapshot_failure
     snap_name = 'tpool/this_will_probably_not_exists@snap'
     assert_raise(ZfsError::NoentError) {
@@ -270,15 +689,20 @@ class ZfsDatasetTest < Test::Unit::TestCase
     ds_name = "tpool/dataset_#{rand(1000)}"
     snap_name = "#{ds_name}@snap"
     clone_name = "#{ds_name}_clone"
+    @zlib.handle_cache_size = 8
     @zfs = ZFS.create(ds_name, ZfsConsts::Types::FILESYSTEM, @zlib)
     assert @zfs
     @snap = ZFS.snapshot(snap_name, @zlib)
     assert @snap
+    assert_same @snap, ZFS.new(snap_name, ZfsConsts::Types::SNAPSHOT, @zlib)
     @clone = @snap.clone!(clone_name)
     # Trying to destroy the dataset with clones will fail
     assert !@zfs.destroy!
     # Promote the clone
     assert @clone.promote
+    # Cached handles of both datasets are gone with the moved snapshot:
+    assert_raise(ZfsError::NoentError) { ZFS.new(snap_name, ZfsConsts::Types::SNAPSHOT, @zlib) }
+    assert_not_same @clone, ZFS.new(clone_name, ZfsConsts::Types::FILESYSTEM, @zlib)
     # We can destroy the original dataset now
     assert @zfs.destroy!
     # Now we cannot destroy the clone:
@@ -308,6 +732,46 @@ class ZfsDatasetTest < Test::Unit::TestCase
     assert !ZFS.exists?(create_mounted_name, ZfsConsts::Types::FILESYSTEM, @zlib)
   end
 
+  def test_mount_all_unmount_all
+    root = "tpool/mount_all_#{rand(1000)}"
+    names = [root, "#{root}/a", "#{root}/a/b", "#{root}/c"]
+    names.each { |name| assert ZFS.create(name, ZfsConsts::Types::FILESYSTEM, @zlib) }
+    ZFS.unmount_all(:root => root)
+    results = ZFS.mount_all({:root => root, :threads => 2}, @zlib)
+    assert_equal names.sort, results.keys.sort
+    assert results.values.all? { |result| result == true }
+    assert results.keys.index(root) < results.keys.index("#{root}/a")
+    assert results.keys.index("#{root}/a") < results.keys.index("#{root}/a/b")
+    assert names.all? { |name| ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).is_mounted? }
+    assert_equal({}, ZFS.mount_all(:root => root))
+    results = ZFS.unmount_all(:root => root, :threads => 3)
+    assert_equal names.sort, results.keys.sort
+    assert results.keys.index("#{root}/a/b") < results.keys.index("#{root}/a")
+    assert names.all? { |name| !ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).is_mounted? }
+    assert_raise(TypeError) { ZFS.mount_all(:threads => 0) }
+    names.reverse.each { |name| assert ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).destroy! }
+  end
+
+  def test_mount_all_sibling_prefixes
+    root = "tpool/mount_prefix_#{rand(1000)}"
+    # "/a-x" sorts between "/a" and "/a/b" byte by byte:
+    names = [root, "#{root}/a", "#{root}/a-x", "#{root}/a/b", "#{root}/a/b/c"]
+    names.each { |name| assert ZFS.create(name, ZfsConsts::Types::FILESYSTEM, @zlib) }
+    ZFS.unmount_all(:root => root)
+    results = ZFS.mount_all(:root => root, :threads => 1)
+    assert results.values.all? { |result| result == true }
+    order = results.keys
+    assert_equal names.sort, order.sort
+    assert order.index("#{root}/a") < order.index("#{root}/a/b")
+    assert order.index("#{root}/a/b") < order.index("#{root}/a/b/c")
+    results = ZFS.unmount_all(:root => root, :threads => 1)
+    assert results.values.all? { |result| result == true }
+    order = results.keys
+    assert order.index("#{root}/a/b/c") < order.index("#{root}/a/b")
+    assert order.index("#{root}/a/b") < order.index("#{root}/a")
+    names.reverse.each { |name| assert ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).destroy! }
+  end
+
   def test_share_unshare_nfs
     @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
     assert !@zfs.is_shared?
@@ -323,6 +787,31 @@ class ZfsDatasetTest < Test::Unit::TestCase
     assert @zfs.set("sharenfs", 'off')
   end
 
+  def test_share_all_unshare_all
+    root = "tpool/share_all_#{rand(1000)}"
+    names = [root, "#{root}/a", "#{root}/b"]
+    names.each { |name| assert ZFS.create(name, ZfsConsts::Types::FILESYSTEM, @zlib) }
+    ZFS.mount_all(:root => root)
+    assert_equal({}, ZFS.share_all(:root => root))
+    assert ZFS.new(root, ZfsConsts::Types::FILESYSTEM, @zlib).set("sharenfs", 'on')
+    results = ZFS.share_all({:root => root, :protocols => [:nfs], :threads => 2}, @zlib)
+    assert_equal names.sort, results.keys.sort
+    assert results.values.all? { |result| result == true }
+    assert names.all? { |name| ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).is_shared_nfs? }
+    results = ZFS.unshare_all(["#{root}/a"], :protocols => :nfs)
+    assert_equal({"#{root}/a" => true}, results)
+    assert !ZFS.new("#{root}/a", ZfsConsts::Types::FILESYSTEM, @zlib).is_shared_nfs?
+    results = ZFS.unshare_all(nil, {:root => root}, @zlib)
+    assert_equal [root, "#{root}/b"], results.keys.sort
+    assert names.all? { |name| !ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).is_shared_nfs? }
+    assert ZFS.share_all(["#{root}/none"])["#{root}/none"].is_a?(String)
+    assert_raise(ArgumentError) { ZFS.share_all(:protocols => [:afp]) }
+    assert_raise(TypeError) { ZFS.share_all([root, 1]) }
+    assert_raise(ArgumentError) { ZFS.unshare_all([root, "#{root}\0"]) }
+    ZFS.unmount_all(:root => root)
+    names.reverse.each { |name| assert ZFS.new(name, ZfsConsts::Types::FILESYSTEM, @zlib).destroy! }
+  end
+
   # BUG: Cannot properly share iSCSI, have to investigate.
   def test_share_unshare_iscsi
     @zfs = ZFS.new('tpool/thome', ZfsConsts::Types::FILESYSTEM, @zlib)
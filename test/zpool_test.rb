@@ -99,6 +99,55 @@ class ZpoolTest < Test::Unit::TestCase
     assert_nil @zpool.get('fakeprop')
   end
 
+  def test_get_many
+    @zpool = Zpool.new('tpool', @zlib)
+    props = @zpool.get_many(['guid', 'size', 'delegation', 'fakeprop'])
+    assert_kind_of Hash, props
+    assert_equal @zpool.guid, props['guid']
+    assert_equal @zpool.get('size'), props['size']
+    assert ['on','off'].include?(props['delegation'])
+    assert props.has_key?('fakeprop')
+    assert_nil props['fakeprop']
+    assert_raise(TypeError) { @zpool.get_many('guid') }
+    assert_raise(TypeError) { @zpool.get_many([1234]) }
+  end
+
+  def test_properties
+    @zpool = Zpool.new('tpool', @zlib)
+    props = @zpool.properties
+    assert_kind_of Hash, props
+    assert_equal props, @zpool.properties(:all)
+    assert_equal @zpool.version, props['version']
+    assert_equal @zpool.get('health'), props['health']
+    assert_equal({'guid' => @zpool.guid}, @zpool.properties(['guid']))
+    assert_raise(ArgumentError) { @zpool.properties(:some) }
+  end
+
+  def test_get_int
+    @zpool = Zpool.new('tpool', @zlib)
+    assert_equal @zpool.guid, @zpool.get_int('guid')
+    assert_kind_of Integer, @zpool.get_int('size')
+    assert_nil @zpool.get_int('health')
+    assert_nil @zpool.get_int('this_is_not_a_property')
+    literal = @zpool.get_many(['size', 'health'], :literal => true)
+    assert_equal @zpool.get_int('size'), literal['size']
+    assert_equal @zpool.get('health'), literal['health']
+    assert_equal literal['size'], @zpool.properties(:all, :literal => true)['size']
+  end
+
+  def test_property_cache
+    @zpool = Zpool.new('tpool', @zlib)
+    assert_same @zpool, @zpool.cache_properties!
+    health = @zpool.get('health')
+    assert health.frozen?
+    assert_same health, @zpool.get('health')
+    assert_equal({'health' => health}, @zpool.get_many(['health']))
+    assert_same @zpool, @zpool.invalidate
+    assert_not_same health, @zpool.get('health')
+    assert_same @zpool, @zpool.refresh!
+    assert_equal health, @zpool.get('health')
+  end
+
   # Requires root or privileged profile to run:
   def test_set_prop
     @zpool = Zpool.new('tpool', @zlib)
@@ -121,6 +170,13 @@ class ZpoolTest < Test::Unit::TestCase
     end
   end
 
+  def test_iteration_enumerator
+    pools = Zpool.each(@zlib)
+    assert_kind_of Enumerable, pools
+    assert pools.map { |pool| pool.name }.include?('tpool')
+    assert_kind_of Zpool, Zpool.each(@zlib).first
+  end
+
   def test_iteration_without_handle
     Zpool.each do |pool|
       assert_kind_of Zpool, pool
@@ -128,4 +184,61 @@ class ZpoolTest < Test::Unit::TestCase
     end
   end
 
+  def test_iostat
+    @zpool = Zpool.new('tpool', @zlib)
+    records = @zpool.iostat
+    assert_kind_of Array, records
+    assert records.size > 1
+    assert_kind_of Zpool::IOStat, records.first
+    assert_equal 'tpool', records.first.name
+    assert_equal 0, records.first.depth
+    assert records.first.frozen?
+    assert records.all? { |r| r.read_ops >= 0 && r.write_bytes >= 0 }
+    samples = []
+    assert_nil @zpool.iostat(:interval => 0.01, :count => 3) { |r| samples << r }
+    assert_equal 3, samples.size
+    assert_equal records.map { |r| r.name }, samples.last.map { |r| r.name }
+    assert_equal 2, @zpool.iostat(:interval => 0.01).first(2).size
+    assert_raise(TypeError) { @zpool.iostat(:interval => 'often') }
+    assert_raise(TypeError) { @zpool.iostat(:interval => 1, :count => 0) }
+  end
+
+  def test_vdev_tree
+    @zpool = Zpool.new('tpool', @zlib)
+    root = @zpool.vdev_tree
+    assert_kind_of Zpool::Vdev, root
+    assert_equal 'tpool', root.name
+    assert_equal 'root', root.type
+    assert_equal 0, root.depth
+    assert !root.leaf?
+    assert_same root, @zpool.vdev_tree
+    leaves = root.each_leaf.to_a
+    assert_equal root.children.map { |v| v.guid }, leaves.map { |v| v.guid }
+    assert_equal '/export/vdev/d1', leaves.first.path
+    assert_equal ZfsConsts::State::Vdev::HEALTHY, leaves.first.state
+    assert leaves.first.healthy?
+    assert_equal [0, 0, 0], leaves.first.errors
+    @zpool.refresh!
+    assert_not_same root, @zpool.vdev_tree
+    assert_equal leaves.first.guid, @zpool.vdev_tree.children.first.guid
+  end
+
+  # Requires root or privileged profile to run:
+  def test_events
+    last = Zpool.events(:follow => false).to_a.last
+    cursor = last ? last.eid : nil
+    @zpool = Zpool.new('tpool', @zlib)
+    assert @zpool.set('listsnaps', 'off')
+    events = Zpool.events(:cursor => cursor, :pool => 'tpool', :follow => false).to_a
+    assert events.size >= 1
+    assert_kind_of Zpool::Event, events.last
+    assert events.last.frozen?
+    assert_equal 'tpool', events.last.pool
+    assert events.last.eid > cursor.to_i
+    assert_kind_of Time, events.last.time
+    assert_equal events.last.event_class, events.last.payload['class']
+    assert_equal [], Zpool.events(:cursor => events.last.eid, :pool => 'tpool', :follow => false).to_a
+    assert_raise(TypeError) { Zpool.events(:cursor => 'now') }
+  end
+
 end